@@ -0,0 +1,581 @@
+#include <stdlib.h>     // NULL, malloc(), realloc(), free()
+#include <string.h>     // memcpy(), memcmp(), memset()
+#include <errno.h>      // errno
+#include <unistd.h>     // read(), lseek()
+#include <sys/uio.h>    // struct iovec
+#ifdef WITH_ZSTD
+#include <zstd.h>       // ZSTD_compress(), ZSTD_decompress()
+#endif
+#include "archive.h"
+
+#define ARCHIVE_ZSTD_LEVEL 3
+
+/*
+ * Returns 1 if this build supports the given codec, 0 otherwise.
+ */
+int archive_has_codec(int codec)
+{
+	switch (codec)
+	{
+		case ARCHIVE_CODEC_NONE:
+			return 1;
+#ifdef WITH_ZSTD
+		case ARCHIVE_CODEC_ZSTD:
+			return 1;
+#endif
+		default:
+			return 0;
+	}
+}
+
+static void encode_block_header(const struct archive_block *blk, char *buf)
+{
+	memset(buf, 0, ARCHIVE_BLOCK_HEADER);
+	put_u32(buf, blk->raw_len);
+	put_u32(buf + 4, blk->stored_len);
+	put_u32(buf + 8, blk->num_records);
+	buf[12] = blk->codec;
+	put_u64(buf + 16, blk->first);
+	put_u64(buf + 24, blk->last);
+}
+
+static void decode_block_header(const char *buf, struct archive_block *blk)
+{
+	blk->raw_len = get_u32(buf);
+	blk->stored_len = get_u32(buf + 4);
+	blk->num_records = get_u32(buf + 8);
+	blk->codec = buf[12];
+	blk->first = get_u64(buf + 16);
+	blk->last = get_u64(buf + 24);
+}
+
+/*
+ * Makes sure the buffer pointed to by 'buf' can hold at least 'len' bytes.
+ * Returns 0 on success, -1 on error.
+ */
+static int reserve(char **buf, size_t *size, size_t len)
+{
+	if (*size >= len)
+	{
+		return 0;
+	}
+	char *res = realloc(*buf, len);
+	if (res == NULL)
+	{
+		return -1;
+	}
+	*buf = res;
+	*size = len;
+	return 0;
+}
+
+/*
+ * Compresses and writes out the current block. Needs the lock to be held.
+ */
+static int seal_locked(struct archive *a)
+{
+	struct archive_block *blk = &a->blk;
+	if (blk->num_records == 0)
+	{
+		return 0;
+	}
+
+	const char *data = a->block;
+	blk->codec = ARCHIVE_CODEC_NONE;
+	blk->stored_len = blk->raw_len;
+
+#ifdef WITH_ZSTD
+	if (a->codec == ARCHIVE_CODEC_ZSTD)
+	{
+		size_t res = ZSTD_compress(a->packed, a->packed_size,
+				a->block, blk->raw_len, ARCHIVE_ZSTD_LEVEL);
+
+		// Only use the compressed data if it actually is smaller
+		if (!ZSTD_isError(res) && res < blk->raw_len)
+		{
+			data = a->packed;
+			blk->codec = ARCHIVE_CODEC_ZSTD;
+			blk->stored_len = res;
+		}
+	}
+#endif
+
+	char header[ARCHIVE_BLOCK_HEADER];
+	encode_block_header(blk, header);
+
+	struct iovec iov[2] = {
+		{ .iov_base = header,       .iov_len = ARCHIVE_BLOCK_HEADER },
+		{ .iov_base = (char *) data, .iov_len = blk->stored_len }
+	};
+	int res = output_write(a->out, iov, 2);
+
+	memset(blk, 0, sizeof(struct archive_block));
+	return res;
+}
+
+/*
+ * Initializes the archive writer and writes the file header to the output.
+ * Returns 0 on success, -1 on error (including an unsupported codec).
+ */
+int archive_init(struct archive *a, struct output *out, int codec, int flush_ms)
+{
+	memset(a, 0, sizeof(struct archive));
+
+	if (!archive_has_codec(codec))
+	{
+		return -1;
+	}
+
+	a->out = out;
+	a->codec = codec;
+	a->flush_ms = flush_ms;
+	if (reserve(&a->block, &a->size, ARCHIVE_BLOCK_SIZE) == -1)
+	{
+		return -1;
+	}
+
+#ifdef WITH_ZSTD
+	if (codec == ARCHIVE_CODEC_ZSTD &&
+	    reserve(&a->packed, &a->packed_size, ZSTD_compressBound(a->size)) == -1)
+	{
+		free(a->block);
+		return -1;
+	}
+#endif
+
+	pthread_mutex_init(&a->lock, NULL);
+
+	char header[ARCHIVE_FILE_HEADER] = { 0 };
+	memcpy(header, ARCHIVE_MAGIC, 4);
+	header[4] = ARCHIVE_VERSION;
+
+	struct iovec iov = { .iov_base = header, .iov_len = ARCHIVE_FILE_HEADER };
+	return output_write(out, &iov, 1);
+}
+
+/*
+ * Adds the given record to the current block, sealing the block first if the
+ * record doesn't fit anymore. Returns 0 on success, -1 on error.
+ */
+int archive_add(struct archive *a, const struct record *r)
+{
+	size_t size = record_size(r);
+	int res = 0;
+
+	pthread_mutex_lock(&a->lock);
+	struct archive_block *blk = &a->blk;
+
+	if (blk->raw_len + size > a->size)
+	{
+		res = seal_locked(a);
+	}
+
+	// A single, huge record might not even fit into an empty block
+	if (size > a->size)
+	{
+		if (reserve(&a->block, &a->size, size) == -1)
+		{
+			pthread_mutex_unlock(&a->lock);
+			return -1;
+		}
+#ifdef WITH_ZSTD
+		if (a->codec == ARCHIVE_CODEC_ZSTD &&
+		    reserve(&a->packed, &a->packed_size, ZSTD_compressBound(size)) == -1)
+		{
+			pthread_mutex_unlock(&a->lock);
+			return -1;
+		}
+#endif
+	}
+
+	if (blk->num_records == 0)
+	{
+		blk->first = r->time;
+		blk->last = r->time;
+		clock_gettime(CLOCK_MONOTONIC, &a->since);
+	}
+	if (r->time < blk->first)
+	{
+		blk->first = r->time;
+	}
+	if (r->time > blk->last)
+	{
+		blk->last = r->time;
+	}
+
+	blk->raw_len += record_encode(r, a->block + blk->raw_len, a->size - blk->raw_len);
+	blk->num_records += 1;
+
+	pthread_mutex_unlock(&a->lock);
+	return res;
+}
+
+/*
+ * Seals the current block if its first record is older than the configured
+ * number of milliseconds. Should be called regularly, just like output_tick(),
+ * and before it, so the sealed block gets flushed right away.
+ */
+int archive_tick(struct archive *a)
+{
+	if (a->flush_ms <= 0)
+	{
+		return 0;
+	}
+
+	int res = 0;
+	pthread_mutex_lock(&a->lock);
+	if (a->blk.num_records > 0)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = (now.tv_sec - a->since.tv_sec) * 1000
+			+ (now.tv_nsec - a->since.tv_nsec) / 1000000;
+		if (ms >= a->flush_ms)
+		{
+			res = seal_locked(a);
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+	return res;
+}
+
+/*
+ * Returns the given timeout (in milliseconds), or less if archive_tick() needs
+ * to be called earlier than that in order to seal blocks in time.
+ */
+int archive_timeout(struct archive *a, int timeout)
+{
+	if (a->flush_ms > 0 && a->flush_ms < timeout)
+	{
+		return a->flush_ms;
+	}
+	return timeout;
+}
+
+/*
+ * Seals the current block, regardless of its size or age.
+ */
+int archive_seal(struct archive *a)
+{
+	pthread_mutex_lock(&a->lock);
+	int res = seal_locked(a);
+	pthread_mutex_unlock(&a->lock);
+	return res;
+}
+
+/*
+ * Seals the current block and frees all buffers. The output needs to be
+ * flushed (or freed) afterwards for the block to actually be written.
+ */
+void archive_free(struct archive *a)
+{
+	if (a->block == NULL)
+	{
+		return;
+	}
+	archive_seal(a);
+	pthread_mutex_destroy(&a->lock);
+	free(a->block);
+	free(a->packed);
+	a->block = NULL;
+	a->packed = NULL;
+}
+
+/*
+ * Reads exactly 'len' bytes, unless we hit the end of the file. Returns the
+ * number of bytes read or -1 on error.
+ */
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t res = read(fd, buf + done, len - done);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (res == 0)
+		{
+			break;
+		}
+		done += res;
+	}
+	return done;
+}
+
+/*
+ * Skips 'len' bytes of input, seeking if possible, reading otherwise (pipes).
+ * Returns 0 on success, -1 on error or if the file ended prematurely.
+ */
+static int skip(struct archive_reader *rd, size_t len)
+{
+	if (lseek(rd->fd, len, SEEK_CUR) != -1)
+	{
+		return 0;
+	}
+	if (errno != ESPIPE)
+	{
+		return -1;
+	}
+	if (reserve(&rd->stored, &rd->stored_size, ARCHIVE_BLOCK_SIZE) == -1)
+	{
+		return -1;
+	}
+	while (len > 0)
+	{
+		size_t chunk = len < rd->stored_size ? len : rd->stored_size;
+		if (read_full(rd->fd, rd->stored, chunk) != (ssize_t) chunk)
+		{
+			return -1;
+		}
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Reads the next block header. Returns 1 on success, 0 at the end of the
+ * file and -1 on error.
+ */
+static int read_block_header(struct archive_reader *rd)
+{
+	char header[ARCHIVE_BLOCK_HEADER];
+	ssize_t res = read_full(rd->fd, header, ARCHIVE_BLOCK_HEADER);
+	if (res == 0)
+	{
+		return 0;
+	}
+	if (res != ARCHIVE_BLOCK_HEADER)
+	{
+		return -1;
+	}
+	decode_block_header(header, &rd->blk);
+	rd->pos = 0;
+	rd->block_at = rd->next_at;
+	rd->next_at += ARCHIVE_BLOCK_HEADER + rd->blk.stored_len;
+	return 1;
+}
+
+/*
+ * Reads and, if required, decompresses the data of the block whose header
+ * has just been read. Returns 0 on success, -1 on error.
+ */
+static int read_block_data(struct archive_reader *rd)
+{
+	struct archive_block *blk = &rd->blk;
+	if (reserve(&rd->stored, &rd->stored_size, blk->stored_len) == -1)
+	{
+		return -1;
+	}
+	if (read_full(rd->fd, rd->stored, blk->stored_len) != (ssize_t) blk->stored_len)
+	{
+		return -1;
+	}
+
+	if (blk->codec == ARCHIVE_CODEC_NONE)
+	{
+		if (blk->stored_len != blk->raw_len)
+		{
+			return -1;
+		}
+		// Swap buffers instead of copying
+		char *tmp = rd->raw;
+		size_t tmp_size = rd->raw_size;
+		rd->raw = rd->stored;
+		rd->raw_size = rd->stored_size;
+		rd->stored = tmp;
+		rd->stored_size = tmp_size;
+		return 0;
+	}
+	return archive_unpack(rd, blk, rd->stored) ? 0 : -1;
+}
+
+/*
+ * Decodes the block header at 'buf', which holds 'len' bytes, for readers
+ * that have the whole archive in memory. Returns 0 on success, -1 if the
+ * header or the block's data is cut off.
+ */
+int archive_header(const char *buf, size_t len, struct archive_block *blk)
+{
+	if (len < ARCHIVE_BLOCK_HEADER)
+	{
+		return -1;
+	}
+	decode_block_header(buf, blk);
+	return len - ARCHIVE_BLOCK_HEADER < blk->stored_len ? -1 : 0;
+}
+
+/*
+ * Returns the records of the block whose data, as stored, is at 'stored':
+ * the data itself if it isn't compressed, or else the reader's buffer, after
+ * decompressing it into that. Returns NULL on error.
+ */
+const char *archive_unpack(struct archive_reader *rd, const struct archive_block *blk, const char *stored)
+{
+	if (blk->codec == ARCHIVE_CODEC_NONE)
+	{
+		return blk->stored_len == blk->raw_len ? stored : NULL;
+	}
+
+#ifdef WITH_ZSTD
+	if (blk->codec == ARCHIVE_CODEC_ZSTD)
+	{
+		if (reserve(&rd->raw, &rd->raw_size, blk->raw_len) == -1)
+		{
+			return NULL;
+		}
+		size_t res = ZSTD_decompress(rd->raw, blk->raw_len, stored, blk->stored_len);
+		return ZSTD_isError(res) || res != blk->raw_len ? NULL : rd->raw;
+	}
+#endif
+
+	// Unknown codec or support not compiled in
+	return NULL;
+}
+
+/*
+ * Prepares reading from the given file descriptor, checking the file header.
+ * Returns 0 on success, -1 if this doesn't look like an archive we can read.
+ */
+int archive_open(struct archive_reader *rd, int fd)
+{
+	memset(rd, 0, sizeof(struct archive_reader));
+	rd->fd = fd;
+
+	char header[ARCHIVE_FILE_HEADER];
+	if (read_full(fd, header, ARCHIVE_FILE_HEADER) != ARCHIVE_FILE_HEADER)
+	{
+		return -1;
+	}
+	if (memcmp(header, ARCHIVE_MAGIC, 4) != 0 || header[4] != ARCHIVE_VERSION)
+	{
+		return -1;
+	}
+	rd->next_at = ARCHIVE_FILE_HEADER;
+	return 0;
+}
+
+/*
+ * Skips ahead to the first record with a time of at least 'time' (in
+ * microseconds since the epoch). Whole blocks that end before that time are
+ * skipped without being read or decompressed. As records are stored roughly
+ * in the order they were received, this can only seek forward.
+ * Returns 1 if there is such a record, 0 if not and -1 on error.
+ */
+int archive_seek(struct archive_reader *rd, uint64_t time)
+{
+	struct record r;
+	for (;;)
+	{
+		// Out of records in the current block: skip blocks until we
+		// find one that might contain what we're looking for
+		if (rd->pos >= rd->blk.raw_len)
+		{
+			int res;
+			while ((res = read_block_header(rd)) == 1 && rd->blk.last < time)
+			{
+				if (skip(rd, rd->blk.stored_len) == -1)
+				{
+					return -1;
+				}
+			}
+			if (res != 1)
+			{
+				return res;
+			}
+			if (read_block_data(rd) == -1)
+			{
+				return -1;
+			}
+		}
+
+		// Skip the records that came before 'time' within the block
+		while (rd->pos < rd->blk.raw_len)
+		{
+			size_t res = record_decode(rd->raw + rd->pos,
+					rd->blk.raw_len - rd->pos, &r);
+			if (res == 0)
+			{
+				return -1;
+			}
+			if (r.time >= time)
+			{
+				return 1;
+			}
+			rd->pos += res;
+		}
+	}
+}
+
+/*
+ * Reads the next record, whose strings will point into the reader's buffers
+ * and therefore stay valid until the next call. Returns 1 if a record has
+ * been read, 0 at the end of the archive and -1 on error.
+ */
+int archive_next(struct archive_reader *rd, struct record *r)
+{
+	while (rd->pos >= rd->blk.raw_len)
+	{
+		int res = read_block_header(rd);
+		if (res != 1)
+		{
+			return res;
+		}
+		if (read_block_data(rd) == -1)
+		{
+			return -1;
+		}
+	}
+
+	size_t res = record_decode(rd->raw + rd->pos, rd->blk.raw_len - rd->pos, r);
+	if (res == 0)
+	{
+		return -1;
+	}
+	rd->last = rd->pos;
+	rd->pos += res;
+	return 1;
+}
+
+/*
+ * Reads the block at the given offset in the file, unless it's the current
+ * one already, so that archive_next() continues from its first record, or
+ * from wherever 'pos' is set to. This needs a file we can seek in, as does
+ * the index. Returns 0 on success, -1 on error.
+ */
+int archive_load(struct archive_reader *rd, uint64_t offset)
+{
+	if (rd->block_at == offset && rd->blk.raw_len > 0)
+	{
+		rd->pos = 0;
+		return 0;
+	}
+	if (lseek(rd->fd, offset, SEEK_SET) == -1)
+	{
+		return -1;
+	}
+	rd->next_at = offset;
+	rd->blk.raw_len = 0;
+	if (read_block_header(rd) != 1 || read_block_data(rd) == -1)
+	{
+		rd->blk.raw_len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Frees the reader's buffers. Does not close the file descriptor.
+ */
+void archive_close(struct archive_reader *rd)
+{
+	free(rd->raw);
+	free(rd->stored);
+	rd->raw = NULL;
+	rd->stored = NULL;
+}
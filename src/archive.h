@@ -0,0 +1,100 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+#include <time.h>       // struct timespec
+#include <pthread.h>    // pthread_mutex_t
+#include "output.h"
+#include "record.h"
+
+#define ARCHIVE_MAGIC        "TWDA"
+#define ARCHIVE_VERSION      1
+#define ARCHIVE_FILE_HEADER  8
+#define ARCHIVE_BLOCK_HEADER 32
+#define ARCHIVE_BLOCK_SIZE   (256 * 1024)
+
+#define ARCHIVE_CODEC_NONE 0
+#define ARCHIVE_CODEC_ZSTD 1
+
+/*
+ * Binary archives consist of a file header, followed by any number of blocks.
+ * The file header is the magic "TWDA", a version byte and 3 reserved bytes.
+ * Every block starts with a header that tells us how large it is and which
+ * time range the records in it cover, so readers can skip over blocks they
+ * are not interested in without decompressing them. Numbers are little endian:
+ *
+ *   u32 size of the uncompressed records
+ *   u32 size of the data as stored (after the header)
+ *   u32 number of records
+ *   u8  codec (ARCHIVE_CODEC_*), 3 reserved bytes
+ *   u64 earliest record time in the block (microseconds since the epoch)
+ *   u64 latest record time in the block
+ *
+ * Blocks are compressed individually, if at all, so every block can be
+ * decoded on its own.
+ */
+struct archive_block
+{
+	uint32_t raw_len;
+	uint32_t stored_len;
+	uint32_t num_records;
+	uint8_t  codec;
+	uint64_t first;
+	uint64_t last;
+};
+
+/*
+ * Collects records into blocks and hands complete blocks to an output.
+ * A block is sealed once it is full or once its oldest record is older than
+ * 'flush_ms' milliseconds (checked by archive_tick()). Thread-safe.
+ */
+struct archive
+{
+	struct output        *out;        // Where sealed blocks go
+	int                   codec;      // ARCHIVE_CODEC_*
+	int                   flush_ms;   // Seal blocks after this long
+	char                 *block;      // Records of the current block
+	size_t                size;       // Size of block
+	char                 *packed;     // Compression buffer
+	size_t                packed_size;
+	struct archive_block  blk;        // Header of the current block
+	struct timespec       since;      // When the first record came in
+	pthread_mutex_t       lock;
+};
+
+/*
+ * Reads archives block by block, record by record.
+ */
+struct archive_reader
+{
+	int                   fd;
+	char                 *raw;        // Uncompressed records of the block
+	size_t                raw_size;
+	char                 *stored;     // Block data as read from the file
+	size_t                stored_size;
+	size_t                pos;        // Offset of the next record in raw
+	size_t                last;       // Offset of the record last read in raw
+	uint64_t              block_at;   // Offset of the current block in the file
+	uint64_t              next_at;    // Offset of the next block in the file
+	struct archive_block  blk;        // Header of the current block
+};
+
+int  archive_init(struct archive *a, struct output *out, int codec, int flush_ms);
+int  archive_add(struct archive *a, const struct record *r);
+int  archive_tick(struct archive *a);
+int  archive_timeout(struct archive *a, int timeout);
+int  archive_seal(struct archive *a);
+void archive_free(struct archive *a);
+
+int  archive_open(struct archive_reader *rd, int fd);
+int  archive_seek(struct archive_reader *rd, uint64_t time);
+int  archive_next(struct archive_reader *rd, struct record *r);
+int  archive_load(struct archive_reader *rd, uint64_t offset);
+int  archive_header(const char *buf, size_t len, struct archive_block *blk);
+const char *archive_unpack(struct archive_reader *rd, const struct archive_block *blk, const char *stored);
+void archive_close(struct archive_reader *rd);
+
+int  archive_has_codec(int codec);
+
+#endif
@@ -0,0 +1,666 @@
+#include <stdio.h>      // NULL, fprintf(), snprintf()
+#include <string.h>     // strcmp(), strstr(), strlen()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, qsort()
+#include <stdint.h>     // uint64_t
+#include <stdatomic.h>  // atomic_uint_least64_t
+#include <errno.h>      // errno
+#include <unistd.h>     // getopt() et al., fork(), execvp(), pipe()
+#include <fcntl.h>      // open()
+#include <signal.h>     // kill()
+#include <time.h>       // clock_gettime()
+#include <pthread.h>    // pthread_create(), pthread_join()
+#include <sys/wait.h>   // waitpid()
+#include "mock.h"
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_BUILD 0
+
+#define PROJECT_URL "https://github.com/domsson/twircclient"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_CHANNEL "#bench"
+#define DEFAULT_COUNT 100000
+#define DEFAULT_TIMEOUT 5
+#define MARKER "BENCH "
+#define SAMPLE_MS 100         // How often to sample memory and CPU usage
+#define JOIN_GRACE_MS 1000    // How long to wait for a JOIN after login
+#define SEND_BATCH 64         // Lines to queue at full speed before polling
+#define READ_BUFFER (64 * 1024)
+#define MAX_SAMPLES 4096
+
+static volatile int running; // Used to stop main loop in case of SIGINT etc
+
+/*
+ * Memory and CPU usage of the target at some point in time.
+ */
+struct sample
+{
+	double   time;        // Seconds since we started sending
+	long     rss;         // Resident set size in KiB
+	double   cpu;         // User plus system time in seconds
+	uint64_t received;    // Messages seen by then
+};
+
+struct metadata
+{
+	char                  **argv;     // Command to run
+	char                   *host;     // Address to listen on
+	char                    port[16]; // Port we ended up listening on
+	char                   *out;      // File to write the results to
+	uint64_t                count;    // Messages to send
+	double                  rate;     // Messages per second, 0 for max
+	int                     timeout;  // Seconds to wait for stragglers
+	int                     verbose;  // Show the target's stderr
+	pid_t                   pid;      // Process ID of the target
+	int                     exited;   // The target has exited
+	int                     fd;       // Read end of the target's stdout
+	uint64_t               *sent;     // Send time of every message (ns)
+	atomic_uint_least64_t  *seen;     // Time every message was seen (ns)
+	atomic_uint_least64_t   received; // Number of messages seen
+	struct sample           samples[MAX_SAMPLES];
+	size_t                  num_samples;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Looks for our marker in the given text and, if this is the first time we
+ * see that message, remembers when we saw it.
+ */
+void mark_seen(struct metadata *meta, const char *text)
+{
+	const char *marker = strstr(text, MARKER);
+	if (marker == NULL)
+	{
+		return;
+	}
+
+	char *end;
+	uint64_t seq = strtoull(marker + strlen(MARKER), &end, 10);
+	if (end == marker + strlen(MARKER) || seq >= meta->count)
+	{
+		return;
+	}
+
+	uint_least64_t expected = 0;
+	if (atomic_compare_exchange_strong(&meta->seen[seq], &expected, now_ns()))
+	{
+		atomic_fetch_add(&meta->received, 1);
+	}
+}
+
+/*
+ * Thread function that reads the target's stdout line by line and takes note
+ * of every message that shows up there.
+ */
+void *read_output(void *arg)
+{
+	struct metadata *meta = arg;
+	char buf[READ_BUFFER + 1];
+	size_t len = 0;
+	ssize_t res;
+
+	while ((res = read(meta->fd, buf + len, READ_BUFFER - len)) != 0)
+	{
+		if (res == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		len += res;
+		buf[len] = '\0';
+
+		char *line = buf;
+		char *end;
+		while ((end = strchr(line, '\n')))
+		{
+			*end = '\0';
+			mark_seen(meta, line);
+			line = end + 1;
+		}
+
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == READ_BUFFER)
+		{
+			len = 0;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called by the mock server for every line the target sends, so that replies
+ * (think of a bot echoing something) count as well.
+ */
+void handle_line(struct mock *m, struct mock_client *c, const char *line)
+{
+	mark_seen(m->ctx, line);
+}
+
+/*
+ * Reads the resident set size (KiB) and CPU time (seconds) of the process.
+ * Returns 0 on success, -1 on error.
+ */
+int read_usage(pid_t pid, long *rss, double *cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+	long pages = 0;
+	int res = fscanf(fp, "%*s %ld", &pages);
+	fclose(fp);
+	if (res != 1)
+	{
+		return -1;
+	}
+	*rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		return -1;
+	}
+	char stat[1024];
+	size_t len = fread(stat, 1, sizeof(stat) - 1, fp);
+	fclose(fp);
+	stat[len] = '\0';
+
+	// The command name can contain spaces, so skip past its ')'
+	char *p = strrchr(stat, ')');
+	unsigned long utime, stime;
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime) != 2)
+	{
+		return -1;
+	}
+	*cpu = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+void take_sample(struct metadata *meta, uint64_t start)
+{
+	if (meta->num_samples == MAX_SAMPLES)
+	{
+		// Keep every other sample, so we can go on sampling forever
+		for (size_t i = 0; i < MAX_SAMPLES / 2; ++i)
+		{
+			meta->samples[i] = meta->samples[i * 2];
+		}
+		meta->num_samples = MAX_SAMPLES / 2;
+	}
+
+	struct sample *s = &meta->samples[meta->num_samples];
+	if (read_usage(meta->pid, &s->rss, &s->cpu) == 0)
+	{
+		s->time = (now_ns() - start) / 1e9;
+		s->received = atomic_load(&meta->received);
+		meta->num_samples += 1;
+	}
+}
+
+/*
+ * Starts the target with its stdout connected to a pipe we read from.
+ * Every "%h" and "%p" in the arguments is replaced with our host and port.
+ * Returns 0 on success, -1 on error.
+ */
+int spawn(struct metadata *meta)
+{
+	int fds[2];
+	if (pipe(fds) == -1)
+	{
+		return -1;
+	}
+
+	if ((meta->pid = fork()) == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (meta->pid == 0)
+	{
+		for (char **arg = meta->argv; *arg; ++arg)
+		{
+			if (strcmp(*arg, "%h") == 0)
+			{
+				*arg = meta->host;
+			}
+			else if (strcmp(*arg, "%p") == 0)
+			{
+				*arg = meta->port;
+			}
+		}
+
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		if (!meta->verbose)
+		{
+			dup2(null, STDERR_FILENO);
+		}
+		close(fds[0]);
+		close(fds[1]);
+		close(null);
+
+		execvp(meta->argv[0], meta->argv);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	meta->fd = fds[0];
+	return 0;
+}
+
+/*
+ * Returns 1 if the target has exited, 0 otherwise.
+ */
+int has_exited(struct metadata *meta)
+{
+	if (!meta->exited && waitpid(meta->pid, NULL, WNOHANG) != 0)
+	{
+		meta->exited = 1;
+	}
+	return meta->exited;
+}
+
+/*
+ * Waits for the target to log in and join a channel (or to not join one for
+ * a little while, like our client). Returns the channel to send the messages
+ * to, or NULL if the target went away or we've been interrupted.
+ */
+const char *wait_for_target(struct metadata *meta, struct mock *m)
+{
+	uint64_t welcomed = 0;
+	while (running)
+	{
+		if (has_exited(meta))
+		{
+			return NULL;
+		}
+
+		mock_poll(m, 10);
+		for (struct mock_client *c = m->clients; c; c = c->next)
+		{
+			if (c->num_chans > 0)
+			{
+				return c->chans[0];
+			}
+			if (c->welcomed && welcomed == 0)
+			{
+				welcomed = now_ns();
+			}
+		}
+		if (welcomed && now_ns() - welcomed > JOIN_GRACE_MS * 1000000ULL)
+		{
+			return DEFAULT_CHANNEL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sends the messages to the target, at the given rate or as fast as it takes
+ * them, then waits for the stragglers. Returns the time we started at.
+ */
+uint64_t run(struct metadata *meta, struct mock *m, const char *chan)
+{
+	char line[MOCK_LINE_BUFFER];
+	uint64_t start = now_ns();
+	uint64_t last_sample = start;
+	uint64_t seq = 0;
+	uint64_t deadline = 0;
+
+	take_sample(meta, start);
+
+	while (running)
+	{
+		uint64_t t = now_ns();
+		if (t - last_sample >= SAMPLE_MS * 1000000ULL)
+		{
+			take_sample(meta, start);
+			last_sample = t;
+			if (has_exited(meta))
+			{
+				fprintf(stderr, "*** Target exited early\n");
+				break;
+			}
+		}
+
+		// All sent, give the target some time to catch up
+		if (seq == meta->count)
+		{
+			if (deadline == 0)
+			{
+				deadline = t + meta->timeout * 1000000000ULL;
+			}
+			if (atomic_load(&meta->received) == meta->count || t > deadline)
+			{
+				break;
+			}
+			mock_poll(m, 10);
+			continue;
+		}
+
+		if (meta->rate > 0 && seq > (t - start) / 1e9 * meta->rate)
+		{
+			mock_poll(m, 1);
+			continue;
+		}
+		if (mock_pending(m) > MOCK_HIGH_WATER)
+		{
+			mock_poll(m, 1);
+			continue;
+		}
+
+		int len = snprintf(line, sizeof(line),
+				"@badge-info=;badges=;color=#1E90FF;display-name=Bencher;emotes=;"
+				"id=bench-%llu;mod=0;room-id=1;subscriber=0;tmi-sent-ts=0;turbo=0;"
+				"user-id=1;user-type= :bencher!bencher@bencher.tmi.twitch.tv "
+				"PRIVMSG %s :" MARKER "%llu Kappa",
+				(unsigned long long) seq, chan, (unsigned long long) seq);
+		meta->sent[seq] = now_ns();
+		if (mock_send(m, NULL, line, len) == 0)
+		{
+			fprintf(stderr, "*** Target disconnected\n");
+			break;
+		}
+		++seq;
+
+		if (seq % SEND_BATCH == 0)
+		{
+			mock_poll(m, 0);
+		}
+	}
+
+	take_sample(meta, start);
+	return start;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the given percentile of the sorted values.
+ */
+static double percentile(uint64_t *values, size_t num, double p)
+{
+	if (num == 0)
+	{
+		return 0;
+	}
+	size_t idx = (size_t) (p / 100.0 * (num - 1) + 0.5);
+	return values[idx];
+}
+
+/*
+ * Writes the results as JSON. Latencies are in microseconds, memory in KiB.
+ */
+void report(struct metadata *meta, FILE *fp, uint64_t start)
+{
+	uint64_t received = atomic_load(&meta->received);
+	uint64_t *lat = malloc((received + 1) * sizeof(uint64_t));
+	size_t num = 0;
+	uint64_t last = start;
+	double sum = 0;
+	for (uint64_t i = 0; i < meta->count && lat; ++i)
+	{
+		uint64_t seen = atomic_load(&meta->seen[i]);
+		if (seen && num <= received)
+		{
+			lat[num++] = seen > meta->sent[i] ? seen - meta->sent[i] : 0;
+			sum += lat[num - 1];
+			last = seen > last ? seen : last;
+		}
+	}
+	if (lat)
+	{
+		qsort(lat, num, sizeof(uint64_t), compare_u64);
+	}
+
+	double secs = (last - start) / 1e9;
+	struct sample *first = &meta->samples[0];
+	struct sample *final = &meta->samples[meta->num_samples ? meta->num_samples - 1 : 0];
+	long rss_max = 0;
+	for (size_t i = 0; i < meta->num_samples; ++i)
+	{
+		rss_max = meta->samples[i].rss > rss_max ? meta->samples[i].rss : rss_max;
+	}
+	double cpu = meta->num_samples ? final->cpu - first->cpu : 0;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"command\": [");
+	for (char **arg = meta->argv; *arg; ++arg)
+	{
+		fputc('"', fp);
+		for (char *c = *arg; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+			{
+				fputc('\\', fp);
+			}
+			fputc(*c, fp);
+		}
+		fprintf(fp, "\"%s", arg[1] ? ", " : "");
+	}
+	fprintf(fp, "],\n");
+	fprintf(fp, "  \"sent\": %llu,\n", (unsigned long long) meta->count);
+	fprintf(fp, "  \"received\": %llu,\n", (unsigned long long) num);
+	fprintf(fp, "  \"seconds\": %.6f,\n", secs);
+	fprintf(fp, "  \"msgs_per_sec\": %.1f,\n", secs > 0 ? num / secs : 0);
+	fprintf(fp, "  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+			"\"p999\": %.1f, \"max\": %.1f},\n",
+			num ? sum / num / 1e3 : 0,
+			percentile(lat, num, 50) / 1e3, percentile(lat, num, 99) / 1e3,
+			percentile(lat, num, 99.9) / 1e3, num ? lat[num - 1] / 1e3 : 0);
+	fprintf(fp, "  \"cpu\": {\"seconds\": %.3f, \"us_per_msg\": %.3f},\n",
+			cpu, num ? cpu * 1e6 / num : 0);
+	fprintf(fp, "  \"rss_kb\": {\"start\": %ld, \"end\": %ld, \"max\": %ld, \"growth\": %ld},\n",
+			first->rss, final->rss, rss_max, final->rss - first->rss);
+	fprintf(fp, "  \"samples\": [\n");
+	for (size_t i = 0; i < meta->num_samples; ++i)
+	{
+		struct sample *s = &meta->samples[i];
+		fprintf(fp, "    {\"t\": %.3f, \"rss_kb\": %ld, \"cpu\": %.3f, \"received\": %llu}%s\n",
+				s->time, s->rss, s->cpu, (unsigned long long) s->received,
+				i + 1 < meta->num_samples ? "," : "");
+	}
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+
+	free(lat);
+}
+
+void sigint_handler(int sig)
+{
+	running = 0;
+}
+
+void version()
+{
+	fprintf(stdout, "twitch-bench version %d.%d.%d - %s\n",
+				VERSION_MAJOR,
+				VERSION_MINOR,
+				VERSION_BUILD,
+				PROJECT_URL);
+}
+
+void help(char *invocation)
+{
+	fprintf(stdout, "Usage:\n");
+	fprintf(stdout, "\t%s [OPTION...] COMMAND [ARG...]\n", invocation);
+	fprintf(stdout, "\t Note: arguments '%%h' and '%%p' are replaced with host and port\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-H HOST Address to listen on (default: %s).\n", DEFAULT_HOST);
+	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-n NUM Number of messages to send (default: %d).\n", DEFAULT_COUNT);
+	fprintf(stdout, "\t-o FILE Write the results to FILE instead of stdout.\n");
+	fprintf(stdout, "\t-P PORT Port to listen on (default: any free port).\n");
+	fprintf(stdout, "\t-r RATE Messages per second, 0 for as fast as possible (default: 0).\n");
+	fprintf(stdout, "\t-s Show the command's stderr.\n");
+	fprintf(stdout, "\t-t SECONDS Time to wait for late messages (default: %d).\n", DEFAULT_TIMEOUT);
+	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\n");
+	version();
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	struct metadata *meta = calloc(1, sizeof(struct metadata));
+	if (meta == NULL)
+	{
+		return EXIT_FAILURE;
+	}
+	meta->host = DEFAULT_HOST;
+	meta->count = DEFAULT_COUNT;
+	meta->timeout = DEFAULT_TIMEOUT;
+	char *port = "0";
+
+	// Process command line options, stopping at the command to run
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "+H:n:o:P:r:t:svh")) != -1)
+	{
+		switch(o)
+		{
+			case 'H':
+				meta->host = optarg;
+				break;
+			case 'n':
+				meta->count = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				meta->out = optarg;
+				break;
+			case 'P':
+				port = optarg;
+				break;
+			case 'r':
+				meta->rate = strtod(optarg, NULL);
+				break;
+			case 't':
+				meta->timeout = atoi(optarg);
+				break;
+			case 's':
+				meta->verbose = 1;
+				break;
+			case 'v':
+				version();
+				free(meta);
+				return EXIT_SUCCESS;
+			case 'h':
+				help(argv[0]);
+				free(meta);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (optind == argc || meta->count == 0)
+	{
+		fprintf(stderr, "No command or no messages to send, exiting\n");
+		free(meta);
+		return EXIT_FAILURE;
+	}
+	meta->argv = argv + optind;
+
+	meta->sent = calloc(meta->count, sizeof(uint64_t));
+	meta->seen = calloc(meta->count, sizeof(atomic_uint_least64_t));
+	if (meta->sent == NULL || meta->seen == NULL)
+	{
+		fprintf(stderr, "Error allocating memory, exiting\n");
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa_int = {
+		.sa_handler = &sigint_handler
+	};
+	sigaction(SIGINT, &sa_int, NULL);
+	sigaction(SIGTERM, &sa_int, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct mock m;
+	if (mock_init(&m, meta->host, port) == -1)
+	{
+		fprintf(stderr, "Error listening on %s:%s, exiting\n", meta->host, port);
+		return EXIT_FAILURE;
+	}
+	m.on_line = handle_line;
+	m.ctx = meta;
+	snprintf(meta->port, sizeof(meta->port), "%d", mock_port(&m));
+
+	if (spawn(meta) == -1)
+	{
+		fprintf(stderr, "Error starting %s, exiting\n", meta->argv[0]);
+		mock_free(&m);
+		return EXIT_FAILURE;
+	}
+
+	pthread_t reader;
+	pthread_create(&reader, NULL, read_output, meta);
+
+	running = 1;
+	int status = EXIT_FAILURE;
+	const char *chan = wait_for_target(meta, &m);
+	if (chan)
+	{
+		fprintf(stderr, "*** Sending %llu messages to %s on port %s\n",
+				(unsigned long long) meta->count, chan, meta->port);
+		uint64_t start = run(meta, &m, chan);
+
+		FILE *fp = meta->out ? fopen(meta->out, "w") : stdout;
+		if (fp)
+		{
+			report(meta, fp, start);
+			status = EXIT_SUCCESS;
+			if (fp != stdout)
+			{
+				fclose(fp);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error writing to %s\n", meta->out);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "*** Target did not log in\n");
+	}
+
+	// Tell the target to quit and let it write out what it has
+	if (!has_exited(meta))
+	{
+		kill(meta->pid, SIGTERM);
+		waitpid(meta->pid, NULL, 0);
+	}
+	mock_free(&m);
+	pthread_join(reader, NULL);
+	close(meta->fd);
+
+	free(meta->sent);
+	free(meta->seen);
+	free(meta);
+	return status;
+}
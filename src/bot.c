@@ -3,17 +3,34 @@
 #include <string.h>     //
 #include <errno.h>      // errno
 #include <sys/types.h>  // ssize_t
+#include <unistd.h>     // getopt() et al.
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 #include "libtwirc.h"
+#include "evloop.h"
+#include "sched.h"
+#include "pool.h"
+#include "cmd.h"
+#include "tags.h"
+#include "metrics.h"
 
 #define NICK "kaulmate"
 #define CHAN "#domsson"
 #define HOST "irc.chat.twitch.tv"
 #define PORT "6667"
 
-static volatile int running; // Used to stop main loop in case of SIGINT etc
-static volatile int handled; // The last signal that has been handled
+/*
+ * Everything the bot needs in its event handlers. The context of every
+ * libtwirc state is its connection, which leads to the pool and to this.
+ */
+struct bot
+{
+	struct evloop loop;       // Main thread's loop, handles signals
+	struct pool   pool;       // One connection per account
+	struct cmd_table cmds;    // Chat commands, like "!hello"
+	pthread_mutex_t lock;     // The reader might change while a command runs
+};
 
 /*
  * Read a file called 'token' (in the same directory as the code is run)
@@ -58,7 +75,15 @@ void handle_connect(twirc_state_t *s, twirc_event_t *evt)
  */
 void handle_welcome(twirc_state_t *s, twirc_event_t *evt)
 {
-	fprintf(stdout, "*** logged in!\n");
+	struct conn *c = twirc_get_context(s);
+	fprintf(stdout, "*** logged in as %s!\n", c->nick);
+
+	// From now on, this connection can take messages to send; after a
+	// reconnect, the new connection rejoins our channel by itself
+	if (pool_login(c, s))
+	{
+		return;
+	}
 
 	// Let's join a channel
 	fprintf(stdout, "*** joining %s\n", CHAN);
@@ -90,14 +115,28 @@ void handle_globaluserstate(twirc_state_t *s, twirc_event_t *evt)
  */
 void handle_join(twirc_state_t *s, twirc_event_t *evt)
 {
-	// Check if we just saw ourself joining our channel
-	if (evt->origin && strcmp(evt->origin, NICK) == 0
-	    && strcmp(evt->channel, CHAN) == 0)
+	// Check if we just saw ourself joining a channel, which we want to
+	// rejoin should we have to reconnect
+	struct conn *c = twirc_get_context(s);
+	if (evt->origin == NULL || strcmp(evt->origin, c->nick) != 0)
 	{
+		return;
+	}
+	reconn_joined(&c->rc, s, evt->channel);
+
+	// All connections join our channel, but only the reader says hello,
+	// and only the first time around
+	if (strcmp(evt->channel, CHAN) == 0 && pool_is_reader(c) && c->rc.reconnects == 0)
+	{
+		// We don't send directly, but hand our messages to the pool,
+		// which picks a connection whose scheduler sends them as soon
+		// as the rate limits allow
+		struct pool *pool = c->pool;
+
 		// privmsg actually sends a message to a channel
-		twirc_cmd_privmsg(s, CHAN, "I'm alive!");
+		pool_send(pool, SCHED_PRIVMSG, CHAN, "I'm alive!", SCHED_NORMAL, 0);
 		// action performs the "/me" command
-		twirc_cmd_action(s, CHAN, "might be the coolest bot ever");
+		pool_send(pool, SCHED_ACTION, CHAN, "might be the coolest bot ever", SCHED_NORMAL, 0);
 	}
 }
 
@@ -109,19 +148,50 @@ void handle_join(twirc_state_t *s, twirc_event_t *evt)
  */
 void handle_privmsg(twirc_state_t *s, twirc_event_t *evt)
 {
-	// Let's get the current time for a nice timestamp
+	// All connections see the chat, but only one of them handles it
+	struct conn *c = twirc_get_context(s);
+	if (!pool_is_reader(c))
+	{
+		return;
+	}
+
+	// Let's get the current time for a nice timestamp; handlers run on a
+	// thread per connection, so we can't share localtime()'s buffer
 	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
+	struct tm tm;
+	localtime_r(&t, &tm);
+
+	// Index the tags in one go, instead of searching through them with
+	// twirc_get_tag_by_key() for every tag we're interested in. This also
+	// splits the badges and emotes for us
+	struct tag_index tags;
+	tags_index(&tags, evt->tags);
+
+	// Right after the reader changed, we might see a message again
+	if (pool_seen(c->pool, tags_get(&tags, TAG_ID)))
+	{
+		return;
+	}
 
 	// Chat messages usually contain a 'color' tag which is the color that 
 	// the user selected for their Twitch account, but could also be NULL
-	twirc_tag_t *color = twirc_get_tag_by_key(evt->tags, "color");
+	const char *color = tags_get(&tags, TAG_COLOR);
+	const char *name = tags_get(&tags, TAG_DISPLAY_NAME);
 
 	// Let's print the chat message to the console!
-	fprintf(stdout, "[%02d:%02d:%02d] [%s] (%s) %s: %s\n", 
+	fprintf(stdout, "[%02d:%02d:%02d] [%s] (%s) %s%s: %s\n", 
 			tm.tm_hour, tm.tm_min, tm.tm_sec, 
-			color && color->value ? color->value : "default",	
-			evt->channel, evt->origin, evt->message);
+			color ? color : "default",	
+			evt->channel, tags_has_badge(&tags, "broadcaster") ? "~" :
+			tags_bool(&tags, TAG_MOD) ? "@" : "",
+			name ? name : evt->origin, evt->message);
+
+	// If the message is a command we know, this runs its handler. Lookup
+	// takes the same time no matter how many commands there are
+	struct bot *bot = c->pool->ctx;
+	pthread_mutex_lock(&bot->lock);
+	cmd_dispatch(&bot->cmds, s, evt);
+	pthread_mutex_unlock(&bot->lock);
 }
 
 /*
@@ -131,15 +201,29 @@ void handle_privmsg(twirc_state_t *s, twirc_event_t *evt)
  */
 void handle_action(twirc_state_t *s, twirc_event_t *evt)
 {
+	struct conn *c = twirc_get_context(s);
+	if (!pool_is_reader(c))
+	{
+		return;
+	}
+
 	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
+	struct tm tm;
+	localtime_r(&t, &tm);
 
-	twirc_tag_t *color = twirc_get_tag_by_key(evt->tags, "color");
+	struct tag_index tags;
+	tags_index(&tags, evt->tags);
+	if (pool_seen(c->pool, tags_get(&tags, TAG_ID)))
+	{
+		return;
+	}
+	const char *color = tags_get(&tags, TAG_COLOR);
+	const char *name = tags_get(&tags, TAG_DISPLAY_NAME);
 	
 	fprintf(stdout, "[%02d:%02d:%02d] [%s] (%s) * %s %s\n",
 			tm.tm_hour, tm.tm_min, tm.tm_sec,
-			color && color->value ? color->value : "default",
-			evt->channel, evt->origin, evt->message);
+			color ? color : "default",
+			evt->channel, name ? name : evt->origin, evt->message);
 }
 
 /*
@@ -148,12 +232,64 @@ void handle_action(twirc_state_t *s, twirc_event_t *evt)
 void handle_whisper(twirc_state_t *s, twirc_event_t *evt)
 {
 	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
+	struct tm tm;
+	localtime_r(&t, &tm);
 
 	fprintf(stdout, "[%02d:%02d:%02d] *** whisper from %s: %s\n",
 			tm.tm_hour, tm.tm_min, tm.tm_sec,
 			evt->origin, evt->message);
-	twirc_cmd_whisper(s, evt->origin, "Thanks, but I'm only a bot :-(");
+
+	// Whispers go to one account only, so we reply from that one. If
+	// someone keeps whispering us, the scheduler makes sure we only have
+	// one reply to them queued at any time and that we don't exceed the
+	// whisper limits; replies that would be late get dropped
+	struct conn *c = twirc_get_context(s);
+	sched_whisper(&c->sched, evt->origin, "Thanks, but I'm only a bot :-(", SCHED_LOW, 0);
+}
+
+/*
+ * Called when we join a channel and after we sent a message to it. The tags
+ * tell us whether we are a moderator there (or the broadcaster), in which
+ * case Twitch lets us send a lot more messages.
+ */
+void handle_userstate(twirc_state_t *s, twirc_event_t *evt)
+{
+	// Every account has its own limits, hence its own scheduler
+	struct conn *c = twirc_get_context(s);
+	struct tag_index tags;
+	tags_index(&tags, evt->tags);
+
+	int is_mod = tags_bool(&tags, TAG_MOD) || tags_has_badge(&tags, "broadcaster");
+	sched_set_mod(&c->sched, evt->channel, is_mod);
+}
+
+/*
+ * Chat command "!hello": greets whoever used it. Each user can only do this
+ * once a minute, see main().
+ */
+void cmd_hello(twirc_state_t *s, twirc_event_t *evt, const char *args, void *ctx)
+{
+	struct bot *bot = ctx;
+	char reply[128];
+	snprintf(reply, sizeof(reply), "Hello, @%s!", evt->origin);
+	pool_send(&bot->pool, SCHED_PRIVMSG, evt->channel, reply, SCHED_NORMAL, 0);
+}
+
+/*
+ * Chat command "!roll [sides]": rolls a die, six sided unless told otherwise.
+ * It may be used once every 5 seconds by anyone, see main().
+ */
+void cmd_roll(twirc_state_t *s, twirc_event_t *evt, const char *args, void *ctx)
+{
+	struct bot *bot = ctx;
+	int sides = atoi(args);
+	if (sides < 2)
+	{
+		sides = 6;
+	}
+	char reply[128];
+	snprintf(reply, sizeof(reply), "@%s rolled a %d (d%d)", evt->origin, rand() % sides + 1, sides);
+	pool_send(&bot->pool, SCHED_PRIVMSG, evt->channel, reply, SCHED_LOW, 5000);
 }
 
 /*
@@ -162,51 +298,63 @@ void handle_whisper(twirc_state_t *s, twirc_event_t *evt)
  */
 void handle_disconnect(twirc_state_t *s, twirc_event_t *evt)
 {
-	fprintf(stdout, "*** connection lost\n");
+	// This also fires for the old state once a new one took over
+	struct conn *c = twirc_get_context(s);
+	if (s == c->loop.s)
+	{
+		// The pool hands our work to the other connections until we
+		// have reconnected
+		fprintf(stdout, "*** connection lost (%s), reconnecting\n", c->nick);
+	}
 }
 
 /*
- * Let's handle CTRL+C by stopping our main loop and tidying up.
+ * Twitch is about to restart the server: we connect to another one while
+ * this one is still up, which takes over once it has rejoined our channel.
  */
-void sigint_handler(int sig)
+void handle_reconnect(twirc_state_t *s, twirc_event_t *evt)
 {
-	fprintf(stderr, "*** received signal, exiting\n");
-	running = 0;
-	handled = sig;
+	struct conn *c = twirc_get_context(s);
+	fprintf(stdout, "*** reconnecting (%s)\n", c->nick);
+	reconn_reconnect(&c->rc);
 }
 
 /*
- * Main - this is where we make things happen!
+ * Let's handle CTRL+C by stopping all connections and tidying up. This is
+ * called from the main loop (not as a signal handler), so we can do anything.
+ * SIGUSR1 prints the metrics instead.
  */
-int main(void)
+void handle_signal(struct evloop *loop, int sig, void *ctx)
 {
-	fprintf(stderr, "Starting up libtwirc test bot...");
-	
-	// Make sure we still do clean-up on SIGINT (ctrl+c)
-	// and similar signals that indicate we should quit.
-	struct sigaction sa_int = {
-		.sa_handler = &sigint_handler
-	};
-	
-	// These might return -1 on error, but we'll ignore that for now
-	sigaction(SIGINT, &sa_int, NULL);
-	sigaction(SIGQUIT, &sa_int, NULL);
-	sigaction (SIGTERM, &sa_int, NULL);
-
-	// Create libtwirc state instance
-	twirc_state_t *s = twirc_init();
-	
-	if (s == NULL)
+	struct bot *bot = ctx;
+	if (sig == SIGUSR1)
 	{
-		fprintf(stderr, "Could not init twirc state\n");
-		return EXIT_FAILURE;
+		metrics_print(stderr);
+		return;
 	}
+	fprintf(stderr, "*** received signal, exiting\n");
+	pool_stop(&bot->pool);
+}
 
-	fprintf(stderr, "Successfully initialized twirc state...\n");
-
-	// We get the callback struct from the libtwirc state
-	twirc_callbacks_t *cbs = twirc_get_callbacks(s);
+/*
+ * Called in the main thread whenever a connection is done; once all of them
+ * are, we're done as well.
+ */
+void handle_finished(struct evloop *loop, int fd, void *ctx)
+{
+	struct bot *bot = ctx;
+	if ((size_t) atomic_load(&bot->pool.finished) == bot->pool.num_conns)
+	{
+		evloop_stop(loop);
+	}
+}
 
+/*
+ * Called by the pool for the libtwirc state of every connection, with the
+ * callback struct of that state.
+ */
+void set_callbacks(twirc_callbacks_t *cbs)
+{
 	// We assign our handlers to the events we are interested int
 	cbs->connect         = handle_connect;
 	cbs->welcome         = handle_welcome;
@@ -215,46 +363,179 @@ int main(void)
 	cbs->action          = handle_action;
 	cbs->privmsg         = handle_privmsg;
 	cbs->whisper         = handle_whisper;
+	cbs->userstate       = handle_userstate;
 	cbs->disconnect      = handle_disconnect;
-	
-	// Read in the token file (oauth token / IRC password)
-	char token[128];
-	int token_success = read_token(token, 128);
-	if (token_success == 0)
+	cbs->reconnect       = handle_reconnect;
+
+	// Count and time all of the above
+	metrics_wrap(cbs);
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	// Connect to Twitch, unless told otherwise (like a mock server)
+	char *host = HOST;
+	char *port = PORT;
+	char *accounts = NULL;
+	char *metrics = NULL;
+	int tick = EVLOOP_TICK;
+
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "a:H:M:P:T:")) != -1)
 	{
-		fprintf(stderr, "Could not read token file\n");
+		switch(o)
+		{
+			case 'a':
+				accounts = optarg;
+				break;
+			case 'T':
+				tick = atoi(optarg);
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			case 'M':
+				metrics = optarg;
+				break;
+			case 'P':
+				port = optarg;
+				break;
+		}
+	}
+
+	fprintf(stderr, "Starting up libtwirc test bot...");
+
+	// Every account gets its own connection, as Twitch's rate limits are
+	// per account; the more accounts, the more we can send
+	struct bot bot;
+	if (pool_init(&bot.pool, host, port, tick, &bot) == -1)
+	{
+		fprintf(stderr, "Could not init connection pool\n");
 		return EXIT_FAILURE;
 	}
 
-	// Connect to the IRC server
-	if (twirc_connect(s, HOST, PORT, NICK, token) != 0)
+	if (accounts)
 	{
-		fprintf(stderr, "Could not connect to Twitch IRC\n");
+		// One account per line: nick and oauth token
+		if (pool_load(&bot.pool, accounts) <= 0)
+		{
+			fprintf(stderr, "Could not read accounts file\n");
+			pool_free(&bot.pool);
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		// Read in the token file (oauth token / IRC password)
+		char token[128];
+		int token_success = read_token(token, 128);
+		if (token_success == 0 || pool_add(&bot.pool, NICK, token) == -1)
+		{
+			fprintf(stderr, "Could not read token file\n");
+			pool_free(&bot.pool);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fprintf(stderr, "Successfully loaded %zu account(s)...\n", bot.pool.num_conns);
+
+	// Register our chat commands with their cooldowns, then compile them
+	// into the lookup table. There could be hundreds of them
+	srand(time(NULL));
+	pthread_mutex_init(&bot.lock, NULL);
+	if (cmd_init(&bot.cmds) == -1 ||
+	    cmd_add(&bot.cmds, "!hello", 0, 60000, cmd_hello, &bot) == -1 ||
+	    cmd_add(&bot.cmds, "!roll", 5000, 0, cmd_roll, &bot) == -1 ||
+	    cmd_compile(&bot.cmds) == -1)
+	{
+		fprintf(stderr, "Could not set up chat commands\n");
+		pool_free(&bot.pool);
 		return EXIT_FAILURE;
 	}
 
-	fprintf(stderr, "Connection initiated...\n");
+	// The main thread only waits for signals and for the connections to
+	// be done. The signals have to be set up before the connections'
+	// threads are created, so they don't get them
+	if (evloop_init(&bot.loop, NULL, 0) == -1)
+	{
+		fprintf(stderr, "Could not init event loop\n");
+		cmd_free(&bot.cmds);
+		pool_free(&bot.pool);
+		return EXIT_FAILURE;
+	}
+	evloop_on_wake(&bot.loop, handle_finished, &bot);
 
-	// Main loop - we call twirc_tick() every go-around, as that's what 
-	// makes the magic happen. The 1000 is a timeout in milliseconds that
-	// we grant twirc_tick() to do its work - in other words, we'll give 
-	// it 1 second to wait for and process IRC messages, then it will hand 
-	// control back to us. If twirc_tick() detects a disconnect or error,
-	// it will return -1, otherwise it will return 0 and we can go on!
+	// Make sure we still do clean-up on SIGINT (ctrl+c)
+	// and similar signals that indicate we should quit.
+	// These might return -1 on error, but we'll ignore that for now
+	evloop_signal(&bot.loop, SIGINT, handle_signal, &bot);
+	evloop_signal(&bot.loop, SIGQUIT, handle_signal, &bot);
+	evloop_signal(&bot.loop, SIGTERM, handle_signal, &bot);
+	evloop_signal(&bot.loop, SIGUSR1, handle_signal, &bot);
+
+	// The main thread's loop has time to spare, so it serves metrics
+	struct metrics_server ms = { .fd = -1 };
+	if (metrics && metrics_listen(&ms, &bot.loop, metrics) == -1)
+	{
+		fprintf(stderr, "Could not serve metrics on %s\n", metrics);
+	}
+
+	// Main loop - every connection runs in its own thread, where its event
+	// loop calls twirc_tick(), which waits for and processes IRC messages.
+	// A connection stops once it's lost or we've been told to via a
+	// signal; we stop once all of them did.
+	int status = EXIT_SUCCESS;
+	if (pool_start(&bot.pool, &bot.loop, set_callbacks) == 0)
+	{
+		fprintf(stderr, "Connections initiated...\n");
+		evloop_run(&bot.loop);
+	}
+	else
+	{
+		fprintf(stderr, "Could not start all connections\n");
+		status = EXIT_FAILURE;
+	}
+	pool_join(&bot.pool);
 
-	running = 1;
-	while (twirc_tick(s, 1000) == 0 && running == 1)
+	for (size_t i = 0; i < bot.pool.num_conns; ++i)
 	{
-		// Nothing to do here - it's all done via the event handlers
+		struct sched *sc = &bot.pool.conns[i].sched;
+		if (bot.pool.conns[i].status != EXIT_SUCCESS)
+		{
+			status = EXIT_FAILURE;
+		}
+		fprintf(stderr, "*** %s: sent %llu, coalesced %llu, dropped %llu late and %llu on full queue\n",
+				bot.pool.conns[i].nick,
+				(unsigned long long) sc->sent,
+				(unsigned long long) sc->coalesced,
+				(unsigned long long) sc->expired,
+				(unsigned long long) sc->rejected);
+
+		struct reconn *rc = &bot.pool.conns[i].rc;
+		if (rc->reconnects)
+		{
+			fprintf(stderr, "*** %s: %u reconnect(s), longest gap %llu ms, %llu ms in total\n",
+					bot.pool.conns[i].nick, rc->reconnects,
+					(unsigned long long) rc->max_gap,
+					(unsigned long long) rc->total_gap);
+		}
 	}
+	fprintf(stderr, "*** dropped %lu that no connection could send\n", atomic_load(&bot.pool.dropped));
+	fprintf(stderr, "*** %zu message(s) allocated at peak\n", bot.pool.msgs.num_objs);
 
-	// twirc_kill() is a convenience functions that calls two functions:
-	// - twirc_disconnect(), which makes sure the connection was closed
-	// - twirc_free(), which frees the libtwirc state, so we don't leak
-	twirc_kill(s);
+	// The connections' states have been freed when their threads ended,
+	// which makes sure they were closed
+	pool_free(&bot.pool);
+	cmd_free(&bot.cmds);
+	metrics_close(&ms);
+	evloop_free(&bot.loop);
+	pthread_mutex_destroy(&bot.lock);
 
 	// That's all, wave good-bye!
 	fprintf(stderr, "Bye!\n");
-	return EXIT_SUCCESS;
+	return status;
 }
-
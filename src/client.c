@@ -1,19 +1,59 @@
-#include <stdio.h>      // NULL, fprintf(), perror()
-#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
+#include <stdio.h>      // NULL, fprintf(), snprintf(), perror()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, mkstemp()
+#include <stdint.h>     // uint64_t
 #include <string.h>     // strstr(), strlen(), etc
 #include <errno.h>      // errno
 #include <sys/types.h>  // ssize_t
+#include <unistd.h>     // getopt() et al., unlink(), close()
 #include <signal.h>	// To handle SIGINT etc
 #include <time.h>
 #include <pthread.h>
+#include <poll.h>       // poll()
+#include <sys/eventfd.h> // eventfd()
+#include <sys/uio.h>    // struct iovec
 #include "libtwirc.h"
+#include "evloop.h"
+#include "spsc.h"
+#include "reconn.h"
+#include "metrics.h"
+#include "output.h"
 
 #define NICK "kaulmate"
 #define HOST "irc.chat.twitch.tv"
 #define PORT "6667"
 
-static volatile int running; // Used to stop main loop in case of SIGINT etc
-static volatile int handled; // The last signal that has been handled
+#define INPUT_BUFFER 2048          // Longest line of input
+#define INPUT_QUEUE (1024 * 1024)  // Size of the queue to the main thread
+#define INPUT_BATCH 256            // Lines to send per go of the main loop
+#define INPUT_RETRY_MS 1           // How long to wait if the queue is full
+
+/*
+ * The input thread reads lines from stdin and hands them to the main thread
+ * through a lock-free queue, waking up its loop. Only the main thread ever
+ * touches the libtwirc state, which is not thread-safe.
+ */
+struct input
+{
+	struct spsc    queue;
+	struct evloop *loop;
+	int            quit;   // eventfd that tells the input thread to stop
+	pthread_t      thread;
+};
+
+/*
+ * Everything the handlers need, available via the context of the libtwirc
+ * state; there can be two states at a time while we reconnect.
+ */
+struct client
+{
+	struct evloop  loop;      // Runs the current connection
+	struct reconn  rc;        // Reconnects, and rejoins our channels
+	struct output  out;       // Written to stdout by a thread of its own
+	int            spill_fd;  // File that output is spilled to, with -o spill
+	const char    *host;
+	const char    *port;
+	char           token[128];
+};
 
 /*
  * Read a file called 'token' (in the same directory as the code is run)
@@ -44,94 +84,121 @@ int read_token(char *buf, size_t len)
 	return 1;
 }
 
+/*
+ * Hands a line to the output thread, so a slow reader on the other end of
+ * stdout can't hold up the connection for long.
+ */
+void print_line(struct client *c, const char *prefix, const char *line)
+{
+	struct iovec iov[3] = {
+		{ .iov_base = (char *) prefix, .iov_len = strlen(prefix) },
+		{ .iov_base = (char *) line,   .iov_len = strlen(line) },
+		{ .iov_base = "\n",            .iov_len = 1 }
+	};
+	output_write(&c->out, iov, 3);
+}
+
 void handle_connect(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stdout, "*** connected!\n");
+	print_line(twirc_get_context(s), "*** ", "connected!");
 }
 
 void handle_welcome(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stdout, "*** logged in!\n");
+	struct client *c = twirc_get_context(s);
+	print_line(c, "*** ", "logged in!");
+
+	// If this is a new connection, it joins the channels we were in
+	if (reconn_welcome(&c->rc, s))
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "rejoining %zu channel(s)", c->rc.num_chans);
+		print_line(c, "*** ", buf);
+	}
 }
 
 void handle_disconnect(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stdout, "*** connection lost\n");
+	print_line(twirc_get_context(s), "*** ", "connection lost");
 }
 
 void handle_everything(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stdout, "> %s\n", evt->raw);
-}
-
-void handle_outbound(struct twirc_state *s, struct twirc_event *evt)
-{
-	if (strcmp(evt->command, "PASS") == 0)
+	// While we reconnect, both connections deliver the same messages
+	struct client *c = twirc_get_context(s);
+	twirc_tag_t *id = twirc_get_tag_by_key(evt->tags, "id");
+	if (id && reconn_dup(&c->rc, id->value))
 	{
-		fprintf(stdout, "< PASS ********\n");
-	}
-	else
-	{
-		fprintf(stdout, "< %s\n", evt->raw);
+		return;
 	}
+	print_line(c, "> ", evt->raw);
 }
 
-void sigint_handler(int sig)
+/*
+ * We keep track of the channels we're in, so we can rejoin them after a
+ * reconnect; that includes the ones joined by hand.
+ */
+void handle_join(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stderr, "*** received signal, exiting\n");
-	running = 0;
-	handled = sig;
+	struct client *c = twirc_get_context(s);
+	if (evt->origin && strcmp(evt->origin, NICK) == 0)
+	{
+		reconn_joined(&c->rc, s, evt->channel);
+	}
+	print_line(c, "> ", evt->raw);
 }
 
-void *input_thread(void *vargp)
+void handle_part(struct twirc_state *s, struct twirc_event *evt)
 {
-	struct twirc_state *s = (struct twirc_state*) vargp;
-
-	fprintf(stderr, "*** input thread launched\n");
-	char buf[2048];
-	while (running)
+	struct client *c = twirc_get_context(s);
+	if (evt->origin && strcmp(evt->origin, NICK) == 0)
 	{
-		fgets(buf, 2048, stdin);
-		twirc_cmd_raw(s, buf);
+		reconn_parted(&c->rc, s, evt->channel);
 	}
-	return NULL;
+	print_line(c, "> ", evt->raw);
 }
 
 /*
- * main
+ * Twitch is about to restart the server we're on: connect to another one
+ * while this one is still up, so we don't miss anything.
  */
-int main(void)
+void handle_reconnect(struct twirc_state *s, struct twirc_event *evt)
 {
-	fprintf(stderr, "Starting up libtwirc test client...\n");
+	struct client *c = twirc_get_context(s);
+	print_line(c, "> ", evt->raw);
+	reconn_reconnect(&c->rc);
+}
 
-	// Make sure we still do clean-up on SIGINT (ctrl+c)
-	// and similar signals that indicate we should quit.
-	struct sigaction sa_int = {
-		.sa_handler = &sigint_handler
-	};
-	if (sigaction(SIGINT, &sa_int, NULL) == -1)
-	{
-		fprintf(stderr, "Failed to register SIGINT handler\n");
-	}
-	if (sigaction(SIGQUIT, &sa_int, NULL) == -1)
+void handle_outbound(struct twirc_state *s, struct twirc_event *evt)
+{
+	struct client *c = twirc_get_context(s);
+	if (strcmp(evt->command, "PASS") == 0)
 	{
-		fprintf(stderr, "Failed to register SIGQUIT handler\n");
+		print_line(c, "< ", "PASS ********");
 	}
-	if (sigaction (SIGTERM, &sa_int, NULL) == -1)
+	else
 	{
-		fprintf(stderr, "Failed to register SIGTERM handler\n");
+		print_line(c, "< ", evt->raw);
 	}
+}
 
-	// CREATE TWIRC INSTANCE
-	struct twirc_state *s = twirc_init();
-
-	if (s == NULL)
+void handle_signal(struct evloop *loop, int sig, void *ctx)
+{
+	if (sig == SIGUSR1)
 	{
-		fprintf(stderr, "Could not init twirc state\n");
-		return EXIT_FAILURE;
+		metrics_print(stderr);
+		return;
 	}
+	fprintf(stderr, "*** received signal, exiting\n");
+	evloop_stop(loop);
+}
 
-	fprintf(stderr, "Successfully initialized twirc state...\n");
+/*
+ * Called for every new libtwirc state, before it connects.
+ */
+void setup_state(twirc_state_t *s, void *ctx)
+{
+	twirc_set_context(s, ctx);
 
 	// SET UP CALLBACKS
 	struct twirc_callbacks *cbs = twirc_get_callbacks(s);
@@ -140,8 +207,8 @@ int main(void)
 	cbs->globaluserstate = handle_everything;
 	cbs->capack          = handle_everything;
 	cbs->ping            = handle_everything;
-	cbs->join            = handle_everything;
-	cbs->part            = handle_everything;
+	cbs->join            = handle_join;
+	cbs->part            = handle_part;
 	cbs->mode            = handle_everything;
 	cbs->names           = handle_everything;
 	cbs->privmsg         = handle_everything;
@@ -154,41 +221,369 @@ int main(void)
 	cbs->clearchat       = handle_everything;
 	cbs->clearmsg        = handle_everything;
 	cbs->hosttarget      = handle_everything;
-	cbs->reconnect       = handle_everything;
+	cbs->reconnect       = handle_reconnect;
 	cbs->invalidcmd      = handle_everything;
 	cbs->other           = handle_everything;
 	cbs->disconnect      = handle_disconnect;
 	cbs->outbound        = handle_outbound;
 
+	// Count and time all of the above
+	metrics_wrap(cbs);
+}
+
+/*
+ * Sets up the output and its thread; with OUTPUT_SPILL, output that doesn't
+ * fit goes to a temporary file. Returns 0 on success, -1 on error.
+ */
+int open_output(struct client *c, int policy)
+{
+	c->spill_fd = -1;
+	if (policy == OUTPUT_SPILL)
+	{
+		char tmp[] = "/tmp/client-spill-XXXXXX";
+		c->spill_fd = mkstemp(tmp);
+		if (c->spill_fd == -1)
+		{
+			return -1;
+		}
+		unlink(tmp);
+	}
+
+	// Every line is written right away, just not by us
+	output_init(&c->out, STDOUT_FILENO, 0, 0);
+	if (output_start(&c->out, policy, c->spill_fd) == -1)
+	{
+		output_free(&c->out);
+		if (c->spill_fd != -1)
+		{
+			close(c->spill_fd);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes out what's left and tells how much output had to be dropped, if any.
+ */
+void close_output(struct client *c)
+{
+	uint64_t dropped, dropped_bytes, spilled_bytes;
+	output_counts(&c->out, &dropped, &dropped_bytes, &spilled_bytes);
+	output_free(&c->out);
+	if (c->spill_fd != -1)
+	{
+		close(c->spill_fd);
+	}
+
+	if (dropped)
+	{
+		fprintf(stderr, "*** output fell behind: %llu line(s) (%llu bytes) dropped\n",
+				(unsigned long long) dropped,
+				(unsigned long long) dropped_bytes);
+	}
+}
+
+int connect_state(twirc_state_t *s, void *ctx)
+{
+	struct client *c = ctx;
+	return twirc_connect(s, c->host, c->port, NICK, c->token);
+}
+
+/*
+ * Called once a new connection took over. Input might have piled up while
+ * we had none, so we check on it.
+ */
+void handle_switch(twirc_state_t *old, twirc_state_t *s, void *ctx)
+{
+	struct client *c = ctx;
+	if (s == NULL)
+	{
+		print_line(c, "*** ", "reconnecting...");
+		return;
+	}
+	char buf[128];
+	snprintf(buf, sizeof(buf), "reconnected, %llu ms without connection, took %llu ms",
+			(unsigned long long) c->rc.last_gap,
+			(unsigned long long) c->rc.last_latency);
+	print_line(c, "*** ", buf);
+	evloop_wake(&c->loop);
+}
+
+/*
+ * Called in the main thread after the input thread queued some lines. We send
+ * them off in batches, so a flood of input can't starve the connection.
+ */
+void handle_input(struct evloop *loop, int fd, void *ctx)
+{
+	struct input *in = ctx;
+	char buf[INPUT_BUFFER + 1];
+	size_t len;
+
+	// Without a connection, the input waits in the queue
+	if (loop->s == NULL)
+	{
+		return;
+	}
+
+	for (int i = 0; i < INPUT_BATCH; ++i)
+	{
+		if ((len = spsc_pop(&in->queue, buf, INPUT_BUFFER)) == 0)
+		{
+			return;
+		}
+		buf[len] = '\0';
+		metrics_add(METRICS_INPUT_QUEUE, -1);
+		twirc_cmd_raw(loop->s, buf);
+	}
+
+	// There is more, we'll be back after checking on the connection
+	evloop_wake(loop);
+}
+
+/*
+ * Puts a line into the queue, waiting for room if the main thread is behind.
+ * Returns 0 on success, -1 if we've been told to quit in the meantime.
+ */
+int queue_line(struct input *in, const char *line, size_t len)
+{
+	struct pollfd quit = { .fd = in->quit, .events = POLLIN };
+	while (spsc_push(&in->queue, line, len) == -1)
+	{
+		evloop_wake(in->loop);
+		if (poll(&quit, 1, INPUT_RETRY_MS) > 0)
+		{
+			return -1;
+		}
+	}
+	metrics_add(METRICS_INPUT_QUEUE, 1);
+	return 0;
+}
+
+/*
+ * Reads stdin until it runs dry or we're told to quit and queues every
+ * complete line; all lines we got from one read() cause only one wake-up.
+ */
+void *input_thread(void *arg)
+{
+	struct input *in = arg;
+
+	fprintf(stderr, "*** input thread launched\n");
+	char buf[INPUT_BUFFER];
+	size_t len = 0;
+	struct pollfd fds[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = in->quit,     .events = POLLIN }
+	};
+
+	for (;;)
+	{
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents)
+		{
+			break;
+		}
+
+		ssize_t res = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+		if (res <= 0)
+		{
+			break;
+		}
+		len += res;
+
+		int queued = 0;
+		char *line = buf;
+		char *end;
+		while ((end = memchr(line, '\n', len - (line - buf))))
+		{
+			size_t line_len = end - line;
+			if (line_len > 0 && line[line_len - 1] == '\r')
+			{
+				--line_len;
+			}
+			if (line_len > 0)
+			{
+				if (queue_line(in, line, line_len) == -1)
+				{
+					return NULL;
+				}
+				queued = 1;
+			}
+			line = end + 1;
+		}
+
+		len -= line - buf;
+		memmove(buf, line, len);
+
+		// Lines too long for our buffer are thrown away
+		if (len == sizeof(buf))
+		{
+			len = 0;
+		}
+		if (queued)
+		{
+			evloop_wake(in->loop);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * main
+ */
+int main(int argc, char **argv)
+{
+	// Connect to Twitch, unless told otherwise (like a mock server)
+	char *host = HOST;
+	char *port = PORT;
+	int tick = EVLOOP_TICK;
+	char *metrics = NULL;
+	int policy = OUTPUT_BLOCK;
+
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "H:M:o:P:T:")) != -1)
+	{
+		switch(o)
+		{
+			case 'o':
+				policy = output_policy(optarg);
+				if (policy == -1)
+				{
+					fprintf(stderr, "Unknown output policy '%s'\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'T':
+				tick = atoi(optarg);
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			case 'M':
+				metrics = optarg;
+				break;
+			case 'P':
+				port = optarg;
+				break;
+		}
+	}
+
+	fprintf(stderr, "Starting up libtwirc test client...\n");
+
 	// READ IN TOKEN FILE
-	char token[128];
-	int token_success = read_token(token, 128);
+	struct client c = { .host = host, .port = port };
+	int token_success = read_token(c.token, sizeof(c.token));
 	if (token_success == 0)
 	{
 		fprintf(stderr, "Could not read token file\n");
 		return EXIT_FAILURE;
 	}
 
+	// SET UP OUTPUT
+	if (open_output(&c, policy) == -1)
+	{
+		fprintf(stderr, "Could not set up output\n");
+		return EXIT_FAILURE;
+	}
+
+	// SET UP EVENT LOOP
+	if (evloop_init(&c.loop, NULL, tick) == -1)
+	{
+		fprintf(stderr, "Could not init event loop\n");
+		close_output(&c);
+		return EXIT_FAILURE;
+	}
+
 	// CONNECT TO THE IRC SERVER
-	if (twirc_connect(s, HOST, PORT, NICK, token) != 0)
+	// The reconnect logic creates the libtwirc state, calling setup_state()
+	// and connect_state(), and will do so again whenever we need a new one
+	reconn_init(&c.rc, &c.loop, setup_state, connect_state, &c);
+	c.rc.on_switch = handle_switch;
+	if (reconn_start(&c.rc) == -1)
 	{
 		fprintf(stderr, "Could not connect socket\n");
+		evloop_free(&c.loop);
+		close_output(&c);
 		return EXIT_FAILURE;
 	}
 
 	fprintf(stderr, "Connection initiated...\n");
 
-	pthread_t t;
-	pthread_create(&t, NULL, &input_thread, (void *) s);
+	// Make sure we still do clean-up on SIGINT (ctrl+c)
+	// and similar signals that indicate we should quit.
+	// This has to happen before we start any threads.
+	if (evloop_signal(&c.loop, SIGINT, handle_signal, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to register SIGINT handler\n");
+	}
+	if (evloop_signal(&c.loop, SIGQUIT, handle_signal, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to register SIGQUIT handler\n");
+	}
+	if (evloop_signal(&c.loop, SIGTERM, handle_signal, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to register SIGTERM handler\n");
+	}
+	if (evloop_signal(&c.loop, SIGUSR1, handle_signal, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to register SIGUSR1 handler\n");
+	}
+
+	// Serve metrics, if asked to
+	struct metrics_server ms = { .fd = -1 };
+	if (metrics && metrics_listen(&ms, &c.loop, metrics) == -1)
+	{
+		fprintf(stderr, "Could not serve metrics on %s\n", metrics);
+	}
 
-	// MAIN LOOP
-	running = 1;
-	while (twirc_tick(s, 1000) == 0 && running == 1)
+	// START INPUT THREAD
+	struct input in = { .loop = &c.loop };
+	in.quit = eventfd(0, EFD_CLOEXEC);
+	if (in.quit == -1 || spsc_init(&in.queue, INPUT_QUEUE) == -1)
 	{
+		fprintf(stderr, "Could not set up input queue\n");
+		reconn_free(&c.rc);
+		evloop_free(&c.loop);
+		close_output(&c);
+		return EXIT_FAILURE;
 	}
+	evloop_on_wake(&c.loop, handle_input, &in);
+	pthread_create(&in.thread, NULL, &input_thread, &in);
+
+	// MAIN LOOP
+	// If the connection is lost, the loop keeps running while we reconnect
+	evloop_run(&c.loop);
 
 	// CLEANUP
-	twirc_kill(s);
+	uint64_t one = 1;
+	if (write(in.quit, &one, sizeof(one)) == sizeof(one))
+	{
+		pthread_join(in.thread, NULL);
+	}
+	close(in.quit);
+	spsc_free(&in.queue);
+
+	// This also frees the libtwirc state(s)
+	metrics_close(&ms);
+	reconn_free(&c.rc);
+	evloop_free(&c.loop);
+	close_output(&c);
+
+	if (c.rc.reconnects)
+	{
+		fprintf(stderr, "*** %u reconnect(s), longest gap %llu ms, %llu ms in total\n",
+				c.rc.reconnects,
+				(unsigned long long) c.rc.max_gap,
+				(unsigned long long) c.rc.total_gap);
+	}
 
 	fprintf(stderr, "Bye!\n");
 	return EXIT_SUCCESS;
@@ -0,0 +1,642 @@
+#include <stdio.h>      // FILE, fopen(), fgets(), fprintf(), fclose(), snprintf(), rename()
+#include <stdlib.h>     // NULL, malloc(), calloc(), free(), qsort(), bsearch(), strtod()
+#include <string.h>     // memset(), memcpy(), strcmp(), strncmp(), strlen(), strspn(), strcspn(), strrchr()
+#include <stdint.h>     // uint64_t
+#include <dirent.h>     // opendir(), readdir(), closedir()
+#include <unistd.h>     // unlink()
+#include <sys/stat.h>   // stat()
+#include "cluster.h"
+
+#define PLAN_FILE   "plan"
+#define NODE_SUFFIX ".node"
+#define PATH_SIZE   (CLUSTER_DIR + 2 * CLUSTER_NAME + 16)
+
+struct point
+{
+	uint64_t hash;
+	int      node;
+};
+
+struct weighed
+{
+	double   weight;
+	uint64_t hash;
+	size_t   chan;
+	size_t   point;    // First point on the ring at or after 'hash'
+};
+
+/*
+ * FNV-1a, with all bits mixed into all others at the end, so the points of a
+ * node, which only differ in the seed, end up all over the ring.
+ */
+static uint64_t hash_str(const char *str, uint64_t seed)
+{
+	uint64_t hash = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+	for (; *str; ++str)
+	{
+		hash = (hash ^ (unsigned char) *str) * 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/*
+ * Node names end up in file names and in lines of the plan, so we only allow
+ * letters, digits, dots, dashes and underscores, and no leading dot.
+ */
+static int valid_name(const char *name)
+{
+	size_t len = strlen(name);
+	if (len == 0 || len >= CLUSTER_NAME || name[0] == '.')
+	{
+		return 0;
+	}
+	return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == len;
+}
+
+static int compare_chans(const void *a, const void *b)
+{
+	return strcmp(((const struct cluster_chan *) a)->name, ((const struct cluster_chan *) b)->name);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp((const char *) a, (const char *) b);
+}
+
+static int compare_points(const void *a, const void *b)
+{
+	const struct point *pa = a;
+	const struct point *pb = b;
+	if (pa->hash != pb->hash)
+	{
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	return pa->node - pb->node;
+}
+
+/*
+ * Heaviest first; ties are broken by hash, so every node sorts the same way.
+ */
+static int compare_weighed(const void *a, const void *b)
+{
+	const struct weighed *wa = a;
+	const struct weighed *wb = b;
+	if (wa->weight != wb->weight)
+	{
+		return wa->weight > wb->weight ? -1 : 1;
+	}
+	if (wa->hash != wb->hash)
+	{
+		return wa->hash < wb->hash ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the index of the node in the sorted list, or -1.
+ */
+static int find_node(char (*names)[CLUSTER_NAME], size_t num, const char *name)
+{
+	char (*res)[CLUSTER_NAME] = bsearch(name, names, num, CLUSTER_NAME, compare_names);
+	return res ? (int) (res - names) : -1;
+}
+
+/*
+ * Sets up the given channels, none of which we want to be in yet, for the
+ * node called 'name'. The names of the channels have to stay around as long
+ * as the cluster does. Returns 0 on success, -1 on error, including an
+ * invalid node name.
+ */
+int cluster_init(struct cluster *cl, const char *dir, const char *name, char **chans, size_t num_chans)
+{
+	memset(cl, 0, sizeof(struct cluster));
+	if (!valid_name(name) || strlen(dir) >= CLUSTER_DIR)
+	{
+		return -1;
+	}
+	strcpy(cl->dir, dir);
+	strcpy(cl->name, name);
+
+	cl->chans = calloc(num_chans ? num_chans : 1, sizeof(struct cluster_chan));
+	cl->scratch = calloc(num_chans ? num_chans : 1, sizeof(int));
+	if (cl->chans == NULL || cl->scratch == NULL)
+	{
+		free(cl->chans);
+		free(cl->scratch);
+		return -1;
+	}
+
+	for (size_t i = 0; i < num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		c->name = chans[i];
+		c->hash = hash_str(chans[i], 0);
+		c->owner = -1;
+		atomic_init(&c->messages, 0);
+		atomic_init(&c->joined, 0);
+		atomic_init(&c->want, 0);
+	}
+	cl->num_chans = num_chans;
+	qsort(cl->chans, num_chans, sizeof(struct cluster_chan), compare_chans);
+	atomic_init(&cl->version, 0);
+	return 0;
+}
+
+/*
+ * Returns the channel with the given name, or NULL if it isn't one of ours.
+ */
+struct cluster_chan *cluster_find(struct cluster *cl, const char *chan)
+{
+	struct cluster_chan key = { .name = chan };
+	return bsearch(&key, cl->chans, cl->num_chans, sizeof(struct cluster_chan), compare_chans);
+}
+
+/*
+ * Opens a temporary file next to 'file' in the directory, for commit(). It's
+ * named after us, as two nodes may briefly both think they're the coordinator
+ * and write the plan at the same time.
+ */
+static FILE *open_tmp(struct cluster *cl, const char *file, char *tmp)
+{
+	snprintf(tmp, PATH_SIZE, "%s/.%s.%s.tmp", cl->dir, file, cl->name);
+	return fopen(tmp, "w");
+}
+
+/*
+ * Closes the temporary file and puts it in the place of 'file', unless there
+ * was an error writing it. Returns 0 on success, -1 on error.
+ */
+static int commit(struct cluster *cl, FILE *fp, const char *tmp, const char *file)
+{
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s/%s", cl->dir, file);
+	int err = ferror(fp);
+	if (fclose(fp) == EOF || err || rename(tmp, path) == -1)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes our heartbeat: the channels we're in, with their message rates.
+ */
+static int write_beat(struct cluster *cl)
+{
+	char file[CLUSTER_NAME + sizeof(NODE_SUFFIX)];
+	char tmp[PATH_SIZE];
+	snprintf(file, sizeof(file), "%s" NODE_SUFFIX, cl->name);
+
+	FILE *fp = open_tmp(cl, file, tmp);
+	if (fp == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		if (atomic_load_explicit(&c->joined, memory_order_relaxed))
+		{
+			fprintf(fp, "%.3f %s\n", c->rate, c->name);
+		}
+	}
+	return commit(cl, fp, tmp, file);
+}
+
+/*
+ * Reads the plan, if there is one yet, and sets the owner of every channel.
+ */
+static void read_plan(struct cluster *cl)
+{
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		cl->chans[i].owner = -1;
+	}
+	cl->num_planned = 0;
+
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s/" PLAN_FILE, cl->dir);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		return;
+	}
+
+	char line[CLUSTER_LINE];
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "node ", 5) == 0)
+		{
+			if (cl->num_planned < CLUSTER_MAX_NODES && valid_name(line + 5))
+			{
+				strcpy(cl->planned[cl->num_planned++], line + 5);
+			}
+			continue;
+		}
+		char *node = strrchr(line, ' ');
+		if (strncmp(line, "chan ", 5) != 0 || node == line + 4)
+		{
+			continue;
+		}
+		*node++ = '\0';
+		struct cluster_chan *c = cluster_find(cl, line + 5);
+		if (c)
+		{
+			c->owner = find_node(cl->planned, cl->num_planned, node);
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * Reads the heartbeat of another node: the rates of the channels it's in,
+ * and whether it's in the ones the plan gives it.
+ */
+static void read_beat(struct cluster *cl, const char *node)
+{
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s/%s" NODE_SUFFIX, cl->dir, node);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		return;
+	}
+
+	int planned = find_node(cl->planned, cl->num_planned, node);
+	char line[CLUSTER_LINE];
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		char *chan = NULL;
+		double rate = strtod(line, &chan);
+		if (chan == line || *chan != ' ')
+		{
+			continue;
+		}
+		struct cluster_chan *c = cluster_find(cl, chan + 1);
+		if (c == NULL)
+		{
+			continue;
+		}
+
+		// While we're in it as well, we measure the rate ourselves
+		if (!atomic_load_explicit(&c->joined, memory_order_relaxed))
+		{
+			c->rate = rate;
+		}
+		if (planned != -1 && c->owner == planned)
+		{
+			c->settled = 1;
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * Finds the nodes with a recent heartbeat, then reads what they're up to.
+ */
+static void scan_nodes(struct cluster *cl, time_t now)
+{
+	cl->num_live = 0;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		cl->chans[i].settled = 0;
+	}
+
+	DIR *dir = opendir(cl->dir);
+	if (dir == NULL)
+	{
+		return;
+	}
+	size_t suffix = strlen(NODE_SUFFIX);
+	struct dirent *e = NULL;
+	while ((e = readdir(dir)) != NULL && cl->num_live < CLUSTER_MAX_NODES)
+	{
+		size_t len = strlen(e->d_name);
+		if (len <= suffix || len - suffix >= CLUSTER_NAME ||
+		    strcmp(e->d_name + len - suffix, NODE_SUFFIX) != 0)
+		{
+			continue;
+		}
+		char name[CLUSTER_NAME];
+		memcpy(name, e->d_name, len - suffix);
+		name[len - suffix] = '\0';
+
+		if (!valid_name(name))
+		{
+			continue;
+		}
+
+		char path[PATH_SIZE];
+		snprintf(path, PATH_SIZE, "%s/%s" NODE_SUFFIX, cl->dir, name);
+		struct stat st;
+		if (stat(path, &st) == -1 || now - st.st_mtime > CLUSTER_TIMEOUT)
+		{
+			continue;
+		}
+		strcpy(cl->live[cl->num_live++], name);
+	}
+	closedir(dir);
+	qsort(cl->live, cl->num_live, CLUSTER_NAME, compare_names);
+
+	for (size_t i = 0; i < cl->num_live; ++i)
+	{
+		if (strcmp(cl->live[i], cl->name) != 0)
+		{
+			read_beat(cl, cl->live[i]);
+		}
+	}
+}
+
+/*
+ * Returns 1 if we're the coordinator, the live node with the lowest name.
+ */
+int cluster_leader(struct cluster *cl)
+{
+	return cl->num_live > 0 && strcmp(cl->live[0], cl->name) == 0;
+}
+
+/*
+ * Assigns every channel to one of the live nodes with consistent hashing and
+ * bounded loads, see cluster.h. Channels that don't fit on the node their
+ * hash points to stay with their current owner if it has room, rather than
+ * going to whichever node comes next now, so fewer of them move. Returns the highest load of a
+ * node, or -1 on error.
+ */
+static double make_plan(struct cluster *cl, int *owners)
+{
+	size_t num_points = cl->num_live * CLUSTER_VNODES;
+	struct point *ring = malloc(num_points * sizeof(struct point));
+	struct weighed *order = malloc((cl->num_chans ? cl->num_chans : 1) * sizeof(struct weighed));
+	if (ring == NULL || order == NULL)
+	{
+		free(ring);
+		free(order);
+		return -1;
+	}
+
+	for (size_t n = 0; n < cl->num_live; ++n)
+	{
+		for (size_t k = 0; k < CLUSTER_VNODES; ++k)
+		{
+			ring[n * CLUSTER_VNODES + k].hash = hash_str(cl->live[n], k + 1);
+			ring[n * CLUSTER_VNODES + k].node = (int) n;
+		}
+	}
+	qsort(ring, num_points, sizeof(struct point), compare_points);
+
+	double total = 0;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		order[i].weight = 1.0 + cl->chans[i].rate;
+		order[i].hash = cl->chans[i].hash;
+		order[i].chan = i;
+		total += order[i].weight;
+	}
+	qsort(order, cl->num_chans, sizeof(struct weighed), compare_weighed);
+
+	double loads[CLUSTER_MAX_NODES] = { 0 };
+	double cap = (1.0 + CLUSTER_SLACK) * total / cl->num_live;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		// The first point at or after the channel's hash, wrapping around
+		size_t lo = 0;
+		size_t hi = num_points;
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (ring[mid].hash < order[i].hash)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		order[i].point = lo % num_points;
+
+		// Channels go where their hash points to, as long as that works
+		int node = ring[order[i].point].node;
+		if (loads[node] + order[i].weight <= cap)
+		{
+			owners[order[i].chan] = node;
+			loads[node] += order[i].weight;
+		}
+		else
+		{
+			owners[order[i].chan] = -1;
+		}
+	}
+
+	// The rest stay where they are if there's room, otherwise they go to
+	// the next node on the ring that isn't full; a channel heavier than
+	// what's left anywhere goes to the node with the least load
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		if (owners[order[i].chan] != -1)
+		{
+			continue;
+		}
+		struct cluster_chan *c = &cl->chans[order[i].chan];
+		int node = c->owner == -1 ? -1 : find_node(cl->live, cl->num_live, cl->planned[c->owner]);
+		if (node != -1 && loads[node] + order[i].weight > cap)
+		{
+			node = -1;
+		}
+		for (size_t step = 1; node == -1 && step < num_points; ++step)
+		{
+			int n = ring[(order[i].point + step) % num_points].node;
+			node = loads[n] + order[i].weight <= cap ? n : -1;
+		}
+		if (node == -1)
+		{
+			node = 0;
+			for (size_t n = 1; n < cl->num_live; ++n)
+			{
+				node = loads[n] < loads[node] ? (int) n : node;
+			}
+		}
+		owners[order[i].chan] = node;
+		loads[node] += order[i].weight;
+	}
+	free(ring);
+	free(order);
+
+	double max = 0;
+	for (size_t n = 0; n < cl->num_live; ++n)
+	{
+		max = loads[n] > max ? loads[n] : max;
+	}
+	return max;
+}
+
+static int write_plan(struct cluster *cl)
+{
+	char tmp[PATH_SIZE];
+	FILE *fp = open_tmp(cl, PLAN_FILE, tmp);
+	if (fp == NULL)
+	{
+		return -1;
+	}
+	for (size_t n = 0; n < cl->num_planned; ++n)
+	{
+		fprintf(fp, "node %s\n", cl->planned[n]);
+	}
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		if (c->owner != -1)
+		{
+			fprintf(fp, "chan %s %s\n", c->name, cl->planned[c->owner]);
+		}
+	}
+	return commit(cl, fp, tmp, PLAN_FILE);
+}
+
+/*
+ * As the coordinator, plans again if nodes came or went, or some channels
+ * have no owner, or a node has a lot more load than the others, as long as
+ * a new plan does better. Returns 1 if we wrote a new plan, 0 if not, -1 on
+ * error.
+ */
+static int replan(struct cluster *cl)
+{
+	int changed = cl->num_planned != cl->num_live;
+	for (size_t n = 0; !changed && n < cl->num_live; ++n)
+	{
+		changed = strcmp(cl->planned[n], cl->live[n]) != 0;
+	}
+
+	double loads[CLUSTER_MAX_NODES] = { 0 };
+	double total = 0;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		total += 1.0 + c->rate;
+		if (c->owner == -1)
+		{
+			changed = 1;
+		}
+		else
+		{
+			loads[c->owner] += 1.0 + c->rate;
+		}
+	}
+
+	double max = 0;
+	for (size_t n = 0; n < cl->num_planned; ++n)
+	{
+		max = loads[n] > max ? loads[n] : max;
+	}
+	if (!changed && max <= (1.0 + CLUSTER_IMBALANCE) * total / cl->num_planned)
+	{
+		return 0;
+	}
+
+	double planned = make_plan(cl, cl->scratch);
+	if (planned < 0 || (!changed && planned >= max))
+	{
+		return planned < 0 ? -1 : 0;
+	}
+
+	cl->moved = 0;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		int owner = cl->scratch[i];
+		if (c->owner == -1 || strcmp(cl->planned[c->owner], cl->live[owner]) != 0)
+		{
+			cl->moved += c->owner != -1;
+			c->settled = 0;
+		}
+		c->owner = owner;
+	}
+	memcpy(cl->planned, cl->live, sizeof(cl->live));
+	cl->num_planned = cl->num_live;
+	cl->plans += 1;
+	return write_plan(cl) == -1 ? -1 : 1;
+}
+
+/*
+ * Does everything that has to happen every CLUSTER_INTERVAL seconds: works out
+ * the message rates of our channels, writes our heartbeat, reads the plan and
+ * those of the other nodes and, if we're the coordinator, plans again when
+ * needed. Then decides which channels we should be in. Should be called
+ * regularly. Returns 1 if that changed, 0 if not.
+ */
+int cluster_tick(struct cluster *cl, time_t now)
+{
+	if (now - cl->beat < CLUSTER_INTERVAL)
+	{
+		return 0;
+	}
+	double secs = cl->beat ? (double) (now - cl->beat) : CLUSTER_INTERVAL;
+	cl->beat = now;
+
+	// A moving average, so a short burst doesn't move a channel
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		uint64_t num = atomic_exchange_explicit(&c->messages, 0, memory_order_relaxed);
+		if (atomic_load_explicit(&c->joined, memory_order_relaxed))
+		{
+			c->rate = (c->rate + num / secs) / 2;
+		}
+	}
+
+	write_beat(cl);
+	read_plan(cl);
+	scan_nodes(cl, now);
+	if (cluster_leader(cl))
+	{
+		replan(cl);
+	}
+
+	int me = find_node(cl->planned, cl->num_planned, cl->name);
+	int changed = 0;
+	cl->num_mine = 0;
+	for (size_t i = 0; i < cl->num_chans; ++i)
+	{
+		struct cluster_chan *c = &cl->chans[i];
+		int mine = me != -1 && c->owner == me;
+		int want = mine || (atomic_load_explicit(&c->joined, memory_order_relaxed) && !c->settled);
+		if (atomic_load_explicit(&c->want, memory_order_relaxed) != want)
+		{
+			atomic_store_explicit(&c->want, want, memory_order_relaxed);
+			changed = 1;
+		}
+		cl->num_mine += mine;
+	}
+	if (changed)
+	{
+		atomic_fetch_add_explicit(&cl->version, 1, memory_order_release);
+	}
+	return changed;
+}
+
+/*
+ * Removes our heartbeat, so the coordinator hands our channels to the other
+ * nodes right away, instead of after CLUSTER_TIMEOUT seconds.
+ */
+void cluster_free(struct cluster *cl)
+{
+	if (cl->chans == NULL)
+	{
+		return;
+	}
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s/%s" NODE_SUFFIX, cl->dir, cl->name);
+	unlink(path);
+	free(cl->chans);
+	free(cl->scratch);
+	cl->chans = NULL;
+	cl->scratch = NULL;
+}
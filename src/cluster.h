@@ -0,0 +1,81 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <stdatomic.h>  // atomic_int, atomic_uint, atomic_uint_fast64_t
+#include <time.h>       // time_t
+
+#define CLUSTER_INTERVAL  5     // Seconds between heartbeats
+#define CLUSTER_TIMEOUT   20    // Nodes without a heartbeat for this long are gone
+#define CLUSTER_VNODES    128   // Points of every node on the hash ring
+#define CLUSTER_SLACK     0.25  // Nodes get at most this much above the average load
+#define CLUSTER_IMBALANCE 0.5   // Plan again once a node is this far above average
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_NAME      64    // Longest node name, including the terminator
+#define CLUSTER_DIR       4096  // Longest path of the directory, likewise
+#define CLUSTER_LINE      512   // Longest line in the files
+
+struct cluster_chan
+{
+	const char          *name;
+	uint64_t             hash;     // Its place on the ring
+	double               rate;     // Messages per second, as last measured
+	int                  owner;    // Index into 'planned', -1 if not in the plan
+	int                  settled;  // The owner said it's in the channel
+	atomic_uint_fast64_t messages; // Counted by the worker that has it
+	atomic_int           joined;   // Set by the worker that has it
+	atomic_int           want;     // Whether we should be in it
+};
+
+/*
+ * Spreads the channels across several dump nodes that share a directory. Every
+ * node writes a heartbeat file to it (NAME.node) every CLUSTER_INTERVAL
+ * seconds, with the channels it is in and their message rates, one per line:
+ * "RATE CHANNEL". The node with the lowest name among the live ones is the
+ * coordinator: it writes the plan (plan), which assigns every channel to a
+ * node, with lines "node NAME" for all nodes, then "chan CHANNEL NAME". The
+ * files are written to a temporary file of the writing node first and then
+ * renamed, so readers never see half of one, even if two nodes write.
+ *
+ * Channels are placed with consistent hashing: every node has CLUSTER_VNODES
+ * points on a ring of 64 bit hashes, and a channel goes to the node of the
+ * first point at or after its hash. If a node comes or goes, only channels
+ * next to its points move. Load is bounded: channels weigh 1 plus their
+ * message rate, and are placed heaviest first, skipping nodes that would end
+ * up more than CLUSTER_SLACK above the average load. The coordinator only
+ * plans again when nodes came or went, or when the rates changed so much that
+ * a node is CLUSTER_IMBALANCE above average and a new plan does better.
+ *
+ * A node leaves a channel it lost only once the new owner's heartbeat lists
+ * it, so the channel is covered by both for a while instead of by none.
+ *
+ * cluster_tick() is only ever called by one thread; the workers count the
+ * messages of their channels, report whether they're in them and read
+ * whether they should be, all of which is atomic.
+ */
+struct cluster
+{
+	char                 dir[CLUSTER_DIR];
+	char                 name[CLUSTER_NAME];
+	struct cluster_chan *chans;       // Sorted by name
+	size_t               num_chans;
+	char                 live[CLUSTER_MAX_NODES][CLUSTER_NAME];    // Sorted
+	size_t               num_live;
+	char                 planned[CLUSTER_MAX_NODES][CLUSTER_NAME]; // As in the plan
+	size_t               num_planned;
+	int                 *scratch;     // Owners while planning
+	time_t               beat;        // When we last wrote our heartbeat
+	size_t               num_mine;    // Channels the plan gives us
+	unsigned             plans;       // Plans we wrote as the coordinator
+	size_t               moved;       // Channels that moved with the last one
+	atomic_uint          version;     // Bumped whenever a 'want' changes
+};
+
+int  cluster_init(struct cluster *cl, const char *dir, const char *name, char **chans, size_t num_chans);
+struct cluster_chan *cluster_find(struct cluster *cl, const char *chan);
+int  cluster_tick(struct cluster *cl, time_t now);
+int  cluster_leader(struct cluster *cl);
+void cluster_free(struct cluster *cl);
+
+#endif
@@ -0,0 +1,365 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), realloc(), free(), qsort()
+#include <string.h>     // strlen(), strcmp(), strcpy(), strchr(), strcspn()
+#include <strings.h>    // strcasecmp()
+#include <stdint.h>     // uint32_t, uint64_t
+#include <ctype.h>      // tolower()
+#include <time.h>       // clock_gettime()
+#include "cmd.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sets up an empty table. Returns 0 on success, -1 on error.
+ */
+int cmd_init(struct cmd_table *t)
+{
+	memset(t, 0, sizeof(struct cmd_table));
+	t->cooldowns = calloc(CMD_COOLDOWNS, sizeof(struct cmd_cooldown));
+	t->cap_cooldowns = CMD_COOLDOWNS;
+	return t->cooldowns ? 0 : -1;
+}
+
+/*
+ * Registers a command, like "!hello". Names are matched case-insensitively.
+ * 'cooldown' is how long nobody may use the command after someone did,
+ * 'user_cooldown' how long the same user may not use it again (both in
+ * milliseconds, 0 for none). Call cmd_compile() once all commands have been
+ * added. Returns 0 on success, -1 on error or if the name is taken.
+ */
+int cmd_add(struct cmd_table *t, const char *name, int cooldown, int user_cooldown,
+		cmd_handler handler, void *ctx)
+{
+	size_t len = strlen(name);
+	if (len == 0 || len >= CMD_MAX_NAME || strchr(name, ' '))
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < t->num_cmds; ++i)
+	{
+		if (strcasecmp(t->cmds[i].name, name) == 0)
+		{
+			return -1;
+		}
+	}
+
+	if (t->num_cmds == t->cap_cmds)
+	{
+		size_t cap = t->cap_cmds ? t->cap_cmds * 2 : 16;
+		struct cmd *cmds = realloc(t->cmds, cap * sizeof(struct cmd));
+		if (cmds == NULL)
+		{
+			return -1;
+		}
+		t->cmds = cmds;
+		t->cap_cmds = cap;
+	}
+
+	struct cmd *cmd = &t->cmds[t->num_cmds];
+	if ((cmd->name = malloc(len + 1)) == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i <= len; ++i)
+	{
+		cmd->name[i] = tolower((unsigned char) name[i]);
+	}
+	cmd->handler = handler;
+	cmd->ctx = ctx;
+	cmd->cooldown = cooldown > 0 ? cooldown : 0;
+	cmd->user_cooldown = user_cooldown > 0 ? user_cooldown : 0;
+	cmd->ready = 0;
+	t->num_cmds += 1;
+	return 0;
+}
+
+static int compare_cmds(const void *a, const void *b)
+{
+	return strcmp(((const struct cmd *) a)->name, ((const struct cmd *) b)->name);
+}
+
+/*
+ * Builds the node for the commands in [lo, hi), which are sorted and all
+ * share their first 'depth' bytes. Every distinct byte at 'depth' becomes an
+ * edge; the edges are reserved before recursing so they stay adjacent.
+ * Returns the index of the node.
+ */
+static uint32_t build_node(struct cmd_table *t, size_t *num_edges, size_t lo, size_t hi, size_t depth)
+{
+	uint32_t index = t->num_nodes++;
+	struct cmd_node *node = &t->nodes[index];
+	node->cmd = -1;
+
+	// Being sorted, a command that ends here comes first
+	if (lo < hi && t->cmds[lo].name[depth] == '\0')
+	{
+		node->cmd = lo++;
+	}
+
+	uint16_t count = 0;
+	for (size_t i = lo; i < hi; ++i)
+	{
+		if (i == lo || t->cmds[i].name[depth] != t->cmds[i - 1].name[depth])
+		{
+			count += 1;
+		}
+	}
+	node->first = *num_edges;
+	node->num_edges = count;
+	*num_edges += count;
+
+	uint32_t edge = t->nodes[index].first;
+	for (size_t start = lo; start < hi; ++edge)
+	{
+		unsigned char c = t->cmds[start].name[depth];
+		size_t end = start + 1;
+		while (end < hi && (unsigned char) t->cmds[end].name[depth] == c)
+		{
+			++end;
+		}
+		t->edges[edge].c = c;
+		t->edges[edge].node = build_node(t, num_edges, start, end, depth + 1);
+		start = end;
+	}
+	return index;
+}
+
+/*
+ * Compiles the registered commands into the trie used for lookups. Can be
+ * called again after adding more commands. Returns 0 on success, -1 on error.
+ */
+int cmd_compile(struct cmd_table *t)
+{
+	qsort(t->cmds, t->num_cmds, sizeof(struct cmd), compare_cmds);
+
+	// There can't be more nodes than bytes in all names, plus the root
+	size_t max_nodes = 1;
+	for (size_t i = 0; i < t->num_cmds; ++i)
+	{
+		max_nodes += strlen(t->cmds[i].name);
+	}
+
+	free(t->nodes);
+	free(t->edges);
+	t->nodes = malloc(max_nodes * sizeof(struct cmd_node));
+	t->edges = malloc(max_nodes * sizeof(struct cmd_edge));
+	t->num_nodes = 0;
+	if (t->nodes == NULL || t->edges == NULL)
+	{
+		return -1;
+	}
+
+	size_t num_edges = 0;
+	build_node(t, &num_edges, 0, t->num_cmds, 0);
+	return 0;
+}
+
+/*
+ * Looks up the command with the given name, of which only the first 'len'
+ * bytes are used. Returns its index, or -1 if there is no such command.
+ */
+int cmd_find(const struct cmd_table *t, const char *name, size_t len)
+{
+	if (t->nodes == NULL)
+	{
+		return -1;
+	}
+
+	const struct cmd_node *node = &t->nodes[0];
+	for (size_t i = 0; i < len; ++i)
+	{
+		unsigned char c = tolower((unsigned char) name[i]);
+		const struct cmd_edge *edges = &t->edges[node->first];
+		size_t lo = 0;
+		size_t hi = node->num_edges;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (edges[mid].c < c)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		if (lo == node->num_edges || edges[lo].c != c)
+		{
+			return -1;
+		}
+		node = &t->nodes[edges[lo].node];
+	}
+	return node->cmd;
+}
+
+/*
+ * Copies the user name in lower case, cut off if it's longer than Twitch
+ * allows, and returns the FNV-1a hash of it and the command's index. Never
+ * returns 0, which marks unused slots.
+ */
+static uint64_t cooldown_key(const char *name, int cmd, char *user)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t len = 0;
+	for (; name[len] && len < CMD_MAX_USER - 1; ++len)
+	{
+		user[len] = tolower((unsigned char) name[len]);
+		hash = (hash ^ (unsigned char) user[len]) * 1099511628211ULL;
+	}
+	user[len] = '\0';
+	hash = (hash ^ ' ') * 1099511628211ULL;
+	hash = (hash ^ (uint32_t) cmd) * 1099511628211ULL;
+	return hash ? hash : 1;
+}
+
+/*
+ * Rebuilds the cooldown table with only the entries that haven't run out,
+ * doubling its size if more than half of them are still live.
+ */
+static int rehash_cooldowns(struct cmd_table *t, uint64_t now)
+{
+	size_t live = 0;
+	for (size_t i = 0; i < t->cap_cooldowns; ++i)
+	{
+		live += t->cooldowns[i].hash && t->cooldowns[i].until > now;
+	}
+
+	size_t cap = live * 2 > t->cap_cooldowns ? t->cap_cooldowns * 2 : t->cap_cooldowns;
+	struct cmd_cooldown *table = calloc(cap, sizeof(struct cmd_cooldown));
+	if (table == NULL)
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < t->cap_cooldowns; ++i)
+	{
+		struct cmd_cooldown *cd = &t->cooldowns[i];
+		if (cd->hash && cd->until > now)
+		{
+			size_t pos = cd->hash & (cap - 1);
+			while (table[pos].hash)
+			{
+				pos = (pos + 1) & (cap - 1);
+			}
+			table[pos] = *cd;
+		}
+	}
+
+	free(t->cooldowns);
+	t->cooldowns = table;
+	t->cap_cooldowns = cap;
+	t->used_cooldowns = live;
+	return 0;
+}
+
+/*
+ * Checks whether the user may use the command and, if so, puts them on
+ * cooldown until 'until'. Returns 1 if they may, 0 if they are on cooldown.
+ */
+static int take_cooldown(struct cmd_table *t, const char *name, int cmd, uint64_t now, uint64_t until)
+{
+	char user[CMD_MAX_USER];
+	uint64_t hash = cooldown_key(name, cmd, user);
+	size_t mask = t->cap_cooldowns - 1;
+	struct cmd_cooldown *reuse = NULL;
+
+	size_t pos = hash & mask;
+	for (; t->cooldowns[pos].hash; pos = (pos + 1) & mask)
+	{
+		struct cmd_cooldown *cd = &t->cooldowns[pos];
+		if (cd->hash == hash && cd->cmd == cmd && strcmp(cd->user, user) == 0)
+		{
+			if (cd->until > now)
+			{
+				return 0;
+			}
+			cd->until = until;
+			return 1;
+		}
+		if (reuse == NULL && cd->until <= now)
+		{
+			reuse = cd;
+		}
+	}
+
+	if (reuse == NULL)
+	{
+		// Keep the table at most three quarters full, so probes stay short
+		if ((t->used_cooldowns + 1) * 4 > t->cap_cooldowns * 3)
+		{
+			if (rehash_cooldowns(t, now) == -1)
+			{
+				return 1;
+			}
+			return take_cooldown(t, name, cmd, now, until);
+		}
+		reuse = &t->cooldowns[pos];
+		t->used_cooldowns += 1;
+	}
+	reuse->hash = hash;
+	reuse->until = until;
+	reuse->cmd = cmd;
+	strcpy(reuse->user, user);
+	return 1;
+}
+
+/*
+ * Runs the command in the chat message, if there is one and it isn't on
+ * cooldown. The command is the first word of the message; the rest, minus
+ * leading spaces, is handed to the handler as 'args'. Returns 1 if a command
+ * was run, 0 otherwise.
+ */
+int cmd_dispatch(struct cmd_table *t, twirc_state_t *s, twirc_event_t *evt)
+{
+	const char *msg = evt->message;
+	if (msg == NULL || evt->origin == NULL)
+	{
+		return 0;
+	}
+
+	size_t len = strcspn(msg, " ");
+	int index = len < CMD_MAX_NAME ? cmd_find(t, msg, len) : -1;
+	if (index == -1)
+	{
+		return 0;
+	}
+
+	struct cmd *cmd = &t->cmds[index];
+	uint64_t now = now_ms();
+	if (now < cmd->ready)
+	{
+		return 0;
+	}
+	if (cmd->user_cooldown &&
+	    take_cooldown(t, evt->origin, index, now, now + cmd->user_cooldown) == 0)
+	{
+		return 0;
+	}
+	cmd->ready = now + cmd->cooldown;
+
+	const char *args = msg + len;
+	while (*args == ' ')
+	{
+		++args;
+	}
+	cmd->handler(s, evt, args, cmd->ctx);
+	return 1;
+}
+
+void cmd_free(struct cmd_table *t)
+{
+	for (size_t i = 0; i < t->num_cmds; ++i)
+	{
+		free(t->cmds[i].name);
+	}
+	free(t->cmds);
+	free(t->nodes);
+	free(t->edges);
+	free(t->cooldowns);
+	memset(t, 0, sizeof(struct cmd_table));
+}
@@ -0,0 +1,78 @@
+#ifndef CMD_H
+#define CMD_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+#include "libtwirc.h"
+
+#define CMD_MAX_NAME  64     // Longest command name, including the prefix
+#define CMD_COOLDOWNS 256    // Initial slots of the cooldown table
+#define CMD_MAX_USER  26     // Twitch logins have at most 25 characters
+
+typedef void (*cmd_handler)(twirc_state_t *s, twirc_event_t *evt, const char *args, void *ctx);
+
+struct cmd
+{
+	char        *name;           // Lower case, including the prefix, like "!hello"
+	cmd_handler  handler;
+	void        *ctx;
+	uint64_t     cooldown;       // For everyone, after anyone used it (ms)
+	uint64_t     user_cooldown;  // For the user who used it (ms)
+	uint64_t     ready;          // When the command may be used again (ms)
+};
+
+/*
+ * The compiled trie: all nodes and all edges live in one array each, and the
+ * edges of a node are adjacent and sorted by their byte, so finding the next
+ * node is a binary search over at most 256 edges. A lookup therefore takes
+ * time linear in the length of the command, no matter how many there are.
+ */
+struct cmd_node
+{
+	uint32_t first;          // Index of the first edge
+	uint16_t num_edges;
+	int32_t  cmd;            // Index of the command ending here, or -1
+};
+
+struct cmd_edge
+{
+	unsigned char c;
+	uint32_t      node;
+};
+
+/*
+ * Per-user cooldowns, in an open-addressing table with linear probing. The
+ * key is the user's name, in lower case, and the command's index; the hash
+ * of both only picks the slot. Entries that have run out are reused, so the
+ * table only grows with the number of users on cooldown at the same time.
+ */
+struct cmd_cooldown
+{
+	uint64_t hash;           // 0 if the slot has never been used
+	uint64_t until;          // (ms)
+	int32_t  cmd;
+	char     user[CMD_MAX_USER];
+};
+
+struct cmd_table
+{
+	struct cmd          *cmds;
+	size_t               num_cmds;
+	size_t               cap_cmds;
+	struct cmd_node     *nodes;   // NULL until cmd_compile() is called
+	struct cmd_edge     *edges;
+	size_t               num_nodes;
+	struct cmd_cooldown *cooldowns;
+	size_t               cap_cooldowns;  // Power of two
+	size_t               used_cooldowns; // Slots with a key, live or not
+};
+
+int  cmd_init(struct cmd_table *t);
+int  cmd_add(struct cmd_table *t, const char *name, int cooldown, int user_cooldown,
+		cmd_handler handler, void *ctx);
+int  cmd_compile(struct cmd_table *t);
+int  cmd_find(const struct cmd_table *t, const char *name, size_t len);
+int  cmd_dispatch(struct cmd_table *t, twirc_state_t *s, twirc_event_t *evt);
+void cmd_free(struct cmd_table *t);
+
+#endif
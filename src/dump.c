@@ -1,12 +1,30 @@
 #include <stdio.h>      // NULL, fprintf(), perror()
 #include <string.h>     // strcmp()
-#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, qsort(), bsearch()
+#include <ctype.h>      // tolower()
 #include <errno.h>      // errno
-#include <unistd.h>     // getopt() et al.
+#include <unistd.h>     // getopt() et al., close(), gethostname()
+#include <fcntl.h>      // open()
 #include <sys/types.h>  // ssize_t
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>    // pthread_create(), pthread_join()
+#include <stdatomic.h>  // atomic_int
+#include <sys/uio.h>    // struct iovec
 #include "libtwirc.h"
+#include "output.h"
+#include "stamp.h"
+#include "record.h"
+#include "archive.h"
+#include "segment.h"
+#include "evloop.h"
+#include "reconn.h"
+#include "join.h"
+#include "metrics.h"
+#include "filter.h"
+#include "stats.h"
+#include "tags.h"
+#include "cluster.h"
 
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 1
@@ -17,159 +35,1142 @@
 #define DEFAULT_HOST "irc.chat.twitch.tv"
 #define DEFAULT_PORT "6667"
 #define DEFAULT_TIMESTAMP "[%H:%M:%S]"
-#define TIMESTAMP_BUFFER 64
+#define CHANNEL_BUFFER 128
+#define DEFAULT_TAGS "id,user-id,room-id,tmi-sent-ts,display-name,color,badges,emotes"
 
-static volatile int running; // Used to stop main loop in case of SIGINT etc
-static volatile int handled; // The last signal that has been handled
+struct worker;
 
 struct metadata
 {
-	char *chan;           // Channel to join
-	char *timestamp;      // Timestamp format
-	int   verbose;        // Print additional info
+	char   *host;         // IRC server to connect to
+	char   *port;         // Port of the IRC server
+	int     tick;         // Longest twirc_tick() in milliseconds
+	char  **chans;        // Channels to join
+	size_t  num_chans;    // Number of channels in chans
+	size_t  cap_chans;    // Allocated size of chans
+	char   *timestamp;    // Timestamp format
+	int     monotonic;    // Prefix a monotonic timestamp with microseconds
+	int     raw;          // Write the raw IRC lines instead of chat
+	int     filter;       // Only write chat that passes flt
+	struct filter flt;    // Keywords and users given with -g, -u and -U
+	char   *stats_file;   // Append analytics snapshots to this file
+	int     stats_interval; // Seconds between analytics snapshots
+	struct output stats_out; // Buffered output for the snapshots
+	int     workers;      // Number of connections/threads to use
+	int     join_limit;   // Channels a connection may join per JOIN_WINDOW
+	int     verbose;      // Print additional info
+	char   *metrics;      // Serve metrics on this socket path or port
+	size_t  flush_bytes;  // Flush output once this many bytes are buffered
+	int     flush_ms;     // Flush output once data is buffered this long
+	int     policy;       // What to do once stdout falls behind (OUTPUT_*)
+	char   *spill_file;   // Spill output to this file, for OUTPUT_SPILL
+	int     spill_fd;     // The open spill file, or -1
+	int     binary;       // Write binary records instead of text
+	int     codec;        // Compression of binary records (ARCHIVE_CODEC_*)
+	char   *tags;         // Comma-separated tag keys to keep (binary only)
+	char   *keys[RECORD_MAX_TAGS]; // The individual keys, pointing into tags
+	size_t  num_keys;     // Number of keys in keys
+	char   *dir;          // Write segment files to this directory
+	size_t  seg_size;     // Size of segment files
+	time_t  seg_period;   // Rotation period of segment files in seconds
+	struct output out;    // Buffered output shared by all workers
+	struct archive arch;  // Block writer for binary records
+	struct segdir segs;   // Segment files, if writing to a directory
+	char   *cluster_dir;  // Share the channels with the nodes using this directory
+	char   *node_name;    // Our name among them
+	struct cluster cluster; // Which of the channels we should be in, with -C
+	unsigned plans_seen;  // Plans of the cluster we've reported
+	struct evloop loop;   // Main thread's loop, handles signals
+	struct worker *workers_list; // All workers, so we can stop them
+	atomic_int finished;  // Number of workers that are done
 };
 
 /*
- * Constructs a timestamp according to the timestamp format saved in the metadata
- * that should be in the state's context and adds a space to it, so it can be 
- * directly used as a prefix for chat messages. If there is no timestamp format,
- * it simply puts an empty string into the provided buffer.
+ * Every worker owns one connection (libtwirc state) and runs it in its own
+ * thread. The channels are distributed across the workers, so each of them
+ * only has to deal with a share of the total traffic.
  */
-char *timestamp_prefix(twirc_state_t *s, char *buf, size_t len)
+struct worker
 {
-	// Initialize to empty string
-	buf[0] = '\0';
+	pthread_t        thread;     // Thread running this worker
+	int              id;         // Index of this worker, starting at 0
+	struct metadata *meta;       // Shared program configuration
+	char           **chans;      // Channels assigned to this worker (sorted)
+	size_t           num_chans;  // Number of channels in chans
+	struct segment **segs;       // Current segment of every channel
+	int              status;     // Exit status of the worker
+	struct stamp     stamp;      // Timestamp cache for this worker's thread
+	struct evloop    loop;       // Runs the connection and the flush timer
+	struct reconn    rc;         // Reconnects, and rejoins the channels
+	struct joiner    joins;      // Joins the channels within the rate limit
+	time_t           reported;   // When we last reported join progress
+	uint64_t         filtered;   // Chat messages the filter dropped
+	struct stats    *stats;      // Analytics of every channel, with -a
+	time_t           stats_at;   // When we last published analytics
+	struct cluster_chan **cluster; // Every channel's place in the cluster, with -C
+	unsigned         cluster_version; // Of the cluster's plan we followed last
+};
+
+/*
+ * Adds a copy of the given channel name to the metadata's channel list,
+ * growing the list as required. If the name doesn't start with '#', it will
+ * be prepended. Returns 0 on success, -1 on error.
+ */
+int add_channel(struct metadata *meta, const char *chan)
+{
+	if (meta->num_chans == meta->cap_chans)
+	{
+		size_t cap = meta->cap_chans ? meta->cap_chans * 2 : 16;
+		char **chans = realloc(meta->chans, cap * sizeof(char *));
+		if (chans == NULL)
+		{
+			return -1;
+		}
+		meta->chans = chans;
+		meta->cap_chans = cap;
+	}
+
+	size_t len = strlen(chan);
+	char *copy = malloc(len + 2);
+	if (copy == NULL)
+	{
+		return -1;
+	}
+	if (chan[0] == '#')
+	{
+		memcpy(copy, chan, len + 1);
+	}
+	else
+	{
+		copy[0] = '#';
+		memcpy(copy + 1, chan, len + 1);
+	}
+
+	// Twitch channel names are always lowercase
+	for (char *c = copy; *c; ++c)
+	{
+		*c = tolower((unsigned char) *c);
+	}
+
+	meta->chans[meta->num_chans++] = copy;
+	return 0;
+}
+
+/*
+ * Reads channel names from the given file, one per line, and adds them to
+ * the metadata's channel list. Empty lines and surrounding whitespace are
+ * ignored. Returns the number of channels read or -1 on error.
+ */
+int read_channels(struct metadata *meta, const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	int num = 0;
+	char buf[CHANNEL_BUFFER];
+	while (fgets(buf, CHANNEL_BUFFER, fp) != NULL)
+	{
+		// Trim leading and trailing whitespace (including the newline)
+		char *chan = buf + strspn(buf, " \t\r\n");
+		size_t len = strcspn(chan, " \t\r\n");
+		if (len == 0)
+		{
+			continue;
+		}
+		chan[len] = '\0';
+
+		if (add_channel(meta, chan) == -1)
+		{
+			fclose(fp);
+			return -1;
+		}
+		++num;
+	}
+
+	fclose(fp);
+	return num;
+}
+
+/*
+ * Splits the comma-separated list of tag keys in the metadata into individual
+ * keys, which will point into the (modified) list. Keys beyond the maximum
+ * number of tags a record can hold are ignored.
+ */
+void split_tags(struct metadata *meta)
+{
+	meta->num_keys = 0;
+	for (char *key = strtok(meta->tags, ","); key; key = strtok(NULL, ","))
+	{
+		if (meta->num_keys == RECORD_MAX_TAGS)
+		{
+			fprintf(stderr, "Too many tags, ignoring '%s' and following\n", key);
+			break;
+		}
+		meta->keys[meta->num_keys++] = key;
+	}
+}
 
-	// Get the metadata from the state context
-	struct metadata *meta = twirc_get_context(s);
+/*
+ * Compares two channel names, for qsort() and bsearch().
+ */
+int compare_channels(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Returns the index of the given channel in the worker's (sorted) channel
+ * list, or -1 if the worker doesn't have this channel.
+ */
+int find_channel(struct worker *w, const char *chan)
+{
+	char **res = bsearch(&chan, w->chans, w->num_chans, sizeof(char *), compare_channels);
+	return res ? res - w->chans : -1;
+}
+
+/*
+ * Frees the channel list of the given metadata.
+ */
+void free_channels(struct metadata *meta)
+{
+	for (size_t i = 0; i < meta->num_chans; ++i)
+	{
+		free(meta->chans[i]);
+	}
+	free(meta->chans);
+	meta->chans = NULL;
+	meta->num_chans = 0;
+	meta->cap_chans = 0;
+}
+
+/*
+ * Returns the timestamp prefix for chat messages, according to the timestamp
+ * format saved in the metadata, including a trailing space, so it can be
+ * directly put in front of chat messages. If there is no timestamp format,
+ * it returns an empty string. The length of the prefix is written to 'len'.
+ * The timestamp is taken from the cache of the worker in the state context,
+ * which only re-renders the format when the result could have changed.
+ */
+const char *timestamp_prefix(twirc_state_t *s, size_t *len)
+{
+	struct worker *w = twirc_get_context(s);
+	return stamp_get(&w->stamp, len);
+}
+
+/*
+ * With -r, hands the raw IRC line to the output as we got it, only preceded
+ * by the time we got it. The pieces go to the output as an iovec, so the line
+ * is copied once, into the output's buffer, and never formatted.
+ */
+void write_raw(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (!w->meta->raw || evt->raw == NULL)
+	{
+		return;
+	}
+
+	size_t stamp_len = 0;
+	const char *stamp = timestamp_prefix(s, &stamp_len);
+
+	struct iovec iov[3] = {
+		{ .iov_base = (char *) stamp, .iov_len = stamp_len },
+		{ .iov_base = evt->raw,       .iov_len = strlen(evt->raw) },
+		{ .iov_base = "\r\n",         .iov_len = 2 }
+	};
+	output_write(&w->meta->out, iov, 3);
+}
+
+/*
+ * Called once the connection has been established. This does not mean we're
+ * authenticated yet, hence we should not attempt to join channels yet etc.
+ */
+void handle_connect(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
+	{
+		fprintf(stderr, "*** Connected (worker %d)\n", w->id);
+	}
+}
+
+/*
+ * Called once we're authenticated. This is where we can join channels etc.
+ */
+void handle_welcome(twirc_state_t *s, twirc_event_t *evt)
+{
+	write_raw(s, evt);
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
+	{
+		fprintf(stderr, "*** Authenticated (worker %d)\n", w->id);
+	}
+
+	// Let's join all channels assigned to this worker, as fast as the rate
+	// limit allows; after a reconnect, that happens via rejoin_state()
+	if (reconn_welcome(&w->rc, s) == 0)
+	{
+		join_start(&w->joins, s);
+	}
+}
+
+/*
+ * Called once we see a user join a channel we're in. This also fires for when
+ * we join a channel, in which case 'evt->origin' will be our own username.
+ */
+void handle_join(twirc_state_t *s, twirc_event_t *evt)
+{
+	write_raw(s, evt);
+	twirc_login_t *login = twirc_get_login(s);
+
+	if (!evt->origin)
+	{
+		return;
+	}
+	if (!login->nick)
+	{
+		return;
+	}
+	if (strcmp(evt->origin, login->nick) != 0)
+	{
+		return;
+	}
+
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
+	{
+		fprintf(stderr, "*** Joined %s (worker %d)\n", evt->channel, w->id);
+	}
+	join_confirm(&w->joins, s, evt->channel);
+	reconn_joined(&w->rc, s, evt->channel);
+}
+
+/*
+ * Called once we see a user leave a channel we're in, which is only of
+ * interest when it's us, leaving a channel another node took over.
+ */
+void handle_part(twirc_state_t *s, twirc_event_t *evt)
+{
+	write_raw(s, evt);
+	twirc_login_t *login = twirc_get_login(s);
+	if (!evt->origin || !login->nick || strcmp(evt->origin, login->nick) != 0)
+	{
+		return;
+	}
+
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
+	{
+		fprintf(stderr, "*** Left %s (worker %d)\n", evt->channel, w->id);
+	}
+	reconn_parted(&w->rc, s, evt->channel);
+}
+
+/*
+ * Called for notices from the server. The ones we care about are those that
+ * tell us we can't join a channel, so we stop trying.
+ */
+void handle_notice(twirc_state_t *s, twirc_event_t *evt)
+{
+	write_raw(s, evt);
+	twirc_tag_t *id = twirc_get_tag_by_key(evt->tags, "msg-id");
+	if (id == NULL || id->value == NULL || evt->channel == NULL)
+	{
+		return;
+	}
+	if (strcmp(id->value, "msg_channel_suspended") == 0 ||
+	    strcmp(id->value, "msg_banned") == 0)
+	{
+		struct worker *w = twirc_get_context(s);
+		fprintf(stderr, "*** Can't join %s: %s (worker %d)\n", evt->channel,
+				evt->message ? evt->message : id->value, w->id);
+		join_fail(&w->joins, s, evt->channel);
+	}
+}
+
+/*
+ * Called by the joiner once all channels have been joined or given up on;
+ * this is how long a cold start takes.
+ */
+void handle_joined(struct joiner *j, void *ctx)
+{
+	struct worker *w = ctx;
+	if (w->meta->verbose || j->num_failed)
+	{
+		fprintf(stderr, "*** Joined %zu of %zu channels in %llu ms, %u retries (worker %d)\n",
+				j->num_joined, j->num_wanted,
+				(unsigned long long) (j->done - j->started),
+				j->retries, w->id);
+	}
+}
+
+/*
+ * Hands one line of chat to the output. The line is made up of the optional
+ * timestamp and channel, the user's name, a separator and the message, plus
+ * a trailing newline. We put the pieces together with an iovec instead of
+ * formatting them, the output will copy them into its buffer in one go.
+ */
+void write_line(twirc_state_t *s, twirc_event_t *evt, const char *sep)
+{
+	struct worker *w = twirc_get_context(s);
+	struct metadata *meta = w->meta;
+
+	size_t stamp_len = 0;
+	const char *stamp = timestamp_prefix(s, &stamp_len);
+	const char *origin = evt->origin ? evt->origin : "";
+	const char *message = evt->message ? evt->message : "";
+
+	struct iovec iov[8];
+	int iovcnt = 0;
+
+	iov[iovcnt].iov_base = (char *) stamp;
+	iov[iovcnt++].iov_len = stamp_len;
+
+	// Only mention the channel if there is more than one
+	if (meta->num_chans > 1 && evt->channel)
+	{
+		iov[iovcnt].iov_base = evt->channel;
+		iov[iovcnt++].iov_len = strlen(evt->channel);
+		iov[iovcnt].iov_base = " ";
+		iov[iovcnt++].iov_len = 1;
+	}
+
+	// For actions, the separator goes in front of the name
+	if (sep[0] == '*')
+	{
+		iov[iovcnt].iov_base = (char *) sep;
+		iov[iovcnt++].iov_len = strlen(sep);
+		iov[iovcnt].iov_base = (char *) origin;
+		iov[iovcnt++].iov_len = strlen(origin);
+		iov[iovcnt].iov_base = " ";
+		iov[iovcnt++].iov_len = 1;
+	}
+	else
+	{
+		iov[iovcnt].iov_base = (char *) origin;
+		iov[iovcnt++].iov_len = strlen(origin);
+		iov[iovcnt].iov_base = (char *) sep;
+		iov[iovcnt++].iov_len = strlen(sep);
+	}
+
+	iov[iovcnt].iov_base = (char *) message;
+	iov[iovcnt++].iov_len = strlen(message);
+	iov[iovcnt].iov_base = "\n";
+	iov[iovcnt++].iov_len = 1;
+
+	output_write(&meta->out, iov, iovcnt);
+}
+
+/*
+ * Hands one chat message to the archive as a binary record. Unlike the text
+ * output, this also keeps the channel, the exact receive time and the tags
+ * selected with -k, if the message has them.
+ */
+void write_record(twirc_state_t *s, twirc_event_t *evt, uint8_t type)
+{
+	struct worker *w = twirc_get_context(s);
+	struct metadata *meta = w->meta;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	struct record r = { 0 };
+	r.time = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	r.type = type;
+	r.channel.str = evt->channel ? evt->channel : "";
+	r.channel.len = strlen(r.channel.str);
+	r.origin.str = evt->origin ? evt->origin : "";
+	r.origin.len = strlen(r.origin.str);
+	r.message.str = evt->message ? evt->message : "";
+	r.message.len = strlen(r.message.str);
+
+	for (size_t i = 0; i < meta->num_keys; ++i)
+	{
+		twirc_tag_t *tag = twirc_get_tag_by_key(evt->tags, meta->keys[i]);
+		if (tag == NULL || tag->value == NULL)
+		{
+			continue;
+		}
+		struct record_tag *rt = &r.tags[r.num_tags++];
+		rt->key.str = tag->key;
+		rt->key.len = strlen(tag->key);
+		rt->value.str = tag->value;
+		rt->value.len = strlen(tag->value);
+	}
 
-	// Stop if we're not supposed to show a timestamp
-	if (!meta->timestamp)
+	// Segment files are per channel, and every channel belongs to exactly
+	// one worker, hence the worker can write to them without any locking
+	if (meta->dir)
+	{
+		int chan = find_channel(w, r.channel.str);
+		if (chan != -1)
+		{
+			segdir_write(&meta->segs, &w->segs[chan], &r);
+		}
+		return;
+	}
+
+	archive_add(&meta->arch, &r);
+}
+
+/*
+ * While a new connection takes over, both of them deliver the same messages
+ * for a little while; returns 1 if we already wrote this one. Only then do we
+ * have to look up its ID.
+ */
+int is_dup(struct worker *w, twirc_event_t *evt)
+{
+	if (!reconn_overlapping(&w->rc))
+	{
+		return 0;
+	}
+	twirc_tag_t *id = twirc_get_tag_by_key(evt->tags, "id");
+	return id && reconn_dup(&w->rc, id->value);
+}
+
+/*
+ * Returns the offset of the given character in the UTF-8 string, or 'len'
+ * if the string is shorter than that.
+ */
+size_t char_offset(const char *str, size_t len, size_t chars)
+{
+	size_t i = 0;
+	while (i < len && chars > 0)
+	{
+		++i;
+		while (i < len && ((unsigned char) str[i] & 0xc0) == 0x80)
+		{
+			++i;
+		}
+		--chars;
+	}
+	return i;
+}
+
+/*
+ * Counts the message and its emotes for the analytics of the channel. The
+ * emotes tag has the positions of the emotes in characters, which we need to
+ * turn into bytes to get their names.
+ */
+void count_chat(struct worker *w, twirc_event_t *evt)
+{
+	int c = find_channel(w, evt->channel);
+	if (c == -1)
+	{
+		return;
+	}
+	struct stats *st = &w->stats[c];
+	stats_message(st, time(NULL), evt->origin);
+
+	twirc_tag_t *emotes = twirc_get_tag_by_key(evt->tags, "emotes");
+	if (evt->message == NULL || emotes == NULL || emotes->value == NULL || emotes->value[0] == '\0')
+	{
+		return;
+	}
+	struct tag_index idx;
+	tags_index(&idx, evt->tags);
+
+	size_t len = strlen(evt->message);
+	for (size_t i = 0; i < idx.num_emotes; ++i)
+	{
+		size_t start = char_offset(evt->message, len, idx.emotes[i].start);
+		size_t end = char_offset(evt->message, len, idx.emotes[i].end + 1);
+		if (end > start)
+		{
+			stats_emote(st, evt->message + start, end - start);
+		}
+	}
+}
+
+/*
+ * Writes a snapshot of the analytics of all of the worker's channels that
+ * have seen any chat.
+ */
+void publish_stats(struct worker *w, time_t now)
+{
+	char buf[STATS_SNAPSHOT];
+	for (size_t i = 0; i < w->num_chans; ++i)
+	{
+		if (w->stats[i].messages == 0)
+		{
+			continue;
+		}
+		size_t len = stats_snapshot(&w->stats[i], now, w->chans[i], buf, STATS_SNAPSHOT);
+		struct iovec iov = { .iov_base = buf, .iov_len = len };
+		if (len > 0)
+		{
+			output_write(&w->meta->stats_out, &iov, 1);
+		}
+	}
+}
+
+/*
+ * Sets up the buffered output all workers write to; its writer thread gets
+ * started along with the other threads. With -o spill, the file given with
+ * -O is truncated and used to spill to; without it, we use a temporary file
+ * that is already gone from the file system. Returns 0 on success, -1 on error.
+ */
+int open_output(struct metadata *meta)
+{
+	meta->spill_fd = -1;
+	if (meta->policy == OUTPUT_SPILL && meta->spill_file)
+	{
+		meta->spill_fd = open(meta->spill_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	}
+	else if (meta->policy == OUTPUT_SPILL)
+	{
+		char tmp[] = "/tmp/dump-spill-XXXXXX";
+		meta->spill_fd = mkstemp(tmp);
+		if (meta->spill_fd != -1)
+		{
+			unlink(tmp);
+		}
+	}
+	if (meta->policy == OUTPUT_SPILL && meta->spill_fd == -1)
+	{
+		return -1;
+	}
+
+	if (output_init(&meta->out, STDOUT_FILENO, meta->flush_bytes, meta->flush_ms) == -1)
+	{
+		if (meta->spill_fd != -1)
+		{
+			close(meta->spill_fd);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes out everything that's still buffered or spilled, then tells how much
+ * output had to be dropped along the way, if any.
+ */
+void close_output(struct metadata *meta)
+{
+	// Nothing gets dropped anymore once the workers are gone
+	uint64_t dropped, dropped_bytes, spilled_bytes;
+	output_counts(&meta->out, &dropped, &dropped_bytes, &spilled_bytes);
+	output_free(&meta->out);
+	if (meta->spill_fd != -1)
+	{
+		close(meta->spill_fd);
+		meta->spill_fd = -1;
+	}
+
+	if (dropped || (meta->verbose && spilled_bytes))
+	{
+		fprintf(stderr, "*** Output fell behind: %llu piece(s) (%llu bytes) dropped, "
+				"%llu bytes spilled\n",
+				(unsigned long long) dropped,
+				(unsigned long long) dropped_bytes,
+				(unsigned long long) spilled_bytes);
+	}
+}
+
+/*
+ * Opens the file given with -a for appending and sets up the buffered output
+ * for the analytics snapshots. Returns 0 on success, -1 on error.
+ */
+int open_stats(struct metadata *meta)
+{
+	int fd = open(meta->stats_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	if (output_init(&meta->stats_out, fd, meta->flush_bytes, meta->flush_ms) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes out the buffered snapshots and closes the file, if it's open.
+ */
+void close_stats(struct metadata *meta)
+{
+	if (meta->stats_out.size)
+	{
+		output_free(&meta->stats_out);
+		close(meta->stats_out.fd);
+	}
+}
+
+/*
+ * Returns 1 if there is no filter or the message passes it, so only these
+ * messages get formatted and written.
+ */
+int is_wanted(struct worker *w, twirc_event_t *evt)
+{
+	if (!w->meta->filter || filter_match(&w->meta->flt, evt->origin, evt->message))
+	{
+		return 1;
+	}
+	w->filtered += 1;
+	return 0;
+}
+
+/*
+ * Counts the message for the rate of its channel, which the cluster uses to
+ * spread the load across the nodes.
+ */
+void count_message(struct worker *w, twirc_event_t *evt)
+{
+	int c = evt->channel ? find_channel(w, evt->channel) : -1;
+	if (c != -1)
+	{
+		atomic_fetch_add_explicit(&w->cluster[c]->messages, 1, memory_order_relaxed);
+	}
+}
+
+/*
+ * Called when a user sends a message to a channel. In other words, chat!
+ * 'evt->origin' will contain the username of the person who sent the message,
+ * 'evt->channel' will contain the channel the message was sent to,
+ * 'evt->message' will contain the actual chat message.
+ */
+void handle_privmsg(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (is_dup(w, evt))
+	{
+		return;
+	}
+	if (w->cluster)
+	{
+		count_message(w, evt);
+	}
+	if (w->stats)
+	{
+		count_chat(w, evt);
+	}
+	if (!is_wanted(w, evt))
+	{
+		return;
+	}
+	if (w->meta->raw)
+	{
+		write_raw(s, evt);
+		return;
+	}
+	if (w->meta->binary)
+	{
+		write_record(s, evt, RECORD_PRIVMSG);
+		return;
+	}
+	write_line(s, evt, ": ");
+}
+
+/*
+ * Called when a user uses the "/me" command in a channel.
+ * This is pretty much the same as the privmsg, just that the output is usually
+ * stylized to differentiate it from regular chat messages.
+ */
+void handle_action(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (is_dup(w, evt))
+	{
+		return;
+	}
+	if (w->cluster)
+	{
+		count_message(w, evt);
+	}
+	if (w->stats)
+	{
+		count_chat(w, evt);
+	}
+	if (!is_wanted(w, evt))
+	{
+		return;
+	}
+	if (w->meta->raw)
+	{
+		write_raw(s, evt);
+		return;
+	}
+	if (w->meta->binary)
+	{
+		write_record(s, evt, RECORD_ACTION);
+		return;
+	}
+	write_line(s, evt, "* ");
+}
+
+/*
+ * With -r, called for everything we don't have a handler for otherwise, like
+ * ROOMSTATE, USERNOTICE or CLEARCHAT, which then go to the output as well.
+ */
+void handle_raw(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (is_dup(w, evt))
+	{
+		return;
+	}
+	write_raw(s, evt);
+}
+
+/*
+ * Called when a loss of connection has been detected. This could be due to 
+ * a connection error or because Twitch closed the connection on us.
+ */
+void handle_disconnect(twirc_state_t *s, twirc_event_t *evt)
+{
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
+	{
+		fprintf(stderr, "*** Disconnected (worker %d)\n", w->id);
+	}
+}
+
+/*
+ * Twitch is about to restart the server: we connect to another one while
+ * this one is still up, so the archive has no gap.
+ */
+void handle_reconnect(twirc_state_t *s, twirc_event_t *evt)
+{
+	write_raw(s, evt);
+	struct worker *w = twirc_get_context(s);
+	if (w->meta->verbose)
 	{
-		return buf;
+		fprintf(stderr, "*** Server asked us to reconnect (worker %d)\n", w->id);
 	}
-
-	// Let's get the current time for a nice timestamp
-	time_t t = time(NULL);
-	struct tm lt = *localtime(&t);
-
-	// Let's run the time through strftime() for format
-	strftime(buf, len - 1, meta->timestamp, &lt);
-
-	// Let's make sure there is a space after the string
-	size_t actual_len = strlen(buf);
-	buf[actual_len] = ' '; // Add a space, overwriting null terminator
-	buf[actual_len+1] = 0; // Add null terminator again
-
-	return buf;
+	reconn_reconnect(&w->rc);
 }
 
+/*
+ * Called once a new connection took over, or with 's' being NULL when the
+ * connection was lost. Chat sent while we had no connection is missing from
+ * the output, so we always report how long that was.
+ */
+void handle_switch(twirc_state_t *old, twirc_state_t *s, void *ctx)
+{
+	struct worker *w = ctx;
+	if (w->joins.s == old)
+	{
+		join_stop(&w->joins);
+	}
+	if (s == NULL)
+	{
+		fprintf(stderr, "*** Lost connection, reconnecting (worker %d)\n", w->id);
+		return;
+	}
+	if (w->rc.last_gap || w->meta->verbose)
+	{
+		fprintf(stderr, "*** Reconnected (worker %d): %llu ms without connection, took %llu ms\n",
+				w->id,
+				(unsigned long long) w->rc.last_gap,
+				(unsigned long long) w->rc.last_latency);
+	}
+}
 
 /*
- * Called once the connection has been established. This does not mean we're
- * authenticated yet, hence we should not attempt to join channels yet etc.
+ * Let's handle CTRL+C by stopping all workers. This is called by the main
+ * thread's loop, which keeps running until all of them are done. SIGUSR1
+ * prints the metrics instead, for a quick look without setting up -M.
  */
-void handle_connect(twirc_state_t *s, twirc_event_t *evt)
+void handle_signal(struct evloop *loop, int sig, void *ctx)
 {
-	struct metadata *meta = twirc_get_context(s);
+	struct metadata *meta = ctx;
+	if (sig == SIGUSR1)
+	{
+		metrics_print(stderr);
+		return;
+	}
 	if (meta->verbose)
 	{
-		fprintf(stderr, "*** Connected\n");
+		fprintf(stderr, "*** Received signal %d, stopping\n", sig);
+	}
+	for (int i = 0; i < meta->workers; ++i)
+	{
+		evloop_stop(&meta->workers_list[i].loop);
 	}
 }
 
 /*
- * Called once we're authenticated. This is where we can join channels etc.
+ * Called in the main thread whenever a worker is done; once all of them are,
+ * we can stop the main thread's loop.
  */
-void handle_welcome(twirc_state_t *s, twirc_event_t *evt)
+void handle_finished(struct evloop *loop, int fd, void *ctx)
 {
-	struct metadata *meta = twirc_get_context(s);
-	if (meta->verbose)
+	struct metadata *meta = ctx;
+	if (atomic_load(&meta->finished) == meta->workers)
 	{
-		fprintf(stderr, "*** Authenticated\n");
+		evloop_stop(loop);
 	}
+}
 
-	// Let's join the specified channel
-	twirc_cmd_join(s, meta->chan);
+/*
+ * Called with a new connection that has to rejoin our channels; the joiner
+ * switches over to it, while the old one keeps going until it takes over.
+ */
+void rejoin_state(twirc_state_t *s, void *ctx)
+{
+	struct worker *w = ctx;
+	join_start(&w->joins, s);
 }
 
 /*
- * Called once we see a user join a channel we're in. This also fires for when
- * we join a channel, in which case 'evt->origin' will be our own username.
+ * Called with a new connection that failed before it could take over, so the
+ * joiner stops using it.
  */
-void handle_join(twirc_state_t *s, twirc_event_t *evt)
+void handle_failed(twirc_state_t *s, void *ctx)
 {
-	twirc_login_t *login = twirc_get_login(s);
+	struct worker *w = ctx;
+	if (w->joins.s == s)
+	{
+		join_stop(&w->joins);
+	}
+}
 
-	if (!evt->origin)
+/*
+ * Tells the cluster which of our channels we're in and, if the plan changed
+ * which ones we should be in, joins or leaves them. Worker 0 also does the
+ * cluster's own work, every CLUSTER_INTERVAL seconds.
+ */
+void sync_cluster(struct worker *w, time_t now)
+{
+	struct metadata *meta = w->meta;
+	struct cluster *cl = &meta->cluster;
+
+	// The joiner's channels are sorted just like ours
+	for (size_t i = 0; i < w->num_chans; ++i)
 	{
-		return;
+		int joined = w->joins.chans[i].status == JOIN_OK;
+		atomic_store_explicit(&w->cluster[i]->joined, joined, memory_order_relaxed);
 	}
-	if (!login->nick)
+
+	if (w->id == 0 && cluster_tick(cl, now) && meta->verbose)
 	{
-		return;
+		fprintf(stderr, "*** Cluster: %zu of %zu channels are ours, %zu node(s)%s\n",
+				cl->num_mine, cl->num_chans, cl->num_planned,
+				cluster_leader(cl) ? ", we're the coordinator" : "");
 	}
-	if (strcmp(evt->origin, login->nick) != 0)
+	if (w->id == 0 && cl->plans != meta->plans_seen && meta->verbose)
 	{
-		return;
+		fprintf(stderr, "*** Cluster: new plan for %zu node(s), %zu channel(s) moved\n",
+				cl->num_planned, cl->moved);
+	}
+	if (w->id == 0)
+	{
+		meta->plans_seen = cl->plans;
 	}
 
-	struct metadata *meta = twirc_get_context(s);
-	if (meta->verbose)
+	unsigned version = atomic_load_explicit(&cl->version, memory_order_acquire);
+	if (version == w->cluster_version)
 	{
-		fprintf(stderr, "*** Joined %s\n", evt->channel);
+		return;
+	}
+	w->cluster_version = version;
+	for (size_t i = 0; i < w->num_chans; ++i)
+	{
+		int want = atomic_load_explicit(&w->cluster[i]->want, memory_order_relaxed);
+		join_want(&w->joins, w->chans[i], want);
 	}
 }
 
 /*
- * Called when a user sends a message to a channel. In other words, chat!
- * 'evt->origin' will contain the username of the person who sent the message,
- * 'evt->channel' will contain the channel the message was sent to,
- * 'evt->message' will contain the actual chat message.
+ * Called by a worker's timer to do everything that has to happen in time,
+ * even if no chat messages come in: flushing the output, closing segments
+ * and, while we're joining channels, reporting how far we got.
  */
-void handle_privmsg(twirc_state_t *s, twirc_event_t *evt)
+void handle_timer(struct evloop *loop, int fd, void *ctx)
 {
-	char buf[TIMESTAMP_BUFFER];
-	fprintf(stdout, "%s%s: %s\n",
-				timestamp_prefix(s, buf, TIMESTAMP_BUFFER),
-				evt->origin,
-				evt->message);
+	struct worker *w = ctx;
+	struct metadata *meta = w->meta;
+	time_t now = time(NULL);
+
+	if (meta->verbose && w->joins.s && w->joins.done == 0 && now - w->reported >= 5)
+	{
+		fprintf(stderr, "*** Joined %zu of %zu channels so far (worker %d)\n",
+				w->joins.num_joined, w->joins.num_wanted, w->id);
+		w->reported = now;
+	}
+
+	if (meta->dir)
+	{
+		for (size_t i = 0; i < w->num_chans; ++i)
+		{
+			segdir_expire(&meta->segs, &w->segs[i], now);
+		}
+	}
+	else if (meta->binary)
+	{
+		archive_tick(&meta->arch);
+	}
+	if (w->stats && now - w->stats_at >= meta->stats_interval)
+	{
+		publish_stats(w, now);
+		w->stats_at = now;
+	}
+	if (w->stats)
+	{
+		output_tick(&meta->stats_out);
+	}
+	if (w->cluster)
+	{
+		sync_cluster(w, now);
+	}
+	uint64_t dropped, dropped_bytes, spilled_bytes;
+	output_counts(&meta->out, &dropped, &dropped_bytes, &spilled_bytes);
+	metrics_set(METRICS_OUTPUT_DROPPED, dropped);
+	metrics_set(METRICS_OUTPUT_SPILLED, spilled_bytes);
+	metrics_set(METRICS_OUTPUT_BUFFERED, output_buffered(&meta->out));
 }
 
 /*
- * Called when a user uses the "/me" command in a channel.
- * This is pretty much the same as the privmsg, just that the output is usually
- * stylized to differentiate it from regular chat messages.
+ * Called for every new libtwirc state of a worker, before it connects.
  */
-void handle_action(twirc_state_t *s, twirc_event_t *evt)
+void setup_state(twirc_state_t *s, void *ctx)
+{
+	// Save the worker in the state, it also gives access to the metadata
+	twirc_set_context(s, ctx);
+
+	// We get the callback struct from the libtwirc state
+	twirc_callbacks_t *cbs = twirc_get_callbacks(s);
+
+	// When passing the raw lines through, we want all of them
+	struct worker *w = ctx;
+	if (w->meta->raw)
+	{
+		cbs->globaluserstate = handle_raw;
+		cbs->capack          = handle_raw;
+		cbs->ping            = handle_raw;
+		cbs->part            = handle_raw;
+		cbs->mode            = handle_raw;
+		cbs->names           = handle_raw;
+		cbs->whisper         = handle_raw;
+		cbs->roomstate       = handle_raw;
+		cbs->usernotice      = handle_raw;
+		cbs->userstate       = handle_raw;
+		cbs->clearchat       = handle_raw;
+		cbs->clearmsg        = handle_raw;
+		cbs->hosttarget      = handle_raw;
+		cbs->invalidcmd      = handle_raw;
+		cbs->other           = handle_raw;
+	}
+
+	// We assign our handlers to the events we are interested int
+	cbs->connect         = handle_connect;
+	cbs->welcome         = handle_welcome;
+	cbs->join            = handle_join;
+	cbs->part            = handle_part;
+	cbs->action          = handle_action;
+	cbs->privmsg         = handle_privmsg;
+	cbs->disconnect      = handle_disconnect;
+	cbs->reconnect       = handle_reconnect;
+	cbs->notice          = handle_notice;
+
+	// Count and time all of the above
+	metrics_wrap(cbs);
+}
+
+int connect_state(twirc_state_t *s, void *ctx)
 {
-	char buf[TIMESTAMP_BUFFER];
-	fprintf(stdout, "%s* %s %s\n",
-				timestamp_prefix(s, buf, TIMESTAMP_BUFFER),
-				evt->origin,
-				evt->message);
+	struct worker *w = ctx;
+	return twirc_connect_anon(s, w->meta->host, w->meta->port);
 }
 
 /*
- * Called when a loss of connection has been detected. This could be due to 
- * a connection error or because Twitch closed the connection on us.
+ * Creates a libtwirc state, connects to the IRC server and runs the worker's
+ * loop for it until we're told to stop; if the connection is lost, we keep
+ * reconnecting. The channels will be joined in handle_welcome(). Returns the
+ * exit status.
  */
-void handle_disconnect(twirc_state_t *s, twirc_event_t *evt)
+int run_connection(struct worker *w)
 {
-	struct metadata *meta = twirc_get_context(s);
-	if (meta->verbose)
+	// The timestamp cache isn't thread-safe, so every worker has its own
+	// The raw lines always get the time we received them, for mockd
+	if (w->meta->raw)
+	{
+		stamp_init(&w->stamp, NULL, w->meta->monotonic ? STAMP_MONOTONIC : STAMP_REALTIME);
+	}
+	else
+	{
+		stamp_init(&w->stamp, w->meta->timestamp, w->meta->monotonic ? STAMP_MONOTONIC : STAMP_NONE);
+	}
+
+	// Joining thousands of channels takes a while, as Twitch only lets
+	// us join so many at a time
+	if (join_init(&w->joins, &w->loop, w->chans, w->num_chans, w->meta->join_limit) == -1)
+	{
+		fprintf(stderr, "Error initializing worker %d\n", w->id);
+		return EXIT_FAILURE;
+	}
+	w->joins.on_done = handle_joined;
+	w->joins.ctx = w;
+
+	// In a cluster, we only join the channels the plan gives us
+	for (size_t i = 0; w->cluster && i < w->num_chans; ++i)
+	{
+		w->cluster[i] = cluster_find(&w->meta->cluster, w->chans[i]);
+		join_want(&w->joins, w->chans[i], 0);
+	}
+
+	// The reconnect logic creates the libtwirc states, calling
+	// setup_state() and connect_state() for every one of them
+	reconn_init(&w->rc, &w->loop, setup_state, connect_state, w);
+	w->rc.on_switch = handle_switch;
+	w->rc.rejoin = rejoin_state;
+	w->rc.on_fail = handle_failed;
+
+	// Connect to the IRC server
+	if (reconn_start(&w->rc) != 0)
+	{
+		fprintf(stderr, "Error connecting worker %d\n", w->id);
+		reconn_free(&w->rc);
+		join_free(&w->joins);
+		return EXIT_FAILURE;
+	}
+
+	// Main loop - the worker's event loop calls twirc_tick(), which waits
+	// for and processes IRC messages, until the main thread stops the
+	// loop. Buffered output has to be flushed in time, even if no messages
+	// come in, which is what the timer is for; output_timeout() tells us
+	// how often it needs to fire.
+
+	struct metadata *meta = w->meta;
+	int timeout = output_timeout(&meta->out, 1000);
+	if (meta->binary)
+	{
+		timeout = archive_timeout(&meta->arch, timeout);
+	}
+
+	if (evloop_timer(&w->loop, timeout, timeout, handle_timer, w) == -1)
 	{
-		fprintf(stderr, "*** Disconnected\n");
+		fprintf(stderr, "Error setting up timer of worker %d\n", w->id);
+		join_free(&w->joins);
+		reconn_free(&w->rc);
+		return EXIT_FAILURE;
 	}
+	evloop_run(&w->loop);
+
+	// Disconnects and frees the libtwirc state(s), so we don't leak
+	join_free(&w->joins);
+	reconn_free(&w->rc);
+	return EXIT_SUCCESS;
 }
 
 /*
- * Let's handle CTRL+C by stopping our main loop and tidying up.
+ * Thread function of a worker: runs its connection, then lets the main
+ * thread know that it's done.
  */
-void sigint_handler(int sig)
+void *run_worker(void *arg)
 {
-	running = 0;
-	handled = sig;
+	struct worker *w = arg;
+	w->status = run_connection(w);
+
+	atomic_fetch_add(&w->meta->finished, 1);
+	evloop_wake(&w->meta->loop);
+	return NULL;
 }
 
 void version()
@@ -184,14 +1185,53 @@ void version()
 void help(char *invocation)
 {
 	fprintf(stdout, "Usage:\n");
-	fprintf(stdout, "\t%s [OPTION...] -c CHANNEL\n", invocation);
+	fprintf(stdout, "\t%s [OPTION...] -c CHANNEL [-c CHANNEL...]\n", invocation);
+	fprintf(stdout, "\t%s [OPTION...] -f FILE\n", invocation);
 	fprintf(stdout, "\t Note: the channel should start with '#'\n");
 	fprintf(stdout, "\n");
 	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-a FILE Append analytics of every channel to FILE, as JSON lines.\n");
+	fprintf(stdout, "\t-b Write binary records instead of text, see dumpread.\n");
+	fprintf(stdout, "\t-B BYTES Flush output once this many bytes are buffered (default: %d).\n", OUTPUT_FLUSH_BYTES);
+	fprintf(stdout, "\t-c CHANNEL Join the given channel, can be used multiple times.\n");
+	fprintf(stdout, "\t-C DIR Share the channels with other dump nodes using DIR, which\n");
+	fprintf(stdout, "\t       all of them can write to; every channel is joined by one.\n");
+	fprintf(stdout, "\t-d DIR Write binary records to segment files in DIR, one per\n");
+	fprintf(stdout, "\t       channel and period, instead of stdout.\n");
+	fprintf(stdout, "\t-f FILE Read channels to join from FILE, one per line.\n");
+	fprintf(stdout, "\t-F MS Flush output once data is buffered this long (default: %d).\n", OUTPUT_FLUSH_MS);
+	fprintf(stdout, "\t-g FILE Only write chat with one of the keywords in FILE, one per\n");
+	fprintf(stdout, "\t        line, ignoring case; lines like /regex/ are regexes.\n");
+	fprintf(stdout, "\t-H HOST IRC server to connect to (default: %s).\n", DEFAULT_HOST);
 	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-i SECONDS Write analytics this often (default: %d).\n", STATS_INTERVAL);
+	fprintf(stdout, "\t-j NUM Channels every connection may join per %d seconds\n", JOIN_WINDOW / 1000);
+	fprintf(stdout, "\t       (default: %d, verified bots may join more).\n", JOIN_LIMIT);
+	fprintf(stdout, "\t-k TAGS Comma-separated tags to keep in binary records\n");
+	fprintf(stdout, "\t        (default: %s).\n", DEFAULT_TAGS);
+	fprintf(stdout, "\t-P PORT Port of the IRC server (default: %s).\n", DEFAULT_PORT);
+	fprintf(stdout, "\t-r Write the raw IRC lines, each preceded by the time it was\n");
+	fprintf(stdout, "\t   received at in seconds since the epoch, see mockd -f.\n");
+	fprintf(stdout, "\t-R MINUTES Start new segment files after this long (default: %d).\n", SEGMENT_PERIOD / 60);
+	fprintf(stdout, "\t-M ADDR Serve metrics on ADDR, a TCP port on localhost or the\n");
+	fprintf(stdout, "\t        path of a Unix socket; SIGUSR1 prints them to stderr.\n");
+	fprintf(stdout, "\t-m Prefix a monotonic timestamp with microsecond precision.\n");
+	fprintf(stdout, "\t-N NAME Name of this node with -C (default: the host name).\n");
+	fprintf(stdout, "\t-o POLICY What to do once stdout can't keep up and the buffer is\n");
+	fprintf(stdout, "\t          full: block (default), drop-oldest, drop-newest or spill\n");
+	fprintf(stdout, "\t          to a file, to be written once stdout caught up.\n");
+	fprintf(stdout, "\t-O FILE File to spill to with -o spill (default: a temporary file).\n");
+	fprintf(stdout, "\t-S MB Size of segment files in megabytes (default: %d, at most %llu).\n",
+			SEGMENT_SIZE / (1024 * 1024), SEGMENT_MAX_SIZE / (1024 * 1024));
 	fprintf(stdout, "\t-s Print additional status information to stderr.\n");
 	fprintf(stdout, "\t-t FORMAT Enable timestamps, optionally specifying the format.\n");
+	fprintf(stdout, "\t-T MS Longest time to wait for IRC messages in one go (default: %d).\n", EVLOOP_TICK);
+	fprintf(stdout, "\t-u FILE Only write chat of the users in FILE, one per line.\n");
+	fprintf(stdout, "\t-U FILE Don't write chat of the users in FILE, one per line.\n");
 	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\t-w NUM Number of connections to spread the channels over,\n");
+	fprintf(stdout, "\t       defaults to the number of CPU cores.\n");
+	fprintf(stdout, "\t-z Compress binary records with zstd, implies -b.\n");
 	fprintf(stdout, "\n");
 	version();
 }
@@ -203,104 +1243,488 @@ int main(int argc, char **argv)
 {
 	// Get a metadata struct	
 	struct metadata m = { 0 };
+	m.host = DEFAULT_HOST;
+	m.port = DEFAULT_PORT;
+	m.flush_bytes = OUTPUT_FLUSH_BYTES;
+	m.flush_ms = OUTPUT_FLUSH_MS;
+	m.seg_size = SEGMENT_SIZE;
+	m.seg_period = SEGMENT_PERIOD;
+	m.stats_interval = STATS_INTERVAL;
 
 	// Process command line options
 	opterr = 0;
 	int o;
-	while ((o = getopt(argc, argv, "c:t:svh")) != -1)
+	while ((o = getopt(argc, argv, "a:bB:c:C:d:f:F:g:H:i:j:k:M:N:o:O:P:rR:S:t:T:u:U:w:msvzh")) != -1)
 	{
 		switch(o)
 		{
+			case 'a':
+				m.stats_file = optarg;
+				break;
+			case 'i':
+				m.stats_interval = atoi(optarg);
+				break;
+			case 'b':
+				m.binary = 1;
+				break;
+			case 'z':
+				m.binary = 1;
+				m.codec = ARCHIVE_CODEC_ZSTD;
+				break;
+			case 'k':
+				m.tags = optarg;
+				break;
+			case 'j':
+				m.join_limit = atoi(optarg);
+				break;
+			case 'M':
+				m.metrics = optarg;
+				break;
+			case 'd':
+				m.binary = 1;
+				m.dir = optarg;
+				break;
+			case 'H':
+				m.host = optarg;
+				break;
+			case 'T':
+				m.tick = atoi(optarg);
+				break;
+			case 'P':
+				m.port = optarg;
+				break;
+			case 'R':
+				m.seg_period = atoi(optarg) * 60;
+				break;
+			case 'S':
+				m.seg_size = strtoull(optarg, NULL, 10);
+				if (m.seg_size == 0 || m.seg_size > SEGMENT_MAX_SIZE / (1024 * 1024))
+				{
+					fprintf(stderr, "Segment size must be 1 to %llu MB, exiting\n",
+							SEGMENT_MAX_SIZE / (1024 * 1024));
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				m.seg_size *= 1024 * 1024;
+				break;
+			case 'B':
+				m.flush_bytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'F':
+				m.flush_ms = atoi(optarg);
+				break;
+			case 'o':
+				m.policy = output_policy(optarg);
+				if (m.policy == -1)
+				{
+					fprintf(stderr, "Unknown output policy '%s', exiting\n", optarg);
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'O':
+				m.spill_file = optarg;
+				break;
+			case 'C':
+				m.cluster_dir = optarg;
+				break;
+			case 'N':
+				m.node_name = optarg;
+				break;
 			case 'c':
-				m.chan = optarg;
+				if (add_channel(&m, optarg) == -1)
+				{
+					fprintf(stderr, "Error adding channel, exiting\n");
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'f':
+				if (read_channels(&m, optarg) == -1)
+				{
+					fprintf(stderr, "Error reading channel file, exiting\n");
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'g':
+				if (filter_read(&m.flt, FILTER_WORDS, optarg) == -1)
+				{
+					fprintf(stderr, "Error reading keyword file, exiting\n");
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				m.filter = 1;
+				break;
+			case 'u':
+			case 'U':
+				if (filter_read(&m.flt, o == 'u' ? FILTER_ALLOW : FILTER_DENY, optarg) == -1)
+				{
+					fprintf(stderr, "Error reading user file, exiting\n");
+					filter_free(&m.flt);
+					free_channels(&m);
+					return EXIT_FAILURE;
+				}
+				m.filter = 1;
 				break;
 			case 't':
 				m.timestamp = optarg;
 				break;
+			case 'w':
+				m.workers = atoi(optarg);
+				break;
+			case 'm':
+				m.monotonic = 1;
+				break;
+			case 'r':
+				m.raw = 1;
+				break;
 			case 's':
 				m.verbose = 1;
 				break;
 			case 'v':
 				version();
+				filter_free(&m.flt);
+				free_channels(&m);
 				return EXIT_SUCCESS;
 			case 'h':
 				help(argv[0]);
+				filter_free(&m.flt);
+				free_channels(&m);
 				return EXIT_SUCCESS;
 		}
 	}
 
 	// Abort if no channel name was given	
-	if (m.chan == NULL)
+	if (m.num_chans == 0)
 	{
 		fprintf(stderr, "No channel specified, exiting\n");
+		filter_free(&m.flt);
 		return EXIT_FAILURE;
 	}
 
+	// Default to one worker per CPU core, but never more than channels
+	if (m.workers <= 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		m.workers = cores > 0 ? (int) cores : 1;
+	}
+	if ((size_t) m.workers > m.num_chans)
+	{
+		m.workers = (int) m.num_chans;
+	}
+
 	if (m.verbose)
 	{
-		fprintf(stderr, "*** Initializing\n");
+		fprintf(stderr, "*** Initializing (%zu channels, %d workers)\n",
+				m.num_chans, m.workers);
 	}
-	
-	// Make sure we still do clean-up on SIGINT (ctrl+c)
-	// and similar signals that indicate we should quit.
-	struct sigaction sa_int = {
-		.sa_handler = &sigint_handler
-	};
-	
+
+	// Set up the buffered output, all workers will write to it
+	if (open_output(&m) == -1)
+	{
+		fprintf(stderr, "Error initializing output, exiting\n");
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+
+	// Binary records keep the tags selected with -k; the tag keys will
+	// point into the tag list, so it needs to stay around
+	char default_tags[] = DEFAULT_TAGS;
+	if (m.binary)
+	{
+		if (!archive_has_codec(m.codec))
+		{
+			fprintf(stderr, "Compression not supported by this build, exiting\n");
+			close_output(&m);
+			filter_free(&m.flt);
+			free_channels(&m);
+			return EXIT_FAILURE;
+		}
+
+		if (m.tags == NULL)
+		{
+			m.tags = default_tags;
+		}
+		split_tags(&m);
+	}
+
+	// Segment files are written via mmap(), so there is no compression
+	if (m.dir && m.codec != ARCHIVE_CODEC_NONE)
+	{
+		fprintf(stderr, "Segment files can't be compressed, exiting\n");
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+
+	// Raw lines are text, with a timestamp of their own
+	if (m.raw && (m.binary || m.timestamp))
+	{
+		fprintf(stderr, "-r can't be combined with -b, -d, -t or -z, exiting\n");
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+
+	// The filter is only read from now on, so all workers can share it
+	if (m.filter && filter_compile(&m.flt) == -1)
+	{
+		fprintf(stderr, "Error compiling filter, exiting\n");
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+	if (m.filter && m.verbose)
+	{
+		fprintf(stderr, "*** Filtering chat: %zu keyword(s) (%s), %zu regex(es), "
+				"%zu user(s) allowed, %zu denied\n",
+				m.flt.num_words, filter_engine_name(m.flt.engine),
+				m.flt.num_regexes, m.flt.num_allow, m.flt.num_deny);
+	}
+
+	// Analytics go to a file of their own, buffered like the main output
+	if (m.stats_file && open_stats(&m) == -1)
+	{
+		fprintf(stderr, "Error opening analytics file, exiting\n");
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+
+	// Make sure we still do clean-up on SIGINT (ctrl+c) and similar
+	// signals that indicate we should quit. They are received by the main
+	// thread's loop, which requires that they are blocked in all threads,
+	// so this has to happen before we start any.
+	if (evloop_init(&m.loop, NULL, 0) == -1)
+	{
+		fprintf(stderr, "Error initializing event loop, exiting\n");
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+	evloop_on_wake(&m.loop, handle_finished, &m);
+
+	// From now on, stdout is written to by a thread of its own, so a slow
+	// reader holds up that thread instead of the workers
+	if (output_start(&m.out, m.policy, m.spill_fd) == -1)
+	{
+		fprintf(stderr, "Error starting output thread, exiting\n");
+		evloop_free(&m.loop);
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
+
 	// These might return -1 on error, but we'll ignore that for now
-	sigaction(SIGINT, &sa_int, NULL);
-	sigaction(SIGQUIT, &sa_int, NULL);
-	sigaction (SIGTERM, &sa_int, NULL);
+	evloop_signal(&m.loop, SIGINT, handle_signal, &m);
+	evloop_signal(&m.loop, SIGQUIT, handle_signal, &m);
+	evloop_signal(&m.loop, SIGTERM, handle_signal, &m);
+	evloop_signal(&m.loop, SIGUSR1, handle_signal, &m);
 
-	// Create libtwirc state instance
-	twirc_state_t *s = twirc_init();
+	if (m.dir && segdir_init(&m.segs, m.dir, m.seg_size, m.seg_period) == -1)
+	{
+		fprintf(stderr, "Error initializing segment files, exiting\n");
+		evloop_free(&m.loop);
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
 
-	if (s == NULL)
+	// Otherwise, binary records are put together in blocks for stdout
+	if (m.binary && !m.dir && archive_init(&m.arch, &m.out, m.codec, m.flush_ms) == -1)
 	{
-		fprintf(stderr, "Error initializing, exiting\n");
+		fprintf(stderr, "Error initializing archive, exiting\n");
+		evloop_free(&m.loop);
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
 		return EXIT_FAILURE;
 	}
-	
-	// Save the metadata in the state
-	twirc_set_context(s, &m);
 
-	// We get the callback struct from the libtwirc state
-	twirc_callbacks_t *cbs = twirc_get_callbacks(s);
+	// Nodes sharing the channels are told apart by name, the host's by default
+	char host[CLUSTER_NAME] = { 0 };
+	if (m.cluster_dir && m.node_name == NULL)
+	{
+		gethostname(host, sizeof(host) - 1);
+		m.node_name = host;
+	}
+	if (m.cluster_dir && cluster_init(&m.cluster, m.cluster_dir, m.node_name, m.chans, m.num_chans) == -1)
+	{
+		fprintf(stderr, "Error joining the cluster in %s as %s, exiting\n", m.cluster_dir, m.node_name);
+		if (m.dir)
+		{
+			segdir_free(&m.segs);
+		}
+		archive_free(&m.arch);
+		evloop_free(&m.loop);
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
+		return EXIT_FAILURE;
+	}
 
-	// We assign our handlers to the events we are interested int
-	cbs->connect         = handle_connect;
-	cbs->welcome         = handle_welcome;
-	cbs->join            = handle_join;
-	cbs->action          = handle_action;
-	cbs->privmsg         = handle_privmsg;
-	cbs->disconnect      = handle_disconnect;
-	
-	// Connect to the IRC server
-	if (twirc_connect_anon(s, DEFAULT_HOST, DEFAULT_PORT) != 0)
+	// Create the workers and hand out the channels round-robin. Each worker
+	// gets its own list of pointers into the channel list of the metadata.
+	struct worker *workers = calloc(m.workers, sizeof(struct worker));
+	char **chans = malloc(m.num_chans * sizeof(char *));
+	struct segment **segs = calloc(m.num_chans, sizeof(struct segment *));
+	struct stats *stats = m.stats_file ? calloc(m.num_chans, sizeof(struct stats)) : NULL;
+	struct cluster_chan **cluster = m.cluster_dir ? calloc(m.num_chans, sizeof(struct cluster_chan *)) : NULL;
+
+	if (workers == NULL || chans == NULL || segs == NULL || (m.stats_file && stats == NULL) ||
+			(m.cluster_dir && cluster == NULL))
 	{
-		fprintf(stderr, "Error connecting, exiting\n");
+		fprintf(stderr, "Error initializing, exiting\n");
+		free(workers);
+		free(chans);
+		free(segs);
+		free(stats);
+		free(cluster);
+		if (m.cluster_dir)
+		{
+			cluster_free(&m.cluster);
+		}
+		if (m.dir)
+		{
+			segdir_free(&m.segs);
+		}
+		archive_free(&m.arch);
+		evloop_free(&m.loop);
+		close_stats(&m);
+		close_output(&m);
+		filter_free(&m.flt);
+		free_channels(&m);
 		return EXIT_FAILURE;
 	}
+	m.workers_list = workers;
+
+	size_t offset = 0;
+	for (int i = 0; i < m.workers; ++i)
+	{
+		workers[i].id = i;
+		workers[i].meta = &m;
+		workers[i].chans = chans + offset;
+		workers[i].segs = segs + offset;
+		workers[i].stats = stats ? stats + offset : NULL;
+		workers[i].cluster = cluster ? cluster + offset : NULL;
+		for (size_t c = i; c < m.num_chans; c += m.workers)
+		{
+			workers[i].chans[workers[i].num_chans++] = m.chans[c];
+		}
+		offset += workers[i].num_chans;
+
+		// Sorted, so handlers can quickly find a channel's index
+		qsort(workers[i].chans, workers[i].num_chans, sizeof(char *), compare_channels);
+
+		// The loop gets its libtwirc state once the worker created it,
+		// but it has to exist before, so we can stop it at any time
+		evloop_init(&workers[i].loop, NULL, m.tick);
+	}
+
+	// The main thread's loop has nothing else to do, so it serves metrics
+	struct metrics_server ms = { .fd = -1 };
+	if (m.metrics && metrics_listen(&ms, &m.loop, m.metrics) == -1)
+	{
+		fprintf(stderr, "Could not serve metrics on %s\n", m.metrics);
+	}
+
+	// Launch all workers; each of them runs its own connection and loop
+	int launched = 0;
+	for (; launched < m.workers; ++launched)
+	{
+		if (pthread_create(&workers[launched].thread, NULL,
+					&run_worker, &workers[launched]) != 0)
+		{
+			fprintf(stderr, "Error launching worker %d\n", launched);
+			break;
+		}
+	}
+
+	// Wait for the workers to finish, which they will do once we receive
+	// a signal; lost connections are reestablished by the workers
+	if (launched == m.workers)
+	{
+		evloop_run(&m.loop);
+	}
+	else
+	{
+		for (int i = 0; i < launched; ++i)
+		{
+			evloop_stop(&workers[i].loop);
+		}
+	}
 
-	// Main loop - we call twirc_tick() every go-around, as that's what 
-	// makes the magic happen. The 1000 is a timeout in milliseconds that
-	// we grant twirc_tick() to do its work - in other words, we'll give 
-	// it 1 second to wait for and process IRC messages, then it will hand 
-	// control back to us. If twirc_tick() detects a disconnect or error,
-	// it will return -1, otherwise it will return 0 and we can go on!
+	int status = launched == m.workers ? EXIT_SUCCESS : EXIT_FAILURE;
+	for (int i = 0; i < m.workers; ++i)
+	{
+		if (i < launched)
+		{
+			pthread_join(workers[i].thread, NULL);
+			if (workers[i].status != EXIT_SUCCESS)
+			{
+				status = EXIT_FAILURE;
+			}
+			if (m.filter && m.verbose)
+			{
+				fprintf(stderr, "*** Worker %d: %llu message(s) filtered out\n",
+						i, (unsigned long long) workers[i].filtered);
+			}
+			if (workers[i].rc.reconnects && m.verbose)
+			{
+				fprintf(stderr, "*** Worker %d: %u reconnect(s), longest gap %llu ms, "
+						"%llu ms in total, slowest reconnect %llu ms\n",
+						i, workers[i].rc.reconnects,
+						(unsigned long long) workers[i].rc.max_gap,
+						(unsigned long long) workers[i].rc.total_gap,
+						(unsigned long long) workers[i].rc.max_latency);
+			}
+		}
+		evloop_free(&workers[i].loop);
+	}
 
-	running = 1;
-	while (twirc_tick(s, 1000) == 0 && running == 1)
+	// Write out whatever is still buffered; this is also where we end
+	// up after SIGINT or SIGTERM, so no chat messages are lost on exit
+	archive_free(&m.arch);
+	close_stats(&m);
+	close_output(&m);
+	if (m.dir)
 	{
-		// Nothing to do here - it's all done via the event handlers
+		segdir_free(&m.segs);
+	}
+	metrics_close(&ms);
+	evloop_free(&m.loop);
+	if (m.cluster_dir)
+	{
+		cluster_free(&m.cluster);
 	}
 
-	// twirc_kill() is a convenience functions that calls two functions:
-	// - twirc_disconnect(), which makes sure the connection was closed
-	// - twirc_free(), which frees the libtwirc state, so we don't leak
-	twirc_kill(s);
+	free(workers);
+	free(chans);
+	free(segs);
+	free(stats);
+	free(cluster);
+	filter_free(&m.flt);
+	free_channels(&m);
 
 	// That's all, wave good-bye!
-	return EXIT_SUCCESS;
+	return status;
 }
-
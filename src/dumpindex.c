@@ -0,0 +1,261 @@
+#include <stdio.h>      // NULL, fprintf(), snprintf()
+#include <string.h>     // memcmp()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // getopt() et al., pread(), close()
+#include <fcntl.h>      // open()
+#include <limits.h>     // PATH_MAX
+#include <time.h>       // clock_gettime()
+#include <sys/stat.h>   // fstat()
+#include "record.h"
+#include "archive.h"
+#include "segment.h"
+#include "index.h"
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_BUILD 0
+
+#define PROJECT_URL "https://github.com/domsson/twircclient"
+
+struct metadata
+{
+	int force;        // Rebuild indexes that are up to date
+	int verbose;      // Print what we did for every file
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns 1 if there is an index at 'path' that covers 'extent' bytes of
+ * data, which means it's up to date, 0 otherwise.
+ */
+int is_fresh(const char *path, uint64_t extent)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return 0;
+	}
+	struct index ix;
+	int fresh = index_open(&ix, fd) == 0 && ix.extent == extent;
+	index_close(&ix);
+	close(fd);
+	return fresh;
+}
+
+/*
+ * Adds all records of the segment file to the index, which refers to them
+ * by their offset. Returns the size of the data covered, or -1 on error.
+ */
+long long index_segment(struct index_builder *b, int fd, const char *path, struct metadata *meta)
+{
+	struct segment_reader rd;
+	if (segment_open(&rd, fd) == -1)
+	{
+		return -1;
+	}
+	if (!meta->force && is_fresh(path, rd.used))
+	{
+		segment_close(&rd);
+		return 0;
+	}
+
+	struct record r;
+	size_t where = rd.pos;
+	int res;
+	while ((res = segment_next(&rd, &r)) == 1)
+	{
+		if (index_add(b, &r, where) == -1)
+		{
+			res = -1;
+			break;
+		}
+		where = rd.pos;
+	}
+
+	long long extent = rd.used;
+	segment_close(&rd);
+	return res == -1 ? -1 : extent;
+}
+
+/*
+ * Adds all records of the archive to the index, which refers to them by the
+ * block they're in and their offset within it. Returns the size of the data
+ * covered, or -1 on error.
+ */
+long long index_archive(struct index_builder *b, int fd, const char *path, struct metadata *meta)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		return -1;
+	}
+	if (!meta->force && is_fresh(path, st.st_size))
+	{
+		return 0;
+	}
+
+	struct archive_reader rd;
+	if (archive_open(&rd, fd) == -1)
+	{
+		archive_close(&rd);
+		return -1;
+	}
+
+	struct record r;
+	int res;
+	while ((res = archive_next(&rd, &r)) == 1)
+	{
+		if (rd.last >> INDEX_BLOCK_BITS || rd.block_at >> (64 - INDEX_BLOCK_BITS))
+		{
+			res = -1;
+			break;
+		}
+		if (index_add(b, &r, rd.block_at << INDEX_BLOCK_BITS | rd.last) == -1)
+		{
+			res = -1;
+			break;
+		}
+	}
+
+	long long extent = rd.next_at;
+	archive_close(&rd);
+	return res == -1 ? -1 : extent;
+}
+
+/*
+ * Builds the index of the given archive or segment file, unless there is
+ * one that is up to date. Returns 0 on success, -1 on error.
+ */
+int index_file(struct metadata *meta, const char *file)
+{
+	char path[PATH_MAX];
+	if ((size_t) snprintf(path, sizeof(path), "%s%s", file, INDEX_SUFFIX) >= sizeof(path))
+	{
+		return -1;
+	}
+	int fd = open(file, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	struct index_builder b;
+	if (index_builder_init(&b) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	double started = now_sec();
+	char magic[4];
+	long long extent;
+	if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, SEGMENT_MAGIC, 4) == 0)
+	{
+		extent = index_segment(&b, fd, path, meta);
+	}
+	else
+	{
+		extent = index_archive(&b, fd, path, meta);
+	}
+	close(fd);
+
+	int res = extent == -1 ? -1 : 0;
+	if (extent > 0 || (extent == 0 && b.num_docs > 0))
+	{
+		res = index_write(&b, path, extent);
+		if (res == 0 && meta->verbose)
+		{
+			fprintf(stderr, "*** %s: %llu records, %zu terms in %.3f s\n", path,
+					(unsigned long long) b.num_docs, b.num_terms,
+					now_sec() - started);
+		}
+	}
+	else if (extent == 0 && meta->verbose)
+	{
+		fprintf(stderr, "*** %s: up to date\n", path);
+	}
+	index_builder_free(&b);
+	return res;
+}
+
+void version()
+{
+	fprintf(stdout, "twitch-dumpindex version %d.%d.%d - %s\n",
+				VERSION_MAJOR,
+				VERSION_MINOR,
+				VERSION_BUILD,
+				PROJECT_URL);
+}
+
+void help(char *invocation)
+{
+	fprintf(stdout, "Usage:\n");
+	fprintf(stdout, "\t%s [OPTION...] FILE...\n", invocation);
+	fprintf(stdout, "\t Note: FILE can be an archive (dump -b) or segment (dump -d)\n");
+	fprintf(stdout, "\t Note: the index of FILE is written to FILE%s\n", INDEX_SUFFIX);
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-f Rebuild indexes even if they are up to date.\n");
+	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-s Print what has been done for every file to stderr.\n");
+	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Search the indexed files with dumpread -u and -w.\n");
+	fprintf(stdout, "\n");
+	version();
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	struct metadata m = { 0 };
+
+	// Process command line options
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "fsvh")) != -1)
+	{
+		switch(o)
+		{
+			case 'f':
+				m.force = 1;
+				break;
+			case 's':
+				m.verbose = 1;
+				break;
+			case 'v':
+				version();
+				return EXIT_SUCCESS;
+			case 'h':
+				help(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	// Indexes refer to records by where they are, so we need files
+	if (optind == argc)
+	{
+		fprintf(stderr, "No file specified, exiting\n");
+		return EXIT_FAILURE;
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = optind; i < argc; ++i)
+	{
+		if (index_file(&m, argv[i]) == -1)
+		{
+			fprintf(stderr, "Error indexing %s\n", argv[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
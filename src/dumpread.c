@@ -0,0 +1,579 @@
+#define _XOPEN_SOURCE 700 // strptime()
+#include <stdio.h>      // NULL, fprintf(), fwrite(), snprintf()
+#include <string.h>     // strcmp(), strspn(), strlen(), memcmp()
+#include <strings.h>    // strncasecmp()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, qsort()
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // getopt() et al.
+#include <fcntl.h>      // open()
+#include <limits.h>     // PATH_MAX
+#include <time.h>       // strftime(), localtime_r(), mktime()
+#include <sys/stat.h>   // fstat()
+#include "record.h"
+#include "archive.h"
+#include "segment.h"
+#include "index.h"
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_BUILD 0
+
+#define PROJECT_URL "https://github.com/domsson/twircclient"
+
+#define DEFAULT_TIMESTAMP "[%Y-%m-%d %H:%M:%S]"
+#define TIMESTAMP_BUFFER 64
+#define MAX_WORDS 16
+
+struct metadata
+{
+	char     *timestamp;  // Timestamp format
+	char     *chan;       // Only show messages of this channel
+	char     *user;       // Only show messages from this user
+	char      words[MAX_WORDS][INDEX_MAX_TERM]; // Words messages need to have
+	size_t    word_len[MAX_WORDS];
+	size_t    num_words;
+	uint64_t  start;      // Only show messages from this time on (usec)
+	uint64_t  end;        // Only show messages up to this time (usec)
+	int       show_tags;  // Print the tags of every message
+	time_t    last;       // Second the cached timestamp is for
+	char      buf[TIMESTAMP_BUFFER]; // Cached timestamp
+	size_t    len;        // Length of the cached timestamp
+};
+
+/*
+ * Parses a point in time given on the command line, either as seconds since
+ * the epoch or as local time in the form "YYYY-MM-DD[ HH:MM[:SS]]".
+ * Returns the time in microseconds since the epoch, or 0 on error.
+ */
+uint64_t parse_time(const char *str)
+{
+	if (str[strspn(str, "0123456789")] == '\0')
+	{
+		return strtoull(str, NULL, 10) * 1000000;
+	}
+
+	const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+	{
+		struct tm tm = { 0 };
+		const char *rest = strptime(str, formats[i], &tm);
+		if (rest && *rest == '\0')
+		{
+			tm.tm_isdst = -1;
+			return (uint64_t) mktime(&tm) * 1000000;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Splits the given string into words the way the index does and adds them
+ * to the words we're looking for. Returns 0 on success, -1 if there are too
+ * many words.
+ */
+int add_words(struct metadata *meta, const char *str)
+{
+	size_t len = strlen(str);
+	size_t pos = 0;
+	char word[INDEX_MAX_TERM];
+	size_t n;
+	while ((n = index_word(str, len, &pos, word)))
+	{
+		if (meta->num_words == MAX_WORDS)
+		{
+			return -1;
+		}
+		memcpy(meta->words[meta->num_words], word, n);
+		meta->word_len[meta->num_words++] = n;
+	}
+	return 0;
+}
+
+/*
+ * Prints one record in the same format dump uses for text output, always
+ * including the channel, optionally preceded by the tags in IRC notation.
+ */
+void print_record(struct metadata *meta, const struct record *r)
+{
+	time_t t = r->time / 1000000;
+
+	// Consecutive records are often from the same second
+	if (t != meta->last)
+	{
+		struct tm lt;
+		localtime_r(&t, &lt);
+		meta->len = strftime(meta->buf, TIMESTAMP_BUFFER, meta->timestamp, &lt);
+		meta->last = t;
+	}
+
+	fwrite(meta->buf, 1, meta->len, stdout);
+	fputc(' ', stdout);
+
+	if (meta->show_tags && r->num_tags > 0)
+	{
+		for (size_t i = 0; i < r->num_tags; ++i)
+		{
+			fprintf(stdout, "%c%.*s=%.*s", i == 0 ? '@' : ';',
+					(int) r->tags[i].key.len, r->tags[i].key.str,
+					(int) r->tags[i].value.len, r->tags[i].value.str);
+		}
+		fputc(' ', stdout);
+	}
+
+	fprintf(stdout, r->type == RECORD_ACTION ? "%.*s * %.*s %.*s\n" : "%.*s %.*s: %.*s\n",
+			(int) r->channel.len, r->channel.str,
+			(int) r->origin.len, r->origin.str,
+			(int) r->message.len, r->message.str);
+}
+
+/*
+ * Returns 1 if the message of the record has the given word, which has to
+ * be lowercased, like those index_word() finds.
+ */
+int has_word(const struct record *r, const char *word, size_t len)
+{
+	char buf[INDEX_MAX_TERM];
+	size_t pos = 0;
+	size_t n;
+	while ((n = index_word(r->message.str, r->message.len, &pos, buf)))
+	{
+		if (n == len && memcmp(buf, word, len) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the record matches the channel, user, words and time range
+ * we're after.
+ */
+int matches(struct metadata *meta, const struct record *r)
+{
+	if (r->time < meta->start || (meta->end && r->time > meta->end))
+	{
+		return 0;
+	}
+	if (meta->chan && (r->channel.len != strlen(meta->chan) ||
+	    memcmp(r->channel.str, meta->chan, r->channel.len) != 0))
+	{
+		return 0;
+	}
+	if (meta->user && (r->origin.len != strlen(meta->user) ||
+	    strncasecmp(r->origin.str, meta->user, r->origin.len) != 0))
+	{
+		return 0;
+	}
+	for (size_t i = 0; i < meta->num_words; ++i)
+	{
+		if (!has_word(r, meta->words[i], meta->word_len[i]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compare_postings(const void *a, const void *b)
+{
+	const struct postings *pa = a;
+	const struct postings *pb = b;
+	return (pa->count > pb->count) - (pa->count < pb->count);
+}
+
+/*
+ * Looks up all the terms we're after in the index and sorts their postings
+ * by the number of records, rarest first. Returns the number of terms, or 0
+ * if one of them is in no record at all, so nothing can match.
+ */
+size_t find_terms(struct metadata *meta, const struct index *ix, struct postings *p)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < meta->num_words; ++i)
+	{
+		if (!index_find(ix, meta->words[i], meta->word_len[i], &p[n++]))
+		{
+			return 0;
+		}
+	}
+
+	char term[INDEX_MAX_TERM];
+	size_t len;
+	if (meta->user)
+	{
+		len = index_term(term, "u:", meta->user, strlen(meta->user));
+		if (len == 0 || !index_find(ix, term, len, &p[n++]))
+		{
+			return 0;
+		}
+	}
+	if (meta->chan)
+	{
+		len = index_term(term, "c:", meta->chan, strlen(meta->chan));
+		if (len == 0 || !index_find(ix, term, len, &p[n++]))
+		{
+			return 0;
+		}
+	}
+
+	qsort(p, n, sizeof(struct postings), compare_postings);
+	return n;
+}
+
+/*
+ * Finds the next record that has all the terms, by taking the next record
+ * of the rarest term and skipping the others ahead to it. If one of them
+ * doesn't have it, the rarest one skips ahead to the record that one is at
+ * instead, and so on. Returns 1 if a record has been found, 0 if not.
+ */
+int next_match(struct metadata *meta, const struct index *ix, struct postings *p, size_t n, uint64_t *doc)
+{
+	uint64_t cand;
+	if (index_next(&p[0], &cand) == 0)
+	{
+		return 0;
+	}
+	for (;;)
+	{
+		size_t i = 1;
+		uint64_t at = cand;
+		while (i < n)
+		{
+			if (index_skip(&p[i], cand, &at) == 0)
+			{
+				return 0;
+			}
+			if (at != cand)
+			{
+				break;
+			}
+			++i;
+		}
+		if (i < n)
+		{
+			// One of the terms is ahead, the rarest one has to catch up
+			if (index_skip(&p[0], at, &cand) == 0)
+			{
+				return 0;
+			}
+			continue;
+		}
+		if (cand >= ix->num_docs)
+		{
+			return 0;
+		}
+
+		// Times are in the index, so there's no need to read the record
+		uint64_t time = index_time(ix, cand);
+		if (time >= meta->start && (meta->end == 0 || time <= meta->end))
+		{
+			*doc = cand;
+			return 1;
+		}
+		if (index_next(&p[0], &cand) == 0)
+		{
+			return 0;
+		}
+	}
+}
+
+/*
+ * Prints the records of the archive the index says match our filters, going
+ * straight to the blocks they are in. Returns 0 on success, -1 on error.
+ */
+int search_archive(struct metadata *meta, struct archive_reader *rd, const struct index *ix)
+{
+	struct postings p[MAX_WORDS + 2];
+	size_t n = find_terms(meta, ix, p);
+
+	struct record r;
+	uint64_t doc;
+	while (n && next_match(meta, ix, p, n, &doc))
+	{
+		uint64_t where = index_where(ix, doc);
+		if (archive_load(rd, where >> INDEX_BLOCK_BITS) == -1)
+		{
+			return -1;
+		}
+		rd->pos = where & ((1 << INDEX_BLOCK_BITS) - 1);
+		if (rd->pos >= rd->blk.raw_len || archive_next(rd, &r) != 1)
+		{
+			return -1;
+		}
+		if (matches(meta, &r))
+		{
+			print_record(meta, &r);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Prints the records of the segment the index says match our filters.
+ * Returns 0 on success, -1 on error.
+ */
+int search_segment(struct metadata *meta, struct segment_reader *rd, const struct index *ix)
+{
+	struct postings p[MAX_WORDS + 2];
+	size_t n = find_terms(meta, ix, p);
+
+	struct record r;
+	uint64_t doc;
+	while (n && next_match(meta, ix, p, n, &doc))
+	{
+		if (segment_read(rd, index_where(ix, doc), &r) != 1)
+		{
+			return -1;
+		}
+		if (matches(meta, &r))
+		{
+			print_record(meta, &r);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Prints all records of the archive that can be read from the given file
+ * descriptor and match our filters, using the index if there is one that
+ * is up to date. Returns 0 on success, -1 on error.
+ */
+int read_archive(struct metadata *meta, int fd, const struct index *ix)
+{
+	struct archive_reader rd;
+	if (archive_open(&rd, fd) == -1)
+	{
+		archive_close(&rd);
+		return -1;
+	}
+
+	struct stat st;
+	if (ix && fstat(fd, &st) == 0 && (uint64_t) st.st_size == ix->extent)
+	{
+		int res = search_archive(meta, &rd, ix);
+		archive_close(&rd);
+		return res;
+	}
+
+	int res = meta->start ? archive_seek(&rd, meta->start) : 1;
+
+	struct record r;
+	while (res == 1 && (res = archive_next(&rd, &r)) == 1)
+	{
+		// Blocks are stored in order, so we can stop once a whole
+		// block is past the end of the requested range
+		if (meta->end && rd.blk.first > meta->end)
+		{
+			break;
+		}
+		if (matches(meta, &r))
+		{
+			print_record(meta, &r);
+		}
+	}
+
+	archive_close(&rd);
+	return res == -1 ? -1 : 0;
+}
+
+/*
+ * Prints all records of the segment file that match our filters, using the
+ * search index if there is one that is up to date, or else the segment's own
+ * index to find the start. Returns 0 on success, -1 on error.
+ */
+int read_segment(struct metadata *meta, int fd, const struct index *ix)
+{
+	struct segment_reader rd;
+	if (segment_open(&rd, fd) == -1)
+	{
+		return -1;
+	}
+
+	if (ix && rd.used == ix->extent)
+	{
+		int res = search_segment(meta, &rd, ix);
+		segment_close(&rd);
+		return res;
+	}
+
+	int res = meta->start ? segment_seek(&rd, meta->start) : 1;
+
+	struct record r;
+	while (res == 1 && (res = segment_next(&rd, &r)) == 1)
+	{
+		if (matches(meta, &r))
+		{
+			print_record(meta, &r);
+		}
+	}
+
+	segment_close(&rd);
+	return res == -1 ? -1 : 0;
+}
+
+/*
+ * Opens the index dumpindex wrote for the given file, if there is one.
+ * Returns 0 on success, -1 if there is no index or it can't be read.
+ */
+int open_index(struct index *ix, const char *file)
+{
+	char path[PATH_MAX];
+	if ((size_t) snprintf(path, sizeof(path), "%s%s", file, INDEX_SUFFIX) >= sizeof(path))
+	{
+		return -1;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	int res = index_open(ix, fd);
+	close(fd);
+	return res;
+}
+
+/*
+ * Prints the records of the given file, which can either be a segment file
+ * or an archive. Segments need to be mapped, hence they can't come from a
+ * pipe; if we can't peek at the file's magic, we assume an archive. When
+ * looking for users or words, the file's index is used if it has one.
+ */
+int read_file(struct metadata *meta, int fd, const char *file)
+{
+	struct index ix = { 0 };
+	int indexed = file && (meta->user || meta->num_words) && open_index(&ix, file) == 0;
+
+	int res;
+	char magic[4];
+	if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, SEGMENT_MAGIC, 4) == 0)
+	{
+		res = read_segment(meta, fd, indexed ? &ix : NULL);
+	}
+	else
+	{
+		res = read_archive(meta, fd, indexed ? &ix : NULL);
+	}
+	index_close(&ix);
+	return res;
+}
+
+void version()
+{
+	fprintf(stdout, "twitch-dumpread version %d.%d.%d - %s\n",
+				VERSION_MAJOR,
+				VERSION_MINOR,
+				VERSION_BUILD,
+				PROJECT_URL);
+}
+
+void help(char *invocation)
+{
+	fprintf(stdout, "Usage:\n");
+	fprintf(stdout, "\t%s [OPTION...] [FILE...]\n", invocation);
+	fprintf(stdout, "\t Note: reads from stdin if no file is given\n");
+	fprintf(stdout, "\t Note: FILE can be an archive (dump -b) or segment (dump -d)\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-c CHANNEL Only show messages sent to this channel.\n");
+	fprintf(stdout, "\t-e TIME Only show messages up to this time.\n");
+	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-k Show the tags that have been kept for every message.\n");
+	fprintf(stdout, "\t-s TIME Only show messages from this time on.\n");
+	fprintf(stdout, "\t-t FORMAT Timestamp format (default: %s).\n", DEFAULT_TIMESTAMP);
+	fprintf(stdout, "\t-u USER Only show messages from this user.\n");
+	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\t-w WORDS Only show messages with these words (can be repeated).\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "TIME is either seconds since the epoch or 'YYYY-MM-DD[ HH:MM[:SS]]'.\n");
+	fprintf(stdout, "With -u or -w, files indexed with dumpindex are searched via the index.\n");
+	fprintf(stdout, "\n");
+	version();
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	struct metadata m = { 0 };
+	m.timestamp = DEFAULT_TIMESTAMP;
+	m.last = -1;
+
+	// Process command line options
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "c:e:s:t:u:w:kvh")) != -1)
+	{
+		switch(o)
+		{
+			case 'c':
+				m.chan = optarg;
+				break;
+			case 'e':
+				if ((m.end = parse_time(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid end time, exiting\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				if ((m.start = parse_time(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid start time, exiting\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				m.timestamp = optarg;
+				break;
+			case 'u':
+				m.user = optarg;
+				break;
+			case 'w':
+				if (add_words(&m, optarg) == -1)
+				{
+					fprintf(stderr, "Too many words, exiting\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'k':
+				m.show_tags = 1;
+				break;
+			case 'v':
+				version();
+				return EXIT_SUCCESS;
+			case 'h':
+				help(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	// No files given, read from stdin
+	if (optind == argc)
+	{
+		if (read_file(&m, STDIN_FILENO, NULL) == -1)
+		{
+			fprintf(stderr, "Error reading archive from stdin\n");
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = optind; i < argc; ++i)
+	{
+		int fd = strcmp(argv[i], "-") == 0 ? STDIN_FILENO : open(argv[i], O_RDONLY);
+		if (fd == -1 || read_file(&m, fd, fd == STDIN_FILENO ? NULL : argv[i]) == -1)
+		{
+			fprintf(stderr, "Error reading archive %s\n", argv[i]);
+			status = EXIT_FAILURE;
+		}
+		if (fd > STDIN_FILENO)
+		{
+			close(fd);
+		}
+	}
+
+	return status;
+}
@@ -0,0 +1,448 @@
+#include <stdlib.h>     // NULL, calloc(), free()
+#include <string.h>     // memset()
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // read(), write(), close()
+#include <time.h>       // clock_gettime()
+#include <sys/epoll.h>  // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/signalfd.h> // signalfd()
+#include <sys/timerfd.h>  // timerfd_create(), timerfd_settime()
+#include <sys/eventfd.h>  // eventfd()
+#include "evloop.h"
+
+/*
+ * EVLOOP_WAKE only has to interrupt epoll_wait() in twirc_tick(), which
+ * always fails with EINTR, even with SA_RESTART. Everything else, like a
+ * send() of libtwirc, gets restarted and doesn't notice a thing.
+ */
+static void wake_handler(int sig)
+{
+}
+
+static struct evloop_watch *add_watch(struct evloop *loop, int fd, enum evloop_kind kind,
+		evloop_callback cb, void *ctx)
+{
+	struct evloop_watch *w = calloc(1, sizeof(struct evloop_watch));
+	if (w == NULL)
+	{
+		return NULL;
+	}
+	w->fd = fd;
+	w->kind = kind;
+	w->cb = cb;
+	w->ctx = ctx;
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		free(w);
+		return NULL;
+	}
+
+	w->next = loop->watches;
+	loop->watches = w;
+	return w;
+}
+
+/*
+ * Frees the watches that have been cancelled. This only happens after all
+ * events have been dispatched, as there might still be events for them.
+ */
+static void collect_watches(struct evloop *loop)
+{
+	struct evloop_watch **link = &loop->watches;
+	while (*link)
+	{
+		struct evloop_watch *w = *link;
+		if (w->removed)
+		{
+			*link = w->next;
+			free(w);
+		}
+		else
+		{
+			link = &w->next;
+		}
+	}
+}
+
+/*
+ * Waits up to 'timeout' milliseconds for events and calls their callbacks.
+ */
+static void dispatch(struct evloop *loop, int timeout)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	int num = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, timeout);
+
+	for (int i = 0; i < num; ++i)
+	{
+		struct evloop_watch *w = events[i].data.ptr;
+		if (w->removed)
+		{
+			continue;
+		}
+
+		uint64_t count;
+		struct signalfd_siginfo si;
+		switch (w->kind)
+		{
+			case EVLOOP_FD:
+				w->cb(loop, w->fd, w->ctx);
+				break;
+			case EVLOOP_TIMER:
+				if (read(w->fd, &count, sizeof(count)) != sizeof(count))
+				{
+					break;
+				}
+				w->cb(loop, w->fd, w->ctx);
+				if (w->oneshot)
+				{
+					evloop_cancel(loop, w->fd);
+				}
+				break;
+			case EVLOOP_SIGNALS:
+				while (read(w->fd, &si, sizeof(si)) == sizeof(si))
+				{
+					loop->on_signal(loop, si.ssi_signo, loop->sig_ctx);
+				}
+				break;
+			case EVLOOP_EVENT:
+				if (read(w->fd, &count, sizeof(count)) == sizeof(count) && loop->on_wake)
+				{
+					loop->on_wake(loop, w->fd, loop->wake_ctx);
+				}
+				break;
+		}
+	}
+
+	collect_watches(loop);
+}
+
+/*
+ * Thread function of the watcher: waits for any of the loop's events and
+ * interrupts the loop's thread until it has handled them. We keep resending
+ * the signal, as it might arrive just before the loop calls twirc_tick().
+ */
+static void *watch(void *arg)
+{
+	struct evloop *loop = arg;
+
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	struct epoll_event ev;
+	for (;;)
+	{
+		int num = epoll_wait(loop->epfd, &ev, 1, -1);
+
+		pthread_mutex_lock(&loop->lock);
+		if (loop->quit)
+		{
+			pthread_mutex_unlock(&loop->lock);
+			break;
+		}
+		if (num > 0)
+		{
+			loop->pending = 1;
+		}
+		while (loop->pending && !loop->quit)
+		{
+			pthread_kill(loop->owner, EVLOOP_WAKE);
+
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += EVLOOP_RETRY_MS * 1000000;
+			if (ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&loop->cond, &loop->lock, &ts);
+		}
+		pthread_mutex_unlock(&loop->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Sets up the loop for the given libtwirc state, which can be NULL. 'tick' is
+ * the longest we let twirc_tick() block; it only matters if something goes
+ * wrong, as the loop is woken up whenever there is something to do.
+ * Returns 0 on success, -1 on error.
+ */
+int evloop_init(struct evloop *loop, twirc_state_t *s, int tick)
+{
+	memset(loop, 0, sizeof(struct evloop));
+	loop->s = s;
+	loop->tick = tick > 0 ? tick : EVLOOP_TICK;
+	loop->sfd = -1;
+	sigemptyset(&loop->sigs);
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1)
+	{
+		return -1;
+	}
+
+	loop->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->efd == -1 || add_watch(loop, loop->efd, EVLOOP_EVENT, NULL, NULL) == NULL)
+	{
+		evloop_free(loop);
+		return -1;
+	}
+
+	struct sigaction sa = {
+		.sa_handler = &wake_handler,
+		.sa_flags = SA_RESTART
+	};
+	sigaction(EVLOOP_WAKE, &sa, NULL);
+	return 0;
+}
+
+/*
+ * Calls 'cb' whenever the file descriptor is readable. The file descriptor
+ * remains ours to close. Returns 0 on success, -1 on error.
+ */
+int evloop_watch(struct evloop *loop, int fd, evloop_callback cb, void *ctx)
+{
+	return add_watch(loop, fd, EVLOOP_FD, cb, ctx) ? 0 : -1;
+}
+
+/*
+ * Calls 'cb' in 'ms' milliseconds and then every 'interval' milliseconds,
+ * or only once if 'interval' is 0. Returns an ID that can be given to
+ * evloop_cancel() on success, -1 on error.
+ */
+int evloop_timer(struct evloop *loop, int ms, int interval, evloop_callback cb, void *ctx)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	// A zero expiration would disarm the timer, so go for the next best
+	struct itimerspec its = {
+		.it_value    = { ms / 1000, (ms % 1000) * 1000000 + (ms <= 0) },
+		.it_interval = { interval / 1000, (interval % 1000) * 1000000 }
+	};
+
+	struct evloop_watch *w;
+	if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+	    (w = add_watch(loop, fd, EVLOOP_TIMER, cb, ctx)) == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+	w->oneshot = interval <= 0;
+	return fd;
+}
+
+/*
+ * Calls 'cb' whenever one of the signals given this way is received. Blocks
+ * the signal for the calling thread, see above. Returns 0 on success, -1 on
+ * error.
+ */
+int evloop_signal(struct evloop *loop, int sig, evloop_signal_callback cb, void *ctx)
+{
+	sigaddset(&loop->sigs, sig);
+	if (pthread_sigmask(SIG_BLOCK, &loop->sigs, NULL) != 0)
+	{
+		return -1;
+	}
+
+	int fd = signalfd(loop->sfd, &loop->sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	if (loop->sfd == -1)
+	{
+		if (add_watch(loop, fd, EVLOOP_SIGNALS, NULL, NULL) == NULL)
+		{
+			close(fd);
+			return -1;
+		}
+		loop->sfd = fd;
+	}
+
+	loop->on_signal = cb;
+	loop->sig_ctx = ctx;
+	return 0;
+}
+
+/*
+ * Calls 'cb' in the loop's thread after evloop_wake() has been called.
+ */
+void evloop_on_wake(struct evloop *loop, evloop_callback cb, void *ctx)
+{
+	loop->on_wake = cb;
+	loop->wake_ctx = ctx;
+}
+
+/*
+ * Calls 'cb' in the loop's thread when the connection is lost, instead of
+ * returning from evloop_run(). The callback should replace the loop's state
+ * or set it to NULL; the lost state is the caller's to free. 'fd' is -1.
+ */
+void evloop_on_lost(struct evloop *loop, evloop_callback cb, void *ctx)
+{
+	loop->on_lost = cb;
+	loop->lost_ctx = ctx;
+}
+
+/*
+ * Stops watching the given file descriptor or timer. Timers are closed,
+ * other file descriptors aren't.
+ */
+void evloop_cancel(struct evloop *loop, int fd)
+{
+	for (struct evloop_watch *w = loop->watches; w; w = w->next)
+	{
+		if (w->fd == fd && !w->removed)
+		{
+			epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+			if (w->kind == EVLOOP_TIMER)
+			{
+				close(fd);
+			}
+			w->removed = 1;
+			w->fd = -1;
+			return;
+		}
+	}
+}
+
+/*
+ * Wakes up the loop, which will call the wake callback, if any. Can be called
+ * from any thread. Returns 0 on success, -1 on error.
+ */
+int evloop_wake(struct evloop *loop)
+{
+	uint64_t one = 1;
+	return write(loop->efd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+/*
+ * Runs the loop until evloop_stop() is called or the connection is lost,
+ * unless there is a callback for the latter, see evloop_on_lost().
+ * Returns 0 if stopped, -1 if the connection has been lost or on error.
+ */
+int evloop_run(struct evloop *loop)
+{
+	loop->owner = pthread_self();
+
+	if (loop->s == NULL)
+	{
+		while (!atomic_load(&loop->stop))
+		{
+			dispatch(loop, -1);
+		}
+		return 0;
+	}
+
+	// Make sure EVLOOP_WAKE gets through to us
+	sigset_t wake;
+	sigemptyset(&wake);
+	sigaddset(&wake, EVLOOP_WAKE);
+	pthread_sigmask(SIG_UNBLOCK, &wake, NULL);
+
+	loop->quit = 0;
+	if (pthread_create(&loop->watcher, NULL, watch, loop) != 0)
+	{
+		return -1;
+	}
+
+	int res = 0;
+	while (!atomic_load(&loop->stop))
+	{
+		pthread_mutex_lock(&loop->lock);
+		int pending = loop->pending;
+		pthread_mutex_unlock(&loop->lock);
+
+		// Between connections, we wait for our events ourselves; the
+		// watcher's signal only makes epoll_wait() return early
+		if (loop->s == NULL)
+		{
+			dispatch(loop, pending ? 0 : loop->tick);
+			pthread_mutex_lock(&loop->lock);
+			loop->pending = 0;
+			pthread_cond_signal(&loop->cond);
+			pthread_mutex_unlock(&loop->lock);
+			continue;
+		}
+
+		// If twirc_tick() fails but we're still connected, it has only
+		// been interrupted by the watcher
+		if (twirc_tick(loop->s, pending ? 0 : loop->tick) != 0 &&
+		    !twirc_is_connected(loop->s))
+		{
+			if (loop->on_lost == NULL)
+			{
+				res = -1;
+				break;
+			}
+			loop->on_lost(loop, -1, loop->lost_ctx);
+			continue;
+		}
+
+		pthread_mutex_lock(&loop->lock);
+		pending = loop->pending;
+		pthread_mutex_unlock(&loop->lock);
+
+		if (pending)
+		{
+			dispatch(loop, 0);
+
+			pthread_mutex_lock(&loop->lock);
+			loop->pending = 0;
+			pthread_cond_signal(&loop->cond);
+			pthread_mutex_unlock(&loop->lock);
+		}
+	}
+
+	// The eventfd gets the watcher out of epoll_wait(), if need be
+	pthread_mutex_lock(&loop->lock);
+	loop->quit = 1;
+	pthread_cond_signal(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+	evloop_wake(loop);
+	pthread_join(loop->watcher, NULL);
+
+	return res;
+}
+
+/*
+ * Makes evloop_run() return. Can be called from any thread.
+ */
+void evloop_stop(struct evloop *loop)
+{
+	atomic_store(&loop->stop, 1);
+	evloop_wake(loop);
+}
+
+/*
+ * Closes the timers and everything else the loop created itself.
+ */
+void evloop_free(struct evloop *loop)
+{
+	for (struct evloop_watch *w = loop->watches; w; w = w->next)
+	{
+		if (!w->removed && w->kind != EVLOOP_FD)
+		{
+			close(w->fd);
+		}
+		w->removed = 1;
+	}
+	collect_watches(loop);
+
+	if (loop->epfd != -1)
+	{
+		close(loop->epfd);
+		loop->epfd = -1;
+	}
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->cond);
+}
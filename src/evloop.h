@@ -0,0 +1,96 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <signal.h>     // sigset_t
+#include <stdatomic.h>  // atomic_int
+#include <pthread.h>    // pthread_t, pthread_mutex_t, pthread_cond_t
+#include "libtwirc.h"
+
+#define EVLOOP_TICK       1000         // Default for the longest twirc_tick()
+#define EVLOOP_MAX_EVENTS 32
+#define EVLOOP_WAKE       (SIGRTMIN)   // Interrupts twirc_tick()
+#define EVLOOP_RETRY_MS   1            // Resend the wake signal this often
+
+struct evloop;
+
+typedef void (*evloop_callback)(struct evloop *loop, int fd, void *ctx);
+typedef void (*evloop_signal_callback)(struct evloop *loop, int sig, void *ctx);
+
+enum evloop_kind
+{
+	EVLOOP_FD,
+	EVLOOP_TIMER,
+	EVLOOP_SIGNALS,
+	EVLOOP_EVENT
+};
+
+/*
+ * Something the loop waits for: a file descriptor given to us, a timer, the
+ * signalfd or the eventfd used to wake the loop from other threads.
+ */
+struct evloop_watch
+{
+	int                  fd;
+	enum evloop_kind     kind;
+	int                  oneshot;    // Timer that only fires once
+	int                  removed;    // Cancelled, free after dispatching
+	evloop_callback      cb;
+	void                *ctx;
+	struct evloop_watch *next;
+};
+
+/*
+ * An event loop that runs a libtwirc state alongside file descriptors,
+ * timers and signals, all handled in the thread that runs the loop.
+ *
+ * libtwirc waits for its socket in twirc_tick() and doesn't let us add
+ * anything to that wait. So a watcher thread waits for everything else and,
+ * once something is ready, interrupts twirc_tick() by sending EVLOOP_WAKE to
+ * the loop's thread. The loop then handles whatever is ready right away,
+ * instead of after up to a whole tick. Signals handed to evloop_signal() are
+ * received via a signalfd, so they have to be blocked in every thread: call
+ * it before creating any threads. Without a libtwirc state, the loop simply
+ * waits for its events itself.
+ *
+ * The state can be swapped, or set to NULL, from within the loop's callbacks
+ * while it runs, as long as it was set when evloop_run() was called. That is
+ * what evloop_on_lost() is for: instead of returning once the connection is
+ * lost, the loop hands over to a callback that can set up a new one.
+ */
+struct evloop
+{
+	twirc_state_t         *s;          // Can be NULL
+	int                    tick;       // Longest twirc_tick() (ms)
+	int                    epfd;
+	int                    sfd;        // signalfd, -1 if no signals
+	int                    efd;        // eventfd for evloop_wake()
+	sigset_t               sigs;       // Signals received via sfd
+	evloop_signal_callback on_signal;
+	void                  *sig_ctx;
+	evloop_callback        on_wake;    // Called after evloop_wake()
+	void                  *wake_ctx;
+	evloop_callback        on_lost;    // Called when the connection is lost
+	void                  *lost_ctx;
+	struct evloop_watch   *watches;
+	atomic_int             stop;       // Set by evloop_stop()
+	pthread_t              owner;      // Thread running the loop
+	pthread_t              watcher;
+	pthread_mutex_t        lock;
+	pthread_cond_t         cond;
+	int                    pending;    // Watcher saw events, not yet handled
+	int                    quit;       // Tells the watcher to quit
+};
+
+int  evloop_init(struct evloop *loop, twirc_state_t *s, int tick);
+int  evloop_watch(struct evloop *loop, int fd, evloop_callback cb, void *ctx);
+int  evloop_timer(struct evloop *loop, int ms, int interval, evloop_callback cb, void *ctx);
+int  evloop_signal(struct evloop *loop, int sig, evloop_signal_callback cb, void *ctx);
+void evloop_on_wake(struct evloop *loop, evloop_callback cb, void *ctx);
+void evloop_on_lost(struct evloop *loop, evloop_callback cb, void *ctx);
+void evloop_cancel(struct evloop *loop, int fd);
+int  evloop_wake(struct evloop *loop);
+int  evloop_run(struct evloop *loop);
+void evloop_stop(struct evloop *loop);
+void evloop_free(struct evloop *loop);
+
+#endif
@@ -0,0 +1,696 @@
+#include <stdio.h>      // FILE, fopen(), fgets(), fclose()
+#include <stdlib.h>     // NULL, malloc(), calloc(), realloc(), free(), qsort(), bsearch()
+#include <string.h>     // strlen(), strcmp(), strncmp(), strndup(), strspn(), strchr(), memset(), memcpy()
+#include <stdint.h>     // uint8_t, uint32_t, UINT32_MAX
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // _mm_shuffle_epi8(), _mm256_shuffle_epi8() et al.
+#define FILTER_X86
+#endif
+#include "filter.h"
+
+/*
+ * Lowercases ASCII letters only, so that all engines agree on what matches,
+ * no matter the locale.
+ */
+static unsigned char fold(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static int equal_fold(const char *str, const char *word, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (fold(str[i]) != (unsigned char) word[i])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Makes sure there is room for one more element in the array pointed to by
+ * 'arr', doubling its capacity if needed. Returns 0 on success, -1 on error.
+ */
+static int reserve(void *arr, size_t *cap, size_t num, size_t size)
+{
+	if (num < *cap)
+	{
+		return 0;
+	}
+	size_t new_cap = *cap ? *cap * 2 : 16;
+	void *res = realloc(*(void **) arr, new_cap * size);
+	if (res == NULL)
+	{
+		return -1;
+	}
+	*(void **) arr = res;
+	*cap = new_cap;
+	return 0;
+}
+
+static char *copy_fold(const char *str, size_t len)
+{
+	char *copy = malloc(len + 1);
+	if (copy == NULL)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < len; ++i)
+	{
+		copy[i] = fold(str[i]);
+	}
+	copy[len] = '\0';
+	return copy;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Sets up an empty filter, which lets everything pass. Returns 0.
+ */
+int filter_init(struct filter *f)
+{
+	memset(f, 0, sizeof(struct filter));
+	return 0;
+}
+
+static int add_regex(struct filter *f, const char *str, size_t len)
+{
+	if (reserve(&f->regexes, &f->cap_regexes, f->num_regexes, sizeof(regex_t)) == -1)
+	{
+		return -1;
+	}
+	char *pattern = strndup(str, len);
+	if (pattern == NULL)
+	{
+		return -1;
+	}
+	int res = regcomp(&f->regexes[f->num_regexes], pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	free(pattern);
+	if (res != 0)
+	{
+		return -1;
+	}
+	f->num_regexes += 1;
+	return 0;
+}
+
+static int add_name(char ***names, size_t *num, size_t *cap, const char *str)
+{
+	if (reserve(names, cap, *num, sizeof(char *)) == -1)
+	{
+		return -1;
+	}
+	char *copy = copy_fold(str, strlen(str));
+	if (copy == NULL)
+	{
+		return -1;
+	}
+	(*names)[(*num)++] = copy;
+	return 0;
+}
+
+/*
+ * Adds a keyword, a user to allow or a user to deny. Keywords are found
+ * anywhere in the message, ignoring case; a keyword like "/regex/" is an
+ * extended regular expression instead, which is a lot slower. Call
+ * filter_compile() once everything has been added. Returns 0 on success,
+ * -1 on error or if the keyword is empty or the regex invalid.
+ */
+int filter_add(struct filter *f, enum filter_list list, const char *str)
+{
+	size_t len = strlen(str);
+	if (len == 0)
+	{
+		return -1;
+	}
+	if (list == FILTER_ALLOW)
+	{
+		return add_name(&f->allow, &f->num_allow, &f->cap_allow, str);
+	}
+	if (list == FILTER_DENY)
+	{
+		return add_name(&f->deny, &f->num_deny, &f->cap_deny, str);
+	}
+
+	if (len > 2 && str[0] == '/' && str[len - 1] == '/')
+	{
+		return add_regex(f, str + 1, len - 2);
+	}
+	if (reserve(&f->words, &f->cap_words, f->num_words, sizeof(struct filter_word)) == -1)
+	{
+		return -1;
+	}
+	char *copy = copy_fold(str, len);
+	if (copy == NULL)
+	{
+		return -1;
+	}
+	f->words[f->num_words].str = copy;
+	f->words[f->num_words].len = len;
+	f->num_words += 1;
+	return 0;
+}
+
+/*
+ * Adds the keywords or users in the given file, one per line. Empty lines and
+ * whitespace around the line are ignored. Returns the number of entries
+ * added, or -1 on error.
+ */
+int filter_read(struct filter *f, enum filter_list list, const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	int num = 0;
+	char buf[FILTER_LINE];
+	while (fgets(buf, FILTER_LINE, fp) != NULL)
+	{
+		char *str = buf + strspn(buf, " \t\r\n");
+		size_t len = strlen(str);
+		while (len > 0 && strchr(" \t\r\n", str[len - 1]))
+		{
+			--len;
+		}
+		if (len == 0)
+		{
+			continue;
+		}
+		str[len] = '\0';
+
+		if (filter_add(f, list, str) == -1)
+		{
+			fclose(fp);
+			return -1;
+		}
+		++num;
+	}
+
+	fclose(fp);
+	return num;
+}
+
+/*
+ * Builds the Aho-Corasick automaton of all keywords as a complete table, so
+ * that matching takes exactly one lookup per byte. Returns 0 on success, -1
+ * on error.
+ */
+static int build_ac(struct filter *f)
+{
+	struct filter_ac *ac = &f->ac;
+
+	// Bytes that are in no keyword all share class 0
+	size_t max_states = 1;
+	ac->num_classes = 1;
+	for (size_t i = 0; i < f->num_words; ++i)
+	{
+		for (size_t j = 0; j < f->words[i].len; ++j)
+		{
+			unsigned char c = f->words[i].str[j];
+			if (ac->classes[c] == 0)
+			{
+				ac->classes[c] = ac->num_classes++;
+				if (c >= 'a' && c <= 'z')
+				{
+					ac->classes[c - 'a' + 'A'] = ac->classes[c];
+				}
+			}
+		}
+		max_states += f->words[i].len;
+	}
+
+	size_t nc = ac->num_classes;
+	if (max_states > FILTER_AC_MATCH / nc)
+	{
+		return -1;
+	}
+	ac->next = calloc(max_states * nc, sizeof(uint32_t));
+	uint8_t *match = calloc(max_states, 1);
+	uint32_t *fail = calloc(max_states, sizeof(uint32_t));
+	uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+	if (ac->next == NULL || match == NULL || fail == NULL || queue == NULL)
+	{
+		free(match);
+		free(fail);
+		free(queue);
+		return -1;
+	}
+
+	// The trie; the root is never the target of an edge, so 0 means none
+	ac->num_states = 1;
+	for (size_t i = 0; i < f->num_words; ++i)
+	{
+		uint32_t s = 0;
+		for (size_t j = 0; j < f->words[i].len; ++j)
+		{
+			uint32_t *edge = &ac->next[s * nc + ac->classes[(unsigned char) f->words[i].str[j]]];
+			if (*edge == 0)
+			{
+				*edge = ac->num_states++;
+			}
+			s = *edge;
+		}
+		match[s] = 1;
+	}
+
+	// Breadth first, so the states we fall back to are complete already;
+	// missing edges become the edges of the state we'd fall back to
+	size_t head = 0;
+	size_t tail = 0;
+	for (size_t c = 1; c < nc; ++c)
+	{
+		if (ac->next[c])
+		{
+			queue[tail++] = ac->next[c];
+		}
+	}
+	while (head < tail)
+	{
+		uint32_t s = queue[head++];
+		uint32_t *row = &ac->next[s * nc];
+		const uint32_t *fallback = &ac->next[fail[s] * nc];
+		for (size_t c = 0; c < nc; ++c)
+		{
+			if (row[c])
+			{
+				fail[row[c]] = fallback[c];
+				match[row[c]] |= match[fallback[c]];
+				queue[tail++] = row[c];
+			}
+			else
+			{
+				row[c] = fallback[c];
+			}
+		}
+	}
+
+	// States become the offset of their row, so the next one is found
+	// with one addition; as the first match is all we need, edges into
+	// states where a keyword ends don't need to go anywhere
+	for (size_t i = 0; i < ac->num_states * nc; ++i)
+	{
+		uint32_t t = ac->next[i];
+		ac->next[i] = match[t] ? FILTER_AC_MATCH : t * nc;
+	}
+
+	free(match);
+	free(fail);
+	free(queue);
+	return 0;
+}
+
+static int compare_prefixes(const void *a, const void *b)
+{
+	const struct filter_word *wa = a;
+	const struct filter_word *wb = b;
+	return strncmp(wa->str, wb->str, FILTER_FINGERPRINT);
+}
+
+/*
+ * Spreads the keywords over the buckets and fills in the nibble tables.
+ * Keywords that start the same go into the same bucket, so that they don't
+ * make other buckets' keywords candidates as well. Returns 0 on success, -1
+ * on error.
+ */
+static int build_teddy(struct filter *f)
+{
+	struct filter_teddy *t = &f->teddy;
+
+	t->len = FILTER_FINGERPRINT;
+	for (size_t i = 0; i < f->num_words; ++i)
+	{
+		if (f->words[i].len < t->len)
+		{
+			t->len = f->words[i].len;
+		}
+	}
+
+	// Sort a copy, the keywords themselves are referred to by index
+	struct filter_word *sorted = malloc(f->num_words * sizeof(struct filter_word));
+	t->words = malloc(f->num_words * sizeof(uint32_t));
+	if (sorted == NULL || t->words == NULL)
+	{
+		free(sorted);
+		return -1;
+	}
+	for (size_t i = 0; i < f->num_words; ++i)
+	{
+		sorted[i].str = f->words[i].str;
+		sorted[i].len = i;
+	}
+	qsort(sorted, f->num_words, sizeof(struct filter_word), compare_prefixes);
+
+	for (size_t b = 0; b <= FILTER_BUCKETS; ++b)
+	{
+		t->start[b] = b * f->num_words / FILTER_BUCKETS;
+	}
+	for (size_t b = 0; b < FILTER_BUCKETS; ++b)
+	{
+		for (size_t i = t->start[b]; i < t->start[b + 1]; ++i)
+		{
+			t->words[i] = sorted[i].len;
+			for (size_t k = 0; k < t->len; ++k)
+			{
+				unsigned char c = sorted[i].str[k];
+				unsigned char u = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+				t->lo[k][c & 0x0f] |= 1 << b;
+				t->hi[k][c >> 4] |= 1 << b;
+				t->lo[k][u & 0x0f] |= 1 << b;
+				t->hi[k][u >> 4] |= 1 << b;
+			}
+		}
+	}
+
+	free(sorted);
+	return 0;
+}
+
+/*
+ * Sorts the user lists and picks the fastest way to find the keywords this
+ * CPU supports: Teddy for up to FILTER_TEDDY_MAX of them, Aho-Corasick for
+ * more, or if the CPU can't do Teddy. Returns 0 on success, -1 on error.
+ */
+int filter_compile(struct filter *f)
+{
+	if (f->num_allow)
+	{
+		qsort(f->allow, f->num_allow, sizeof(char *), compare_names);
+	}
+	if (f->num_deny)
+	{
+		qsort(f->deny, f->num_deny, sizeof(char *), compare_names);
+	}
+
+	if (f->num_words == 0)
+	{
+		f->engine = FILTER_NONE;
+		return 0;
+	}
+
+	// Teddy needs Aho-Corasick for CPUs without SSSE3 anyway
+	if (build_ac(f) == -1)
+	{
+		return -1;
+	}
+	f->engine = FILTER_AC;
+
+#ifdef FILTER_X86
+	if (f->num_words <= FILTER_TEDDY_MAX)
+	{
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("ssse3") && build_teddy(f) == -1)
+		{
+			return -1;
+		}
+		if (__builtin_cpu_supports("avx2"))
+		{
+			f->engine = FILTER_AVX2;
+		}
+		else if (__builtin_cpu_supports("ssse3"))
+		{
+			f->engine = FILTER_SSSE3;
+		}
+	}
+#endif
+	return 0;
+}
+
+static int match_ac(const struct filter_ac *ac, const char *str, size_t len)
+{
+	uint32_t s = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		s = ac->next[s + ac->classes[(unsigned char) str[i]]];
+		if (s == FILTER_AC_MATCH)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compares the keywords of the given buckets with the message at 'pos'.
+ */
+static int verify(const struct filter *f, const char *str, size_t len, size_t pos, unsigned buckets)
+{
+	const struct filter_teddy *t = &f->teddy;
+	while (buckets)
+	{
+		int b = __builtin_ctz(buckets);
+		buckets &= buckets - 1;
+		for (size_t i = t->start[b]; i < t->start[b + 1]; ++i)
+		{
+			const struct filter_word *w = &f->words[t->words[i]];
+			if (w->len <= len - pos && equal_fold(str + pos, w->str, w->len))
+			{
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Verifies all candidates of a block that starts at 'pos', one bit each in
+ * 'cand', with the buckets they are candidates for in 'buckets'.
+ */
+static int verify_block(const struct filter *f, const char *str, size_t len, size_t pos,
+		uint32_t cand, const uint8_t *buckets)
+{
+	while (cand)
+	{
+		int i = __builtin_ctz(cand);
+		cand &= cand - 1;
+		if (verify(f, str, len, pos + i, buckets[i]))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#ifdef FILTER_X86
+/*
+ * Finds the candidates among the 16 positions starting at 'block', which
+ * has to have t->len - 1 bytes more to read. Returns one bit per candidate
+ * and writes their buckets to 'buckets'.
+ */
+__attribute__((target("ssse3")))
+static uint32_t block_ssse3(const struct filter_teddy *t, const __m128i *lo, const __m128i *hi,
+		const char *block, uint8_t *buckets)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i res = _mm_set1_epi8((char) 0xff);
+	for (size_t k = 0; k < t->len; ++k)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *) (block + k));
+		__m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(c, nibble));
+		__m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(c, 4), nibble));
+		res = _mm_and_si128(res, _mm_and_si128(l, h));
+	}
+	_mm_storeu_si128((__m128i *) buckets, res);
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(res, _mm_setzero_si128())) & 0xffff;
+}
+
+__attribute__((target("ssse3")))
+static int match_teddy_ssse3(const struct filter *f, const char *str, size_t len)
+{
+	const struct filter_teddy *t = &f->teddy;
+	__m128i lo[FILTER_FINGERPRINT];
+	__m128i hi[FILTER_FINGERPRINT];
+	for (size_t k = 0; k < t->len; ++k)
+	{
+		lo[k] = _mm_loadu_si128((const __m128i *) t->lo[k]);
+		hi[k] = _mm_loadu_si128((const __m128i *) t->hi[k]);
+	}
+
+	uint8_t buckets[16];
+	size_t pos = 0;
+	for (; pos + 16 + t->len - 1 <= len; pos += 16)
+	{
+		uint32_t cand = block_ssse3(t, lo, hi, str + pos, buckets);
+		if (cand && verify_block(f, str, len, pos, cand, buckets))
+		{
+			return 1;
+		}
+	}
+
+	// Chat messages are short, so the rest is often most of it: it goes
+	// through the same steps, from a padded copy; positions that would
+	// look at the padding are ignored
+	if (pos + t->len <= len)
+	{
+		char rest[16 + FILTER_FINGERPRINT - 1] = { 0 };
+		memcpy(rest, str + pos, len - pos);
+		uint32_t cand = block_ssse3(t, lo, hi, rest, buckets) & ((1u << (len - pos - t->len + 1)) - 1);
+		return cand && verify_block(f, str, len, pos, cand, buckets);
+	}
+	return 0;
+}
+
+/*
+ * Like block_ssse3(), for 32 positions.
+ */
+__attribute__((target("avx2")))
+static uint32_t block_avx2(const struct filter_teddy *t, const __m256i *lo, const __m256i *hi,
+		const char *block, uint8_t *buckets)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i res = _mm256_set1_epi8((char) 0xff);
+	for (size_t k = 0; k < t->len; ++k)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *) (block + k));
+		__m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(c, nibble));
+		__m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+		res = _mm256_and_si256(res, _mm256_and_si256(l, h));
+	}
+	_mm256_storeu_si256((__m256i *) buckets, res);
+	return ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(res, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static int match_teddy_avx2(const struct filter *f, const char *str, size_t len)
+{
+	const struct filter_teddy *t = &f->teddy;
+	__m256i lo[FILTER_FINGERPRINT];
+	__m256i hi[FILTER_FINGERPRINT];
+	for (size_t k = 0; k < t->len; ++k)
+	{
+		// Shuffles only work within 16 byte lanes, so both get the table
+		lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->lo[k]));
+		hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->hi[k]));
+	}
+
+	uint8_t buckets[32];
+	size_t pos = 0;
+	for (; pos + 32 + t->len - 1 <= len; pos += 32)
+	{
+		uint32_t cand = block_avx2(t, lo, hi, str + pos, buckets);
+		if (cand && verify_block(f, str, len, pos, cand, buckets))
+		{
+			return 1;
+		}
+	}
+	if (pos + t->len <= len)
+	{
+		char rest[32 + FILTER_FINGERPRINT - 1] = { 0 };
+		memcpy(rest, str + pos, len - pos);
+		uint32_t cand = block_avx2(t, lo, hi, rest, buckets) & ((1u << (len - pos - t->len + 1)) - 1);
+		return cand && verify_block(f, str, len, pos, cand, buckets);
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Returns 1 if any of the keywords (not the regexes) is in the given string.
+ */
+int filter_words(const struct filter *f, const char *str, size_t len)
+{
+	switch (f->engine)
+	{
+#ifdef FILTER_X86
+		case FILTER_AVX2:
+			return match_teddy_avx2(f, str, len);
+		case FILTER_SSSE3:
+			return match_teddy_ssse3(f, str, len);
+#endif
+		case FILTER_AC:
+			return match_ac(&f->ac, str, len);
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Returns 1 if the message passes the filter: the user is allowed (if there
+ * is a list of users to allow), not denied, and the message has one of the
+ * keywords or matches one of the regexes (if there are any).
+ */
+int filter_match(const struct filter *f, const char *origin, const char *message)
+{
+	if (origin == NULL)
+	{
+		origin = "";
+	}
+	if (f->num_allow && !bsearch(&origin, f->allow, f->num_allow, sizeof(char *), compare_names))
+	{
+		return 0;
+	}
+	if (f->num_deny && bsearch(&origin, f->deny, f->num_deny, sizeof(char *), compare_names))
+	{
+		return 0;
+	}
+	if (f->num_words == 0 && f->num_regexes == 0)
+	{
+		return 1;
+	}
+	if (message == NULL)
+	{
+		return 0;
+	}
+
+	if (filter_words(f, message, strlen(message)))
+	{
+		return 1;
+	}
+	for (size_t i = 0; i < f->num_regexes; ++i)
+	{
+		if (regexec(&f->regexes[i], message, 0, NULL, 0) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+const char *filter_engine_name(enum filter_engine engine)
+{
+	switch (engine)
+	{
+		case FILTER_AVX2:
+			return "Teddy (AVX2)";
+		case FILTER_SSSE3:
+			return "Teddy (SSSE3)";
+		case FILTER_AC:
+			return "Aho-Corasick";
+		default:
+			return "none";
+	}
+}
+
+void filter_free(struct filter *f)
+{
+	for (size_t i = 0; i < f->num_words; ++i)
+	{
+		free(f->words[i].str);
+	}
+	for (size_t i = 0; i < f->num_regexes; ++i)
+	{
+		regfree(&f->regexes[i]);
+	}
+	for (size_t i = 0; i < f->num_allow; ++i)
+	{
+		free(f->allow[i]);
+	}
+	for (size_t i = 0; i < f->num_deny; ++i)
+	{
+		free(f->deny[i]);
+	}
+	free(f->words);
+	free(f->regexes);
+	free(f->allow);
+	free(f->deny);
+	free(f->teddy.words);
+	free(f->ac.next);
+	memset(f, 0, sizeof(struct filter));
+}
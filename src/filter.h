@@ -0,0 +1,94 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint8_t, uint32_t
+#include <regex.h>      // regex_t
+
+#define FILTER_TEDDY_MAX  24    // More keywords than this go to Aho-Corasick
+#define FILTER_BUCKETS    8     // Teddy buckets, one bit each
+#define FILTER_FINGERPRINT 3    // Most bytes Teddy looks at per position
+#define FILTER_LINE       512   // Longest line in keyword and user files
+#define FILTER_AC_MATCH   UINT32_MAX
+
+enum filter_list
+{
+	FILTER_WORDS,     // Keywords, or /regexes/, one of which has to match
+	FILTER_ALLOW,     // Only messages of these users pass
+	FILTER_DENY       // Messages of these users never pass
+};
+
+enum filter_engine
+{
+	FILTER_NONE,      // No keywords, every message matches
+	FILTER_AC,        // Aho-Corasick automaton, one byte at a time
+	FILTER_SSSE3,     // Teddy, 16 bytes at a time
+	FILTER_AVX2       // Teddy, 32 bytes at a time
+};
+
+/*
+ * Teddy, as in Hyperscan and Rust's regex crate, finds where keywords could
+ * start by looking at the first few bytes of every position at once. Their
+ * low and high nibbles are looked up in a table with a shuffle instruction,
+ * each giving a bit per bucket of keywords that have such a nibble there.
+ * Positions where all lookups share a bit are candidates, and only the
+ * keywords of those buckets are compared there. With few keywords, that is
+ * rare, so most of the message is skipped 16 or 32 bytes at a time.
+ */
+struct filter_teddy
+{
+	uint8_t   lo[FILTER_FINGERPRINT][16]; // Low nibble => buckets
+	uint8_t   hi[FILTER_FINGERPRINT][16]; // High nibble => buckets
+	size_t    len;                        // Bytes looked at, 1 to 3
+	uint32_t *words;                      // Keywords, grouped by bucket
+	size_t    start[FILTER_BUCKETS + 1];  // Where every bucket's group starts
+};
+
+/*
+ * With many keywords, Teddy finds candidates everywhere. Aho-Corasick looks
+ * at every byte, but only once, no matter how many keywords there are. Bytes
+ * that are in no keyword share a class, so the transition table stays small.
+ */
+struct filter_ac
+{
+	uint8_t   classes[256];  // Byte => class, letters ignore case
+	size_t    num_classes;
+	uint32_t *next;          // State + class => state, or FILTER_AC_MATCH
+	size_t    num_states;
+};
+
+struct filter_word
+{
+	char   *str;             // Lower case
+	size_t  len;
+};
+
+struct filter
+{
+	struct filter_word  *words;
+	size_t               num_words;
+	size_t               cap_words;
+	regex_t             *regexes;
+	size_t               num_regexes;
+	size_t               cap_regexes;
+	char               **allow;      // Sorted after filter_compile()
+	size_t               num_allow;
+	size_t               cap_allow;
+	char               **deny;       // Sorted after filter_compile()
+	size_t               num_deny;
+	size_t               cap_deny;
+	enum filter_engine   engine;
+	struct filter_teddy  teddy;
+	struct filter_ac     ac;
+};
+
+int  filter_init(struct filter *f);
+int  filter_add(struct filter *f, enum filter_list list, const char *str);
+int  filter_read(struct filter *f, enum filter_list list, const char *file);
+int  filter_compile(struct filter *f);
+int  filter_match(const struct filter *f, const char *origin, const char *message);
+int  filter_words(const struct filter *f, const char *str, size_t len);
+const char *filter_engine_name(enum filter_engine engine);
+void filter_free(struct filter *f);
+
+#endif
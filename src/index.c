@@ -0,0 +1,561 @@
+#include <stdio.h>      // FILE, fopen(), fwrite(), fclose(), rename(), remove()
+#include <stdlib.h>     // NULL, malloc(), calloc(), realloc(), free(), qsort()
+#include <string.h>     // memset(), memcpy(), memcmp(), strlen()
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/stat.h>   // fstat()
+#include <limits.h>     // PATH_MAX
+#include "index.h"
+
+/*
+ * A term while the index is being built: its postings grow as records come
+ * in, already encoded as they'll be written.
+ */
+struct index_term
+{
+	uint64_t       hash;
+	uint64_t       last;      // ID of the last record added
+	uint32_t       count;
+	unsigned char *post;
+	size_t         post_len;
+	size_t         post_size;
+	size_t         len;
+	char           str[];
+};
+
+static int is_word(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+static char lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/*
+ * Finds the next word in 'str', starting at 'pos', and writes it to 'word'
+ * (INDEX_MAX_TERM bytes), lowercased. Words are made of letters, digits,
+ * underscores and anything that isn't ASCII, so UTF-8 is kept together.
+ * Words that are too long are skipped. Returns the length of the word and
+ * moves 'pos' past it, or returns 0 if there are no more words.
+ */
+size_t index_word(const char *str, size_t len, size_t *pos, char *word)
+{
+	size_t i = *pos;
+	while (i < len)
+	{
+		while (i < len && !is_word(str[i]))
+		{
+			++i;
+		}
+		size_t start = i;
+		while (i < len && is_word(str[i]))
+		{
+			++i;
+		}
+		if (i > start && i - start <= INDEX_MAX_TERM)
+		{
+			for (size_t j = start; j < i; ++j)
+			{
+				word[j - start] = lower(str[j]);
+			}
+			*pos = i;
+			return i - start;
+		}
+	}
+	*pos = len;
+	return 0;
+}
+
+/*
+ * Writes a term made of the prefix and the (lowercased) string to 'term'
+ * (INDEX_MAX_TERM bytes), like "u:name". Returns its length, 0 if it's too
+ * long.
+ */
+size_t index_term(char *term, const char *prefix, const char *str, size_t len)
+{
+	size_t plen = strlen(prefix);
+	if (len == 0 || plen + len > INDEX_MAX_TERM)
+	{
+		return 0;
+	}
+	memcpy(term, prefix, plen);
+	for (size_t i = 0; i < len; ++i)
+	{
+		term[plen + i] = lower(str[i]);
+	}
+	return plen + len;
+}
+
+static uint64_t hash_term(const char *str, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash = (hash ^ (unsigned char) str[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Makes sure there is room for 'more' bytes in the buffer. Returns 0 on
+ * success, -1 on error.
+ */
+static int reserve(void *buf, size_t *size, size_t len, size_t more)
+{
+	if (len + more <= *size)
+	{
+		return 0;
+	}
+	size_t cap = *size ? *size : 16;
+	while (cap < len + more)
+	{
+		cap *= 2;
+	}
+	void *tmp = realloc(*(void **) buf, cap);
+	if (tmp == NULL)
+	{
+		return -1;
+	}
+	*(void **) buf = tmp;
+	*size = cap;
+	return 0;
+}
+
+/*
+ * Doubles the size of the term table. Returns 0 on success, -1 on error.
+ */
+static int grow(struct index_builder *b)
+{
+	size_t cap = b->cap * 2;
+	struct index_term **table = calloc(cap, sizeof(struct index_term *));
+	if (table == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < b->cap; ++i)
+	{
+		struct index_term *t = b->table[i];
+		if (t == NULL)
+		{
+			continue;
+		}
+		size_t pos = t->hash & (cap - 1);
+		while (table[pos])
+		{
+			pos = (pos + 1) & (cap - 1);
+		}
+		table[pos] = t;
+	}
+	free(b->table);
+	b->table = table;
+	b->cap = cap;
+	return 0;
+}
+
+/*
+ * Adds the record 'doc' to the postings of the term, unless it's already in
+ * there. Returns 0 on success, -1 on error.
+ */
+static int add_term(struct index_builder *b, const char *str, size_t len, uint64_t doc)
+{
+	if ((b->num_terms + 1) * 4 > b->cap * 3 && grow(b) == -1)
+	{
+		return -1;
+	}
+
+	uint64_t hash = hash_term(str, len);
+	size_t pos = hash & (b->cap - 1);
+	struct index_term *t;
+	while ((t = b->table[pos]))
+	{
+		if (t->hash == hash && t->len == len && memcmp(t->str, str, len) == 0)
+		{
+			break;
+		}
+		pos = (pos + 1) & (b->cap - 1);
+	}
+
+	if (t == NULL)
+	{
+		t = calloc(1, sizeof(struct index_term) + len);
+		if (t == NULL)
+		{
+			return -1;
+		}
+		t->hash = hash;
+		t->len = len;
+		memcpy(t->str, str, len);
+		b->table[pos] = t;
+		b->num_terms += 1;
+	}
+	else if (t->last == doc)
+	{
+		return 0;
+	}
+
+	// Varints take up to 10 bytes
+	if (reserve(&t->post, &t->post_size, t->post_len, 10) == -1)
+	{
+		return -1;
+	}
+	uint64_t delta = t->count ? doc - t->last : doc;
+	do
+	{
+		unsigned char byte = delta & 0x7f;
+		delta >>= 7;
+		t->post[t->post_len++] = byte | (delta ? 0x80 : 0);
+	}
+	while (delta);
+
+	t->last = doc;
+	t->count += 1;
+	return 0;
+}
+
+/*
+ * Returns 0 on success, -1 on error.
+ */
+int index_builder_init(struct index_builder *b)
+{
+	memset(b, 0, sizeof(struct index_builder));
+	b->cap = 1024;
+	b->table = calloc(b->cap, sizeof(struct index_term *));
+	return b->table ? 0 : -1;
+}
+
+/*
+ * Adds the next record of the file, which is found at 'where' (see index.h).
+ * Returns 0 on success, -1 on error.
+ */
+int index_add(struct index_builder *b, const struct record *r, uint64_t where)
+{
+	if (reserve(&b->docs, &b->docs_size, b->docs_len, INDEX_DOC) == -1)
+	{
+		return -1;
+	}
+	put_u64(b->docs + b->docs_len, r->time);
+	put_u64(b->docs + b->docs_len + 8, where);
+	b->docs_len += INDEX_DOC;
+
+	uint64_t doc = b->num_docs++;
+	if (b->first == 0 || r->time < b->first)
+	{
+		b->first = r->time;
+	}
+	if (r->time > b->last)
+	{
+		b->last = r->time;
+	}
+
+	char term[INDEX_MAX_TERM];
+	size_t len;
+	if ((len = index_term(term, "u:", r->origin.str, r->origin.len)) &&
+	    add_term(b, term, len, doc) == -1)
+	{
+		return -1;
+	}
+	if ((len = index_term(term, "c:", r->channel.str, r->channel.len)) &&
+	    add_term(b, term, len, doc) == -1)
+	{
+		return -1;
+	}
+
+	size_t pos = 0;
+	while ((len = index_word(r->message.str, r->message.len, &pos, term)))
+	{
+		if (add_term(b, term, len, doc) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int compare_terms(const void *a, const void *b)
+{
+	const struct index_term *ta = *(const struct index_term **) a;
+	const struct index_term *tb = *(const struct index_term **) b;
+	int cmp = memcmp(ta->str, tb->str, ta->len < tb->len ? ta->len : tb->len);
+	if (cmp != 0)
+	{
+		return cmp;
+	}
+	return ta->len < tb->len ? -1 : ta->len > tb->len;
+}
+
+/*
+ * Writes the index to 'path', via a temporary file that replaces it once
+ * it's complete, so readers never see half an index. 'extent' is the size of
+ * the data the index covers. Returns 0 on success, -1 on error.
+ */
+int index_write(struct index_builder *b, const char *path, uint64_t extent)
+{
+	char tmp[PATH_MAX];
+	if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+	{
+		return -1;
+	}
+
+	// Collect the terms and put them in order
+	struct index_term **terms = malloc((b->num_terms ? b->num_terms : 1) * sizeof(struct index_term *));
+	if (terms == NULL)
+	{
+		return -1;
+	}
+	size_t n = 0;
+	uint64_t strings_len = 0;
+	for (size_t i = 0; i < b->cap; ++i)
+	{
+		if (b->table[i])
+		{
+			terms[n++] = b->table[i];
+			strings_len += b->table[i]->len;
+		}
+	}
+	qsort(terms, n, sizeof(struct index_term *), compare_terms);
+
+	uint64_t terms_at = INDEX_HEADER + b->docs_len;
+	uint64_t strings_at = terms_at + n * INDEX_TERM;
+	uint64_t postings_at = strings_at + strings_len;
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL)
+	{
+		free(terms);
+		return -1;
+	}
+
+	char header[INDEX_HEADER] = { 0 };
+	memcpy(header, INDEX_MAGIC, 4);
+	header[4] = INDEX_VERSION;
+	put_u64(header + 8, extent);
+	put_u64(header + 16, b->num_docs);
+	put_u64(header + 24, b->first);
+	put_u64(header + 32, b->last);
+	put_u32(header + 40, n);
+	put_u64(header + 48, terms_at);
+	put_u64(header + 56, strings_at);
+	put_u64(header + 64, postings_at);
+	fwrite(header, 1, INDEX_HEADER, fp);
+	fwrite(b->docs, 1, b->docs_len, fp);
+
+	uint64_t post = 0;
+	uint32_t str = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		char entry[INDEX_TERM];
+		put_u64(entry, post);
+		put_u32(entry + 8, terms[i]->post_len);
+		put_u32(entry + 12, terms[i]->count);
+		put_u32(entry + 16, str);
+		put_u32(entry + 20, terms[i]->len);
+		fwrite(entry, 1, INDEX_TERM, fp);
+		post += terms[i]->post_len;
+		str += terms[i]->len;
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		fwrite(terms[i]->str, 1, terms[i]->len, fp);
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		fwrite(terms[i]->post, 1, terms[i]->post_len, fp);
+	}
+	free(terms);
+
+	int failed = ferror(fp);
+	failed |= fclose(fp) != 0;
+	if (failed || rename(tmp, path) == -1)
+	{
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void index_builder_free(struct index_builder *b)
+{
+	for (size_t i = 0; i < b->cap; ++i)
+	{
+		if (b->table[i])
+		{
+			free(b->table[i]->post);
+			free(b->table[i]);
+		}
+	}
+	free(b->table);
+	free(b->docs);
+	memset(b, 0, sizeof(struct index_builder));
+}
+
+/*
+ * Maps the index for reading. Returns 0 on success, -1 if this doesn't look
+ * like an index we can read.
+ */
+int index_open(struct index *ix, int fd)
+{
+	memset(ix, 0, sizeof(struct index));
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < INDEX_HEADER)
+	{
+		return -1;
+	}
+	ix->size = st.st_size;
+	void *map = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		return -1;
+	}
+	ix->map = map;
+
+	if (memcmp(ix->map, INDEX_MAGIC, 4) != 0 || ix->map[4] != INDEX_VERSION)
+	{
+		index_close(ix);
+		return -1;
+	}
+	ix->extent = get_u64(ix->map + 8);
+	ix->num_docs = get_u64(ix->map + 16);
+	ix->first = get_u64(ix->map + 24);
+	ix->last = get_u64(ix->map + 32);
+	ix->num_terms = get_u32(ix->map + 40);
+	uint64_t terms_at = get_u64(ix->map + 48);
+	uint64_t strings_at = get_u64(ix->map + 56);
+	uint64_t postings_at = get_u64(ix->map + 64);
+
+	// Everything has to be where the header says it is
+	if (terms_at != INDEX_HEADER + ix->num_docs * INDEX_DOC ||
+	    strings_at != terms_at + (uint64_t) ix->num_terms * INDEX_TERM ||
+	    postings_at < strings_at || postings_at > ix->size)
+	{
+		index_close(ix);
+		return -1;
+	}
+	ix->docs = ix->map + INDEX_HEADER;
+	ix->terms = ix->map + terms_at;
+	ix->strings = ix->map + strings_at;
+	ix->postings = ix->map + postings_at;
+	return 0;
+}
+
+/*
+ * Looks up the term (which has to be lowercased, see index_term()) and sets
+ * up reading its postings. Returns 1 if found, 0 if not.
+ */
+int index_find(const struct index *ix, const char *term, size_t len, struct postings *p)
+{
+	size_t strings_len = ix->postings - ix->strings;
+	size_t postings_len = ix->map + ix->size - ix->postings;
+
+	size_t lo = 0;
+	size_t hi = ix->num_terms;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		const char *entry = ix->terms + mid * INDEX_TERM;
+		uint32_t str = get_u32(entry + 16);
+		uint32_t str_len = get_u32(entry + 20);
+		if ((uint64_t) str + str_len > strings_len)
+		{
+			return 0;
+		}
+
+		int cmp = memcmp(ix->strings + str, term, str_len < len ? str_len : len);
+		if (cmp == 0)
+		{
+			cmp = str_len < len ? -1 : str_len > len;
+		}
+		if (cmp < 0)
+		{
+			lo = mid + 1;
+		}
+		else if (cmp > 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			uint64_t post = get_u64(entry);
+			uint32_t post_len = get_u32(entry + 8);
+			if (post + post_len > postings_len)
+			{
+				return 0;
+			}
+			memset(p, 0, sizeof(struct postings));
+			p->pos = (const unsigned char *) ix->postings + post;
+			p->end = p->pos + post_len;
+			p->count = get_u32(entry + 12);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads the next record ID. Returns 1 on success, 0 if there are no more.
+ */
+int index_next(struct postings *p, uint64_t *doc)
+{
+	uint64_t delta = 0;
+	int shift = 0;
+	for (;;)
+	{
+		if (p->pos >= p->end || shift > 63)
+		{
+			return 0;
+		}
+		unsigned char byte = *p->pos++;
+		delta |= (uint64_t) (byte & 0x7f) << shift;
+		shift += 7;
+		if (!(byte & 0x80))
+		{
+			break;
+		}
+	}
+	p->doc = p->started ? p->doc + delta : delta;
+	p->started = 1;
+	*doc = p->doc;
+	return 1;
+}
+
+/*
+ * Reads up to the first record ID that is at least 'target', which might be
+ * the current one. Returns 1 on success, 0 if there is no such ID.
+ */
+int index_skip(struct postings *p, uint64_t target, uint64_t *doc)
+{
+	if (p->started && p->doc >= target)
+	{
+		*doc = p->doc;
+		return 1;
+	}
+	while (index_next(p, doc))
+	{
+		if (*doc >= target)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint64_t index_time(const struct index *ix, uint64_t doc)
+{
+	return get_u64(ix->docs + doc * INDEX_DOC);
+}
+
+uint64_t index_where(const struct index *ix, uint64_t doc)
+{
+	return get_u64(ix->docs + doc * INDEX_DOC + 8);
+}
+
+void index_close(struct index *ix)
+{
+	if (ix->map)
+	{
+		munmap((void *) ix->map, ix->size);
+		ix->map = NULL;
+	}
+}
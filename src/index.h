@@ -0,0 +1,112 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+#include "record.h"
+
+#define INDEX_MAGIC     "TWIX"
+#define INDEX_VERSION   1
+#define INDEX_HEADER    72
+#define INDEX_DOC       16
+#define INDEX_TERM      24
+#define INDEX_MAX_TERM  64          // Longer words aren't indexed
+#define INDEX_SUFFIX    ".twix"
+#define INDEX_BLOCK_BITS 24         // Offset of a record within an archive block
+
+/*
+ * An index holds the terms of all records of one archive or segment file, so
+ * we can find the records with a given word, user or channel without reading
+ * the whole file. It is kept next to that file, with INDEX_SUFFIX appended to
+ * the name, and mapped for reading. With all numbers little endian:
+ *
+ *   4 bytes magic "TWIX", u8 version, 3 reserved bytes
+ *   u64 size of the indexed data, to tell if it's stale: the size of the
+ *       archive, or the bytes of records in the segment
+ *   u64 number of records (documents)
+ *   u64 earliest record time, u64 latest record time (microseconds)
+ *   u32 number of terms, 4 reserved bytes
+ *   u64 offset of the terms, u64 offset of their strings, u64 offset of the
+ *       postings
+ *
+ * The header is followed by one entry per record, in the order they appear
+ * in the file, the index of the entry being the record's ID:
+ *
+ *   u64 time, u64 where the record is: the offset in a segment's records or,
+ *       for archives, the offset of the block in the file, shifted left by
+ *       INDEX_BLOCK_BITS, plus the offset of the record within the block
+ *
+ * Then the terms, sorted by their strings (memcmp(), shorter first):
+ *
+ *   u64 offset of the postings, u32 their size in bytes, u32 number of
+ *   records, u32 offset of the string, u32 its length
+ *
+ * Terms are the words of the messages, lowercased ("kappa"), the user the
+ * message is from ("u:name") and the channel it was sent to ("c:#chan").
+ * The postings of a term are the IDs of the records that have it, ascending,
+ * every one but the first as the difference to the previous one, as LEB128
+ * varints: mostly one byte per record.
+ */
+struct index
+{
+	const char *map;
+	size_t      size;
+	uint64_t    extent;     // Size of the data this index was built from
+	uint64_t    num_docs;
+	uint64_t    first;
+	uint64_t    last;
+	uint32_t    num_terms;
+	const char *docs;
+	const char *terms;
+	const char *strings;
+	const char *postings;
+};
+
+/*
+ * Reads the IDs of one term's records in order.
+ */
+struct postings
+{
+	const unsigned char *pos;
+	const unsigned char *end;
+	uint32_t             count;   // Number of records, for ordering terms
+	uint64_t             doc;     // Last ID read
+	int                  started;
+};
+
+struct index_term;
+
+/*
+ * Collects the terms of records while the file is read, then writes the
+ * index in one go.
+ */
+struct index_builder
+{
+	struct index_term **table;    // Open addressing, by hash
+	size_t              cap;      // Power of two
+	size_t              num_terms;
+	char               *docs;     // Entries as written to the file
+	size_t              docs_len;
+	size_t              docs_size;
+	uint64_t            num_docs;
+	uint64_t            first;
+	uint64_t            last;
+};
+
+size_t index_word(const char *str, size_t len, size_t *pos, char *word);
+size_t index_term(char *term, const char *prefix, const char *str, size_t len);
+
+int  index_builder_init(struct index_builder *b);
+int  index_add(struct index_builder *b, const struct record *r, uint64_t where);
+int  index_write(struct index_builder *b, const char *path, uint64_t extent);
+void index_builder_free(struct index_builder *b);
+
+int  index_open(struct index *ix, int fd);
+int  index_find(const struct index *ix, const char *term, size_t len, struct postings *p);
+int  index_next(struct postings *p, uint64_t *doc);
+int  index_skip(struct postings *p, uint64_t target, uint64_t *doc);
+uint64_t index_time(const struct index *ix, uint64_t doc);
+uint64_t index_where(const struct index *ix, uint64_t doc);
+void index_close(struct index *ix);
+
+#endif
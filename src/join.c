@@ -0,0 +1,344 @@
+#include <stdlib.h>     // NULL, calloc(), free(), qsort(), bsearch()
+#include <string.h>     // memset(), memcpy(), strcmp(), strlen()
+#include <stdint.h>     // uint64_t, UINT64_MAX
+#include <time.h>       // clock_gettime()
+#include "join.h"
+#include "metrics.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int compare_chans(const void *a, const void *b)
+{
+	return strcmp(((const struct join_chan *) a)->name, ((const struct join_chan *) b)->name);
+}
+
+static struct join_chan *find_chan(struct joiner *j, const char *name)
+{
+	struct join_chan key = { .name = name };
+	return bsearch(&key, j->chans, j->num_chans, sizeof(struct join_chan), compare_chans);
+}
+
+/*
+ * Returns the earliest time the next channel may be joined. The slot at 'pos'
+ * holds the oldest of the last 'limit' join times, zero if it was never used.
+ */
+static uint64_t window_ready(const struct joiner *j, uint64_t now)
+{
+	uint64_t oldest = j->sent[j->pos];
+	uint64_t window = JOIN_WINDOW + JOIN_MARGIN_MS;
+	return oldest == 0 || oldest + window <= now ? now : oldest + window;
+}
+
+static void window_take(struct joiner *j, uint64_t now)
+{
+	j->sent[j->pos] = now;
+	j->pos = (j->pos + 1) % j->limit;
+	metrics_add(METRICS_JOINS_SENT, 1);
+}
+
+/*
+ * Checks whether we're done with all channels and, the first time we are,
+ * lets the owner know.
+ */
+static void check_done(struct joiner *j)
+{
+	if (j->done || j->num_joined + j->num_failed < j->num_wanted)
+	{
+		return;
+	}
+	j->done = now_ms();
+	if (j->on_done)
+	{
+		j->on_done(j, j->ctx);
+	}
+}
+
+static void pump(struct joiner *j);
+
+static void handle_timer(struct evloop *loop, int fd, void *ctx)
+{
+	struct joiner *j = ctx;
+	j->timer = -1;
+	pump(j);
+}
+
+/*
+ * Makes sure pump() gets called at the given time (or earlier).
+ */
+static void arm_timer(struct joiner *j, uint64_t due, uint64_t now)
+{
+	if (j->timer != -1)
+	{
+		if (j->timer_due <= due)
+		{
+			return;
+		}
+		evloop_cancel(j->loop, j->timer);
+	}
+	j->timer = evloop_timer(j->loop, (int) (due - now), 0, handle_timer, j);
+	j->timer_due = due;
+}
+
+/*
+ * Sends the JOIN for the channels collected in 'line', if any.
+ */
+static void flush(struct joiner *j, char *line, size_t *len)
+{
+	if (*len == 0)
+	{
+		return;
+	}
+	line[*len] = '\0';
+	twirc_cmd_join(j->s, line);
+	*len = 0;
+}
+
+/*
+ * Sends as many pending channels as the rate limit allows right now, packed
+ * into as few JOINs as possible, and puts channels that haven't been
+ * confirmed in time back in line. Then sets the timer for when there is
+ * something to do next.
+ */
+static void pump(struct joiner *j)
+{
+	if (j->s == NULL)
+	{
+		return;
+	}
+
+	uint64_t now = now_ms();
+	uint64_t next = UINT64_MAX;
+	char line[JOIN_LINE + 1];
+	size_t len = 0;
+
+	for (size_t i = 0; i < j->num_chans; ++i)
+	{
+		struct join_chan *c = &j->chans[i];
+		if (c->status == JOIN_SENT)
+		{
+			if (now - c->sent < JOIN_TIMEOUT_MS)
+			{
+				next = c->sent + JOIN_TIMEOUT_MS < next ? c->sent + JOIN_TIMEOUT_MS : next;
+				continue;
+			}
+			if (c->tries >= JOIN_TRIES)
+			{
+				c->status = JOIN_FAILED;
+				j->num_failed += 1;
+				continue;
+			}
+			c->status = JOIN_PENDING;
+			j->retries += 1;
+			metrics_add(METRICS_JOIN_RETRIES, 1);
+		}
+		if (c->status != JOIN_PENDING)
+		{
+			continue;
+		}
+
+		// Out of budget; the rest has to wait for the window to move
+		uint64_t ready = window_ready(j, now);
+		if (ready > now)
+		{
+			next = ready < next ? ready : next;
+			break;
+		}
+
+		size_t n = strlen(c->name);
+		if (n > JOIN_LINE)
+		{
+			c->status = JOIN_FAILED;
+			j->num_failed += 1;
+			continue;
+		}
+		if (len + (len > 0) + n > JOIN_LINE)
+		{
+			flush(j, line, &len);
+		}
+		if (len > 0)
+		{
+			line[len++] = ',';
+		}
+		memcpy(line + len, c->name, n);
+		len += n;
+
+		window_take(j, now);
+		c->status = JOIN_SENT;
+		c->sent = now;
+		c->tries += 1;
+	}
+	flush(j, line, &len);
+
+	if (next != UINT64_MAX)
+	{
+		arm_timer(j, next, now);
+	}
+	check_done(j);
+}
+
+/*
+ * Sets up joining the given channels, which have to stay around as long as
+ * the joiner does. 'limit' is the number of channels we may join per
+ * JOIN_WINDOW, 0 for JOIN_LIMIT. Returns 0 on success, -1 on error.
+ */
+int join_init(struct joiner *j, struct evloop *loop, char **chans, size_t num_chans, int limit)
+{
+	memset(j, 0, sizeof(struct joiner));
+	j->loop = loop;
+	j->timer = -1;
+	j->limit = limit > 0 ? limit : JOIN_LIMIT;
+	j->sent = calloc(j->limit, sizeof(uint64_t));
+	j->chans = calloc(num_chans ? num_chans : 1, sizeof(struct join_chan));
+	if (j->sent == NULL || j->chans == NULL)
+	{
+		free(j->sent);
+		free(j->chans);
+		return -1;
+	}
+
+	for (size_t i = 0; i < num_chans; ++i)
+	{
+		j->chans[i].name = chans[i];
+		j->chans[i].wanted = 1;
+	}
+	j->num_chans = num_chans;
+	j->num_wanted = num_chans;
+	qsort(j->chans, num_chans, sizeof(struct join_chan), compare_chans);
+	return 0;
+}
+
+/*
+ * Starts joining all channels we want with the given state, usually from the
+ * welcome handler. Can be called again for a new connection, which starts
+ * over; the rate limit carries over, as Twitch counts per account.
+ */
+void join_start(struct joiner *j, twirc_state_t *s)
+{
+	for (size_t i = 0; i < j->num_chans; ++i)
+	{
+		j->chans[i].status = j->chans[i].wanted ? JOIN_PENDING : JOIN_IDLE;
+		j->chans[i].tries = 0;
+	}
+	j->s = s;
+	metrics_add(METRICS_CHANNELS_JOINED, -(long long) j->num_joined);
+	j->num_joined = 0;
+	j->num_failed = 0;
+	j->retries = 0;
+	j->started = now_ms();
+	j->done = 0;
+	pump(j);
+}
+
+/*
+ * To be called by the join handler when we joined a channel. Returns 1 if
+ * it's one of ours that we've been waiting for, 0 otherwise.
+ */
+int join_confirm(struct joiner *j, twirc_state_t *s, const char *chan)
+{
+	struct join_chan *c = s == j->s ? find_chan(j, chan) : NULL;
+	if (c == NULL || c->status == JOIN_OK || c->status == JOIN_IDLE)
+	{
+		return 0;
+	}
+	if (c->status == JOIN_FAILED)
+	{
+		j->num_failed -= 1;
+	}
+	c->status = JOIN_OK;
+	j->num_joined += 1;
+	metrics_add(METRICS_CHANNELS_JOINED, 1);
+	check_done(j);
+	return 1;
+}
+
+/*
+ * To be called when Twitch told us we can't join a channel (it might be
+ * suspended, for example), so we don't keep trying.
+ */
+void join_fail(struct joiner *j, twirc_state_t *s, const char *chan)
+{
+	struct join_chan *c = s == j->s ? find_chan(j, chan) : NULL;
+	if (c == NULL || c->status == JOIN_OK || c->status == JOIN_FAILED || c->status == JOIN_IDLE)
+	{
+		return;
+	}
+	c->status = JOIN_FAILED;
+	j->num_failed += 1;
+	check_done(j);
+}
+
+/*
+ * Changes whether we should be in the given channel. A channel we want is
+ * joined like all the others, within the rate limit; one we don't want any
+ * more is left right away, if we're in it or about to be. Returns 1 if that
+ * changed anything, 0 if not and -1 if the channel isn't one of ours.
+ */
+int join_want(struct joiner *j, const char *chan, int want)
+{
+	struct join_chan *c = find_chan(j, chan);
+	if (c == NULL)
+	{
+		return -1;
+	}
+	if (c->wanted == want)
+	{
+		return 0;
+	}
+
+	c->wanted = want;
+	if (want)
+	{
+		j->num_wanted += 1;
+		c->status = JOIN_PENDING;
+		c->tries = 0;
+		pump(j);
+		return 1;
+	}
+
+	j->num_wanted -= 1;
+	if (c->status == JOIN_OK)
+	{
+		j->num_joined -= 1;
+		metrics_add(METRICS_CHANNELS_JOINED, -1);
+	}
+	if (c->status == JOIN_FAILED)
+	{
+		j->num_failed -= 1;
+	}
+	if (j->s && (c->status == JOIN_OK || c->status == JOIN_SENT))
+	{
+		twirc_cmd_part(j->s, c->name);
+	}
+	c->status = JOIN_IDLE;
+	return 1;
+}
+
+/*
+ * Stops joining, for example because the state is about to be freed.
+ */
+void join_stop(struct joiner *j)
+{
+	j->s = NULL;
+	if (j->timer != -1)
+	{
+		evloop_cancel(j->loop, j->timer);
+		j->timer = -1;
+	}
+}
+
+void join_free(struct joiner *j)
+{
+	join_stop(j);
+	metrics_add(METRICS_CHANNELS_JOINED, -(long long) j->num_joined);
+	j->num_joined = 0;
+	free(j->chans);
+	free(j->sent);
+	j->chans = NULL;
+	j->sent = NULL;
+	j->num_chans = 0;
+}
@@ -0,0 +1,75 @@
+#ifndef JOIN_H
+#define JOIN_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include "libtwirc.h"
+#include "evloop.h"
+
+#define JOIN_LIMIT      20      // JOINs per window Twitch allows a regular account
+#define JOIN_WINDOW     10000   // Window of the above (ms)
+#define JOIN_MARGIN_MS  250     // Added to the window, for jitter
+#define JOIN_LINE       500     // Longest list of channels in one JOIN
+#define JOIN_TIMEOUT_MS 10000   // Try again if a JOIN isn't confirmed by then
+#define JOIN_TRIES      3       // Give up on a channel after that many tries
+
+enum join_status
+{
+	JOIN_PENDING,    // Waiting for its turn
+	JOIN_SENT,       // Waiting for Twitch to confirm
+	JOIN_OK,         // Joined
+	JOIN_FAILED,     // Gave up on it
+	JOIN_IDLE        // Not wanted, see join_want()
+};
+
+struct join_chan
+{
+	const char *name;
+	uint64_t    sent;      // When we last sent a JOIN for it (ms)
+	int         status;    // enum join_status
+	int         tries;
+	int         wanted;    // 0 if we should stay out of it
+};
+
+struct joiner;
+
+typedef void (*join_callback)(struct joiner *j, void *ctx);
+
+/*
+ * Joins a lot of channels as fast as Twitch lets us. Channels are sent in
+ * batches, many per JOIN, but every channel counts against the rate limit,
+ * which is a sliding window like the one for chat messages (see sched.h).
+ * Joins that Twitch doesn't confirm in time are sent again, a few times.
+ * A timer on the event loop fires whenever the next batch may go. Channels
+ * can be given up and taken back with join_want(), which leaves or joins them.
+ */
+struct joiner
+{
+	struct evloop    *loop;
+	twirc_state_t    *s;          // Joining with this state, NULL if stopped
+	struct join_chan *chans;      // Sorted by name
+	size_t            num_chans;
+	size_t            num_wanted; // Channels we should be in
+	uint64_t         *sent;       // Ring of the last 'limit' JOINs (ms)
+	int               limit;
+	int               pos;        // Oldest entry of 'sent'
+	int               timer;      // -1 if none
+	uint64_t          timer_due;
+	join_callback     on_done;    // Can be NULL
+	void             *ctx;
+	size_t            num_joined; // Progress, since join_start()
+	size_t            num_failed;
+	unsigned          retries;
+	uint64_t          started;    // When join_start() was called (ms)
+	uint64_t          done;       // When all channels were joined or given up on (ms), 0 until then
+};
+
+int  join_init(struct joiner *j, struct evloop *loop, char **chans, size_t num_chans, int limit);
+void join_start(struct joiner *j, twirc_state_t *s);
+int  join_confirm(struct joiner *j, twirc_state_t *s, const char *chan);
+void join_fail(struct joiner *j, twirc_state_t *s, const char *chan);
+int  join_want(struct joiner *j, const char *chan, int want);
+void join_stop(struct joiner *j);
+void join_free(struct joiner *j);
+
+#endif
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE     // accept4()
+#include <stdio.h>      // FILE, fprintf(), fdopen(), fclose()
+#include <stdlib.h>     // NULL, calloc(), free()
+#include <string.h>     // memset(), strlen(), strchr(), strncpy(), strdup()
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // close(), read(), unlink()
+#include <time.h>       // clock_gettime()
+#include <pthread.h>    // pthread_mutex_t
+#include <netdb.h>      // getaddrinfo()
+#include <sys/socket.h> // socket(), bind(), listen(), accept4(), setsockopt()
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/time.h>   // struct timeval
+#include "metrics.h"
+
+/*
+ * Names of the events, in the order of the enum, as used for labels.
+ */
+static const char *event_names[METRICS_NUM_EVENTS] = {
+	"connect",
+	"welcome",
+	"globaluserstate",
+	"capack",
+	"ping",
+	"join",
+	"part",
+	"mode",
+	"names",
+	"privmsg",
+	"whisper",
+	"action",
+	"notice",
+	"roomstate",
+	"usernotice",
+	"userstate",
+	"clearchat",
+	"clearmsg",
+	"hosttarget",
+	"reconnect",
+	"invalidcmd",
+	"other",
+	"disconnect",
+	"outbound"
+};
+
+static const struct
+{
+	const char *name;
+	const char *type;
+	const char *help;
+}
+stat_info[METRICS_NUM_STATS] = {
+	{ "twirc_reconnects_total",      "counter", "Connections that took over from another one" },
+	{ "twirc_connections_lost_total", "counter", "Connections that were lost" },
+	{ "twirc_joins_sent_total",      "counter", "Channels we sent a JOIN for" },
+	{ "twirc_join_retries_total",    "counter", "JOINs sent again as they weren't confirmed" },
+	{ "twirc_sent_total",            "counter", "Messages sent by the schedulers" },
+	{ "twirc_coalesced_total",       "counter", "Messages merged with an identical queued one" },
+	{ "twirc_dropped_total",         "counter", "Messages dropped as late or over the queue limit" },
+	{ "twirc_output_dropped_total",  "counter", "Pieces of output dropped as the reader fell behind" },
+	{ "twirc_output_spilled_bytes_total", "counter", "Output moved to the spill file as the reader fell behind" },
+	{ "twirc_channels_joined",       "gauge",   "Channels we're in" },
+	{ "twirc_send_queue",            "gauge",   "Messages waiting in the schedulers" },
+	{ "twirc_input_queue",           "gauge",   "Lines of input waiting to be sent" },
+	{ "twirc_output_buffered_bytes", "gauge",   "Output waiting to be written" }
+};
+
+static atomic_llong stats[METRICS_NUM_STATS];
+
+// Every thread gets its own shard, on its first event; they're never freed,
+// so the totals survive the threads
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *shards;
+static _Thread_local struct metrics_shard *shard;
+
+// The handlers the wrappers call, see metrics_wrap()
+static _Atomic(twirc_callback) handlers[METRICS_NUM_EVENTS];
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct metrics_shard *get_shard()
+{
+	if (shard)
+	{
+		return shard;
+	}
+	shard = calloc(1, sizeof(struct metrics_shard));
+	if (shard)
+	{
+		pthread_mutex_lock(&shards_lock);
+		shard->next = shards;
+		shards = shard;
+		pthread_mutex_unlock(&shards_lock);
+	}
+	return shard;
+}
+
+/*
+ * Adds to a field of our own shard. We're the only writer, so a plain load
+ * and store do, which is a lot cheaper than an atomic add.
+ */
+static void bump(atomic_uint_fast64_t *field, uint64_t delta)
+{
+	uint64_t val = atomic_load_explicit(field, memory_order_relaxed);
+	atomic_store_explicit(field, val + delta, memory_order_relaxed);
+}
+
+/*
+ * Returns the histogram bucket for the given duration. Like an HDR
+ * histogram, every power of two is split into 2^METRICS_SUB_BITS buckets,
+ * so the error is at most 1/8 of the value, whatever its size.
+ */
+static size_t bucket(uint64_t ns)
+{
+	if (ns < (1 << METRICS_SUB_BITS))
+	{
+		return ns;
+	}
+	int msb = 63 - __builtin_clzll(ns);
+	size_t mag = msb - METRICS_SUB_BITS + 1;
+	size_t sub = (ns >> (msb - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+	size_t idx = (mag << METRICS_SUB_BITS) + sub;
+	return idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1;
+}
+
+/*
+ * Returns the smallest duration that doesn't fit into the given bucket.
+ */
+static uint64_t bucket_end(size_t idx)
+{
+	size_t mag = idx >> METRICS_SUB_BITS;
+	uint64_t sub = idx & ((1 << METRICS_SUB_BITS) - 1);
+	if (mag == 0)
+	{
+		return sub + 1;
+	}
+	return ((1 << METRICS_SUB_BITS) + sub + 1) << (mag - 1);
+}
+
+/*
+ * Calls the handler for the event and counts it, the bytes and the time the
+ * handler took.
+ */
+static void run(enum metrics_event ev, twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_callback cb = atomic_load_explicit(&handlers[ev], memory_order_relaxed);
+	uint64_t start = now_ns();
+	cb(s, evt);
+	uint64_t took = now_ns() - start;
+
+	struct metrics_shard *sh = get_shard();
+	if (sh == NULL)
+	{
+		return;
+	}
+	bump(&sh->events[ev], 1);
+	bump(&sh->nanos[ev], took);
+	bump(&sh->latency[ev][bucket(took)], 1);
+	if (evt && evt->raw)
+	{
+		bump(ev == METRICS_EV_OUTBOUND ? &sh->bytes_out : &sh->bytes_in, strlen(evt->raw) + 2);
+	}
+}
+
+#define WRAPPER(slot, ev) \
+	static void wrap_##slot(twirc_state_t *s, twirc_event_t *evt) \
+	{ \
+		run(ev, s, evt); \
+	}
+
+WRAPPER(connect,         METRICS_EV_CONNECT)
+WRAPPER(welcome,         METRICS_EV_WELCOME)
+WRAPPER(globaluserstate, METRICS_EV_GLOBALUSERSTATE)
+WRAPPER(capack,          METRICS_EV_CAPACK)
+WRAPPER(ping,            METRICS_EV_PING)
+WRAPPER(join,            METRICS_EV_JOIN)
+WRAPPER(part,            METRICS_EV_PART)
+WRAPPER(mode,            METRICS_EV_MODE)
+WRAPPER(names,           METRICS_EV_NAMES)
+WRAPPER(privmsg,         METRICS_EV_PRIVMSG)
+WRAPPER(whisper,         METRICS_EV_WHISPER)
+WRAPPER(action,          METRICS_EV_ACTION)
+WRAPPER(notice,          METRICS_EV_NOTICE)
+WRAPPER(roomstate,       METRICS_EV_ROOMSTATE)
+WRAPPER(usernotice,      METRICS_EV_USERNOTICE)
+WRAPPER(userstate,       METRICS_EV_USERSTATE)
+WRAPPER(clearchat,       METRICS_EV_CLEARCHAT)
+WRAPPER(clearmsg,        METRICS_EV_CLEARMSG)
+WRAPPER(hosttarget,      METRICS_EV_HOSTTARGET)
+WRAPPER(reconnect,       METRICS_EV_RECONNECT)
+WRAPPER(invalidcmd,      METRICS_EV_INVALIDCMD)
+WRAPPER(other,           METRICS_EV_OTHER)
+WRAPPER(disconnect,      METRICS_EV_DISCONNECT)
+WRAPPER(outbound,        METRICS_EV_OUTBOUND)
+
+/*
+ * Puts the wrapper in the slot, remembering the handler it has to call. As
+ * there is only one wrapper per slot, all states have to use the same
+ * handler for it; if one doesn't, its slot is left alone and not counted.
+ */
+static void wrap(twirc_callback *slot, twirc_callback wrapper, enum metrics_event ev)
+{
+	if (*slot == NULL || *slot == wrapper)
+	{
+		return;
+	}
+	twirc_callback none = NULL;
+	if (atomic_compare_exchange_strong(&handlers[ev], &none, *slot) || none == *slot)
+	{
+		*slot = wrapper;
+	}
+}
+
+/*
+ * Makes all event handlers count their events and how long they take. To be
+ * called once the handlers have been assigned, for every libtwirc state.
+ */
+void metrics_wrap(twirc_callbacks_t *cbs)
+{
+	wrap(&cbs->connect,         wrap_connect,         METRICS_EV_CONNECT);
+	wrap(&cbs->welcome,         wrap_welcome,         METRICS_EV_WELCOME);
+	wrap(&cbs->globaluserstate, wrap_globaluserstate, METRICS_EV_GLOBALUSERSTATE);
+	wrap(&cbs->capack,          wrap_capack,          METRICS_EV_CAPACK);
+	wrap(&cbs->ping,            wrap_ping,            METRICS_EV_PING);
+	wrap(&cbs->join,            wrap_join,            METRICS_EV_JOIN);
+	wrap(&cbs->part,            wrap_part,            METRICS_EV_PART);
+	wrap(&cbs->mode,            wrap_mode,            METRICS_EV_MODE);
+	wrap(&cbs->names,           wrap_names,           METRICS_EV_NAMES);
+	wrap(&cbs->privmsg,         wrap_privmsg,         METRICS_EV_PRIVMSG);
+	wrap(&cbs->whisper,         wrap_whisper,         METRICS_EV_WHISPER);
+	wrap(&cbs->action,          wrap_action,          METRICS_EV_ACTION);
+	wrap(&cbs->notice,          wrap_notice,          METRICS_EV_NOTICE);
+	wrap(&cbs->roomstate,       wrap_roomstate,       METRICS_EV_ROOMSTATE);
+	wrap(&cbs->usernotice,      wrap_usernotice,      METRICS_EV_USERNOTICE);
+	wrap(&cbs->userstate,       wrap_userstate,       METRICS_EV_USERSTATE);
+	wrap(&cbs->clearchat,       wrap_clearchat,       METRICS_EV_CLEARCHAT);
+	wrap(&cbs->clearmsg,        wrap_clearmsg,        METRICS_EV_CLEARMSG);
+	wrap(&cbs->hosttarget,      wrap_hosttarget,      METRICS_EV_HOSTTARGET);
+	wrap(&cbs->reconnect,       wrap_reconnect,       METRICS_EV_RECONNECT);
+	wrap(&cbs->invalidcmd,      wrap_invalidcmd,      METRICS_EV_INVALIDCMD);
+	wrap(&cbs->other,           wrap_other,           METRICS_EV_OTHER);
+	wrap(&cbs->disconnect,      wrap_disconnect,      METRICS_EV_DISCONNECT);
+	wrap(&cbs->outbound,        wrap_outbound,        METRICS_EV_OUTBOUND);
+}
+
+void metrics_add(enum metrics_stat stat, long long delta)
+{
+	atomic_fetch_add_explicit(&stats[stat], delta, memory_order_relaxed);
+}
+
+void metrics_set(enum metrics_stat stat, long long value)
+{
+	atomic_store_explicit(&stats[stat], value, memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t *field)
+{
+	return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+/*
+ * Writes the handler latencies of one event as a Prometheus histogram. We
+ * keep far more buckets than anybody wants to scrape, so they're summed up
+ * into powers of two, from 1 microsecond to about 1 second.
+ */
+static void print_latency(FILE *fp, enum metrics_event ev, uint64_t *counts,
+		uint64_t total, uint64_t nanos)
+{
+	size_t idx = 0;
+	uint64_t sum = 0;
+	for (uint64_t le = 1000; le <= 1000 << 20; le <<= 1)
+	{
+		while (idx < METRICS_BUCKETS && bucket_end(idx) <= le)
+		{
+			sum += counts[idx++];
+		}
+		fprintf(fp, "twirc_handler_seconds_bucket{event=\"%s\",le=\"%.9g\"} %llu\n",
+				event_names[ev], le / 1e9, (unsigned long long) sum);
+	}
+	fprintf(fp, "twirc_handler_seconds_bucket{event=\"%s\",le=\"+Inf\"} %llu\n",
+			event_names[ev], (unsigned long long) total);
+	fprintf(fp, "twirc_handler_seconds_sum{event=\"%s\"} %.9f\n", event_names[ev], nanos / 1e9);
+	fprintf(fp, "twirc_handler_seconds_count{event=\"%s\"} %llu\n",
+			event_names[ev], (unsigned long long) total);
+}
+
+/*
+ * Writes all metrics, summed up over all threads, in Prometheus' text
+ * format. Can be called from any thread.
+ */
+void metrics_print(FILE *fp)
+{
+	uint64_t counts[METRICS_BUCKETS];
+	uint64_t events[METRICS_NUM_EVENTS] = { 0 };
+	uint64_t nanos[METRICS_NUM_EVENTS] = { 0 };
+	uint64_t bytes_in = 0;
+	uint64_t bytes_out = 0;
+
+	// The list only ever grows at the head, so we can walk it unlocked
+	pthread_mutex_lock(&shards_lock);
+	struct metrics_shard *first = shards;
+	pthread_mutex_unlock(&shards_lock);
+
+	for (struct metrics_shard *sh = first; sh; sh = sh->next)
+	{
+		for (int ev = 0; ev < METRICS_NUM_EVENTS; ++ev)
+		{
+			events[ev] += load(&sh->events[ev]);
+			nanos[ev] += load(&sh->nanos[ev]);
+		}
+		bytes_in += load(&sh->bytes_in);
+		bytes_out += load(&sh->bytes_out);
+	}
+
+	fprintf(fp, "# HELP twirc_events_total Events handled, by type\n");
+	fprintf(fp, "# TYPE twirc_events_total counter\n");
+	for (int ev = 0; ev < METRICS_NUM_EVENTS; ++ev)
+	{
+		fprintf(fp, "twirc_events_total{event=\"%s\"} %llu\n",
+				event_names[ev], (unsigned long long) events[ev]);
+	}
+
+	fprintf(fp, "# HELP twirc_bytes_total IRC traffic, as seen by the handlers\n");
+	fprintf(fp, "# TYPE twirc_bytes_total counter\n");
+	fprintf(fp, "twirc_bytes_total{direction=\"in\"} %llu\n", (unsigned long long) bytes_in);
+	fprintf(fp, "twirc_bytes_total{direction=\"out\"} %llu\n", (unsigned long long) bytes_out);
+
+	fprintf(fp, "# HELP twirc_handler_seconds Time spent in the handlers, by event\n");
+	fprintf(fp, "# TYPE twirc_handler_seconds histogram\n");
+	for (int ev = 0; ev < METRICS_NUM_EVENTS; ++ev)
+	{
+		if (events[ev] == 0)
+		{
+			continue;
+		}
+		memset(counts, 0, sizeof(counts));
+		uint64_t total = 0;
+		for (struct metrics_shard *sh = first; sh; sh = sh->next)
+		{
+			for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+			{
+				uint64_t n = load(&sh->latency[ev][i]);
+				counts[i] += n;
+				total += n;
+			}
+		}
+		print_latency(fp, ev, counts, total, nanos[ev]);
+	}
+
+	for (int i = 0; i < METRICS_NUM_STATS; ++i)
+	{
+		fprintf(fp, "# HELP %s %s\n", stat_info[i].name, stat_info[i].help);
+		fprintf(fp, "# TYPE %s %s\n", stat_info[i].name, stat_info[i].type);
+		fprintf(fp, "%s %lld\n", stat_info[i].name,
+				atomic_load_explicit(&stats[i], memory_order_relaxed));
+	}
+}
+
+/*
+ * Called by the loop when somebody connected to the metrics socket: we
+ * answer whatever they asked with all of our metrics and hang up.
+ */
+static void handle_client(struct evloop *loop, int fd, void *ctx)
+{
+	int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn == -1)
+	{
+		return;
+	}
+
+	// Don't let a slow client hold up the loop for long
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	char req[1024];
+	if (read(conn, req, sizeof(req)) <= 0)
+	{
+		close(conn);
+		return;
+	}
+
+	FILE *fp = fdopen(conn, "w");
+	if (fp == NULL)
+	{
+		close(conn);
+		return;
+	}
+	fprintf(fp, "HTTP/1.0 200 OK\r\n");
+	fprintf(fp, "Content-Type: text/plain; version=0.0.4\r\n");
+	fprintf(fp, "Connection: close\r\n\r\n");
+	metrics_print(fp);
+	fclose(fp);
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return -1;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_tcp(const char *port)
+{
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *info;
+	if (getaddrinfo("localhost", port, &hints, &info) != 0)
+	{
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = info; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+		{
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+		{
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(info);
+	return fd;
+}
+
+/*
+ * Serves the metrics on the given loop. If 'addr' contains a slash, it's the
+ * path of a Unix socket (try `curl --unix-socket PATH http://localhost/`),
+ * otherwise a TCP port on localhost, for Prometheus to scrape. Returns 0 on
+ * success, -1 on error.
+ */
+int metrics_listen(struct metrics_server *ms, struct evloop *loop, const char *addr)
+{
+	ms->loop = loop;
+	ms->path = NULL;
+	ms->fd = strchr(addr, '/') ? listen_unix(addr) : listen_tcp(addr);
+	if (ms->fd == -1)
+	{
+		return -1;
+	}
+	if (strchr(addr, '/'))
+	{
+		ms->path = strdup(addr);
+	}
+	if (evloop_watch(loop, ms->fd, handle_client, ms) == -1)
+	{
+		metrics_close(ms);
+		return -1;
+	}
+	return 0;
+}
+
+void metrics_close(struct metrics_server *ms)
+{
+	if (ms->fd == -1)
+	{
+		return;
+	}
+	evloop_cancel(ms->loop, ms->fd);
+	close(ms->fd);
+	ms->fd = -1;
+	if (ms->path)
+	{
+		unlink(ms->path);
+		free(ms->path);
+		ms->path = NULL;
+	}
+}
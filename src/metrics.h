@@ -0,0 +1,101 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>      // FILE
+#include <stdint.h>     // uint64_t
+#include <stdatomic.h>  // atomic_uint_fast64_t
+#include "libtwirc.h"
+#include "evloop.h"
+
+#define METRICS_SUB_BITS   3     // Histogram buckets per power of two: 2^3
+#define METRICS_MAGNITUDES 40    // Powers of two, up to about an hour (ns)
+#define METRICS_BUCKETS    (METRICS_MAGNITUDES << METRICS_SUB_BITS)
+
+/*
+ * The events of libtwirc, one for every slot in twirc_callbacks_t.
+ */
+enum metrics_event
+{
+	METRICS_EV_CONNECT,
+	METRICS_EV_WELCOME,
+	METRICS_EV_GLOBALUSERSTATE,
+	METRICS_EV_CAPACK,
+	METRICS_EV_PING,
+	METRICS_EV_JOIN,
+	METRICS_EV_PART,
+	METRICS_EV_MODE,
+	METRICS_EV_NAMES,
+	METRICS_EV_PRIVMSG,
+	METRICS_EV_WHISPER,
+	METRICS_EV_ACTION,
+	METRICS_EV_NOTICE,
+	METRICS_EV_ROOMSTATE,
+	METRICS_EV_USERNOTICE,
+	METRICS_EV_USERSTATE,
+	METRICS_EV_CLEARCHAT,
+	METRICS_EV_CLEARMSG,
+	METRICS_EV_HOSTTARGET,
+	METRICS_EV_RECONNECT,
+	METRICS_EV_INVALIDCMD,
+	METRICS_EV_OTHER,
+	METRICS_EV_DISCONNECT,
+	METRICS_EV_OUTBOUND,
+	METRICS_NUM_EVENTS
+};
+
+/*
+ * Everything else we count, or measure the current value of. These don't
+ * change nearly as often as events come in, so they're shared by all threads.
+ */
+enum metrics_stat
+{
+	METRICS_RECONNECTS,        // Counters
+	METRICS_LOST,
+	METRICS_JOINS_SENT,
+	METRICS_JOIN_RETRIES,
+	METRICS_SENT,
+	METRICS_COALESCED,
+	METRICS_DROPPED,
+	METRICS_OUTPUT_DROPPED,
+	METRICS_OUTPUT_SPILLED,
+	METRICS_CHANNELS_JOINED,   // Gauges
+	METRICS_SEND_QUEUE,
+	METRICS_INPUT_QUEUE,
+	METRICS_OUTPUT_BUFFERED,
+	METRICS_NUM_STATS
+};
+
+/*
+ * What one thread counted. Only that thread writes to it, so no locks and no
+ * atomic read-modify-write are needed; the fields are atomic only so that
+ * other threads can read them while it does.
+ */
+struct metrics_shard
+{
+	atomic_uint_fast64_t  events[METRICS_NUM_EVENTS];
+	atomic_uint_fast64_t  nanos[METRICS_NUM_EVENTS];     // Time spent in handlers
+	atomic_uint_fast64_t  latency[METRICS_NUM_EVENTS][METRICS_BUCKETS];
+	atomic_uint_fast64_t  bytes_in;
+	atomic_uint_fast64_t  bytes_out;
+	struct metrics_shard *next;
+};
+
+/*
+ * Serves the metrics in Prometheus' text format, over HTTP, to whoever
+ * connects to the socket. Runs on an event loop.
+ */
+struct metrics_server
+{
+	struct evloop *loop;
+	int            fd;         // Listening socket, -1 if none
+	char          *path;       // Of the Unix socket, NULL for TCP
+};
+
+void metrics_wrap(twirc_callbacks_t *cbs);
+void metrics_add(enum metrics_stat stat, long long delta);
+void metrics_set(enum metrics_stat stat, long long value);
+void metrics_print(FILE *fp);
+int  metrics_listen(struct metrics_server *ms, struct evloop *loop, const char *addr);
+void metrics_close(struct metrics_server *ms);
+
+#endif
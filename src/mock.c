@@ -0,0 +1,777 @@
+#define _GNU_SOURCE     // accept4()
+#include <stdio.h>      // fprintf(), vsnprintf()
+#include <stdlib.h>     // NULL, malloc(), realloc(), free()
+#include <string.h>     // strcmp(), strncmp(), strstr(), memcpy()
+#include <stdarg.h>     // va_list
+#include <errno.h>      // errno
+#include <unistd.h>     // close()
+#include <time.h>       // clock_gettime()
+#include <netdb.h>      // getaddrinfo()
+#include <sys/socket.h> // socket(), bind(), listen(), accept4()
+#include <sys/epoll.h>  // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <netinet/in.h> // struct sockaddr_in, ntohs()
+#include <netinet/tcp.h> // TCP_NODELAY
+#include "mock.h"
+
+/*
+ * Returns the current time in milliseconds since the epoch, for tmi-sent-ts.
+ */
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Derives a stable, fake user or room id from a name.
+ */
+static unsigned long fake_id(const char *name)
+{
+	unsigned long hash = 5381;
+	while (*name)
+	{
+		hash = hash * 33 + (unsigned char) *name++;
+	}
+	return 10000000 + hash % 90000000;
+}
+
+/*
+ * Anonymous logins use a nick of the form justinfanNNNN and don't get any
+ * GLOBALUSERSTATE or USERSTATE messages.
+ */
+static int is_anon(struct mock_client *c)
+{
+	return strncmp(c->nick, "justinfan", 9) == 0;
+}
+
+/*
+ * Updates what we want epoll to tell us about the client's socket: we always
+ * want to read, but only want to hear about it being writable if we have
+ * something to write.
+ */
+static void watch_client(struct mock *m, struct mock_client *c)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0),
+		.data.ptr = c
+	};
+	epoll_ctl(m->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+ * Appends data to the client's output buffer. If a client doesn't read its
+ * data fast enough, we kick it, just like Twitch would.
+ */
+static void queue(struct mock *m, struct mock_client *c, const char *data, size_t len)
+{
+	if (c->closing)
+	{
+		return;
+	}
+	if (c->out_len + len > MOCK_MAX_PENDING)
+	{
+		if (m->verbose)
+		{
+			fprintf(stderr, "[%d] too slow, kicking\n", c->id);
+		}
+		m->kicked += 1;
+		c->closing = 1;
+		c->out_len = 0;
+		return;
+	}
+	if (c->out_len + len > c->out_size)
+	{
+		size_t size = c->out_size ? c->out_size : 4096;
+		while (size < c->out_len + len)
+		{
+			size *= 2;
+		}
+		char *out = realloc(c->out, size);
+		if (out == NULL)
+		{
+			c->closing = 1;
+			return;
+		}
+		c->out = out;
+		c->out_size = size;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+/*
+ * Formats a line, adds the line ending and queues it for the client.
+ */
+static void queuef(struct mock *m, struct mock_client *c, const char *fmt, ...)
+{
+	char buf[MOCK_LINE_BUFFER];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf) - 2, fmt, args);
+	va_end(args);
+
+	if (len < 0)
+	{
+		return;
+	}
+	if ((size_t) len > sizeof(buf) - 3)
+	{
+		len = sizeof(buf) - 3;
+	}
+	if (m->verbose)
+	{
+		fprintf(stderr, "[%d] < %s\n", c->id, buf);
+	}
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	queue(m, c, buf, len);
+	m->lines_out += 1;
+}
+
+/*
+ * Writes as much of the client's pending output as the socket takes.
+ * Returns 0 on success, -1 if the connection is broken.
+ */
+static int flush_client(struct mock *m, struct mock_client *c)
+{
+	size_t done = 0;
+	while (done < c->out_len)
+	{
+		ssize_t res = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			return -1;
+		}
+		done += res;
+	}
+
+	int was_pending = c->out_len > 0;
+	memmove(c->out, c->out + done, c->out_len - done);
+	c->out_len -= done;
+	m->bytes_out += done;
+
+	// Only bother epoll if the state actually changed
+	if (was_pending != (c->out_len > 0) || c->out_len > 0)
+	{
+		watch_client(m, c);
+	}
+	return 0;
+}
+
+static void remove_client(struct mock *m, struct mock_client *c)
+{
+	if (m->verbose)
+	{
+		fprintf(stderr, "[%d] disconnected\n", c->id);
+	}
+
+	struct mock_client **link = &m->clients;
+	while (*link && *link != c)
+	{
+		link = &(*link)->next;
+	}
+	if (*link)
+	{
+		*link = c->next;
+	}
+
+	epoll_ctl(m->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	for (size_t i = 0; i < c->num_chans; ++i)
+	{
+		free(c->chans[i]);
+	}
+	free(c->chans);
+	free(c->out);
+	free(c);
+}
+
+static int compare_channels(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Returns the index of the channel in the client's sorted channel list,
+ * or -1 if the client hasn't joined that channel.
+ */
+static int find_channel(struct mock_client *c, const char *chan)
+{
+	char **res = bsearch(&chan, c->chans, c->num_chans, sizeof(char *), compare_channels);
+	return res ? res - c->chans : -1;
+}
+
+/*
+ * Adds the channel to the client's sorted channel list.
+ * Returns 1 if added, 0 if it was already there, -1 on error.
+ */
+static int add_channel(struct mock_client *c, const char *chan)
+{
+	if (find_channel(c, chan) != -1)
+	{
+		return 0;
+	}
+	if (c->num_chans == MOCK_MAX_CHANNELS)
+	{
+		return -1;
+	}
+
+	char **chans = realloc(c->chans, (c->num_chans + 1) * sizeof(char *));
+	if (chans == NULL)
+	{
+		return -1;
+	}
+	c->chans = chans;
+
+	size_t pos = 0;
+	while (pos < c->num_chans && strcmp(c->chans[pos], chan) < 0)
+	{
+		++pos;
+	}
+	memmove(c->chans + pos + 1, c->chans + pos, (c->num_chans - pos) * sizeof(char *));
+	if ((c->chans[pos] = strdup(chan)) == NULL)
+	{
+		memmove(c->chans + pos, c->chans + pos + 1, (c->num_chans - pos) * sizeof(char *));
+		return -1;
+	}
+	c->num_chans += 1;
+	return 1;
+}
+
+static void remove_channel(struct mock_client *c, const char *chan)
+{
+	int pos = find_channel(c, chan);
+	if (pos == -1)
+	{
+		return;
+	}
+	free(c->chans[pos]);
+	memmove(c->chans + pos, c->chans + pos + 1, (c->num_chans - pos - 1) * sizeof(char *));
+	c->num_chans -= 1;
+}
+
+static void handle_cap(struct mock *m, struct mock_client *c, char *sub, char *arg)
+{
+	if (strcmp(sub, "LS") == 0)
+	{
+		queuef(m, c, ":%s CAP * LS :twitch.tv/tags twitch.tv/commands twitch.tv/membership", MOCK_HOST);
+	}
+	else if (strcmp(sub, "REQ") == 0 && arg)
+	{
+		c->tags |= strstr(arg, "twitch.tv/tags") != NULL;
+		c->commands |= strstr(arg, "twitch.tv/commands") != NULL;
+		c->membership |= strstr(arg, "twitch.tv/membership") != NULL;
+		queuef(m, c, ":%s CAP * ACK :%s", MOCK_HOST, arg);
+	}
+}
+
+static void handle_nick(struct mock *m, struct mock_client *c, const char *nick)
+{
+	snprintf(c->nick, sizeof(c->nick), "%s", nick);
+	if (c->welcomed)
+	{
+		return;
+	}
+	c->welcomed = 1;
+
+	queuef(m, c, ":%s 001 %s :Welcome, GLHF!", MOCK_HOST, c->nick);
+	queuef(m, c, ":%s 002 %s :Your host is %s", MOCK_HOST, c->nick, MOCK_HOST);
+	queuef(m, c, ":%s 003 %s :This server is rather new", MOCK_HOST, c->nick);
+	queuef(m, c, ":%s 004 %s :-", MOCK_HOST, c->nick);
+	queuef(m, c, ":%s 375 %s :-", MOCK_HOST, c->nick);
+	queuef(m, c, ":%s 372 %s :You are in a maze of twisty passages, all alike.", MOCK_HOST, c->nick);
+	queuef(m, c, ":%s 376 %s :>", MOCK_HOST, c->nick);
+
+	if (c->commands && !is_anon(c))
+	{
+		queuef(m, c, "@badge-info=;badges=;color=;display-name=%s;emote-sets=0;"
+				"user-id=%lu;user-type= :%s GLOBALUSERSTATE",
+				c->nick, fake_id(c->nick), MOCK_HOST);
+	}
+}
+
+static void handle_join(struct mock *m, struct mock_client *c, char *chans)
+{
+	for (char *chan = strtok(chans, ","); chan; chan = strtok(NULL, ","))
+	{
+		if (chan[0] != '#' || add_channel(c, chan) != 1)
+		{
+			continue;
+		}
+
+		queuef(m, c, ":%s!%s@%s.%s JOIN %s", c->nick, c->nick, c->nick, MOCK_HOST, chan);
+		queuef(m, c, ":%s.%s 353 %s = %s :%s", c->nick, MOCK_HOST, c->nick, chan, c->nick);
+		queuef(m, c, ":%s.%s 366 %s %s :End of /NAMES list", c->nick, MOCK_HOST, c->nick, chan);
+
+		if (c->commands)
+		{
+			if (!is_anon(c))
+			{
+				queuef(m, c, "@badge-info=;badges=;color=;display-name=%s;emote-sets=0;"
+						"mod=0;subscriber=0;user-type= :%s USERSTATE %s",
+						c->nick, MOCK_HOST, chan);
+			}
+			queuef(m, c, "@emote-only=0;followers-only=-1;r9k=0;rituals=0;room-id=%lu;"
+					"slow=0;subs-only=0 :%s ROOMSTATE %s",
+					fake_id(chan + 1), MOCK_HOST, chan);
+		}
+	}
+}
+
+static void handle_part(struct mock *m, struct mock_client *c, char *chans)
+{
+	for (char *chan = strtok(chans, ","); chan; chan = strtok(NULL, ","))
+	{
+		if (find_channel(c, chan) == -1)
+		{
+			continue;
+		}
+		remove_channel(c, chan);
+		queuef(m, c, ":%s!%s@%s.%s PART %s", c->nick, c->nick, c->nick, MOCK_HOST, chan);
+	}
+}
+
+/*
+ * A client sent a chat message. We hand it to everyone else in the channel,
+ * the way Twitch would, or deliver it as a whisper if it is a "/w" command.
+ */
+static void handle_privmsg(struct mock *m, struct mock_client *c, const char *chan, const char *msg)
+{
+	const char *fmt = "@badge-info=;badges=;color=;display-name=%s;emotes=;id=mock-%llu;"
+		"mod=0;room-id=%lu;subscriber=0;tmi-sent-ts=%llu;turbo=0;user-id=%lu;"
+		"user-type= :%s!%s@%s.%s %s %s :%s";
+	unsigned long long ts = now_ms();
+
+	if (strncmp(msg, "/w ", 3) == 0)
+	{
+		char target[64];
+		int len = 0;
+		if (sscanf(msg + 3, "%63s %n", target, &len) != 1 || len == 0)
+		{
+			return;
+		}
+		for (struct mock_client *o = m->clients; o; o = o->next)
+		{
+			if (o != c && strcmp(o->nick, target) == 0)
+			{
+				queuef(m, o, fmt, c->nick, (unsigned long long) m->lines_out, 0UL, ts,
+						fake_id(c->nick), c->nick, c->nick, c->nick, MOCK_HOST,
+						"WHISPER", target, msg + 3 + len);
+			}
+		}
+		return;
+	}
+
+	for (struct mock_client *o = m->clients; o; o = o->next)
+	{
+		if (o != c && find_channel(o, chan) != -1)
+		{
+			queuef(m, o, fmt, c->nick, (unsigned long long) m->lines_out, fake_id(chan + 1),
+					ts, fake_id(c->nick), c->nick, c->nick, c->nick, MOCK_HOST,
+					"PRIVMSG", chan, msg);
+		}
+	}
+}
+
+/*
+ * Handles one line received from a client. Lines look like this, we ignore
+ * the tags and prefix a client could send:
+ * [@tags ][:prefix ]COMMAND [param ...][ :trailing]
+ */
+static void handle_line(struct mock *m, struct mock_client *c, char *line)
+{
+	m->lines_in += 1;
+	if (m->verbose)
+	{
+		fprintf(stderr, "[%d] > %s\n", c->id, strncmp(line, "PASS ", 5) == 0 ? "PASS ***" : line);
+	}
+	if (m->on_line)
+	{
+		m->on_line(m, c, line);
+	}
+
+	char *p = line;
+	if (*p == '@' && (p = strchr(p, ' ')))
+	{
+		++p;
+	}
+	if (p && *p == ':' && (p = strchr(p, ' ')))
+	{
+		++p;
+	}
+	if (p == NULL)
+	{
+		return;
+	}
+
+	char *trailing = strstr(p, " :");
+	if (trailing)
+	{
+		*trailing = '\0';
+		trailing += 2;
+	}
+
+	char *save;
+	char *cmd = strtok_r(p, " ", &save);
+	char *arg = strtok_r(NULL, " ", &save);
+	char *param = arg ? arg : trailing;
+	if (cmd == NULL)
+	{
+		return;
+	}
+
+	if (strcmp(cmd, "CAP") == 0 && arg)
+	{
+		handle_cap(m, c, arg, trailing ? trailing : strtok_r(NULL, " ", &save));
+	}
+	else if (strcmp(cmd, "NICK") == 0 && param)
+	{
+		handle_nick(m, c, param);
+	}
+	else if (!c->welcomed)
+	{
+		// PASS, or anything else before NICK, we don't check passwords
+	}
+	else if (strcmp(cmd, "PING") == 0)
+	{
+		queuef(m, c, ":%s PONG %s :%s", MOCK_HOST, MOCK_HOST, param ? param : MOCK_HOST);
+	}
+	else if (strcmp(cmd, "JOIN") == 0 && param)
+	{
+		handle_join(m, c, param);
+	}
+	else if (strcmp(cmd, "PART") == 0 && param)
+	{
+		handle_part(m, c, param);
+	}
+	else if (strcmp(cmd, "PRIVMSG") == 0 && arg && trailing)
+	{
+		handle_privmsg(m, c, arg, trailing);
+	}
+	else if (strcmp(cmd, "QUIT") == 0)
+	{
+		c->closing = 1;
+	}
+}
+
+/*
+ * Reads whatever the client sent and handles all complete lines.
+ * Returns 0 on success, -1 if the client disconnected.
+ */
+static int read_client(struct mock *m, struct mock_client *c)
+{
+	for (;;)
+	{
+		ssize_t res = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1, 0);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if (res == 0)
+		{
+			return -1;
+		}
+		c->in_len += res;
+		c->in[c->in_len] = '\0';
+
+		char *line = c->in;
+		char *end;
+		while ((end = strchr(line, '\n')))
+		{
+			*end = '\0';
+			if (end > line && end[-1] == '\r')
+			{
+				end[-1] = '\0';
+			}
+			handle_line(m, c, line);
+			line = end + 1;
+		}
+
+		c->in_len -= line - c->in;
+		memmove(c->in, line, c->in_len);
+
+		// A line that doesn't fit into the buffer gets thrown away
+		if (c->in_len == sizeof(c->in) - 1)
+		{
+			c->in_len = 0;
+		}
+	}
+}
+
+static void accept_clients(struct mock *m)
+{
+	int fd;
+	while ((fd = accept4(m->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		struct mock_client *c = calloc(1, sizeof(struct mock_client));
+		if (c == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->id = m->next_id++;
+
+		// We do our own batching, don't let Nagle add delays on top
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		c->next = m->clients;
+		m->clients = c;
+		if (m->verbose)
+		{
+			fprintf(stderr, "[%d] connected\n", c->id);
+		}
+	}
+}
+
+/*
+ * Sets up the listening socket. Returns 0 on success, -1 on error.
+ */
+int mock_init(struct mock *m, const char *host, const char *port)
+{
+	memset(m, 0, sizeof(struct mock));
+	m->lfd = -1;
+
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	struct addrinfo *info;
+	if (getaddrinfo(host, port, &hints, &info) != 0)
+	{
+		return -1;
+	}
+
+	for (struct addrinfo *ai = info; ai; ai = ai->ai_next)
+	{
+		m->lfd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (m->lfd == -1)
+		{
+			continue;
+		}
+		int one = 1;
+		setsockopt(m->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(m->lfd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(m->lfd, 128) == 0)
+		{
+			break;
+		}
+		close(m->lfd);
+		m->lfd = -1;
+	}
+	freeaddrinfo(info);
+
+	if (m->lfd == -1)
+	{
+		return -1;
+	}
+
+	m->epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (m->epfd == -1 || epoll_ctl(m->epfd, EPOLL_CTL_ADD, m->lfd, &ev) == -1)
+	{
+		close(m->lfd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the port the server is listening on, which is useful if it was
+ * initialized with port "0" to let the system pick one. Returns -1 on error.
+ */
+int mock_port(struct mock *m)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(m->lfd, (struct sockaddr *) &addr, &len) == -1)
+	{
+		return -1;
+	}
+	if (addr.ss_family == AF_INET6)
+	{
+		return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+	}
+	return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+}
+
+/*
+ * Writes pending output, then waits up to 'timeout' milliseconds for
+ * something to happen and handles it: new connections, incoming lines,
+ * sockets becoming writable. Returns the number of events handled or -1.
+ */
+int mock_poll(struct mock *m, int timeout)
+{
+	// Lines queued since the last poll go out right away, if possible
+	for (struct mock_client *c = m->clients; c; c = c->next)
+	{
+		if (c->out_len > 0 && flush_client(m, c) == -1)
+		{
+			c->closing = 1;
+			c->out_len = 0;
+		}
+	}
+
+	struct epoll_event events[MOCK_MAX_EVENTS];
+	int num = epoll_wait(m->epfd, events, MOCK_MAX_EVENTS, timeout);
+	if (num == -1)
+	{
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (int i = 0; i < num; ++i)
+	{
+		struct mock_client *c = events[i].data.ptr;
+		if (c == NULL)
+		{
+			accept_clients(m);
+			continue;
+		}
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+		{
+			c->closing = 1;
+			c->out_len = 0;
+			continue;
+		}
+		if ((events[i].events & EPOLLIN) && read_client(m, c) == -1)
+		{
+			c->closing = 1;
+			c->out_len = 0;
+			continue;
+		}
+		if (c->out_len > 0 && flush_client(m, c) == -1)
+		{
+			c->closing = 1;
+			c->out_len = 0;
+		}
+	}
+
+	// Get rid of clients that are gone or done
+	struct mock_client *c = m->clients;
+	while (c)
+	{
+		struct mock_client *next = c->next;
+		if (c->closing && c->out_len == 0)
+		{
+			remove_client(m, c);
+		}
+		c = next;
+	}
+	return num;
+}
+
+/*
+ * Finds the channel in a raw IRC line, which is the first parameter of the
+ * command, if it starts with '#'. Returns a pointer to it and writes its
+ * length to 'len', or returns NULL if there is no channel.
+ */
+const char *mock_channel(const char *line, size_t *len)
+{
+	const char *p = line;
+	if (*p == '@' && (p = strchr(p, ' ')))
+	{
+		++p;
+	}
+	if (p && *p == ':' && (p = strchr(p, ' ')))
+	{
+		++p;
+	}
+	if (p == NULL || (p = strchr(p, ' ')) == NULL || p[1] != '#')
+	{
+		return NULL;
+	}
+	++p;
+	*len = strcspn(p, " ");
+	return p;
+}
+
+/*
+ * Sends a raw line (without line ending) to every client that joined the
+ * given channel, or to every client that has been welcomed if 'chan' is NULL.
+ * Returns the number of clients the line has been queued for.
+ */
+int mock_send(struct mock *m, const char *chan, const char *line, size_t len)
+{
+	int num = 0;
+	for (struct mock_client *c = m->clients; c; c = c->next)
+	{
+		if (!c->welcomed || (chan && find_channel(c, chan) == -1))
+		{
+			continue;
+		}
+		queue(m, c, line, len);
+		queue(m, c, "\r\n", 2);
+		m->lines_out += 1;
+		++num;
+	}
+	return num;
+}
+
+/*
+ * Returns the number of clients that have joined at least one channel.
+ */
+int mock_num_joined(struct mock *m)
+{
+	int num = 0;
+	for (struct mock_client *c = m->clients; c; c = c->next)
+	{
+		num += c->num_chans > 0 && !c->closing;
+	}
+	return num;
+}
+
+/*
+ * Returns the largest amount of output pending for any one client, which
+ * tells us whether we should slow down.
+ */
+size_t mock_pending(struct mock *m)
+{
+	size_t max = 0;
+	for (struct mock_client *c = m->clients; c; c = c->next)
+	{
+		if (c->out_len > max)
+		{
+			max = c->out_len;
+		}
+	}
+	return max;
+}
+
+/*
+ * Disconnects all clients and closes the listening socket.
+ */
+void mock_free(struct mock *m)
+{
+	while (m->clients)
+	{
+		remove_client(m, m->clients);
+	}
+	if (m->lfd != -1)
+	{
+		close(m->lfd);
+		close(m->epfd);
+		m->lfd = -1;
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+#define MOCK_HOST         "tmi.twitch.tv"
+#define MOCK_LINE_BUFFER  (16 * 1024)        // Max length of incoming lines
+#define MOCK_HIGH_WATER   (256 * 1024)       // Client is considered busy
+#define MOCK_MAX_PENDING  (64 * 1024 * 1024) // Client is too slow, kick it
+#define MOCK_MAX_CHANNELS 1024               // Max channels per client
+#define MOCK_MAX_EVENTS   64
+
+struct mock;
+struct mock_client;
+
+/*
+ * Called for every line a client sends us, after we've handled it ourselves.
+ */
+typedef void (*mock_callback)(struct mock *m, struct mock_client *c, const char *line);
+
+/*
+ * A connection to the mock server. Outgoing data is buffered per client and
+ * written whenever the socket is writable, so a slow client never blocks the
+ * server, but it will be disconnected once too much data has piled up.
+ */
+struct mock_client
+{
+	int                 fd;
+	int                 id;          // Running number, for log output
+	char                nick[64];    // Nick as given with NICK
+	int                 welcomed;    // We sent the welcome messages
+	int                 tags;        // Requested twitch.tv/tags
+	int                 commands;    // Requested twitch.tv/commands
+	int                 membership;  // Requested twitch.tv/membership
+	char              **chans;       // Channels joined (without duplicates)
+	size_t              num_chans;
+	char                in[MOCK_LINE_BUFFER];
+	size_t              in_len;
+	char               *out;         // Pending outgoing data
+	size_t              out_len;
+	size_t              out_size;
+	int                 closing;     // Disconnect once the output is sent
+	struct mock_client *next;
+};
+
+/*
+ * The mock server speaks just enough of the Twitch IRC dialect for our
+ * programs: PASS, NICK, CAP, JOIN, PART, PING/PONG, PRIVMSG and QUIT, with
+ * the welcome messages, GLOBALUSERSTATE, ROOMSTATE and USERSTATE a real
+ * server sends. Chat lines are injected with mock_send() and go to every
+ * client that joined the channel. Single-threaded, driven by mock_poll().
+ */
+struct mock
+{
+	int                 lfd;         // Listening socket
+	int                 epfd;
+	int                 next_id;
+	struct mock_client *clients;
+	int                 verbose;     // Log protocol lines to stderr
+	uint64_t            lines_out;   // Lines sent to clients
+	uint64_t            bytes_out;   // Bytes sent to clients
+	uint64_t            lines_in;    // Lines received from clients
+	uint64_t            kicked;      // Clients kicked for being too slow
+	mock_callback       on_line;     // Optional, see above
+	void               *ctx;         // For use by whoever set on_line
+};
+
+int    mock_init(struct mock *m, const char *host, const char *port);
+int    mock_port(struct mock *m);
+int    mock_poll(struct mock *m, int timeout);
+int    mock_send(struct mock *m, const char *chan, const char *line, size_t len);
+int    mock_num_joined(struct mock *m);
+size_t mock_pending(struct mock *m);
+void   mock_free(struct mock *m);
+
+const char *mock_channel(const char *line, size_t *len);
+
+#endif
@@ -0,0 +1,481 @@
+#include <stdio.h>      // NULL, fprintf(), getline()
+#include <string.h>     // strcmp(), strstr(), strspn()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, strtod()
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // getopt() et al.
+#include <signal.h>     // sigaction()
+#include <time.h>       // clock_gettime()
+#include "mock.h"
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_BUILD 0
+
+#define PROJECT_URL "https://github.com/domsson/twircclient"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "6667"
+#define DEFAULT_CHANNEL "#mock"
+#define DEFAULT_RATE 1000
+#define CHANNEL_BUFFER 128
+#define SEND_BATCH 64       // Lines to queue at full speed before polling
+
+static volatile int running; // Used to stop main loop in case of SIGINT etc
+
+/*
+ * A line of recorded traffic and the time it was received at, if known.
+ */
+struct line
+{
+	double  time;         // Seconds, or -1 if the line had no timestamp
+	char   *text;         // Raw IRC line, without line ending
+	size_t  len;
+};
+
+struct metadata
+{
+	char        *host;    // Address to listen on
+	char        *port;    // Port to listen on
+	char        *file;    // Traffic to replay, NULL for synthetic messages
+	char        *chan;    // Channel for synthetic messages
+	double       speed;   // Replay speed, 0 for as fast as possible
+	double       rate;    // Lines per second without timestamps, 0 for max
+	uint64_t     count;   // Stop after this many lines, 0 for no limit
+	int          wait;    // Clients to wait for before sending anything
+	int          loop;    // Start over once all lines have been sent
+	int          all;     // Send every line to every client
+	int          quit;    // Exit once everything has been sent
+	int          verbose; // Log the protocol to stderr
+	struct line *lines;
+	size_t       num_lines;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Reads the traffic to replay. Every line is a raw IRC line as sent by the
+ * server, optionally preceded by the time it was received at, in seconds
+ * (with fraction) and a space. Lines as printed by our client, which start
+ * with "> ", are fine, too. Returns 0 on success, -1 on error.
+ */
+int read_lines(struct metadata *meta, const char *file)
+{
+	FILE *fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	size_t cap = 0;
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&buf, &size, fp)) != -1)
+	{
+		while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		{
+			buf[--len] = '\0';
+		}
+
+		char *text = buf;
+		double time = -1;
+		size_t digits = strspn(text, "0123456789.");
+		if (digits > 0 && text[digits] == ' ')
+		{
+			time = strtod(text, NULL);
+			text += digits + 1;
+		}
+		if (strncmp(text, "> ", 2) == 0)
+		{
+			text += 2;
+		}
+		if (*text == '\0')
+		{
+			continue;
+		}
+
+		if (meta->num_lines == cap)
+		{
+			cap = cap ? cap * 2 : 1024;
+			struct line *lines = realloc(meta->lines, cap * sizeof(struct line));
+			if (lines == NULL)
+			{
+				break;
+			}
+			meta->lines = lines;
+		}
+
+		struct line *l = &meta->lines[meta->num_lines];
+		l->time = time;
+		l->len = strlen(text);
+		if ((l->text = strdup(text)) == NULL)
+		{
+			break;
+		}
+		meta->num_lines += 1;
+	}
+
+	free(buf);
+	if (fp != stdin)
+	{
+		fclose(fp);
+	}
+	return meta->num_lines > 0 ? 0 : -1;
+}
+
+/*
+ * Makes up a chat message, for when no traffic to replay has been given.
+ */
+size_t synthetic_line(struct metadata *meta, uint64_t num, char *buf, size_t size)
+{
+	int len = snprintf(buf, size,
+			"@badge-info=;badges=;color=#1E90FF;display-name=User%llu;emotes=;"
+			"id=mock-%llu;mod=0;room-id=1;subscriber=0;tmi-sent-ts=0;turbo=0;"
+			"user-id=%llu;user-type= :user%llu!user%llu@user%llu.tmi.twitch.tv "
+			"PRIVMSG %s :This is message number %llu, Kappa",
+			(unsigned long long) num % 1000, (unsigned long long) num,
+			(unsigned long long) num % 1000, (unsigned long long) num % 1000,
+			(unsigned long long) num % 1000, (unsigned long long) num % 1000,
+			meta->chan, (unsigned long long) num);
+	return len < 0 ? 0 : ((size_t) len < size ? (size_t) len : size - 1);
+}
+
+/*
+ * Copies the line to buf, setting its tmi-sent-ts tag (if any) to the current
+ * time, so that clients can tell how long it took the line to reach them.
+ * Returns the length of the new line.
+ */
+size_t restamp(const char *line, size_t len, char *buf, size_t size)
+{
+	const char *ts = NULL;
+	if (line[0] == '@')
+	{
+		const char *end = strchr(line, ' ');
+		ts = strstr(line, "tmi-sent-ts=");
+		if (end && ts > end)
+		{
+			ts = NULL;
+		}
+	}
+
+	if (ts == NULL)
+	{
+		if (len >= size)
+		{
+			len = size - 1;
+		}
+		memcpy(buf, line, len);
+		return len;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned long long ms = (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	ts += 12;
+	const char *rest = ts + strspn(ts, "0123456789");
+	int res = snprintf(buf, size, "%.*s%llu%.*s",
+			(int) (ts - line), line, ms, (int) (len - (rest - line)), rest);
+	return res < 0 ? 0 : ((size_t) res < size ? (size_t) res : size - 1);
+}
+
+/*
+ * Sends one line to all clients that joined its channel, or to all clients
+ * if -a was given or the line isn't for any channel in particular.
+ */
+void send_line(struct metadata *meta, struct mock *m, const char *line, size_t len)
+{
+	char buf[MOCK_LINE_BUFFER];
+	len = restamp(line, len, buf, sizeof(buf));
+
+	char chan[CHANNEL_BUFFER];
+	size_t chan_len = 0;
+	const char *c = meta->all ? NULL : mock_channel(buf, &chan_len);
+	if (c && chan_len < CHANNEL_BUFFER)
+	{
+		memcpy(chan, c, chan_len);
+		chan[chan_len] = '\0';
+	}
+	mock_send(m, c && chan_len < CHANNEL_BUFFER ? chan : NULL, buf, len);
+}
+
+/*
+ * Sends the traffic (or synthetic messages), honoring the timestamps of the
+ * lines or the configured rate, while also serving the clients. When going
+ * as fast as possible, we hold back while any client has a lot of output
+ * pending, so that we measure the clients and not the size of our buffers.
+ */
+void replay(struct metadata *meta, struct mock *m)
+{
+	uint64_t sent = 0;
+	uint64_t last_sent = 0;
+	double start = now();
+	double last_report = start;
+	double first = -1;
+	size_t idx = 0;
+	int done = 0;
+
+	while (running)
+	{
+		double t = now();
+		if (t - last_report >= 1.0)
+		{
+			fprintf(stderr, "*** %d clients, %llu lines sent, %.0f lines/s\n",
+					mock_num_joined(m), (unsigned long long) sent,
+					(sent - last_sent) / (t - last_report));
+			last_sent = sent;
+			last_report = t;
+		}
+
+		if (meta->count && sent >= meta->count)
+		{
+			if (!done)
+			{
+				fprintf(stderr, "*** Replay done\n");
+				done = 1;
+			}
+			if (meta->quit && mock_pending(m) == 0)
+			{
+				break;
+			}
+			mock_poll(m, 100);
+			continue;
+		}
+
+		// Figure out when the next line is due
+		struct line *l = meta->lines ? &meta->lines[idx] : NULL;
+		double due = t;
+		if (l && l->time >= 0)
+		{
+			if (first < 0)
+			{
+				first = l->time;
+			}
+			if (meta->speed > 0)
+			{
+				due = start + (l->time - first) / meta->speed;
+			}
+		}
+		else if (meta->rate > 0)
+		{
+			due = start + sent / meta->rate;
+		}
+
+		if (due > t)
+		{
+			double wait = (due - t) * 1000;
+			mock_poll(m, wait > 100 ? 100 : (int) wait);
+			continue;
+		}
+		if (mock_pending(m) > MOCK_HIGH_WATER)
+		{
+			mock_poll(m, 10);
+			continue;
+		}
+
+		if (l)
+		{
+			send_line(meta, m, l->text, l->len);
+		}
+		else
+		{
+			char buf[MOCK_LINE_BUFFER];
+			size_t len = synthetic_line(meta, sent, buf, sizeof(buf));
+			send_line(meta, m, buf, len);
+		}
+		sent += 1;
+
+		if (l && ++idx == meta->num_lines)
+		{
+			idx = 0;
+			if (meta->loop)
+			{
+				// Keep the timing going as if the file continued
+				start = now();
+				first = -1;
+			}
+			else
+			{
+				meta->count = sent;
+			}
+		}
+
+		if (sent % SEND_BATCH == 0)
+		{
+			mock_poll(m, 0);
+		}
+	}
+
+	double secs = now() - start;
+	fprintf(stderr, "*** %llu lines (%llu bytes) sent, %llu received, %llu clients kicked\n",
+			(unsigned long long) m->lines_out, (unsigned long long) m->bytes_out,
+			(unsigned long long) m->lines_in, (unsigned long long) m->kicked);
+	fprintf(stderr, "*** %llu lines replayed in %.3f s (%.0f lines/s)\n",
+			(unsigned long long) sent, secs, secs > 0 ? sent / secs : 0);
+}
+
+void sigint_handler(int sig)
+{
+	running = 0;
+}
+
+void version()
+{
+	fprintf(stdout, "twitch-mockd version %d.%d.%d - %s\n",
+				VERSION_MAJOR,
+				VERSION_MINOR,
+				VERSION_BUILD,
+				PROJECT_URL);
+}
+
+void help(char *invocation)
+{
+	fprintf(stdout, "Usage:\n");
+	fprintf(stdout, "\t%s [OPTION...]\n", invocation);
+	fprintf(stdout, "\t Note: sends synthetic chat messages unless -f is given\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-a Send every line to every client, regardless of channel.\n");
+	fprintf(stdout, "\t-c CHANNEL Channel for synthetic messages (default: %s).\n", DEFAULT_CHANNEL);
+	fprintf(stdout, "\t-e Exit once everything has been sent.\n");
+	fprintf(stdout, "\t-f FILE Replay the raw IRC lines in FILE, each optionally\n");
+	fprintf(stdout, "\t        preceded by its time in seconds and a space.\n");
+	fprintf(stdout, "\t-H HOST Address to listen on (default: %s).\n", DEFAULT_HOST);
+	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-l Loop, start over once all lines have been sent.\n");
+	fprintf(stdout, "\t-n NUM Stop after sending this many lines.\n");
+	fprintf(stdout, "\t-P PORT Port to listen on (default: %s).\n", DEFAULT_PORT);
+	fprintf(stdout, "\t-r RATE Lines per second for lines without time, 0 for\n");
+	fprintf(stdout, "\t        as fast as possible (default: %d).\n", DEFAULT_RATE);
+	fprintf(stdout, "\t-s Print the protocol to stderr.\n");
+	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\t-w NUM Wait for this many clients to join before sending.\n");
+	fprintf(stdout, "\t-x FACTOR Replay at this multiple of real time, 0 for as\n");
+	fprintf(stdout, "\t          fast as possible (default: 1).\n");
+	fprintf(stdout, "\n");
+	version();
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	struct metadata meta = { 0 };
+	meta.host = DEFAULT_HOST;
+	meta.port = DEFAULT_PORT;
+	meta.chan = DEFAULT_CHANNEL;
+	meta.speed = 1.0;
+	meta.rate = DEFAULT_RATE;
+	meta.wait = 1;
+
+	// Process command line options
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "c:f:H:n:P:r:w:x:aelsvh")) != -1)
+	{
+		switch(o)
+		{
+			case 'a':
+				meta.all = 1;
+				break;
+			case 'c':
+				meta.chan = optarg;
+				break;
+			case 'e':
+				meta.quit = 1;
+				break;
+			case 'f':
+				meta.file = optarg;
+				break;
+			case 'H':
+				meta.host = optarg;
+				break;
+			case 'l':
+				meta.loop = 1;
+				break;
+			case 'n':
+				meta.count = strtoull(optarg, NULL, 10);
+				break;
+			case 'P':
+				meta.port = optarg;
+				break;
+			case 'r':
+				meta.rate = strtod(optarg, NULL);
+				break;
+			case 's':
+				meta.verbose = 1;
+				break;
+			case 'w':
+				meta.wait = atoi(optarg);
+				break;
+			case 'x':
+				meta.speed = strtod(optarg, NULL);
+				break;
+			case 'v':
+				version();
+				return EXIT_SUCCESS;
+			case 'h':
+				help(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (meta.chan[0] != '#')
+	{
+		fprintf(stderr, "Channel has to start with '#', exiting\n");
+		return EXIT_FAILURE;
+	}
+
+	if (meta.file && read_lines(&meta, meta.file) == -1)
+	{
+		fprintf(stderr, "Error reading traffic from %s, exiting\n", meta.file);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa_int = {
+		.sa_handler = &sigint_handler
+	};
+	sigaction(SIGINT, &sa_int, NULL);
+	sigaction(SIGQUIT, &sa_int, NULL);
+	sigaction(SIGTERM, &sa_int, NULL);
+
+	struct mock m;
+	if (mock_init(&m, meta.host, meta.port) == -1)
+	{
+		fprintf(stderr, "Error listening on %s:%s, exiting\n", meta.host, meta.port);
+		return EXIT_FAILURE;
+	}
+	m.verbose = meta.verbose;
+
+	fprintf(stderr, "*** Listening on %s:%s, waiting for %d client(s)\n",
+			meta.host, meta.port, meta.wait);
+
+	running = 1;
+	while (running && mock_num_joined(&m) < meta.wait)
+	{
+		mock_poll(&m, 100);
+	}
+
+	if (running)
+	{
+		if (meta.file)
+		{
+			fprintf(stderr, "*** Replaying %zu lines\n", meta.num_lines);
+		}
+		replay(&meta, &m);
+	}
+
+	mock_free(&m);
+	for (size_t i = 0; i < meta.num_lines; ++i)
+	{
+		free(meta.lines[i].text);
+	}
+	free(meta.lines);
+	return EXIT_SUCCESS;
+}
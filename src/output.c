@@ -0,0 +1,639 @@
+#include <stdlib.h>     // NULL, malloc(), free()
+#include <string.h>     // memcpy(), memset(), strcmp()
+#include <errno.h>      // errno
+#include <signal.h>     // sigfillset(), pthread_sigmask()
+#include <unistd.h>     // pread(), pwrite(), ftruncate()
+#include <sys/uio.h>    // writev()
+#include "output.h"
+
+/*
+ * Returns the number of milliseconds that have passed since 'then'.
+ */
+static long elapsed_ms(const struct timespec *then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000
+		+ (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/*
+ * Writes all of the given buffers to the file descriptor, retrying on partial
+ * writes and interruptions. Returns 0 on success, -1 on error. The iovec
+ * array will be modified in the process.
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t res = writev(fd, iov, iovcnt);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+
+		// Skip over everything that has been written already
+		while (iovcnt > 0 && (size_t) res >= iov->iov_len)
+		{
+			res -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns a chunk with room for at least 'need' bytes, reusing a spare one
+ * if that's enough. Returns NULL on error.
+ */
+static struct output_chunk *get_chunk(struct output *out, size_t need)
+{
+	struct output_chunk *c = NULL;
+	if (need <= OUTPUT_CHUNK && out->spare)
+	{
+		c = out->spare;
+		out->spare = c->next;
+	}
+	else
+	{
+		size_t size = need > OUTPUT_CHUNK ? need : OUTPUT_CHUNK;
+		c = malloc(sizeof(struct output_chunk) + size);
+		if (c == NULL)
+		{
+			return NULL;
+		}
+		c->size = size;
+	}
+	c->next = NULL;
+	c->len = 0;
+	c->pieces = 0;
+	return c;
+}
+
+/*
+ * Keeps chunks of the usual size around for reuse, frees larger ones.
+ */
+static void put_chunk(struct output *out, struct output_chunk *c)
+{
+	if (c->size == OUTPUT_CHUNK)
+	{
+		c->next = out->spare;
+		out->spare = c;
+	}
+	else
+	{
+		free(c);
+	}
+}
+
+/*
+ * Takes the oldest chunk that isn't being written yet off the list.
+ */
+static struct output_chunk *take_first(struct output *out)
+{
+	struct output_chunk *c = out->first;
+	out->first = c->next;
+	if (out->first == NULL)
+	{
+		out->last = NULL;
+	}
+	out->len -= c->len;
+	return c;
+}
+
+/*
+ * Appends the buffers to the spill file. Called with the lock held, so that
+ * nothing else gets spilled in between. Returns 0 on success, -1 on error.
+ */
+static int spill(struct output *out, const struct iovec *iov, int iovcnt)
+{
+	off_t at = out->spill_len;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		size_t done = 0;
+		while (done < iov[i].iov_len)
+		{
+			ssize_t res = pwrite(out->spill_fd, (char *) iov[i].iov_base + done,
+					iov[i].iov_len - done, at);
+			if (res == -1 && errno != EINTR)
+			{
+				return -1;
+			}
+			done += res > 0 ? (size_t) res : 0;
+			at += res > 0 ? res : 0;
+		}
+	}
+	out->spilled_bytes += at - out->spill_len;
+	out->spill_len = at;
+	return 0;
+}
+
+/*
+ * Writes the spilled output, then everything buffered at the time of calling.
+ * Needs to be called with the lock held and no other flush in progress. The
+ * lock will be released while writing, so other threads can keep appending
+ * data. Returns 0 on success, -1 on error.
+ */
+static int flush_locked(struct output *out)
+{
+	out->flushing = 1;
+	int res = 0;
+
+	// Everything in the spill file is older than what's still in memory;
+	// whatever gets spilled while we're at it is too, so keep going
+	while (out->spill_len > out->spill_read)
+	{
+		off_t at = out->spill_read;
+		size_t len = out->spill_len - at < OUTPUT_CHUNK ? out->spill_len - at : OUTPUT_CHUNK;
+
+		pthread_mutex_unlock(&out->lock);
+		struct iovec iov = { .iov_base = out->spill_buf, .iov_len = len };
+		int ok = pread(out->spill_fd, out->spill_buf, len, at) == (ssize_t) len &&
+			write_all(out->fd, &iov, 1) == 0;
+		int err = errno;
+		pthread_mutex_lock(&out->lock);
+
+		// As with memory, what couldn't be written is gone
+		if (!ok)
+		{
+			out->error = err;
+			res = -1;
+		}
+		out->spill_read += len;
+		if (out->spill_read == out->spill_len)
+		{
+			ftruncate(out->spill_fd, 0);
+			out->spill_read = 0;
+			out->spill_len = 0;
+		}
+	}
+
+	// New output goes to new chunks while we write these ones
+	struct output_chunk *chunks = out->first;
+	out->first = NULL;
+	out->last = NULL;
+
+	pthread_mutex_unlock(&out->lock);
+	size_t len = 0;
+	struct output_chunk *c = chunks;
+	while (c)
+	{
+		struct iovec iov[OUTPUT_MAX_IOV];
+		int iovcnt = 0;
+		for (; c && iovcnt < OUTPUT_MAX_IOV; c = c->next)
+		{
+			iov[iovcnt].iov_base = c->data;
+			iov[iovcnt++].iov_len = c->len;
+			len += c->len;
+		}
+
+		// On error, we drop the data anyway, otherwise we would end up
+		// with a full buffer that can never be emptied
+		if (write_all(out->fd, iov, iovcnt) == -1)
+		{
+			out->error = errno;
+			res = -1;
+		}
+	}
+	pthread_mutex_lock(&out->lock);
+
+	while (chunks)
+	{
+		struct output_chunk *next = chunks->next;
+		put_chunk(out, chunks);
+		chunks = next;
+	}
+	out->len -= len;
+	out->flushing = 0;
+	clock_gettime(CLOCK_MONOTONIC, &out->since);
+	pthread_cond_broadcast(&out->flushed);
+	return res;
+}
+
+/*
+ * Returns 1 if there's anything that hasn't been written yet.
+ */
+static int is_pending(struct output *out)
+{
+	return out->len > 0 || out->spill_len > out->spill_read;
+}
+
+/*
+ * Waits for all buffered data to be written, flushing it ourselves unless
+ * the writer thread does that. Needs to be called with the lock held.
+ * Returns 0 on success, -1 on error.
+ */
+static int flush_all_locked(struct output *out)
+{
+	int res = 0;
+	while (out->flushing || is_pending(out))
+	{
+		if (out->flushing || out->threaded)
+		{
+			out->waiting += 1;
+			pthread_cond_signal(&out->wake);
+			pthread_cond_wait(&out->flushed, &out->lock);
+			out->waiting -= 1;
+		}
+		else if (flush_locked(out) == -1)
+		{
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/*
+ * Writes out whatever is buffered as soon as there's enough of it, it has
+ * been waiting long enough or someone needs room. Once told to stop, it
+ * writes out everything there is first.
+ */
+static void *run_writer(void *arg)
+{
+	struct output *out = arg;
+	pthread_mutex_lock(&out->lock);
+	for (;;)
+	{
+		if (out->first == NULL && out->spill_len == out->spill_read)
+		{
+			if (out->stop)
+			{
+				break;
+			}
+			pthread_cond_wait(&out->wake, &out->lock);
+			continue;
+		}
+
+		if (out->stop || out->waiting || out->len >= out->flush_bytes ||
+		    out->spill_len > out->spill_read ||
+		    (out->flush_ms > 0 && elapsed_ms(&out->since) >= out->flush_ms))
+		{
+			flush_locked(out);
+		}
+		else if (out->flush_ms > 0)
+		{
+			struct timespec until = out->since;
+			until.tv_sec += out->flush_ms / 1000;
+			until.tv_nsec += (out->flush_ms % 1000) * 1000000;
+			if (until.tv_nsec >= 1000000000)
+			{
+				until.tv_sec += 1;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&out->wake, &out->lock, &until);
+		}
+		else
+		{
+			pthread_cond_wait(&out->wake, &out->lock);
+		}
+	}
+	pthread_mutex_unlock(&out->lock);
+	return NULL;
+}
+
+/*
+ * Initializes the given output struct to write to the file descriptor 'fd'.
+ * How much is buffered at most is derived from 'flush_bytes', which gives us
+ * plenty of room to keep appending while a flush is in progress. A value of
+ * 0 for 'flush_bytes' means every write is flushed immediately, a value of 0
+ * or less for 'flush_ms' disables time-based flushing.
+ * Returns 0 on success, -1 on error.
+ */
+int output_init(struct output *out, int fd, size_t flush_bytes, int flush_ms)
+{
+	memset(out, 0, sizeof(struct output));
+
+	out->fd = fd;
+	out->flush_bytes = flush_bytes;
+	out->flush_ms = flush_ms;
+	out->size = flush_bytes * 4 > OUTPUT_MIN_SIZE ?
+		flush_bytes * 4 : OUTPUT_MIN_SIZE;
+	out->spill_fd = -1;
+
+	// The writer thread's timeouts are based on 'since'
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	clock_gettime(CLOCK_MONOTONIC, &out->since);
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->flushed, NULL);
+	pthread_cond_init(&out->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	return 0;
+}
+
+/*
+ * Starts a thread that does all the writing from now on, so that threads
+ * handing us output never wait for the file descriptor. If it can't keep up,
+ * 'policy' tells what to do once the buffer is full; OUTPUT_SPILL needs the
+ * file descriptor of a file to spill to, which is truncated as it's emptied.
+ * Returns 0 on success, -1 on error.
+ */
+int output_start(struct output *out, int policy, int spill_fd)
+{
+	if (policy == OUTPUT_SPILL)
+	{
+		out->spill_buf = malloc(OUTPUT_CHUNK);
+		if (spill_fd == -1 || out->spill_buf == NULL)
+		{
+			free(out->spill_buf);
+			out->spill_buf = NULL;
+			return -1;
+		}
+		out->spill_fd = spill_fd;
+	}
+	out->policy = policy;
+
+	// Signals are for the threads of the program to handle, never ours;
+	// the thread inherits our mask, so it can't receive any to begin with
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int res = pthread_create(&out->thread, NULL, &run_writer, out);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (res != 0)
+	{
+		return -1;
+	}
+	out->threaded = 1;
+	return 0;
+}
+
+/*
+ * Makes room for 'total' more bytes, according to the policy. Needs to be
+ * called with the lock held. Returns 1 if the output can be appended now, 0
+ * if it has been dropped or spilled instead and -1 if it can be appended but
+ * a write failed.
+ */
+static int make_room(struct output *out, const struct iovec *iov, int iovcnt, size_t total)
+{
+	int res = 1;
+
+	// Output larger than the buffer goes in once the buffer is empty
+	while (out->len > 0 && out->len + total > out->size)
+	{
+		if (!out->threaded || out->policy == OUTPUT_BLOCK)
+		{
+			// If someone else is flushing, wait for them to finish
+			if (out->flushing || out->threaded)
+			{
+				out->waiting += 1;
+				pthread_cond_signal(&out->wake);
+				pthread_cond_wait(&out->flushed, &out->lock);
+				out->waiting -= 1;
+			}
+			else if (flush_locked(out) == -1)
+			{
+				res = -1;
+			}
+			continue;
+		}
+
+		// Once all of the buffered output is being written, there's
+		// nothing left we could make room with
+		if (out->first == NULL || out->policy == OUTPUT_DROP_NEWEST)
+		{
+			break;
+		}
+		struct output_chunk *c = take_first(out);
+		struct iovec chunk = { .iov_base = c->data, .iov_len = c->len };
+		if (out->policy == OUTPUT_DROP_OLDEST || spill(out, &chunk, 1) == -1)
+		{
+			out->dropped += c->pieces;
+			out->dropped_bytes += c->len;
+		}
+		put_chunk(out, c);
+	}
+
+	if (out->len == 0 || out->len + total <= out->size)
+	{
+		return res;
+	}
+
+	// Nothing in memory is older than this now, so it can go to the file
+	if (out->policy == OUTPUT_SPILL && out->first == NULL && spill(out, iov, iovcnt) == 0)
+	{
+		pthread_cond_signal(&out->wake);
+		return 0;
+	}
+	out->dropped += 1;
+	out->dropped_bytes += total;
+	return 0;
+}
+
+/*
+ * Appends the contents of the given buffers to the output, as one piece that
+ * will not be interleaved with data from other threads. If the buffer is
+ * full, this blocks until there is enough room, unless a writer thread has
+ * been started with a policy that says otherwise. Returns 0 on success (even
+ * if the output has been dropped), -1 if a write failed.
+ */
+int output_write(struct output *out, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		total += iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&out->lock);
+	int room = make_room(out, iov, iovcnt, total);
+	int res = room == -1 ? -1 : 0;
+	if (room == 0)
+	{
+		pthread_mutex_unlock(&out->lock);
+		return res;
+	}
+
+	// The writer thread sleeps for as long as there's nothing to write
+	int wake = out->threaded && out->first == NULL;
+
+	if (out->last == NULL || out->last->size - out->last->len < total)
+	{
+		struct output_chunk *c = get_chunk(out, total);
+		if (c == NULL)
+		{
+			out->dropped += 1;
+			out->dropped_bytes += total;
+			pthread_mutex_unlock(&out->lock);
+			return -1;
+		}
+		if (out->last)
+		{
+			out->last->next = c;
+		}
+		else
+		{
+			out->first = c;
+		}
+		out->last = c;
+	}
+
+	if (out->len == 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &out->since);
+	}
+
+	struct output_chunk *c = out->last;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		memcpy(c->data + c->len, iov[i].iov_base, iov[i].iov_len);
+		c->len += iov[i].iov_len;
+	}
+	c->pieces += 1;
+	out->len += total;
+
+	if (wake)
+	{
+		pthread_cond_signal(&out->wake);
+	}
+	else if (out->len >= out->flush_bytes)
+	{
+		if (out->threaded)
+		{
+			pthread_cond_signal(&out->wake);
+		}
+		else if (!out->flushing && flush_locked(out) == -1)
+		{
+			res = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&out->lock);
+	return res;
+}
+
+/*
+ * Flushes the output if there is data that has been buffered for longer than
+ * the configured number of milliseconds. Should be called regularly, for
+ * example after every twirc_tick(), unless there's a writer thread, which
+ * keeps track of that itself. Returns 0 on success, -1 on error.
+ */
+int output_tick(struct output *out)
+{
+	if (out->flush_ms <= 0 || out->threaded)
+	{
+		return 0;
+	}
+
+	int res = 0;
+	pthread_mutex_lock(&out->lock);
+	if (out->len > 0 && !out->flushing && elapsed_ms(&out->since) >= out->flush_ms)
+	{
+		res = flush_locked(out);
+	}
+	pthread_mutex_unlock(&out->lock);
+	return res;
+}
+
+/*
+ * Returns the given timeout (in milliseconds), or less if output_tick() needs
+ * to be called earlier than that in order to honor the time threshold.
+ */
+int output_timeout(struct output *out, int timeout)
+{
+	if (!out->threaded && out->flush_ms > 0 && out->flush_ms < timeout)
+	{
+		return out->flush_ms;
+	}
+	return timeout;
+}
+
+/*
+ * Returns the number of bytes currently buffered in memory.
+ */
+size_t output_buffered(struct output *out)
+{
+	pthread_mutex_lock(&out->lock);
+	size_t len = out->len;
+	pthread_mutex_unlock(&out->lock);
+	return len;
+}
+
+/*
+ * Tells how many pieces of output, and how many bytes, have been dropped,
+ * and how many bytes have been spilled to the file so far.
+ */
+void output_counts(struct output *out, uint64_t *dropped, uint64_t *dropped_bytes, uint64_t *spilled_bytes)
+{
+	pthread_mutex_lock(&out->lock);
+	*dropped = out->dropped;
+	*dropped_bytes = out->dropped_bytes;
+	*spilled_bytes = out->spilled_bytes;
+	pthread_mutex_unlock(&out->lock);
+}
+
+/*
+ * Writes out all buffered data, waiting for any flush in progress first.
+ * Returns 0 on success, -1 on error.
+ */
+int output_flush(struct output *out)
+{
+	pthread_mutex_lock(&out->lock);
+	int res = flush_all_locked(out);
+	pthread_mutex_unlock(&out->lock);
+	return res;
+}
+
+/*
+ * Flushes all remaining data, stops the writer thread and frees the chunks.
+ * Does not close any file descriptors, as we didn't open them either.
+ */
+void output_free(struct output *out)
+{
+	if (out->size == 0)
+	{
+		return;
+	}
+
+	output_flush(out);
+	if (out->threaded)
+	{
+		pthread_mutex_lock(&out->lock);
+		out->stop = 1;
+		pthread_cond_signal(&out->wake);
+		pthread_mutex_unlock(&out->lock);
+		pthread_join(out->thread, NULL);
+	}
+
+	while (out->spare)
+	{
+		struct output_chunk *next = out->spare->next;
+		free(out->spare);
+		out->spare = next;
+	}
+	free(out->spill_buf);
+	pthread_mutex_destroy(&out->lock);
+	pthread_cond_destroy(&out->flushed);
+	pthread_cond_destroy(&out->wake);
+	out->spill_buf = NULL;
+	out->size = 0;
+}
+
+/*
+ * Returns the policy with the given name, as used on the command line, or -1
+ * if there is none by that name.
+ */
+int output_policy(const char *name)
+{
+	const char *names[] = { "block", "drop-oldest", "drop-newest", "spill" };
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); ++i)
+	{
+		if (strcmp(name, names[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,99 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <time.h>       // struct timespec
+#include <pthread.h>    // pthread_t, pthread_mutex_t, pthread_cond_t
+#include <sys/types.h>  // off_t
+#include <sys/uio.h>    // struct iovec
+
+#define OUTPUT_FLUSH_BYTES (64 * 1024)   // Default for -B
+#define OUTPUT_FLUSH_MS    250           // Default for -F
+#define OUTPUT_MIN_SIZE    (1024 * 1024) // Minimum number of bytes to buffer
+#define OUTPUT_CHUNK       (64 * 1024)   // Size of the chunks output is kept in
+#define OUTPUT_MAX_IOV     64            // Most chunks handed to one writev()
+
+/*
+ * What to do with output that doesn't fit into the buffer any more, because
+ * whatever we write to can't keep up.
+ */
+enum output_policy
+{
+	OUTPUT_BLOCK,        // Wait until there is room
+	OUTPUT_DROP_OLDEST,  // Drop buffered output that isn't being written yet
+	OUTPUT_DROP_NEWEST,  // Drop what doesn't fit
+	OUTPUT_SPILL         // Move buffered output to a file, to write it later
+};
+
+/*
+ * Output is appended to the last of a list of chunks; a piece of output is
+ * never split across chunks, so chunks can be dropped as a whole.
+ */
+struct output_chunk
+{
+	struct output_chunk *next;
+	size_t               size;    // Room for data
+	size_t               len;     // Bytes of data
+	size_t               pieces;  // Calls to output_write() that went into it
+	char                 data[];
+};
+
+/*
+ * A buffered writer that collects output from any number of threads and
+ * hands it to the file descriptor in as few writev() calls as possible. The
+ * buffer gets flushed once it holds at least 'flush_bytes' bytes or once the
+ * oldest buffered byte is older than 'flush_ms' milliseconds. Flushing takes
+ * all chunks off the list and writes them without holding the lock, so other
+ * threads can keep appending to new chunks in the meantime.
+ *
+ * Unless output_start() is called, whichever thread finds the buffer needs
+ * flushing does it, so a slow reader on the other end slows that thread down.
+ * With output_start(), a thread of its own does all the writing, and the
+ * policy decides what happens once 'size' bytes are buffered. When spilling,
+ * the oldest chunks go to a file; everything in it is older than what's still
+ * in memory, so the writer thread catches up on it first.
+ */
+struct output
+{
+	int                  fd;          // File descriptor we write to
+	size_t               size;        // Most bytes to buffer
+	size_t               len;         // Bytes buffered, including those being written
+	size_t               flush_bytes; // Flush when this many bytes are buffered
+	int                  flush_ms;    // Flush when data is buffered this long
+	struct timespec      since;       // When the oldest buffered data came in
+	struct output_chunk *first;       // Oldest chunk not being written yet
+	struct output_chunk *last;        // Chunk that new output goes to
+	struct output_chunk *spare;       // Chunks of OUTPUT_CHUNK bytes to reuse
+	int                  flushing;    // A thread is currently writing
+	int                  error;       // errno of the last failed write, if any
+	int                  policy;      // What to do when full (enum output_policy)
+	int                  spill_fd;    // File to spill to, or -1
+	off_t                spill_read;  // Bytes of the spill file written out
+	off_t                spill_len;   // Bytes in the spill file
+	char                *spill_buf;   // For reading spilled output back
+	int                  threaded;    // A writer thread has been started
+	int                  waiting;     // Threads waiting for room
+	int                  stop;        // Tells the writer thread to quit
+	pthread_t            thread;
+	uint64_t             dropped;     // Pieces of output dropped
+	uint64_t             dropped_bytes;
+	uint64_t             spilled_bytes;
+	pthread_mutex_t      lock;
+	pthread_cond_t       flushed;     // Signalled whenever a flush completes
+	pthread_cond_t       wake;        // Tells the writer thread there's work
+};
+
+int  output_init(struct output *out, int fd, size_t flush_bytes, int flush_ms);
+int  output_start(struct output *out, int policy, int spill_fd);
+int  output_write(struct output *out, const struct iovec *iov, int iovcnt);
+int  output_tick(struct output *out);
+int  output_timeout(struct output *out, int timeout);
+size_t output_buffered(struct output *out);
+void output_counts(struct output *out, uint64_t *dropped, uint64_t *dropped_bytes, uint64_t *spilled_bytes);
+int  output_flush(struct output *out);
+void output_free(struct output *out);
+
+int  output_policy(const char *name);
+
+#endif
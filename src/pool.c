@@ -0,0 +1,494 @@
+#include <stdio.h>      // fopen(), fgets(), sscanf(), fclose()
+#include <stdlib.h>     // NULL, calloc(), free()
+#include <string.h>     // memset(), strdup()
+#include <stdint.h>     // uint64_t
+#include <time.h>       // clock_gettime()
+#include "pool.h"
+#include "metrics.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Puts the message into the inbox of a connection, going round-robin over
+ * those that are up or, if none are, those still connecting or, if none of
+ * them are, those reconnecting. The message is owned by the connection
+ * afterwards. Returns 0 on success, -1 if nobody can take it, in which case
+ * it's freed.
+ */
+static int deliver(struct pool *p, struct sched_msg *msg)
+{
+	static const int wanted[] = { CONN_UP, CONN_CONNECTING, CONN_DOWN };
+	for (size_t w = 0; w < sizeof(wanted) / sizeof(wanted[0]); ++w)
+	{
+		unsigned start = atomic_fetch_add(&p->next, 1);
+		for (size_t i = 0; i < p->num_conns; ++i)
+		{
+			struct conn *c = &p->conns[(start + i) % p->num_conns];
+			if (atomic_load(&c->state) != wanted[w])
+			{
+				continue;
+			}
+
+			// Check again, the connection might just have gone down
+			pthread_mutex_lock(&c->lock);
+			if (atomic_load(&c->state) == CONN_DOWN && wanted[w] != CONN_DOWN)
+			{
+				pthread_mutex_unlock(&c->lock);
+				continue;
+			}
+			msg->next = NULL;
+			*c->inbox_tail = msg;
+			c->inbox_tail = &msg->next;
+			pthread_mutex_unlock(&c->lock);
+
+			evloop_wake(&c->loop);
+			return 0;
+		}
+	}
+
+	sched_free_msg(msg);
+	atomic_fetch_add(&p->dropped, 1);
+	metrics_add(METRICS_DROPPED, 1);
+	return -1;
+}
+
+/*
+ * Hands the messages of a connection that went down to the others, unless
+ * they're out of time or we're shutting down anyway.
+ */
+static void requeue(struct pool *p, struct sched_msg *list)
+{
+	uint64_t now = now_ms();
+	while (list)
+	{
+		struct sched_msg *msg = list;
+		list = msg->next;
+		if (atomic_load(&p->stopping) || msg->deadline <= now)
+		{
+			sched_free_msg(msg);
+			atomic_fetch_add(&p->dropped, 1);
+			metrics_add(METRICS_DROPPED, 1);
+			continue;
+		}
+		deliver(p, msg);
+	}
+}
+
+/*
+ * Called in the connection's thread whenever something was put into its
+ * inbox: moves the messages over to the connection's scheduler.
+ */
+static void handle_inbox(struct evloop *loop, int fd, void *ctx)
+{
+	struct conn *c = ctx;
+
+	// Until we're logged in, the messages have to wait in the inbox
+	pthread_mutex_lock(&c->lock);
+	if (atomic_load(&c->state) != CONN_UP)
+	{
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	struct sched_msg *list = c->inbox;
+	c->inbox = NULL;
+	c->inbox_tail = &c->inbox;
+	pthread_mutex_unlock(&c->lock);
+
+	uint64_t now = now_ms();
+	while (list)
+	{
+		struct sched_msg *msg = list;
+		list = msg->next;
+		if (msg->deadline <= now)
+		{
+			c->sched.expired += 1;
+			metrics_add(METRICS_DROPPED, 1);
+		}
+		else
+		{
+			sched_send(&c->sched, msg->kind, msg->target, msg->text,
+					msg->prio, (int) (msg->deadline - now));
+		}
+		sched_free_msg(msg);
+	}
+}
+
+/*
+ * Called for every new libtwirc state of a connection, before it connects.
+ */
+static void setup_state(twirc_state_t *s, void *ctx)
+{
+	// The handlers get to the connection, and via that the pool, through
+	// the state's context
+	struct conn *c = ctx;
+	twirc_set_context(s, c);
+	c->pool->setup(twirc_get_callbacks(s));
+}
+
+static int connect_state(twirc_state_t *s, void *ctx)
+{
+	struct conn *c = ctx;
+	return twirc_connect(s, c->pool->host, c->pool->port, c->nick, c->token);
+}
+
+/*
+ * Called once a new state took over, or with 's' being NULL when the
+ * connection was lost, in which case the others take over its work until
+ * it's back; see pool_login().
+ */
+static void handle_switch(twirc_state_t *old, twirc_state_t *s, void *ctx)
+{
+	struct conn *c = ctx;
+	c->sched.s = s;
+	if (s == NULL)
+	{
+		pool_failover(c);
+		return;
+	}
+	sched_run(&c->sched);
+}
+
+/*
+ * Runs the connection until we're told to stop, reconnecting whenever it's
+ * lost. The channels are joined by the welcome handler. Returns the exit
+ * status.
+ */
+static int run_conn(struct conn *c)
+{
+	reconn_init(&c->rc, &c->loop, setup_state, connect_state, c);
+	c->rc.on_switch = handle_switch;
+
+	if (reconn_start(&c->rc) != 0)
+	{
+		fprintf(stderr, "Error connecting %s\n", c->nick);
+		return EXIT_FAILURE;
+	}
+	c->sched.s = c->loop.s;
+	evloop_run(&c->loop);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Thread function of a connection: runs it, makes sure its messages end up
+ * elsewhere, then lets the main thread know that it's done.
+ */
+static void *run_thread(void *arg)
+{
+	struct conn *c = arg;
+	c->status = run_conn(c);
+
+	// Its messages go elsewhere, then the state(s) can be freed
+	pool_failover(c);
+	c->sched.s = NULL;
+	reconn_free(&c->rc);
+
+	atomic_fetch_add(&c->pool->finished, 1);
+	evloop_wake(c->pool->main);
+	return NULL;
+}
+
+/*
+ * Sets up an empty pool; connections are added with pool_add() or
+ * pool_load(). 'ctx' is for the event handlers to use. Returns 0 on success,
+ * -1 on error.
+ */
+int pool_init(struct pool *p, const char *host, const char *port, int tick, void *ctx)
+{
+	memset(p, 0, sizeof(struct pool));
+	p->host = host;
+	p->port = port;
+	p->tick = tick;
+	p->ctx = ctx;
+	atomic_init(&p->reader, -1);
+	pthread_mutex_init(&p->lock, NULL);
+
+	// Messages are passed between the connections, so they all share one
+	// slab; it grows to what we need at peak and stays that size
+	if (slab_init(&p->msgs, sizeof(struct sched_msg), 0) == -1)
+	{
+		return -1;
+	}
+
+	// Allocated in one go, so the connections never move
+	p->conns = calloc(POOL_MAX_CONNS, sizeof(struct conn));
+	return p->conns ? 0 : -1;
+}
+
+/*
+ * Adds an account to the pool. Returns 0 on success, -1 on error or if the
+ * pool is full.
+ */
+int pool_add(struct pool *p, const char *nick, const char *token)
+{
+	if (p->num_conns == POOL_MAX_CONNS)
+	{
+		return -1;
+	}
+
+	struct conn *c = &p->conns[p->num_conns];
+	c->pool = p;
+	c->id = p->num_conns;
+	c->inbox_tail = &c->inbox;
+	atomic_init(&c->state, CONN_CONNECTING);
+	c->nick = strdup(nick);
+	c->token = strdup(token);
+
+	// The loop gets its libtwirc state once the connection's thread has
+	// created it, but it has to exist before, so we can wake or stop it
+	if (c->nick == NULL || c->token == NULL ||
+	    evloop_init(&c->loop, NULL, p->tick) == -1)
+	{
+		free(c->nick);
+		free(c->token);
+		return -1;
+	}
+	if (sched_init(&c->sched, &c->loop, NULL, &p->msgs) == -1)
+	{
+		evloop_free(&c->loop);
+		free(c->nick);
+		free(c->token);
+		return -1;
+	}
+	evloop_on_wake(&c->loop, handle_inbox, c);
+	pthread_mutex_init(&c->lock, NULL);
+
+	p->num_conns += 1;
+	return 0;
+}
+
+/*
+ * Adds all accounts from the given file, which has one account per line:
+ * the nick, followed by the oauth token, separated by a space. Empty lines
+ * and lines starting with '#' are skipped. Returns the number of accounts
+ * added, or -1 on error.
+ */
+int pool_load(struct pool *p, const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	int num = 0;
+	char line[256];
+	char nick[64];
+	char token[128];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#' || sscanf(line, "%63s %127s", nick, token) != 2)
+		{
+			continue;
+		}
+		if (pool_add(p, nick, token) == -1)
+		{
+			fclose(fp);
+			return -1;
+		}
+		++num;
+	}
+	fclose(fp);
+	return num;
+}
+
+/*
+ * Launches a thread for every connection. 'main' is woken up whenever one
+ * of them is done, 'setup' assigns the event handlers of each of them. Call
+ * this after the signals have been set up, so the threads inherit the mask.
+ * Returns 0 on success, -1 if not all threads could be launched, in which
+ * case the ones that were are told to stop.
+ */
+int pool_start(struct pool *p, struct evloop *main, pool_setup setup)
+{
+	p->main = main;
+	p->setup = setup;
+
+	for (; p->num_threads < p->num_conns; ++p->num_threads)
+	{
+		struct conn *c = &p->conns[p->num_threads];
+		if (pthread_create(&c->thread, NULL, run_thread, c) != 0)
+		{
+			pool_stop(p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Queues a message on one of the connections, see sched_privmsg(). Can be
+ * called from any thread. Returns 0 on success, -1 on error.
+ */
+int pool_send(struct pool *p, enum sched_kind kind, const char *target, const char *msg,
+		int prio, int deadline)
+{
+	uint64_t due = now_ms() + (deadline > 0 ? deadline : SCHED_DEADLINE);
+	struct sched_msg *m = sched_new_msg(&p->msgs, kind, target, msg, prio, due);
+	if (m == NULL)
+	{
+		return -1;
+	}
+	return deliver(p, m);
+}
+
+/*
+ * To be called by the welcome handler: the connection can now send, and
+ * becomes the reader if there is none. After a reconnect, the new state
+ * rejoins our channels by itself; returns 1 if it did, 0 if the caller has
+ * to join them.
+ */
+int pool_login(struct conn *c, twirc_state_t *s)
+{
+	int rejoined = reconn_welcome(&c->rc, s);
+	if (s != c->loop.s)
+	{
+		// Still the old state's turn until the new one has rejoined
+		return rejoined;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if (!atomic_load(&c->pool->stopping))
+	{
+		atomic_store(&c->state, CONN_UP);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	int none = -1;
+	atomic_compare_exchange_strong(&c->pool->reader, &none, c->id);
+
+	// Messages might have been waiting for us
+	handle_inbox(&c->loop, -1, c);
+	return rejoined;
+}
+
+/*
+ * Called in the connection's thread once it has been lost: hands its queued
+ * messages to the others and, if it was the reader, makes another connection
+ * the reader. Can be called more than once.
+ */
+void pool_failover(struct conn *c)
+{
+	struct pool *p = c->pool;
+
+	pthread_mutex_lock(&c->lock);
+	if (atomic_load(&c->state) == CONN_DOWN)
+	{
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	atomic_store(&c->state, CONN_DOWN);
+	struct sched_msg *inbox = c->inbox;
+	c->inbox = NULL;
+	c->inbox_tail = &c->inbox;
+	pthread_mutex_unlock(&c->lock);
+
+	int id = c->id;
+	if (atomic_compare_exchange_strong(&p->reader, &id, -1))
+	{
+		for (size_t i = 0; i < p->num_conns; ++i)
+		{
+			int none = -1;
+			if (atomic_load(&p->conns[i].state) == CONN_UP &&
+			    atomic_compare_exchange_strong(&p->reader, &none, (int) i))
+			{
+				break;
+			}
+		}
+	}
+
+	// What's already in the scheduler has been waiting longer
+	requeue(p, sched_drain(&c->sched));
+	requeue(p, inbox);
+}
+
+/*
+ * Returns 1 if the connection is the one that should handle incoming chat.
+ */
+int pool_is_reader(struct conn *c)
+{
+	return atomic_load(&c->pool->reader) == c->id;
+}
+
+/*
+ * Returns 1 if a message with the given ID (the "id" tag) has been seen
+ * before, otherwise remembers it and returns 0. When the reader changes, the
+ * new one may get messages the old one already handled; this weeds them out.
+ * With only the last few hundred IDs to check, a scan is fast enough.
+ */
+int pool_seen(struct pool *p, const char *id)
+{
+	if (id == NULL)
+	{
+		return 0;
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *c = id; *c; ++c)
+	{
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	for (size_t i = 0; i < POOL_DEDUP; ++i)
+	{
+		if (p->seen[i] == hash)
+		{
+			pthread_mutex_unlock(&p->lock);
+			return 1;
+		}
+	}
+	p->seen[p->seen_pos] = hash;
+	p->seen_pos = (p->seen_pos + 1) % POOL_DEDUP;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+ * Tells all connections to stop. Can be called from any thread.
+ */
+void pool_stop(struct pool *p)
+{
+	atomic_store(&p->stopping, 1);
+	for (size_t i = 0; i < p->num_conns; ++i)
+	{
+		evloop_stop(&p->conns[i].loop);
+	}
+}
+
+/*
+ * Waits for all connection threads to be done.
+ */
+void pool_join(struct pool *p)
+{
+	atomic_store(&p->stopping, 1);
+	for (size_t i = 0; i < p->num_threads; ++i)
+	{
+		pthread_join(p->conns[i].thread, NULL);
+	}
+	p->num_threads = 0;
+}
+
+void pool_free(struct pool *p)
+{
+	pool_join(p);
+	for (size_t i = 0; i < p->num_conns; ++i)
+	{
+		struct conn *c = &p->conns[i];
+		requeue(p, c->inbox);
+		sched_free(&c->sched);
+		evloop_free(&c->loop);
+		pthread_mutex_destroy(&c->lock);
+		free(c->nick);
+		free(c->token);
+	}
+	free(p->conns);
+	p->conns = NULL;
+	p->num_conns = 0;
+	slab_free(&p->msgs);
+	pthread_mutex_destroy(&p->lock);
+}
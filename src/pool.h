@@ -0,0 +1,93 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <stdatomic.h>  // atomic_int, atomic_uint
+#include <pthread.h>    // pthread_t, pthread_mutex_t
+#include "libtwirc.h"
+#include "evloop.h"
+#include "sched.h"
+#include "reconn.h"
+#include "slab.h"
+
+#define POOL_MAX_CONNS 32     // Accounts we load at most
+#define POOL_DEDUP     256    // Message IDs the reader remembers
+
+enum conn_state
+{
+	CONN_CONNECTING,     // Not logged in yet, can't send
+	CONN_UP,             // Logged in, takes messages
+	CONN_DOWN            // Lost and reconnecting, its messages went elsewhere
+};
+
+struct pool;
+
+typedef void (*pool_setup)(twirc_callbacks_t *cbs);
+
+/*
+ * One account and its connection. Every connection runs in its own thread
+ * with its own loop and its own scheduler, as Twitch's rate limits are per
+ * account. Other threads hand it messages through the inbox.
+ */
+struct conn
+{
+	struct pool      *pool;
+	int               id;         // Index in the pool, starting at 0
+	char             *nick;
+	char             *token;
+	struct evloop     loop;       // Runs the connection and the scheduler
+	struct reconn     rc;         // Reconnects, and rejoins the channels
+	struct sched      sched;      // Only ever touched by this thread
+	pthread_t         thread;
+	atomic_int        state;      // enum conn_state
+	pthread_mutex_t   lock;       // Protects the inbox and state changes
+	struct sched_msg *inbox;      // Deadlines are absolute here
+	struct sched_msg **inbox_tail;
+	int               status;     // Exit status of the thread
+};
+
+/*
+ * A pool of connections, one per account. Outgoing messages are spread
+ * across all connections that are up, so every account adds to how much we
+ * can send. Only one connection, the reader, handles incoming chat; if it
+ * goes down, another one takes over. All of them join the same channels, so
+ * the new reader sees everything right away.
+ */
+struct pool
+{
+	struct conn     *conns;
+	size_t           num_conns;
+	const char      *host;
+	const char      *port;
+	int              tick;
+	atomic_int       reader;      // ID of the reading connection, -1 if none
+	atomic_uint      next;        // For handing out messages round-robin
+	atomic_int       stopping;    // Don't fail over while shutting down
+	atomic_int       finished;    // Number of connection threads that are done
+	atomic_ulong     dropped;     // Messages no connection could send
+	struct slab      msgs;        // Messages of all connections
+	size_t           num_threads; // Connection threads launched
+	pool_setup       setup;       // Sets the handlers of every connection
+	struct evloop   *main;        // Woken up whenever a connection is done
+	pthread_mutex_t  lock;        // Protects the message IDs below
+	uint64_t         seen[POOL_DEDUP];
+	size_t           seen_pos;
+	void            *ctx;         // For the event handlers
+};
+
+int  pool_init(struct pool *p, const char *host, const char *port, int tick, void *ctx);
+int  pool_add(struct pool *p, const char *nick, const char *token);
+int  pool_load(struct pool *p, const char *file);
+int  pool_start(struct pool *p, struct evloop *main, pool_setup setup);
+int  pool_send(struct pool *p, enum sched_kind kind, const char *target, const char *msg,
+		int prio, int deadline);
+int  pool_login(struct conn *c, twirc_state_t *s);
+void pool_failover(struct conn *c);
+int  pool_is_reader(struct conn *c);
+int  pool_seen(struct pool *p, const char *id);
+void pool_stop(struct pool *p);
+void pool_join(struct pool *p);
+void pool_free(struct pool *p);
+
+#endif
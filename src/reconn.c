@@ -0,0 +1,430 @@
+#include <stdlib.h>     // NULL, malloc(), realloc(), free(), rand_r()
+#include <string.h>     // memset(), memmove(), strcmp(), strdup()
+#include <stdint.h>     // uint64_t, uintptr_t
+#include <time.h>       // clock_gettime(), time()
+#include "reconn.h"
+#include "metrics.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dial(struct reconn *r);
+
+/*
+ * Returns the index of the channel in our sorted list or, if it's not in
+ * there, the index it would have to be inserted at, as -(index + 1).
+ */
+static long find_chan(struct reconn *r, const char *chan)
+{
+	size_t lo = 0;
+	size_t hi = r->num_chans;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		int cmp = strcmp(chan, r->chans[mid]);
+		if (cmp == 0)
+		{
+			return (long) mid;
+		}
+		if (cmp < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return -(long) lo - 1;
+}
+
+static void handle_retry(struct evloop *loop, int fd, void *ctx)
+{
+	struct reconn *r = ctx;
+	r->retry = -1;
+	dial(r);
+}
+
+/*
+ * Waits before the next attempt: twice as long as last time, up to a limit,
+ * minus a random part of up to half of it, so that many clients that lost
+ * their connections at once don't all come back at the same time.
+ */
+static void schedule_retry(struct reconn *r)
+{
+	uint64_t delay = RECONN_MAX_MS;
+	if (r->attempt < 16 && ((uint64_t) RECONN_MIN_MS << r->attempt) < RECONN_MAX_MS)
+	{
+		delay = (uint64_t) RECONN_MIN_MS << r->attempt;
+	}
+	delay -= rand_r(&r->seed) % (delay / 2 + 1);
+	r->attempt += 1;
+	r->retry = evloop_timer(r->loop, (int) delay, 0, handle_retry, r);
+}
+
+/*
+ * Makes the dialed connection the loop's connection and frees the old one,
+ * if there still is one.
+ */
+static void take_over(struct reconn *r)
+{
+	twirc_state_t *old = r->loop->s;
+	r->loop->s = r->next;
+	r->next = NULL;
+	if (r->poll != -1)
+	{
+		evloop_cancel(r->loop, r->poll);
+		r->poll = -1;
+	}
+
+	uint64_t now = now_ms();
+	r->last_gap = r->lost ? now - r->lost : 0;
+	r->max_gap = r->last_gap > r->max_gap ? r->last_gap : r->max_gap;
+	r->total_gap += r->last_gap;
+	r->last_latency = now - r->dialed;
+	r->max_latency = r->last_latency > r->max_latency ? r->last_latency : r->max_latency;
+	r->reconnects += 1;
+	metrics_add(METRICS_RECONNECTS, 1);
+	r->lost = 0;
+	r->attempt = 0;
+	r->overlap = now + RECONN_OVERLAP_MS;
+
+	if (r->on_switch)
+	{
+		r->on_switch(old, r->loop->s, r->ctx);
+	}
+	if (old)
+	{
+		twirc_kill(old);
+	}
+}
+
+/*
+ * Ticks the connection being dialed, without waiting, as the loop only ticks
+ * its own connection.
+ */
+static void handle_poll(struct evloop *loop, int fd, void *ctx)
+{
+	struct reconn *r = ctx;
+
+	// The handlers called from in here might make it take over
+	twirc_state_t *s = r->next;
+	if (twirc_tick(s, 0) != 0 && !twirc_is_connected(s))
+	{
+		if (r->next == s)
+		{
+			r->next = NULL;
+			evloop_cancel(r->loop, r->poll);
+			r->poll = -1;
+			if (r->on_fail)
+			{
+				r->on_fail(s, r->ctx);
+			}
+			twirc_kill(s);
+			schedule_retry(r);
+		}
+		return;
+	}
+
+	// Rejoins can take minutes when they're paced, so we wait for as long
+	// as they keep coming in; some channels might never confirm our join
+	if (r->next && r->welcomed && now_ms() - r->progress > RECONN_READY_MS)
+	{
+		take_over(r);
+	}
+}
+
+/*
+ * Creates and connects a new state, which takes over once it's ready.
+ */
+static void dial(struct reconn *r)
+{
+	twirc_state_t *s = twirc_init();
+	if (s == NULL)
+	{
+		schedule_retry(r);
+		return;
+	}
+	r->setup(s, r->ctx);
+	if (r->connect(s, r->ctx) != 0)
+	{
+		twirc_kill(s);
+		schedule_retry(r);
+		return;
+	}
+
+	r->next = s;
+	r->welcomed = 0;
+	r->waiting = 0;
+	r->dialed = now_ms();
+	r->poll = evloop_timer(r->loop, RECONN_POLL_MS, RECONN_POLL_MS, handle_poll, r);
+}
+
+/*
+ * Called by the loop when its connection is lost: frees it and, unless we're
+ * dialing a new one already, tries again after a while.
+ */
+static void handle_lost(struct evloop *loop, int fd, void *ctx)
+{
+	struct reconn *r = ctx;
+	twirc_state_t *old = loop->s;
+	loop->s = NULL;
+	r->lost = now_ms();
+	metrics_add(METRICS_LOST, 1);
+
+	if (r->on_switch)
+	{
+		r->on_switch(old, NULL, r->ctx);
+	}
+	twirc_kill(old);
+
+	// A connection that's still rejoining is better than none at all
+	if (r->next && r->welcomed)
+	{
+		take_over(r);
+	}
+	else if (r->next == NULL && r->retry == -1)
+	{
+		schedule_retry(r);
+	}
+}
+
+/*
+ * Sets up reconnecting for the loop. 'setup' and 'connect' are called for
+ * every new state, 'ctx' is handed to them. Returns 0 on success, -1 on
+ * error.
+ */
+int reconn_init(struct reconn *r, struct evloop *loop, reconn_callback setup,
+		reconn_connect connect, void *ctx)
+{
+	memset(r, 0, sizeof(struct reconn));
+	r->loop = loop;
+	r->setup = setup;
+	r->connect = connect;
+	r->ctx = ctx;
+	r->poll = -1;
+	r->retry = -1;
+	r->seed = (unsigned) time(NULL) ^ (unsigned) (uintptr_t) r;
+	evloop_on_lost(loop, handle_lost, r);
+	return 0;
+}
+
+/*
+ * Creates and connects the first state and makes it the loop's state.
+ * Returns 0 on success, -1 on error.
+ */
+int reconn_start(struct reconn *r)
+{
+	twirc_state_t *s = twirc_init();
+	if (s == NULL)
+	{
+		return -1;
+	}
+	r->setup(s, r->ctx);
+	if (r->connect(s, r->ctx) != 0)
+	{
+		twirc_kill(s);
+		return -1;
+	}
+	r->loop->s = s;
+	return 0;
+}
+
+/*
+ * To be called when Twitch sends RECONNECT: dials a new connection right
+ * away, while the current one keeps going until the new one is ready.
+ */
+void reconn_reconnect(struct reconn *r)
+{
+	if (r->next)
+	{
+		return;
+	}
+	if (r->retry != -1)
+	{
+		evloop_cancel(r->loop, r->retry);
+		r->retry = -1;
+	}
+	dial(r);
+}
+
+/*
+ * To be called by the welcome handler. If this is a new connection, rejoins
+ * the channels we were in, or has the 'rejoin' callback do so, for callers
+ * that have to pace their joins. If there is no other connection, it takes
+ * over right away; otherwise, it does so once all the channels have been
+ * joined. Returns 1 if channels are being rejoined, 0 if the caller has to
+ * join its channels itself.
+ */
+int reconn_welcome(struct reconn *r, twirc_state_t *s)
+{
+	if (s != r->next)
+	{
+		return 0;
+	}
+
+	r->welcomed = 1;
+	r->waiting = r->num_chans;
+	r->progress = now_ms();
+	int rejoined = r->num_chans > 0;
+	if (rejoined && r->rejoin)
+	{
+		r->rejoin(s, r->ctx);
+	}
+	else
+	{
+		for (size_t i = 0; i < r->num_chans; ++i)
+		{
+			twirc_cmd_join(s, r->chans[i]);
+		}
+	}
+
+	if (r->loop->s == NULL || r->waiting == 0)
+	{
+		take_over(r);
+	}
+	return rejoined;
+}
+
+/*
+ * To be called by the join handler when we joined a channel: remembers the
+ * channel, so we can rejoin it later. With 's' being NULL, this only adds the
+ * channel to the ones we rejoin.
+ */
+void reconn_joined(struct reconn *r, twirc_state_t *s, const char *chan)
+{
+	long pos = find_chan(r, chan);
+	if (pos < 0)
+	{
+		if (r->num_chans == r->cap_chans)
+		{
+			size_t cap = r->cap_chans ? r->cap_chans * 2 : 16;
+			char **chans = realloc(r->chans, cap * sizeof(char *));
+			if (chans == NULL)
+			{
+				return;
+			}
+			r->chans = chans;
+			r->cap_chans = cap;
+		}
+		char *copy = strdup(chan);
+		if (copy == NULL)
+		{
+			return;
+		}
+		pos = -pos - 1;
+		memmove(&r->chans[pos + 1], &r->chans[pos], (r->num_chans - pos) * sizeof(char *));
+		r->chans[pos] = copy;
+		r->num_chans += 1;
+	}
+
+	if (s && s == r->next && r->waiting > 0)
+	{
+		r->progress = now_ms();
+		if (--r->waiting == 0)
+		{
+			take_over(r);
+		}
+	}
+}
+
+/*
+ * To be called by the part handler when we left a channel.
+ */
+void reconn_parted(struct reconn *r, twirc_state_t *s, const char *chan)
+{
+	long pos = find_chan(r, chan);
+	if (s != r->loop->s || pos < 0)
+	{
+		return;
+	}
+	free(r->chans[pos]);
+	memmove(&r->chans[pos], &r->chans[pos + 1], (r->num_chans - pos - 1) * sizeof(char *));
+	r->num_chans -= 1;
+}
+
+/*
+ * Returns 1 while two connections overlap, and for a little while after,
+ * which is when messages might be delivered twice. Cheap enough to call for
+ * every message, so the "id" tag only has to be looked up when it matters.
+ */
+int reconn_overlapping(struct reconn *r)
+{
+	if (r->next)
+	{
+		return 1;
+	}
+	if (r->overlap && now_ms() > r->overlap)
+	{
+		r->overlap = 0;
+	}
+	return r->overlap != 0;
+}
+
+/*
+ * Returns 1 if a message with the given ID (the "id" tag) has already been
+ * delivered by the other connection, 0 otherwise. Only while connections
+ * overlap, see above, do we keep track of the IDs.
+ */
+int reconn_dup(struct reconn *r, const char *id)
+{
+	if (id == NULL || !reconn_overlapping(r))
+	{
+		return 0;
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *c = id; *c; ++c)
+	{
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+	for (size_t i = 0; i < RECONN_DEDUP; ++i)
+	{
+		if (r->seen[i] == hash)
+		{
+			return 1;
+		}
+	}
+	r->seen[r->seen_pos] = hash;
+	r->seen_pos = (r->seen_pos + 1) % RECONN_DEDUP;
+	return 0;
+}
+
+/*
+ * Frees both connections, the loop's and the one being dialed, if any.
+ */
+void reconn_free(struct reconn *r)
+{
+	if (r->poll != -1)
+	{
+		evloop_cancel(r->loop, r->poll);
+		r->poll = -1;
+	}
+	if (r->retry != -1)
+	{
+		evloop_cancel(r->loop, r->retry);
+		r->retry = -1;
+	}
+	if (r->next)
+	{
+		twirc_kill(r->next);
+		r->next = NULL;
+	}
+	if (r->loop->s)
+	{
+		twirc_kill(r->loop->s);
+		r->loop->s = NULL;
+	}
+	for (size_t i = 0; i < r->num_chans; ++i)
+	{
+		free(r->chans[i]);
+	}
+	free(r->chans);
+	r->chans = NULL;
+	r->num_chans = 0;
+	evloop_on_lost(r->loop, NULL, NULL);
+}
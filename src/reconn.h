@@ -0,0 +1,88 @@
+#ifndef RECONN_H
+#define RECONN_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include "libtwirc.h"
+#include "evloop.h"
+
+#define RECONN_MIN_MS     500     // First retry after a failure, before jitter
+#define RECONN_MAX_MS     60000   // Longest we wait between attempts
+#define RECONN_POLL_MS    10      // How often we tick a connection being dialed
+#define RECONN_READY_MS   15000   // Longest we wait for the next rejoin to complete
+#define RECONN_OVERLAP_MS 5000    // How long after a switch we check for dupes
+#define RECONN_DEDUP      1024    // Message IDs we remember for that
+
+struct reconn;
+
+/*
+ * Called for every new state, before it connects: sets its callbacks and
+ * context. Then called to connect it, returning 0 on success, -1 on error.
+ */
+typedef void (*reconn_callback)(twirc_state_t *s, void *ctx);
+typedef int  (*reconn_connect)(twirc_state_t *s, void *ctx);
+
+/*
+ * Called once a new state has taken over, before the old one is freed (which
+ * can be NULL if the connection had been lost).
+ */
+typedef void (*reconn_switch)(twirc_state_t *old, twirc_state_t *s, void *ctx);
+
+/*
+ * Keeps a loop connected. A lost connection is redialed with jittered
+ * exponential backoff. When Twitch announces a restart with RECONNECT, a new
+ * connection is dialed while the old one is still up (make-before-break),
+ * and only takes over once it has rejoined all our channels, however long
+ * paced joins take. It takes over early if the old connection is lost, or if
+ * no channel has been rejoined for RECONN_READY_MS, as some never confirm.
+ * In both cases the channels we were in are joined again.
+ *
+ * The connection being dialed is ticked by a short timer, as the loop only
+ * runs one state. While both connections are up, both deliver messages;
+ * reconn_dup() tells which ones have been seen already.
+ */
+struct reconn
+{
+	struct evloop  *loop;       // Its state is the current connection
+	reconn_callback setup;
+	reconn_connect  connect;
+	reconn_switch   on_switch;  // Can be NULL
+	reconn_callback rejoin;     // Can be NULL, see reconn_welcome()
+	reconn_callback on_fail;    // Can be NULL, called before a failed 'next' is freed
+	void           *ctx;
+	twirc_state_t  *next;       // Connection being dialed, or NULL
+	int             poll;       // Timer ticking 'next', -1 if none
+	int             retry;      // Backoff timer, -1 if none
+	int             attempt;    // Failed attempts in a row
+	unsigned        seed;       // For the jitter
+	char          **chans;      // Channels we're in, to rejoin (sorted)
+	size_t          num_chans;
+	size_t          cap_chans;
+	size_t          waiting;    // Rejoins 'next' still waits for
+	int             welcomed;   // 'next' is logged in
+	uint64_t        lost;       // When the connection was lost (ms), 0 if up
+	uint64_t        dialed;     // When we started dialing 'next' (ms)
+	uint64_t        progress;   // When 'next' last rejoined a channel (ms)
+	uint64_t        overlap;    // Check for dupes until then (ms)
+	uint64_t        seen[RECONN_DEDUP];
+	size_t          seen_pos;
+	unsigned        reconnects;   // Statistics
+	uint64_t        last_gap;     // Time without any connection (ms)
+	uint64_t        max_gap;
+	uint64_t        total_gap;
+	uint64_t        last_latency; // From dialing to taking over (ms)
+	uint64_t        max_latency;
+};
+
+int  reconn_init(struct reconn *r, struct evloop *loop, reconn_callback setup,
+		reconn_connect connect, void *ctx);
+int  reconn_start(struct reconn *r);
+void reconn_reconnect(struct reconn *r);
+int  reconn_welcome(struct reconn *r, twirc_state_t *s);
+void reconn_joined(struct reconn *r, twirc_state_t *s, const char *chan);
+void reconn_parted(struct reconn *r, twirc_state_t *s, const char *chan);
+int  reconn_overlapping(struct reconn *r);
+int  reconn_dup(struct reconn *r, const char *id);
+void reconn_free(struct reconn *r);
+
+#endif
@@ -0,0 +1,189 @@
+#include <string.h>     // memcpy()
+#include "record.h"
+
+/*
+ * Little endian helpers, so that archives can be read on any machine.
+ */
+void put_u16(char *buf, uint16_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = val >> 8;
+}
+
+void put_u32(char *buf, uint32_t val)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		buf[i] = (val >> (8 * i)) & 0xff;
+	}
+}
+
+void put_u64(char *buf, uint64_t val)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		buf[i] = (val >> (8 * i)) & 0xff;
+	}
+}
+
+uint16_t get_u16(const char *buf)
+{
+	const unsigned char *b = (const unsigned char *) buf;
+	return b[0] | (b[1] << 8);
+}
+
+uint32_t get_u32(const char *buf)
+{
+	const unsigned char *b = (const unsigned char *) buf;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+uint64_t get_u64(const char *buf)
+{
+	return get_u32(buf) | ((uint64_t) get_u32(buf + 4) << 32);
+}
+
+static size_t clamp(size_t len, size_t max)
+{
+	return len > max ? max : len;
+}
+
+/*
+ * Writes the length 'len' as a field of 'width' bytes, followed by the string
+ * itself. Returns the number of bytes written.
+ */
+static size_t put_span(char *buf, const struct span *sp, size_t width)
+{
+	size_t len = clamp(sp->len, width == 1 ? RECORD_MAX_SHORT : RECORD_MAX_LONG);
+	if (width == 1)
+	{
+		buf[0] = len;
+	}
+	else
+	{
+		put_u16(buf, len);
+	}
+	memcpy(buf + width, sp->str, len);
+	return width + len;
+}
+
+/*
+ * Reads a string with a length field of 'width' bytes from 'buf', which holds
+ * 'len' bytes. Returns the number of bytes consumed or 0 if it didn't fit.
+ */
+static size_t get_span(const char *buf, size_t len, struct span *sp, size_t width)
+{
+	if (len < width)
+	{
+		return 0;
+	}
+	sp->len = width == 1 ? (unsigned char) buf[0] : get_u16(buf);
+	sp->str = buf + width;
+	return len - width < sp->len ? 0 : width + sp->len;
+}
+
+/*
+ * Returns the number of bytes the given record will take up when encoded.
+ */
+size_t record_size(const struct record *r)
+{
+	size_t size = RECORD_HEADER;
+	size += 1 + clamp(r->channel.len, RECORD_MAX_SHORT);
+	size += 1 + clamp(r->origin.len, RECORD_MAX_SHORT);
+	size += 2 + clamp(r->message.len, RECORD_MAX_LONG);
+	for (size_t i = 0; i < r->num_tags; ++i)
+	{
+		size += 1 + clamp(r->tags[i].key.len, RECORD_MAX_SHORT);
+		size += 2 + clamp(r->tags[i].value.len, RECORD_MAX_LONG);
+	}
+	return size;
+}
+
+/*
+ * Encodes the given record into 'buf', which has room for 'len' bytes.
+ * Returns the number of bytes written, or 0 if the buffer was too small.
+ */
+size_t record_encode(const struct record *r, char *buf, size_t len)
+{
+	size_t size = record_size(r);
+	if (size > len)
+	{
+		return 0;
+	}
+
+	put_u32(buf, size - 4);
+	put_u64(buf + 4, r->time);
+	buf[12] = r->type;
+	buf[13] = r->num_tags;
+
+	size_t pos = RECORD_HEADER;
+	pos += put_span(buf + pos, &r->channel, 1);
+	pos += put_span(buf + pos, &r->origin, 1);
+	pos += put_span(buf + pos, &r->message, 2);
+	for (size_t i = 0; i < r->num_tags; ++i)
+	{
+		pos += put_span(buf + pos, &r->tags[i].key, 1);
+		pos += put_span(buf + pos, &r->tags[i].value, 2);
+	}
+	return pos;
+}
+
+/*
+ * Decodes one record from 'buf', which holds 'len' bytes. All strings of the
+ * record will point into 'buf', so it has to stay around as long as the
+ * record is in use. Returns the number of bytes consumed, or 0 if there was
+ * no complete or no valid record at the start of the buffer.
+ */
+size_t record_decode(const char *buf, size_t len, struct record *r)
+{
+	if (len < RECORD_HEADER)
+	{
+		return 0;
+	}
+
+	size_t size = get_u32(buf) + 4;
+	if (size > len || size < RECORD_HEADER)
+	{
+		return 0;
+	}
+
+	r->time = get_u64(buf + 4);
+	r->type = buf[12];
+	r->num_tags = (unsigned char) buf[13];
+	if (r->num_tags > RECORD_MAX_TAGS)
+	{
+		return 0;
+	}
+
+	size_t pos = RECORD_HEADER;
+	size_t res;
+	if ((res = get_span(buf + pos, size - pos, &r->channel, 1)) == 0)
+	{
+		return 0;
+	}
+	pos += res;
+	if ((res = get_span(buf + pos, size - pos, &r->origin, 1)) == 0)
+	{
+		return 0;
+	}
+	pos += res;
+	if ((res = get_span(buf + pos, size - pos, &r->message, 2)) == 0)
+	{
+		return 0;
+	}
+	pos += res;
+	for (size_t i = 0; i < r->num_tags; ++i)
+	{
+		if ((res = get_span(buf + pos, size - pos, &r->tags[i].key, 1)) == 0)
+		{
+			return 0;
+		}
+		pos += res;
+		if ((res = get_span(buf + pos, size - pos, &r->tags[i].value, 2)) == 0)
+		{
+			return 0;
+		}
+		pos += res;
+	}
+	return size;
+}
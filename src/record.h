@@ -0,0 +1,68 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint8_t, uint64_t
+
+#define RECORD_MAX_TAGS   16
+#define RECORD_MAX_SHORT  UINT8_MAX   // Max length of channel, origin, tag keys
+#define RECORD_MAX_LONG   UINT16_MAX  // Max length of message, tag values
+#define RECORD_HEADER     14          // Length prefix, time, type, tag count
+
+#define RECORD_PRIVMSG 1
+#define RECORD_ACTION  2
+
+/*
+ * A string that is not necessarily null-terminated, as is the case for all
+ * strings of a decoded record, which point right into the encoded data.
+ */
+struct span
+{
+	const char *str;
+	size_t      len;
+};
+
+struct record_tag
+{
+	struct span key;
+	struct span value;
+};
+
+/*
+ * One chat message as it is stored in binary archives. Encoded, a record
+ * looks like this, with all numbers little endian:
+ *
+ *   u32 length of the rest of the record
+ *   u64 receive time in microseconds since the epoch
+ *   u8  type (RECORD_PRIVMSG or RECORD_ACTION)
+ *   u8  number of tags
+ *   u8  length, followed by the channel
+ *   u8  length, followed by the origin
+ *   u16 length, followed by the message
+ *   for every tag: u8 length and key, u16 length and value
+ *
+ * Strings that are too long for their length field get truncated.
+ */
+struct record
+{
+	uint64_t          time;
+	uint8_t           type;
+	struct span       channel;
+	struct span       origin;
+	struct span       message;
+	size_t            num_tags;
+	struct record_tag tags[RECORD_MAX_TAGS];
+};
+
+size_t record_size(const struct record *r);
+size_t record_encode(const struct record *r, char *buf, size_t len);
+size_t record_decode(const char *buf, size_t len, struct record *r);
+
+void     put_u16(char *buf, uint16_t val);
+void     put_u32(char *buf, uint32_t val);
+void     put_u64(char *buf, uint64_t val);
+uint16_t get_u16(const char *buf);
+uint32_t get_u32(const char *buf);
+uint64_t get_u64(const char *buf);
+
+#endif
@@ -0,0 +1,693 @@
+#define _XOPEN_SOURCE 700 // strptime()
+#include <stdio.h>      // NULL, fprintf(), fwrite(), fflush()
+#include <string.h>     // strlen(), strspn(), memcpy(), memcmp()
+#include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS, calloc(), realloc(), free(), strtoull()
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // getopt() et al., close(), sysconf()
+#include <fcntl.h>      // open()
+#include <time.h>       // mktime()
+#include <pthread.h>    // pthread_create(), pthread_join(), pthread_mutex_t, pthread_cond_t
+#include <stdatomic.h>  // atomic_size_t, atomic_fetch_add()
+#include <sys/mman.h>   // mmap(), munmap(), posix_madvise()
+#include <sys/stat.h>   // fstat()
+#include "record.h"
+#include "archive.h"
+#include "segment.h"
+#include "filter.h"
+#include "stamp.h"
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_BUILD 0
+
+#define PROJECT_URL "https://github.com/domsson/twircclient"
+
+#define DEFAULT_TIMESTAMP "[%Y-%m-%d %H:%M:%S]"
+#define TASK_SIZE   (1024 * 1024)  // Segments are cut into pieces about this large
+#define TASK_WINDOW 4              // Tasks per thread that may wait to be written
+#define TEXT_BUFFER (256 * 1024)   // Initial size of a task's output
+
+/*
+ * One piece of work: an archive block or a piece of a segment, whose records
+ * are formatted into a buffer of its own. Tasks are written out in the order
+ * they were created in, which is the order of the records in the files.
+ */
+struct task
+{
+	const char          *data;      // Block data as stored, or records
+	size_t               len;       // Bytes of records, for segments
+	struct archive_block blk;       // Header of the block, for archives
+	int                  packed;    // 1 for archive blocks
+	char                *out;       // Formatted lines
+	size_t               out_len;
+	size_t               out_size;
+	int                  done;      // 1 once formatted, -1 on error
+};
+
+/*
+ * A file we keep mapped until all tasks are done.
+ */
+struct mapping
+{
+	char                  *map;
+	size_t                 size;
+	struct segment_reader  seg;     // If it's a segment
+};
+
+struct metadata
+{
+	char             *timestamp;  // Timestamp format
+	int               epoch;      // Prefix the time in seconds and microseconds
+	char             *chan;       // Only write messages of this channel
+	uint64_t          start;      // Only write messages from this time on (usec)
+	uint64_t          end;        // Only write messages up to this time (usec)
+	int               show_tags;  // Write the tags of every message
+	int               filter;     // Only write chat that passes flt
+	struct filter     flt;        // Keywords and users given with -g, -u and -U
+	int               threads;    // Number of threads formatting records
+	struct mapping   *maps;       // All files, mapped
+	size_t            num_maps;
+	size_t            cap_maps;
+	struct task      *tasks;      // All pieces of work, in order
+	size_t            num_tasks;
+	size_t            cap_tasks;
+	atomic_size_t     next;       // Next task to be taken
+	size_t            written;    // Tasks written out so far
+	pthread_mutex_t   lock;       // Protects done and written
+	pthread_cond_t    cond;       // Signalled when either changes
+};
+
+struct worker
+{
+	pthread_t              thread;
+	struct metadata       *meta;
+	struct stamp           stamp;   // Timestamp cache of this thread
+	struct archive_reader  rd;      // Buffer for decompressing blocks
+	char                   origin[RECORD_MAX_SHORT + 1];  // For the filter,
+	char                   message[RECORD_MAX_LONG + 1];  // null-terminated
+};
+
+/*
+ * Parses a point in time given on the command line, either as seconds since
+ * the epoch or as local time in the form "YYYY-MM-DD[ HH:MM[:SS]]".
+ * Returns the time in microseconds since the epoch, or 0 on error.
+ */
+uint64_t parse_time(const char *str)
+{
+	if (str[strspn(str, "0123456789")] == '\0')
+	{
+		return strtoull(str, NULL, 10) * 1000000;
+	}
+
+	const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+	{
+		struct tm tm = { 0 };
+		const char *rest = strptime(str, formats[i], &tm);
+		if (rest && *rest == '\0')
+		{
+			tm.tm_isdst = -1;
+			return (uint64_t) mktime(&tm) * 1000000;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Adds a task to the end of the list, growing it as required. Returns the
+ * task, or NULL on error.
+ */
+struct task *add_task(struct metadata *meta)
+{
+	if (meta->num_tasks == meta->cap_tasks)
+	{
+		size_t cap = meta->cap_tasks ? meta->cap_tasks * 2 : 1024;
+		struct task *tasks = realloc(meta->tasks, cap * sizeof(struct task));
+		if (tasks == NULL)
+		{
+			return NULL;
+		}
+		meta->tasks = tasks;
+		meta->cap_tasks = cap;
+	}
+	struct task *t = &meta->tasks[meta->num_tasks++];
+	memset(t, 0, sizeof(struct task));
+	return t;
+}
+
+/*
+ * Makes one task of every block of the archive mapped at 'map', skipping
+ * the blocks outside of the requested time range. Returns 0 on success, -1
+ * if the archive is broken.
+ */
+int split_archive(struct metadata *meta, const char *map, size_t size)
+{
+	if (size < ARCHIVE_FILE_HEADER || memcmp(map, ARCHIVE_MAGIC, 4) != 0 || map[4] != ARCHIVE_VERSION)
+	{
+		return -1;
+	}
+	size_t pos = ARCHIVE_FILE_HEADER;
+	while (pos < size)
+	{
+		struct archive_block blk;
+		if (archive_header(map + pos, size - pos, &blk) == -1)
+		{
+			return -1;
+		}
+		const char *data = map + pos + ARCHIVE_BLOCK_HEADER;
+		pos += ARCHIVE_BLOCK_HEADER + blk.stored_len;
+
+		if (blk.last < meta->start || (meta->end && blk.first > meta->end))
+		{
+			continue;
+		}
+		struct task *t = add_task(meta);
+		if (t == NULL)
+		{
+			return -1;
+		}
+		t->data = data;
+		t->blk = blk;
+		t->packed = 1;
+	}
+	return 0;
+}
+
+/*
+ * Cuts the records of the segment into tasks of about TASK_SIZE bytes. The
+ * cuts are made where a second starts, as told by the segment's index; if
+ * that is too far off, we walk the records to find one. Returns 0 on
+ * success, -1 on error.
+ */
+int split_segment(struct metadata *meta, struct segment_reader *rd)
+{
+	int res = meta->start ? segment_seek(rd, meta->start) : 1;
+	if (res == -1)
+	{
+		return -1;
+	}
+
+	const char *data = rd->map + SEGMENT_HEADER;
+	size_t pos = rd->pos;
+	while (res == 1 && pos < rd->used)
+	{
+		size_t cut = segment_split(rd, pos + TASK_SIZE);
+		if (cut > pos + 2 * TASK_SIZE)
+		{
+			cut = pos;
+			while (cut < rd->used && cut < pos + TASK_SIZE)
+			{
+				if (rd->used - cut < 4)
+				{
+					return -1;
+				}
+				cut += get_u32(data + cut) + 4;
+			}
+			cut = cut < rd->used ? cut : rd->used;
+		}
+
+		struct task *t = add_task(meta);
+		if (t == NULL)
+		{
+			return -1;
+		}
+		t->data = data + pos;
+		t->len = cut - pos;
+		pos = cut;
+	}
+	return 0;
+}
+
+/*
+ * Maps the file and splits it into tasks. Archives and segments are told
+ * apart by their magic. Returns 0 on success, -1 on error.
+ */
+int add_file(struct metadata *meta, const char *file)
+{
+	if (meta->num_maps == meta->cap_maps)
+	{
+		size_t cap = meta->cap_maps ? meta->cap_maps * 2 : 16;
+		struct mapping *maps = realloc(meta->maps, cap * sizeof(struct mapping));
+		if (maps == NULL)
+		{
+			return -1;
+		}
+		meta->maps = maps;
+		meta->cap_maps = cap;
+	}
+
+	int fd = open(file, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	struct mapping *m = &meta->maps[meta->num_maps];
+	memset(m, 0, sizeof(struct mapping));
+	char magic[4];
+	if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, SEGMENT_MAGIC, 4) == 0)
+	{
+		int res = segment_open(&m->seg, fd);
+		close(fd);
+		if (res == -1)
+		{
+			return -1;
+		}
+		meta->num_maps += 1;
+		posix_madvise(m->seg.map, m->seg.size, POSIX_MADV_SEQUENTIAL);
+		return split_segment(meta, &m->seg);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return -1;
+	}
+	m->size = st.st_size;
+	m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED)
+	{
+		m->map = NULL;
+		return -1;
+	}
+	meta->num_maps += 1;
+	posix_madvise(m->map, m->size, POSIX_MADV_SEQUENTIAL);
+	return split_archive(meta, m->map, m->size);
+}
+
+/*
+ * Appends 'len' bytes to the output of the task, growing it as required.
+ * Returns 0 on success, -1 on error.
+ */
+int append(struct task *t, const char *str, size_t len)
+{
+	if (t->out_len + len > t->out_size)
+	{
+		size_t size = t->out_size ? t->out_size : TEXT_BUFFER;
+		while (size < t->out_len + len)
+		{
+			size *= 2;
+		}
+		char *out = realloc(t->out, size);
+		if (out == NULL)
+		{
+			return -1;
+		}
+		t->out = out;
+		t->out_size = size;
+	}
+	memcpy(t->out + t->out_len, str, len);
+	t->out_len += len;
+	return 0;
+}
+
+/*
+ * Returns 1 if the record is one we want: in the time range, of the channel
+ * and passing the filter, if there are any.
+ */
+int is_wanted(struct worker *w, const struct record *r)
+{
+	struct metadata *meta = w->meta;
+	if (r->time < meta->start || (meta->end && r->time > meta->end))
+	{
+		return 0;
+	}
+	if (meta->chan && (r->channel.len != strlen(meta->chan) ||
+			memcmp(r->channel.str, meta->chan, r->channel.len) != 0))
+	{
+		return 0;
+	}
+	if (!meta->filter)
+	{
+		return 1;
+	}
+
+	// The filter wants null-terminated strings, records don't have them
+	memcpy(w->origin, r->origin.str, r->origin.len);
+	w->origin[r->origin.len] = '\0';
+	memcpy(w->message, r->message.str, r->message.len);
+	w->message[r->message.len] = '\0';
+	return filter_match(&meta->flt, w->origin, w->message);
+}
+
+/*
+ * Formats one record the way dumpread prints it, always including the
+ * channel, optionally preceded by the tags in IRC notation. Returns 0 on
+ * success, -1 on error.
+ */
+int format_record(struct worker *w, struct task *t, const struct record *r)
+{
+	size_t stamp_len = 0;
+	const char *stamp = stamp_at(&w->stamp, r->time, &stamp_len);
+	int res = append(t, stamp, stamp_len);
+
+	if (w->meta->show_tags && r->num_tags > 0)
+	{
+		for (size_t i = 0; i < r->num_tags; ++i)
+		{
+			res |= append(t, i == 0 ? "@" : ";", 1);
+			res |= append(t, r->tags[i].key.str, r->tags[i].key.len);
+			res |= append(t, "=", 1);
+			res |= append(t, r->tags[i].value.str, r->tags[i].value.len);
+		}
+		res |= append(t, " ", 1);
+	}
+
+	res |= append(t, r->channel.str, r->channel.len);
+	if (r->type == RECORD_ACTION)
+	{
+		res |= append(t, " * ", 3);
+		res |= append(t, r->origin.str, r->origin.len);
+		res |= append(t, " ", 1);
+	}
+	else
+	{
+		res |= append(t, " ", 1);
+		res |= append(t, r->origin.str, r->origin.len);
+		res |= append(t, ": ", 2);
+	}
+	res |= append(t, r->message.str, r->message.len);
+	res |= append(t, "\n", 1);
+	return res;
+}
+
+/*
+ * Formats all records of the task that we want. Returns 0 on success, -1 on
+ * error.
+ */
+int run_task(struct worker *w, struct task *t)
+{
+	const char *data = t->data;
+	size_t len = t->len;
+	if (t->packed)
+	{
+		data = archive_unpack(&w->rd, &t->blk, t->data);
+		len = t->blk.raw_len;
+		if (data == NULL)
+		{
+			return -1;
+		}
+	}
+
+	struct record r;
+	size_t pos = 0;
+	while (pos < len)
+	{
+		size_t res = record_decode(data + pos, len - pos, &r);
+		if (res == 0)
+		{
+			return -1;
+		}
+		pos += res;
+		if (is_wanted(w, &r) && format_record(w, t, &r) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Takes tasks in order until there are none left. To keep the tasks waiting
+ * to be written out (and their memory) in check, no thread gets more than
+ * TASK_WINDOW tasks per thread ahead of the writer.
+ */
+void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct metadata *meta = w->meta;
+	size_t window = (size_t) meta->threads * TASK_WINDOW;
+
+	for (;;)
+	{
+		size_t i = atomic_fetch_add(&meta->next, 1);
+		if (i >= meta->num_tasks)
+		{
+			break;
+		}
+
+		pthread_mutex_lock(&meta->lock);
+		while (i >= meta->written + window)
+		{
+			pthread_cond_wait(&meta->cond, &meta->lock);
+		}
+		pthread_mutex_unlock(&meta->lock);
+
+		int res = run_task(w, &meta->tasks[i]);
+
+		pthread_mutex_lock(&meta->lock);
+		meta->tasks[i].done = res == -1 ? -1 : 1;
+		pthread_cond_broadcast(&meta->cond);
+		pthread_mutex_unlock(&meta->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Writes the output of the tasks to stdout in order, as they get done.
+ * Returns 0 on success, -1 if a task failed or writing did.
+ */
+int write_tasks(struct metadata *meta)
+{
+	int status = 0;
+	for (size_t i = 0; i < meta->num_tasks; ++i)
+	{
+		struct task *t = &meta->tasks[i];
+		pthread_mutex_lock(&meta->lock);
+		while (t->done == 0)
+		{
+			pthread_cond_wait(&meta->cond, &meta->lock);
+		}
+		pthread_mutex_unlock(&meta->lock);
+
+		if (t->done == -1)
+		{
+			status = -1;
+		}
+		if (t->out_len && fwrite(t->out, 1, t->out_len, stdout) != t->out_len)
+		{
+			status = -1;
+		}
+		free(t->out);
+		t->out = NULL;
+
+		pthread_mutex_lock(&meta->lock);
+		meta->written = i + 1;
+		pthread_cond_broadcast(&meta->cond);
+		pthread_mutex_unlock(&meta->lock);
+	}
+	return fflush(stdout) == EOF ? -1 : status;
+}
+
+void free_maps(struct metadata *meta)
+{
+	for (size_t i = 0; i < meta->num_maps; ++i)
+	{
+		if (meta->maps[i].map)
+		{
+			munmap(meta->maps[i].map, meta->maps[i].size);
+		}
+		segment_close(&meta->maps[i].seg);
+	}
+	free(meta->maps);
+	for (size_t i = 0; i < meta->num_tasks; ++i)
+	{
+		free(meta->tasks[i].out);
+	}
+	free(meta->tasks);
+}
+
+void version()
+{
+	fprintf(stdout, "twitch-redump version %d.%d.%d - %s\n",
+				VERSION_MAJOR,
+				VERSION_MINOR,
+				VERSION_BUILD,
+				PROJECT_URL);
+}
+
+void help(char *invocation)
+{
+	fprintf(stdout, "Usage:\n");
+	fprintf(stdout, "\t%s [OPTION...] FILE...\n", invocation);
+	fprintf(stdout, "\t Note: FILE can be an archive (dump -b) or segment (dump -d),\n");
+	fprintf(stdout, "\t       but not a pipe, as files are mapped\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t-c CHANNEL Only write messages sent to this channel.\n");
+	fprintf(stdout, "\t-e TIME Only write messages up to this time.\n");
+	fprintf(stdout, "\t-g FILE Only write chat with one of the keywords in FILE, one per\n");
+	fprintf(stdout, "\t        line, ignoring case; lines like /regex/ are regexes.\n");
+	fprintf(stdout, "\t-h Print this help text and exit.\n");
+	fprintf(stdout, "\t-j NUM Number of threads, defaults to the number of CPU cores.\n");
+	fprintf(stdout, "\t-k Write the tags that have been kept for every message.\n");
+	fprintf(stdout, "\t-m Prefix the time in seconds since the epoch, with microseconds.\n");
+	fprintf(stdout, "\t-s TIME Only write messages from this time on.\n");
+	fprintf(stdout, "\t-t FORMAT Timestamp format (default: %s).\n", DEFAULT_TIMESTAMP);
+	fprintf(stdout, "\t-u FILE Only write chat of the users in FILE, one per line.\n");
+	fprintf(stdout, "\t-U FILE Don't write chat of the users in FILE, one per line.\n");
+	fprintf(stdout, "\t-v Print version information and exit.\n");
+	fprintf(stdout, "\n");
+	fprintf(stdout, "TIME is either seconds since the epoch or 'YYYY-MM-DD[ HH:MM[:SS]]'.\n");
+	fprintf(stdout, "The output is the same as that of dumpread, in the same order.\n");
+	fprintf(stdout, "\n");
+	version();
+}
+
+/*
+ * Main - this is where we make things happen!
+ */
+int main(int argc, char **argv)
+{
+	struct metadata m = { 0 };
+	m.timestamp = DEFAULT_TIMESTAMP;
+
+	if (filter_init(&m.flt) == -1)
+	{
+		fprintf(stderr, "Error initializing filter, exiting\n");
+		return EXIT_FAILURE;
+	}
+
+	// Process command line options
+	opterr = 0;
+	int o;
+	while ((o = getopt(argc, argv, "c:e:g:j:s:t:u:U:kmvh")) != -1)
+	{
+		switch(o)
+		{
+			case 'c':
+				m.chan = optarg;
+				break;
+			case 'e':
+				if ((m.end = parse_time(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid end time, exiting\n");
+					filter_free(&m.flt);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				if ((m.start = parse_time(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid start time, exiting\n");
+					filter_free(&m.flt);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'g':
+			case 'u':
+			case 'U':
+				m.filter = 1;
+				if (filter_read(&m.flt, o == 'g' ? FILTER_WORDS :
+						o == 'u' ? FILTER_ALLOW : FILTER_DENY, optarg) == -1)
+				{
+					fprintf(stderr, "Error reading %s, exiting\n", optarg);
+					filter_free(&m.flt);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'j':
+				m.threads = atoi(optarg);
+				break;
+			case 't':
+				m.timestamp = optarg;
+				break;
+			case 'k':
+				m.show_tags = 1;
+				break;
+			case 'm':
+				m.epoch = 1;
+				break;
+			case 'v':
+				version();
+				filter_free(&m.flt);
+				return EXIT_SUCCESS;
+			case 'h':
+				help(argv[0]);
+				filter_free(&m.flt);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (optind == argc)
+	{
+		help(argv[0]);
+		filter_free(&m.flt);
+		return EXIT_FAILURE;
+	}
+	if (m.filter && filter_compile(&m.flt) == -1)
+	{
+		fprintf(stderr, "Error compiling filter, exiting\n");
+		filter_free(&m.flt);
+		return EXIT_FAILURE;
+	}
+
+	// One thread per core, unless told otherwise
+	if (m.threads <= 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		m.threads = cores > 0 ? cores : 1;
+	}
+
+	// Split all files up front, so all threads have work from the start
+	int status = EXIT_SUCCESS;
+	for (int i = optind; i < argc; ++i)
+	{
+		if (add_file(&m, argv[i]) == -1)
+		{
+			fprintf(stderr, "Error reading archive %s\n", argv[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	struct worker *workers = calloc(m.threads, sizeof(struct worker));
+	if (workers == NULL)
+	{
+		fprintf(stderr, "Error initializing, exiting\n");
+		free_maps(&m);
+		filter_free(&m.flt);
+		return EXIT_FAILURE;
+	}
+
+	atomic_init(&m.next, 0);
+	pthread_mutex_init(&m.lock, NULL);
+	pthread_cond_init(&m.cond, NULL);
+
+	int launched = 0;
+	for (; launched < m.threads; ++launched)
+	{
+		workers[launched].meta = &m;
+		stamp_init(&workers[launched].stamp, m.timestamp, m.epoch ? STAMP_REALTIME : STAMP_NONE);
+		if (pthread_create(&workers[launched].thread, NULL, &run_worker, &workers[launched]) != 0)
+		{
+			break;
+		}
+	}
+
+	// Without any threads, we'd wait forever
+	if (launched == 0)
+	{
+		fprintf(stderr, "Error launching threads, exiting\n");
+		status = EXIT_FAILURE;
+	}
+	else if (write_tasks(&m) == -1)
+	{
+		fprintf(stderr, "Error reading archives or writing output\n");
+		status = EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < launched; ++i)
+	{
+		pthread_join(workers[i].thread, NULL);
+		archive_close(&workers[i].rd);
+	}
+	pthread_cond_destroy(&m.cond);
+	pthread_mutex_destroy(&m.lock);
+
+	free(workers);
+	free_maps(&m);
+	filter_free(&m.flt);
+	return status;
+}
@@ -0,0 +1,520 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), free()
+#include <string.h>     // strcmp(), strdup(), strlen(), memcpy()
+#include <stdint.h>     // uint64_t, UINT64_MAX
+#include <time.h>       // clock_gettime()
+#include "sched.h"
+#include "metrics.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int bucket_init(struct bucket *b, int limit, uint64_t window)
+{
+	b->sent = calloc(limit, sizeof(uint64_t));
+	b->limit = limit;
+	b->pos = 0;
+	b->window = window + SCHED_MARGIN_MS;
+	return b->sent ? 0 : -1;
+}
+
+/*
+ * Returns the earliest time the next message may be sent. The slot at 'pos'
+ * holds the oldest of the last 'limit' send times, zero if it was never used.
+ */
+static uint64_t bucket_ready(const struct bucket *b, uint64_t now)
+{
+	uint64_t oldest = b->sent[b->pos];
+	return oldest == 0 || oldest + b->window <= now ? now : oldest + b->window;
+}
+
+/*
+ * Returns the number of messages that may be sent right now.
+ */
+static int bucket_avail(const struct bucket *b, uint64_t now)
+{
+	int avail = 0;
+	for (int i = 0; i < b->limit; ++i)
+	{
+		avail += b->sent[i] == 0 || b->sent[i] + b->window <= now;
+	}
+	return avail;
+}
+
+static void bucket_take(struct bucket *b, uint64_t now)
+{
+	b->sent[b->pos] = now;
+	b->pos = (b->pos + 1) % b->limit;
+}
+
+static void bucket_free(struct bucket *b)
+{
+	free(b->sent);
+	b->sent = NULL;
+}
+
+/*
+ * FNV-1a over kind, target and text, so coalescing rarely needs strcmp().
+ */
+static uint64_t hash_msg(enum sched_kind kind, const char *target, const char *text)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ kind) * 1099511628211ULL;
+	for (const char *c = target; *c; ++c)
+	{
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+	hash = (hash ^ ' ') * 1099511628211ULL;
+	for (const char *c = text; *c; ++c)
+	{
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static struct sched_chan *find_chan(struct sched *sc, const char *name)
+{
+	for (size_t i = 0; i < sc->num_chans; ++i)
+	{
+		if (strcmp(sc->chans[i].name, name) == 0)
+		{
+			return &sc->chans[i];
+		}
+	}
+	return NULL;
+}
+
+static struct sched_chan *get_chan(struct sched *sc, const char *name)
+{
+	struct sched_chan *chan = find_chan(sc, name);
+	if (chan)
+	{
+		return chan;
+	}
+
+	struct sched_chan *chans = realloc(sc->chans, (sc->num_chans + 1) * sizeof(struct sched_chan));
+	if (chans == NULL)
+	{
+		return NULL;
+	}
+	sc->chans = chans;
+
+	chan = &sc->chans[sc->num_chans];
+	chan->mod = 0;
+	if ((chan->name = strdup(name)) == NULL)
+	{
+		return NULL;
+	}
+	if (bucket_init(&chan->bucket, 1, SCHED_CHAN_WINDOW) == -1)
+	{
+		free(chan->name);
+		return NULL;
+	}
+	sc->num_chans += 1;
+	return chan;
+}
+
+/*
+ * Returns the rate limits that apply to the message: up to two buckets, the
+ * first one being shared with other channels (or other whispers).
+ */
+static int msg_buckets(struct sched *sc, struct sched_msg *msg, struct bucket **b)
+{
+	if (msg->kind == SCHED_WHISPER)
+	{
+		b[0] = &sc->whisper_min;
+		b[1] = &sc->whisper_sec;
+		return 2;
+	}
+
+	struct sched_chan *chan = get_chan(sc, msg->target);
+	if (chan == NULL)
+	{
+		return 0;
+	}
+	if (chan->mod)
+	{
+		b[0] = &sc->mod;
+		return 1;
+	}
+	b[0] = &sc->user;
+	b[1] = &chan->bucket;
+	return 2;
+}
+
+/*
+ * Takes a message from the slab and fills it in; 'deadline' is absolute
+ * (ms). Returns NULL on error, or if the target or text is too long, in which
+ * case Twitch wouldn't take it anyway.
+ */
+struct sched_msg *sched_new_msg(struct slab *msgs, enum sched_kind kind, const char *target,
+		const char *text, int prio, uint64_t deadline)
+{
+	size_t target_len = strlen(target);
+	size_t text_len = strlen(text);
+	if (target_len >= SCHED_TARGET_MAX || text_len >= SCHED_TEXT_MAX)
+	{
+		return NULL;
+	}
+
+	struct sched_msg *msg = slab_get(msgs);
+	if (msg == NULL)
+	{
+		return NULL;
+	}
+	msg->kind = kind;
+	msg->prio = prio;
+	msg->hash = 0;
+	msg->deadline = deadline;
+	msg->next = NULL;
+	memcpy(msg->target, target, target_len + 1);
+	memcpy(msg->text, text, text_len + 1);
+	return msg;
+}
+
+void sched_free_msg(struct sched_msg *msg)
+{
+	slab_put(msg);
+}
+
+/*
+ * Updates the number of queued messages, and with it the metrics.
+ */
+static void set_queued(struct sched *sc, size_t queued)
+{
+	metrics_add(METRICS_SEND_QUEUE, (long long) queued - (long long) sc->queued);
+	sc->queued = queued;
+}
+
+static void send_msg(struct sched *sc, struct sched_msg *msg)
+{
+	switch (msg->kind)
+	{
+		case SCHED_PRIVMSG:
+			twirc_cmd_privmsg(sc->s, msg->target, msg->text);
+			break;
+		case SCHED_ACTION:
+			twirc_cmd_action(sc->s, msg->target, msg->text);
+			break;
+		case SCHED_WHISPER:
+			twirc_cmd_whisper(sc->s, msg->target, msg->text);
+			break;
+	}
+	sc->sent += 1;
+	metrics_add(METRICS_SENT, 1);
+}
+
+static void handle_timer(struct evloop *loop, int fd, void *ctx)
+{
+	struct sched *sc = ctx;
+	sc->timer = -1;
+	sched_run(sc);
+}
+
+/*
+ * Makes sure sched_run() gets called at the given time (or earlier).
+ */
+static void arm_timer(struct sched *sc, uint64_t due, uint64_t now)
+{
+	if (sc->timer != -1)
+	{
+		if (sc->timer_due <= due)
+		{
+			return;
+		}
+		evloop_cancel(sc->loop, sc->timer);
+	}
+	sc->timer = evloop_timer(sc->loop, (int) (due - now), 0, handle_timer, sc);
+	sc->timer_due = due;
+}
+
+/*
+ * Sends every queued message the rate limits allow right now, highest
+ * priority first, and sets the timer for when the next one may go. A waiting
+ * message reserves the shared bucket it needs: lower priorities only get to
+ * use that bucket as long as they don't take its last free slot. Does nothing
+ * while there is no connection.
+ */
+void sched_run(struct sched *sc)
+{
+	// Without a connection, everything waits for the next one
+	if (sc->s == NULL)
+	{
+		return;
+	}
+
+	uint64_t now = now_ms();
+	uint64_t next = UINT64_MAX;
+	struct bucket *reserved[SCHED_NUM_PRIOS * 2];
+	int num_reserved = 0;
+
+	for (int prio = 0; prio < SCHED_NUM_PRIOS; ++prio)
+	{
+		struct sched_msg **link = &sc->head[prio];
+		while (*link)
+		{
+			struct sched_msg *msg = *link;
+			struct bucket *b[2];
+			int num_b = msg_buckets(sc, msg, b);
+
+			uint64_t ready = now;
+			for (int i = 0; i < num_b; ++i)
+			{
+				uint64_t t = bucket_ready(b[i], now);
+				ready = t > ready ? t : ready;
+			}
+
+			// Leave the last free slot to whoever reserved it; we'll
+			// have another look once the reserving message is sent
+			int blocked = 0;
+			for (int i = 0; i < num_reserved && ready == now && num_b > 0; ++i)
+			{
+				blocked |= reserved[i] == b[0] && bucket_avail(b[0], now) < 2;
+			}
+			if (blocked && now <= msg->deadline)
+			{
+				link = &msg->next;
+				continue;
+			}
+
+			// Sending it late would be worse than not sending it at all
+			if (num_b == 0 || blocked || ready > msg->deadline)
+			{
+				*link = msg->next;
+				sched_free_msg(msg);
+				set_queued(sc, sc->queued - 1);
+				sc->expired += 1;
+				metrics_add(METRICS_DROPPED, 1);
+				continue;
+			}
+
+			if (ready == now)
+			{
+				for (int i = 0; i < num_b; ++i)
+				{
+					bucket_take(b[i], now);
+				}
+				send_msg(sc, msg);
+				*link = msg->next;
+				sched_free_msg(msg);
+				set_queued(sc, sc->queued - 1);
+				continue;
+			}
+
+			if (num_reserved < SCHED_NUM_PRIOS * 2)
+			{
+				reserved[num_reserved++] = b[0];
+			}
+			next = ready < next ? ready : next;
+			link = &msg->next;
+		}
+		sc->tail[prio] = link;
+	}
+
+	if (next != UINT64_MAX)
+	{
+		arm_timer(sc, next, now);
+	}
+}
+
+static int enqueue(struct sched *sc, enum sched_kind kind, const char *target,
+		const char *text, int prio, int deadline)
+{
+	if (prio < 0 || prio >= SCHED_NUM_PRIOS)
+	{
+		prio = SCHED_NORMAL;
+	}
+	uint64_t due = now_ms() + (deadline > 0 ? deadline : SCHED_DEADLINE);
+	uint64_t hash = hash_msg(kind, target, text);
+
+	// The same message is already waiting, one of them is plenty
+	for (int p = 0; p < SCHED_NUM_PRIOS; ++p)
+	{
+		for (struct sched_msg *msg = sc->head[p]; msg; msg = msg->next)
+		{
+			if (msg->hash == hash && msg->kind == kind &&
+			    strcmp(msg->target, target) == 0 && strcmp(msg->text, text) == 0)
+			{
+				msg->deadline = due > msg->deadline ? due : msg->deadline;
+				sc->coalesced += 1;
+				metrics_add(METRICS_COALESCED, 1);
+				return 0;
+			}
+		}
+	}
+
+	if (sc->queued == SCHED_MAX_QUEUED)
+	{
+		sc->rejected += 1;
+		metrics_add(METRICS_DROPPED, 1);
+		return -1;
+	}
+
+	struct sched_msg *msg = sched_new_msg(sc->msgs, kind, target, text, prio, due);
+	if (msg == NULL)
+	{
+		return -1;
+	}
+	msg->hash = hash;
+
+	*sc->tail[prio] = msg;
+	sc->tail[prio] = &msg->next;
+	set_queued(sc, sc->queued + 1);
+
+	// Often, the message can go right away
+	sched_run(sc);
+	return 0;
+}
+
+/*
+ * Sets up the scheduler for the given state, using the loop for its timer
+ * and the slab for its messages, which can be shared by several schedulers.
+ * Returns 0 on success, -1 on error.
+ */
+int sched_init(struct sched *sc, struct evloop *loop, twirc_state_t *s, struct slab *msgs)
+{
+	memset(sc, 0, sizeof(struct sched));
+	sc->s = s;
+	sc->loop = loop;
+	sc->msgs = msgs;
+	sc->timer = -1;
+	for (int prio = 0; prio < SCHED_NUM_PRIOS; ++prio)
+	{
+		sc->tail[prio] = &sc->head[prio];
+	}
+
+	if (bucket_init(&sc->user, SCHED_USER_LIMIT, SCHED_CHAT_WINDOW) == -1 ||
+	    bucket_init(&sc->mod, SCHED_MOD_LIMIT, SCHED_CHAT_WINDOW) == -1 ||
+	    bucket_init(&sc->whisper_sec, SCHED_WHISPER_SEC, 1000) == -1 ||
+	    bucket_init(&sc->whisper_min, SCHED_WHISPER_MIN, 60000) == -1)
+	{
+		sched_free(sc);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queues a chat message to the given channel. 'deadline' is how long it may
+ * wait (in milliseconds, 0 for the default). Returns 0 on success, -1 if the
+ * queue is full or on error.
+ */
+int sched_privmsg(struct sched *sc, const char *chan, const char *msg, int prio, int deadline)
+{
+	return enqueue(sc, SCHED_PRIVMSG, chan, msg, prio, deadline);
+}
+
+/*
+ * Queues a "/me" message to the given channel, see sched_privmsg().
+ */
+int sched_action(struct sched *sc, const char *chan, const char *msg, int prio, int deadline)
+{
+	return enqueue(sc, SCHED_ACTION, chan, msg, prio, deadline);
+}
+
+/*
+ * Queues a whisper to the given user, see sched_privmsg().
+ */
+int sched_whisper(struct sched *sc, const char *nick, const char *msg, int prio, int deadline)
+{
+	return enqueue(sc, SCHED_WHISPER, nick, msg, prio, deadline);
+}
+
+/*
+ * Queues a message of the given kind, for when the kind isn't known until
+ * runtime, see sched_privmsg().
+ */
+int sched_send(struct sched *sc, enum sched_kind kind, const char *target, const char *msg,
+		int prio, int deadline)
+{
+	return enqueue(sc, kind, target, msg, prio, deadline);
+}
+
+/*
+ * Takes all queued messages out of the scheduler, highest priority first,
+ * for example to hand them to another connection. The caller has to free
+ * them with sched_free_msg(). Returns NULL if nothing was queued.
+ */
+struct sched_msg *sched_drain(struct sched *sc)
+{
+	struct sched_msg *list = NULL;
+	struct sched_msg **tail = &list;
+	for (int prio = 0; prio < SCHED_NUM_PRIOS; ++prio)
+	{
+		if (sc->head[prio])
+		{
+			*tail = sc->head[prio];
+			tail = sc->tail[prio];
+		}
+		sc->head[prio] = NULL;
+		sc->tail[prio] = &sc->head[prio];
+	}
+	set_queued(sc, 0);
+
+	if (sc->timer != -1)
+	{
+		evloop_cancel(sc->loop, sc->timer);
+		sc->timer = -1;
+	}
+	return list;
+}
+
+/*
+ * Tells the scheduler whether we're a moderator (or the broadcaster) in the
+ * channel, as learned from USERSTATE. Returns 0 on success, -1 on error.
+ */
+int sched_set_mod(struct sched *sc, const char *chan, int mod)
+{
+	struct sched_chan *c = get_chan(sc, chan);
+	if (c == NULL)
+	{
+		return -1;
+	}
+	if (c->mod != mod)
+	{
+		c->mod = mod;
+		sched_run(sc);
+	}
+	return 0;
+}
+
+/*
+ * Drops all queued messages and frees the scheduler's resources.
+ */
+void sched_free(struct sched *sc)
+{
+	for (int prio = 0; prio < SCHED_NUM_PRIOS; ++prio)
+	{
+		while (sc->head[prio])
+		{
+			struct sched_msg *msg = sc->head[prio];
+			sc->head[prio] = msg->next;
+			sched_free_msg(msg);
+		}
+		sc->tail[prio] = &sc->head[prio];
+	}
+	set_queued(sc, 0);
+
+	if (sc->timer != -1)
+	{
+		evloop_cancel(sc->loop, sc->timer);
+		sc->timer = -1;
+	}
+
+	for (size_t i = 0; i < sc->num_chans; ++i)
+	{
+		free(sc->chans[i].name);
+		bucket_free(&sc->chans[i].bucket);
+	}
+	free(sc->chans);
+	sc->chans = NULL;
+	sc->num_chans = 0;
+
+	bucket_free(&sc->user);
+	bucket_free(&sc->mod);
+	bucket_free(&sc->whisper_sec);
+	bucket_free(&sc->whisper_min);
+}
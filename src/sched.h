@@ -0,0 +1,123 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include "libtwirc.h"
+#include "evloop.h"
+#include "slab.h"
+
+#define SCHED_USER_LIMIT     20     // Messages per window as a regular user
+#define SCHED_MOD_LIMIT      100    // Messages per window as a moderator
+#define SCHED_CHAT_WINDOW    30000  // Window of the above (ms)
+#define SCHED_CHAN_WINDOW    1000   // One message per channel per second
+#define SCHED_WHISPER_SEC    3      // Whispers per second
+#define SCHED_WHISPER_MIN    100    // Whispers per minute
+#define SCHED_MARGIN_MS      250    // Added to every window, for jitter
+#define SCHED_MAX_QUEUED     1024   // Messages waiting, over all priorities
+#define SCHED_DEADLINE       10000  // Default deadline (ms)
+#define SCHED_TARGET_MAX     64     // Longest channel or nick, plus '\0'
+#define SCHED_TEXT_MAX       2048   // Twitch takes 500 characters, in UTF-8
+
+enum sched_prio
+{
+	SCHED_HIGH,      // Replies that matter, mod actions
+	SCHED_NORMAL,    // Regular replies
+	SCHED_LOW,       // Announcements and other chatter
+	SCHED_NUM_PRIOS
+};
+
+enum sched_kind
+{
+	SCHED_PRIVMSG,
+	SCHED_ACTION,
+	SCHED_WHISPER
+};
+
+/*
+ * Twitch counts messages in a sliding window: no more than 'limit' within
+ * any 'window' milliseconds. A classic token bucket that refills at
+ * limit/window would allow a burst of 'limit' right after another 'limit'
+ * trickled in, which is how bots end up globally throttled. So the bucket
+ * remembers the times of the last 'limit' messages instead, which tells us
+ * exactly when the next one may go.
+ */
+struct bucket
+{
+	uint64_t *sent;       // Ring of send times (ms), oldest at 'pos'
+	int       limit;
+	int       pos;
+	uint64_t  window;     // Including SCHED_MARGIN_MS
+};
+
+/*
+ * A message waiting to be sent. The strings are part of it, so it takes only
+ * one allocation, which comes from a slab: messages are created and freed
+ * all the time, often in different threads.
+ */
+struct sched_msg
+{
+	enum sched_kind   kind;
+	int               prio;
+	uint64_t          hash;     // Of kind, target and text, for coalescing
+	uint64_t          deadline; // Drop if it can't be sent by then (ms)
+	struct sched_msg *next;
+	char              target[SCHED_TARGET_MAX]; // Channel or, for whispers, nick
+	char              text[SCHED_TEXT_MAX];
+};
+
+/*
+ * What we know about a channel: whether we're a moderator (or broadcaster)
+ * there, which gets us the higher limits, and when we last sent to it.
+ */
+struct sched_chan
+{
+	char             *name;
+	int               mod;
+	struct bucket     bucket;  // Regular users: one message per second
+};
+
+/*
+ * Queues outgoing chat messages and whispers and sends them as soon as
+ * Twitch's rate limits allow, highest priority first. Identical messages
+ * that are already waiting are coalesced, and messages that can't be sent
+ * before their deadline are dropped instead of being sent late. A timer on
+ * the event loop fires exactly when the next message may go.
+ */
+struct sched
+{
+	twirc_state_t     *s;
+	struct evloop     *loop;
+	struct slab       *msgs;       // Where our messages come from
+	int                timer;      // Timer ID, -1 if not armed
+	uint64_t           timer_due;  // When the timer fires (ms)
+	struct sched_msg  *head[SCHED_NUM_PRIOS];
+	struct sched_msg **tail[SCHED_NUM_PRIOS];
+	size_t             queued;
+	struct bucket      user;       // Messages to channels we don't moderate
+	struct bucket      mod;        // Messages to channels we moderate
+	struct bucket      whisper_sec;
+	struct bucket      whisper_min;
+	struct sched_chan *chans;
+	size_t             num_chans;
+	uint64_t           sent;       // Statistics
+	uint64_t           coalesced;
+	uint64_t           expired;
+	uint64_t           rejected;
+};
+
+int  sched_init(struct sched *sc, struct evloop *loop, twirc_state_t *s, struct slab *msgs);
+int  sched_privmsg(struct sched *sc, const char *chan, const char *msg, int prio, int deadline);
+int  sched_action(struct sched *sc, const char *chan, const char *msg, int prio, int deadline);
+int  sched_whisper(struct sched *sc, const char *nick, const char *msg, int prio, int deadline);
+int  sched_send(struct sched *sc, enum sched_kind kind, const char *target, const char *msg,
+		int prio, int deadline);
+int  sched_set_mod(struct sched *sc, const char *chan, int mod);
+void sched_run(struct sched *sc);
+struct sched_msg *sched_drain(struct sched *sc);
+struct sched_msg *sched_new_msg(struct slab *msgs, enum sched_kind kind, const char *target,
+		const char *text, int prio, uint64_t deadline);
+void sched_free_msg(struct sched_msg *msg);
+void sched_free(struct sched *sc);
+
+#endif
@@ -0,0 +1,546 @@
+#include <stdio.h>      // snprintf()
+#include <stdlib.h>     // NULL, malloc(), free()
+#include <string.h>     // memcpy(), memcmp(), memset()
+#include <errno.h>      // errno
+#include <fcntl.h>      // open(), posix_fallocate()
+#include <unistd.h>     // close(), ftruncate(), sysconf()
+#include <sys/mman.h>   // mmap(), msync(), munmap()
+#include <sys/stat.h>   // fstat()
+#include "segment.h"
+
+#define SEGMENT_MIN_FREE (64 * 1024) // Don't continue segments fuller than this
+#define SEGMENT_MAX_SUFFIX 1000
+
+/*
+ * Syncs the range [from, to) of the segment's mapping to disk. msync() wants
+ * the start address to be page aligned, so we round it down.
+ */
+static void sync_range(struct segment *seg, size_t from, size_t to)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	from -= from % page;
+	msync(seg->map + from, to - from, MS_SYNC);
+}
+
+/*
+ * Syncs everything that has been written since the last sync, plus the
+ * header, which holds the number of used bytes and the index.
+ */
+static void sync_segment(struct segment *seg)
+{
+	size_t used = atomic_load(&seg->used);
+	if (used == seg->synced)
+	{
+		return;
+	}
+	sync_range(seg, SEGMENT_HEADER + seg->synced, SEGMENT_HEADER + used);
+	sync_range(seg, 0, SEGMENT_HEADER);
+	seg->synced = used;
+}
+
+/*
+ * Syncs the segment one last time, then gets rid of the unused, preallocated
+ * space at its end and frees everything.
+ */
+static void finish_segment(struct segment *seg)
+{
+	size_t used = atomic_load(&seg->used);
+	sync_segment(seg);
+	munmap(seg->map, seg->size);
+	if (ftruncate(seg->fd, SEGMENT_HEADER + used) == 0)
+	{
+		fdatasync(seg->fd);
+	}
+	close(seg->fd);
+	free(seg);
+}
+
+/*
+ * The syncer thread: syncs the segments in regular intervals and finishes
+ * those the writers are done with. This way, neither of it ever blocks the
+ * workers, they only ever write to memory.
+ */
+static void *run_syncer(void *arg)
+{
+	struct segdir *sd = arg;
+
+	pthread_mutex_lock(&sd->lock);
+	while (!sd->stop)
+	{
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += SEGMENT_SYNC_MS / 1000;
+		until.tv_nsec += (SEGMENT_SYNC_MS % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec += 1;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&sd->cond, &sd->lock, &until);
+
+		// Take the retired segments out of the list
+		struct segment *retired = NULL;
+		struct segment **link = &sd->list;
+		while (*link)
+		{
+			struct segment *seg = *link;
+			if (atomic_load(&seg->retired))
+			{
+				*link = seg->next;
+				seg->next = retired;
+				retired = seg;
+			}
+			else
+			{
+				link = &seg->next;
+			}
+		}
+
+		// New segments only ever get added at the head of the list and
+		// only we remove them, so we can walk it without holding the lock
+		struct segment *head = sd->list;
+		pthread_mutex_unlock(&sd->lock);
+
+		for (struct segment *seg = head; seg; seg = seg->next)
+		{
+			sync_segment(seg);
+		}
+		while (retired)
+		{
+			struct segment *next = retired->next;
+			finish_segment(retired);
+			retired = next;
+		}
+
+		pthread_mutex_lock(&sd->lock);
+	}
+	pthread_mutex_unlock(&sd->lock);
+	return NULL;
+}
+
+/*
+ * Puts together the path for the segment of the given channel and period.
+ * The channel's '#' is dropped, anything that can't go in a file name is
+ * replaced. For 'suffix' > 0, that number is added to the name.
+ */
+static void segment_path(struct segdir *sd, char *buf, size_t len,
+		const struct span *chan, uint64_t start, int suffix)
+{
+	char name[RECORD_MAX_SHORT + 1];
+	size_t name_len = 0;
+	for (size_t i = 0; i < chan->len; ++i)
+	{
+		char c = chan->str[i];
+		if (c == '#' && i == 0)
+		{
+			continue;
+		}
+		name[name_len++] = (c == '/' || c == '.') ? '_' : c;
+	}
+	name[name_len] = '\0';
+
+	// Only include the minutes if periods don't start on the hour
+	time_t t = start;
+	struct tm lt;
+	localtime_r(&t, &lt);
+	char date[32];
+	strftime(date, sizeof(date), sd->period % 3600 ? "%Y%m%d-%H%M" : "%Y%m%d-%H", &lt);
+
+	if (suffix > 0)
+	{
+		snprintf(buf, len, "%s/%s-%s-%d.seg", sd->dir, name, date, suffix);
+	}
+	else
+	{
+		snprintf(buf, len, "%s/%s-%s.seg", sd->dir, name, date);
+	}
+}
+
+/*
+ * Checks whether the file mapped by 'seg' is a segment for the same period
+ * that still has room, in which case we pick up where it left off.
+ * Returns 1 if so, 0 otherwise.
+ */
+static int resume_segment(struct segment *seg)
+{
+	const char *hdr = seg->map;
+	if (memcmp(hdr, SEGMENT_MAGIC, 4) != 0 || hdr[4] != SEGMENT_VERSION)
+	{
+		return 0;
+	}
+	if (get_u64(hdr + 8) != seg->start)
+	{
+		return 0;
+	}
+
+	uint64_t used = get_u64(hdr + 16);
+	uint32_t num_index = get_u32(hdr + 24);
+	if (used + SEGMENT_MIN_FREE > seg->size - SEGMENT_HEADER || num_index > SEGMENT_INDEX_MAX)
+	{
+		return 0;
+	}
+
+	atomic_store(&seg->used, used);
+	seg->synced = used;
+	seg->num_index = num_index;
+	seg->last_sec = num_index ?
+		seg->start + get_u32(hdr + SEGMENT_META + (num_index - 1) * 8) : 0;
+	return 1;
+}
+
+/*
+ * Opens (or creates) the segment for the given channel and the period that
+ * 'sec' falls into, preallocates and maps it. Returns NULL on error.
+ */
+static struct segment *open_segment(struct segdir *sd, const struct span *chan, uint64_t sec)
+{
+	struct segment *seg = calloc(1, sizeof(struct segment));
+	if (seg == NULL)
+	{
+		return NULL;
+	}
+
+	seg->size = sd->size;
+	seg->start = sec - sec % sd->period;
+	seg->end = seg->start + sd->period;
+	seg->index_step = (sd->period + SEGMENT_INDEX_MAX - 1) / SEGMENT_INDEX_MAX;
+
+	for (int suffix = 0; suffix < SEGMENT_MAX_SUFFIX; ++suffix)
+	{
+		segment_path(sd, seg->path, PATH_MAX, chan, seg->start, suffix);
+
+		seg->fd = open(seg->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (seg->fd == -1)
+		{
+			break;
+		}
+
+		struct stat st;
+		if (fstat(seg->fd, &st) == -1 || (size_t) st.st_size > seg->size)
+		{
+			close(seg->fd);
+			continue;
+		}
+		int fresh = st.st_size == 0;
+
+		// Allocate the disk space right away, so we don't run into
+		// SIGBUS when the disk fills up while writing to the mapping
+		if (ftruncate(seg->fd, seg->size) == -1 ||
+		    posix_fallocate(seg->fd, 0, seg->size) != 0)
+		{
+			close(seg->fd);
+			break;
+		}
+
+		seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+		if (seg->map == MAP_FAILED)
+		{
+			close(seg->fd);
+			break;
+		}
+
+		if (fresh)
+		{
+			memcpy(seg->map, SEGMENT_MAGIC, 4);
+			seg->map[4] = SEGMENT_VERSION;
+			put_u64(seg->map + 8, seg->start);
+			return seg;
+		}
+		if (resume_segment(seg))
+		{
+			return seg;
+		}
+
+		// Not ours or full, leave it as it was and try the next name
+		munmap(seg->map, seg->size);
+		ftruncate(seg->fd, st.st_size);
+		close(seg->fd);
+	}
+
+	free(seg);
+	return NULL;
+}
+
+/*
+ * Hands the segment over to the syncer thread, which will finish it.
+ */
+static void retire_segment(struct segdir *sd, struct segment *seg)
+{
+	atomic_store(&seg->retired, 1);
+	pthread_cond_signal(&sd->cond);
+}
+
+/*
+ * Initializes the segment directory and launches the syncer thread. Segments
+ * can't be larger than SEGMENT_MAX_SIZE. Returns 0 on success, -1 on error.
+ */
+int segdir_init(struct segdir *sd, const char *dir, size_t size, time_t period)
+{
+	memset(sd, 0, sizeof(struct segdir));
+	if (size > SEGMENT_MAX_SIZE)
+	{
+		return -1;
+	}
+	sd->dir = dir;
+	sd->size = size > SEGMENT_HEADER + SEGMENT_MIN_FREE ? size : SEGMENT_HEADER + SEGMENT_MIN_FREE;
+	sd->period = period > 0 ? period : SEGMENT_PERIOD;
+
+	pthread_mutex_init(&sd->lock, NULL);
+	pthread_cond_init(&sd->cond, NULL);
+	if (pthread_create(&sd->thread, NULL, &run_syncer, sd) != 0)
+	{
+		pthread_mutex_destroy(&sd->lock);
+		pthread_cond_destroy(&sd->cond);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes the record to the segment pointed to by 'seg', which belongs to the
+ * record's channel and must only ever be used by one thread. If there is no
+ * segment yet, the period is over or the segment is full, a new one will be
+ * opened and put into 'seg'. Returns 0 on success, -1 on error.
+ */
+int segdir_write(struct segdir *sd, struct segment **seg, const struct record *r)
+{
+	uint64_t sec = r->time / 1000000;
+	size_t size = record_size(r);
+	struct segment *s = *seg;
+
+	if (s && (sec >= s->end || atomic_load(&s->used) + size > s->size - SEGMENT_HEADER))
+	{
+		retire_segment(sd, s);
+		*seg = s = NULL;
+	}
+
+	if (s == NULL)
+	{
+		if ((s = open_segment(sd, &r->channel, sec)) == NULL)
+		{
+			return -1;
+		}
+		pthread_mutex_lock(&sd->lock);
+		s->next = sd->list;
+		sd->list = s;
+		pthread_mutex_unlock(&sd->lock);
+
+		// A record that doesn't fit into a fresh segment never will
+		if (size > s->size - SEGMENT_HEADER - atomic_load(&s->used))
+		{
+			retire_segment(sd, s);
+			return -1;
+		}
+		*seg = s;
+	}
+
+	size_t used = atomic_load(&s->used);
+	record_encode(r, s->map + SEGMENT_HEADER + used, size);
+
+	// First record of a new second, remember where it is
+	if ((s->num_index == 0 || sec >= s->last_sec + s->index_step) && s->num_index < SEGMENT_INDEX_MAX)
+	{
+		char *entry = s->map + SEGMENT_META + s->num_index * 8;
+		put_u32(entry, sec > s->start ? sec - s->start : 0);
+		put_u32(entry + 4, used);
+		s->num_index += 1;
+		s->last_sec = sec;
+		put_u32(s->map + 24, s->num_index);
+	}
+
+	put_u64(s->map + 16, used + size);
+	atomic_store(&s->used, used + size);
+	return 0;
+}
+
+/*
+ * Retires the segment pointed to by 'seg' if its period is over, so segments
+ * of quiet channels get finished in time, too. Should be called regularly by
+ * the thread that writes to the segment.
+ */
+void segdir_expire(struct segdir *sd, struct segment **seg, time_t now)
+{
+	if (*seg && (uint64_t) now >= (*seg)->end)
+	{
+		retire_segment(sd, *seg);
+		*seg = NULL;
+	}
+}
+
+/*
+ * Stops the syncer thread and finishes all segments. No writes must happen
+ * during or after this call.
+ */
+void segdir_free(struct segdir *sd)
+{
+	pthread_mutex_lock(&sd->lock);
+	sd->stop = 1;
+	pthread_cond_signal(&sd->cond);
+	pthread_mutex_unlock(&sd->lock);
+	pthread_join(sd->thread, NULL);
+
+	while (sd->list)
+	{
+		struct segment *next = sd->list->next;
+		finish_segment(sd->list);
+		sd->list = next;
+	}
+
+	pthread_mutex_destroy(&sd->lock);
+	pthread_cond_destroy(&sd->cond);
+}
+
+/*
+ * Maps the segment file for reading. Returns 0 on success, -1 on error.
+ */
+int segment_open(struct segment_reader *rd, int fd)
+{
+	memset(rd, 0, sizeof(struct segment_reader));
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < SEGMENT_HEADER)
+	{
+		return -1;
+	}
+
+	rd->size = st.st_size;
+	rd->map = mmap(NULL, rd->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (rd->map == MAP_FAILED)
+	{
+		rd->map = NULL;
+		return -1;
+	}
+
+	if (memcmp(rd->map, SEGMENT_MAGIC, 4) != 0 || rd->map[4] != SEGMENT_VERSION)
+	{
+		segment_close(rd);
+		return -1;
+	}
+
+	rd->start = get_u64(rd->map + 8);
+	rd->used = get_u64(rd->map + 16);
+	rd->num_index = get_u32(rd->map + 24);
+	if (rd->used > rd->size - SEGMENT_HEADER)
+	{
+		rd->used = rd->size - SEGMENT_HEADER;
+	}
+	if (rd->num_index > SEGMENT_INDEX_MAX)
+	{
+		rd->num_index = SEGMENT_INDEX_MAX;
+	}
+	return 0;
+}
+
+/*
+ * Skips ahead to the first record with a time of at least 'time' (in
+ * microseconds since the epoch), using the index to get close to it.
+ * Returns 1 if there is such a record, 0 if not and -1 on error.
+ */
+int segment_seek(struct segment_reader *rd, uint64_t time)
+{
+	uint64_t sec = time / 1000000;
+
+	// Binary search for the last index entry at or before 'sec'
+	const char *index = rd->map + SEGMENT_META;
+	size_t lo = 0;
+	size_t hi = rd->num_index;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (rd->start + get_u32(index + mid * 8) <= sec)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	size_t pos = lo > 0 ? get_u32(index + (lo - 1) * 8 + 4) : 0;
+	if (pos > rd->pos)
+	{
+		rd->pos = pos;
+	}
+
+	const char *data = rd->map + SEGMENT_HEADER;
+	struct record r;
+	while (rd->pos < rd->used)
+	{
+		size_t res = record_decode(data + rd->pos, rd->used - rd->pos, &r);
+		if (res == 0)
+		{
+			return -1;
+		}
+		if (r.time >= time)
+		{
+			return 1;
+		}
+		rd->pos += res;
+	}
+	return 0;
+}
+
+/*
+ * Reads the next record, whose strings point into the mapping. Returns 1 if
+ * a record has been read, 0 at the end of the segment and -1 on error.
+ */
+int segment_next(struct segment_reader *rd, struct record *r)
+{
+	if (rd->pos >= rd->used)
+	{
+		return 0;
+	}
+	size_t res = record_decode(rd->map + SEGMENT_HEADER + rd->pos, rd->used - rd->pos, r);
+	if (res == 0)
+	{
+		return -1;
+	}
+	rd->pos += res;
+	return 1;
+}
+
+/*
+ * Reads the record at the given offset, as found by segment_next() before,
+ * and moves on to the one after it. Returns 1 if a record has been read, 0
+ * if there is none and -1 on error.
+ */
+int segment_read(struct segment_reader *rd, size_t pos, struct record *r)
+{
+	rd->pos = pos;
+	return segment_next(rd, r);
+}
+
+/*
+ * Returns the offset of the first record of the first second in the index
+ * that starts at or after 'pos', or the end of the records if there is none,
+ * so the records can be split into pieces that are read in parallel.
+ */
+size_t segment_split(const struct segment_reader *rd, size_t pos)
+{
+	const char *index = rd->map + SEGMENT_META;
+	size_t lo = 0;
+	size_t hi = rd->num_index;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (get_u32(index + mid * 8 + 4) < pos)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	size_t at = lo < rd->num_index ? get_u32(index + lo * 8 + 4) : rd->used;
+	return at < rd->used ? at : rd->used;
+}
+
+void segment_close(struct segment_reader *rd)
+{
+	if (rd->map)
+	{
+		munmap(rd->map, rd->size);
+		rd->map = NULL;
+	}
+}
@@ -0,0 +1,101 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdatomic.h>  // atomic_size_t, atomic_int
+#include <time.h>       // time_t
+#include <pthread.h>    // pthread_t, pthread_mutex_t, pthread_cond_t
+#include <limits.h>     // PATH_MAX
+#include "record.h"
+
+#define SEGMENT_MAGIC     "TWSG"
+#define SEGMENT_VERSION   1
+#define SEGMENT_HEADER    (16 * 1024)
+#define SEGMENT_META      32
+#define SEGMENT_INDEX_MAX ((SEGMENT_HEADER - SEGMENT_META) / 8)
+#define SEGMENT_SIZE      (64 * 1024 * 1024) // Default for -S (in bytes)
+#define SEGMENT_MAX_SIZE  (4096ULL * 1024 * 1024) // Offsets in the index are 32 bit
+#define SEGMENT_PERIOD    3600               // Default for -R (in seconds)
+#define SEGMENT_SYNC_MS   1000               // How often the syncer runs
+
+/*
+ * Segment files hold the records of one channel for one period of time (an
+ * hour by default) and are named after both, like 'chan-YYYYMMDD-HH.seg'.
+ * They are preallocated to their full size and written via mmap(), so that
+ * writing a record is just a copy into memory. The first SEGMENT_HEADER
+ * bytes are reserved for the header, with all numbers being little endian:
+ *
+ *   4 bytes magic "TWSG", u8 version, 3 reserved bytes
+ *   u64 start of the period in seconds since the epoch
+ *   u64 number of bytes of records following the header
+ *   u32 number of index entries, 4 reserved bytes
+ *   index entries: u32 second (relative to start), u32 offset of the first
+ *                  record of that second (relative to the end of the header)
+ *
+ * An index entry is added for every second that has records. Periods longer
+ * than SEGMENT_INDEX_MAX seconds get an entry every few seconds instead, so
+ * the index always covers the whole period. Segments are never larger than
+ * SEGMENT_MAX_SIZE, so offsets fit. Records are encoded exactly like in
+ * binary archives.
+ * Once a segment is full or its period is over, it is handed to the syncer
+ * thread, which writes it to disk and truncates the unused space.
+ */
+struct segment
+{
+	int              fd;
+	char            *map;        // Mapping of the whole file
+	size_t           size;       // Size of the file/mapping
+	atomic_size_t    used;       // Bytes of records written
+	size_t           synced;     // Bytes of records synced to disk
+	uint64_t         start;      // Start of the period (seconds)
+	uint64_t         end;        // End of the period (seconds)
+	uint64_t         last_sec;   // Second of the last index entry
+	uint64_t         index_step; // Seconds from one index entry to the next, at least
+	uint32_t         num_index;  // Number of index entries
+	atomic_int       retired;    // The writer is done with this segment
+	struct segment  *next;       // Next segment in the syncer's list
+	char             path[PATH_MAX];
+};
+
+/*
+ * Configuration and syncer thread shared by all segments.
+ */
+struct segdir
+{
+	const char      *dir;        // Directory to create segments in
+	size_t           size;       // Size of new segments
+	time_t           period;     // Rotation period in seconds
+	struct segment  *list;       // All segments the syncer looks after
+	int              stop;       // Tells the syncer thread to quit
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+};
+
+/*
+ * Read-only view of a segment, for dumpread and friends.
+ */
+struct segment_reader
+{
+	char            *map;
+	size_t           size;
+	uint64_t         start;
+	size_t           used;
+	uint32_t         num_index;
+	size_t           pos;        // Offset of the next record
+};
+
+int  segdir_init(struct segdir *sd, const char *dir, size_t size, time_t period);
+int  segdir_write(struct segdir *sd, struct segment **seg, const struct record *r);
+void segdir_expire(struct segdir *sd, struct segment **seg, time_t now);
+void segdir_free(struct segdir *sd);
+
+int  segment_open(struct segment_reader *rd, int fd);
+int  segment_seek(struct segment_reader *rd, uint64_t time);
+int  segment_next(struct segment_reader *rd, struct record *r);
+int  segment_read(struct segment_reader *rd, size_t pos, struct record *r);
+size_t segment_split(const struct segment_reader *rd, size_t pos);
+void segment_close(struct segment_reader *rd);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdlib.h>     // NULL, malloc(), free()
+#include <string.h>     // memset()
+#include "slab.h"
+
+#define HEAD sizeof(union slab_head)
+
+/*
+ * Allocates another chunk and puts all of its objects into the free list.
+ * Called with the lock held. Returns 0 on success, -1 on error.
+ */
+static int grow(struct slab *sl)
+{
+	struct slab_chunk *chunk = malloc(sizeof(struct slab_chunk) + sl->per_chunk * sl->size);
+	if (chunk == NULL)
+	{
+		return -1;
+	}
+	chunk->next = sl->chunks;
+	sl->chunks = chunk;
+
+	char *pos = (char *) chunk->objs;
+	for (size_t i = 0; i < sl->per_chunk; ++i, pos += sl->size)
+	{
+		((union slab_head *) pos)->slab = sl;
+		*(void **) (pos + HEAD) = sl->free;
+		sl->free = pos + HEAD;
+	}
+	sl->num_objs += sl->per_chunk;
+	return 0;
+}
+
+/*
+ * Sets up a slab for objects of 'size' bytes, allocating 'per_chunk' of them
+ * at a time, SLAB_CHUNK if 0. Returns 0 on success, -1 on error.
+ */
+int slab_init(struct slab *sl, size_t size, size_t per_chunk)
+{
+	memset(sl, 0, sizeof(struct slab));
+	size = size < sizeof(void *) ? sizeof(void *) : size;
+	sl->size = (HEAD + size + HEAD - 1) / HEAD * HEAD;
+	sl->per_chunk = per_chunk ? per_chunk : SLAB_CHUNK;
+	return pthread_mutex_init(&sl->lock, NULL) == 0 ? 0 : -1;
+}
+
+/*
+ * Returns an object, which is not zeroed, or NULL on error.
+ */
+void *slab_get(struct slab *sl)
+{
+	pthread_mutex_lock(&sl->lock);
+	if (sl->free == NULL && grow(sl) == -1)
+	{
+		pthread_mutex_unlock(&sl->lock);
+		return NULL;
+	}
+	void *obj = sl->free;
+	sl->free = *(void **) obj;
+	sl->num_used += 1;
+	pthread_mutex_unlock(&sl->lock);
+	return obj;
+}
+
+/*
+ * Gives an object back to the slab it came from.
+ */
+void slab_put(void *obj)
+{
+	if (obj == NULL)
+	{
+		return;
+	}
+	struct slab *sl = ((union slab_head *) ((char *) obj - HEAD))->slab;
+	pthread_mutex_lock(&sl->lock);
+	*(void **) obj = sl->free;
+	sl->free = obj;
+	sl->num_used -= 1;
+	pthread_mutex_unlock(&sl->lock);
+}
+
+/*
+ * Frees all objects, whether they have been given back or not.
+ */
+void slab_free(struct slab *sl)
+{
+	while (sl->chunks)
+	{
+		struct slab_chunk *chunk = sl->chunks;
+		sl->chunks = chunk->next;
+		free(chunk);
+	}
+	sl->free = NULL;
+	sl->num_objs = 0;
+	sl->num_used = 0;
+	pthread_mutex_destroy(&sl->lock);
+}
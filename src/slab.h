@@ -0,0 +1,48 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>     // size_t, max_align_t
+#include <pthread.h>    // pthread_mutex_t
+
+#define SLAB_CHUNK 32   // Objects we allocate at once, by default
+
+/*
+ * Every object is preceded by this, so it can be given back without knowing
+ * which slab it came from.
+ */
+union slab_head
+{
+	struct slab *slab;
+	max_align_t  align;
+};
+
+struct slab_chunk
+{
+	struct slab_chunk *next;
+	max_align_t        objs[];
+};
+
+/*
+ * Hands out objects of one size, for things that come and go all the time.
+ * Objects are allocated a chunk at a time and never given back to the heap
+ * until the slab is freed; returned objects are kept in a free list and
+ * handed out again. So once the slab has grown to what's needed at peak, it
+ * doesn't allocate anymore. Objects may be taken and returned by any thread.
+ */
+struct slab
+{
+	size_t             size;      // Of an object, including its head
+	size_t             per_chunk;
+	struct slab_chunk *chunks;
+	void              *free;      // Returned objects, linked through their first bytes
+	size_t             num_objs;  // Statistics
+	size_t             num_used;
+	pthread_mutex_t    lock;
+};
+
+int   slab_init(struct slab *sl, size_t size, size_t per_chunk);
+void *slab_get(struct slab *sl);
+void  slab_put(void *obj);
+void  slab_free(struct slab *sl);
+
+#endif
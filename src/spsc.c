@@ -0,0 +1,96 @@
+#include <stdlib.h>     // NULL, malloc(), free()
+#include <string.h>     // memcpy()
+#include <stdint.h>     // uint32_t
+#include "spsc.h"
+
+#define SPSC_LEN 4      // Bytes of the length in front of every message
+
+/*
+ * Copies data into the ring at the given position, wrapping around.
+ */
+static void copy_in(struct spsc *q, size_t pos, const void *data, size_t len)
+{
+	size_t off = pos & (q->size - 1);
+	size_t first = q->size - off < len ? q->size - off : len;
+	memcpy(q->buf + off, data, first);
+	memcpy(q->buf, (const char *) data + first, len - first);
+}
+
+/*
+ * Copies data out of the ring from the given position, wrapping around.
+ */
+static void copy_out(struct spsc *q, size_t pos, void *data, size_t len)
+{
+	size_t off = pos & (q->size - 1);
+	size_t first = q->size - off < len ? q->size - off : len;
+	memcpy(data, q->buf + off, first);
+	memcpy((char *) data + first, q->buf, len - first);
+}
+
+/*
+ * Sets up a queue of at least the given size in bytes.
+ * Returns 0 on success, -1 on error.
+ */
+int spsc_init(struct spsc *q, size_t size)
+{
+	q->size = 1024;
+	while (q->size < size)
+	{
+		q->size *= 2;
+	}
+	q->buf = malloc(q->size);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return q->buf ? 0 : -1;
+}
+
+/*
+ * Adds a message to the queue; only ever call this from the producer.
+ * Returns 0 on success, -1 if there is currently no room for it.
+ */
+int spsc_push(struct spsc *q, const char *data, size_t len)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (len > UINT32_MAX || q->size - (tail - head) < SPSC_LEN + len)
+	{
+		return -1;
+	}
+
+	uint32_t len32 = len;
+	copy_in(q, tail, &len32, SPSC_LEN);
+	copy_in(q, tail + SPSC_LEN, data, len);
+
+	// Release, so the consumer sees the data once it sees the new tail
+	atomic_store_explicit(&q->tail, tail + SPSC_LEN + len, memory_order_release);
+	return 0;
+}
+
+/*
+ * Takes the next message off the queue and copies it to 'data', truncating
+ * it if it doesn't fit; only ever call this from the consumer. Returns the
+ * length of the message, or 0 if the queue is empty.
+ */
+size_t spsc_pop(struct spsc *q, char *data, size_t size)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail)
+	{
+		return 0;
+	}
+
+	uint32_t len;
+	copy_out(q, head, &len, SPSC_LEN);
+	copy_out(q, head + SPSC_LEN, data, len < size ? len : size);
+
+	// Release, so the producer only reuses the space once we're done
+	atomic_store_explicit(&q->head, head + SPSC_LEN + len, memory_order_release);
+	return len < size ? len : size;
+}
+
+void spsc_free(struct spsc *q)
+{
+	free(q->buf);
+	q->buf = NULL;
+}
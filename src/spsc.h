@@ -0,0 +1,32 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>     // size_t
+#include <stdatomic.h>  // atomic_size_t
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * A lock-free queue of variable-length messages for exactly one producer
+ * thread and one consumer thread. Messages are stored in a ring buffer as a
+ * 4 byte length followed by the data, wrapping around at the end. 'head' and
+ * 'tail' only ever grow and are masked to get offsets into the buffer; each
+ * is written by one side only, and they live on separate cache lines so the
+ * two threads don't keep stealing the line from each other.
+ */
+struct spsc
+{
+	char         *buf;
+	size_t        size;      // Power of two
+	_Alignas(SPSC_CACHE_LINE)
+	atomic_size_t head;      // Where the consumer reads, written by it
+	_Alignas(SPSC_CACHE_LINE)
+	atomic_size_t tail;      // Where the producer writes, written by it
+};
+
+int    spsc_init(struct spsc *q, size_t size);
+int    spsc_push(struct spsc *q, const char *data, size_t len);
+size_t spsc_pop(struct spsc *q, char *data, size_t size);
+void   spsc_free(struct spsc *q);
+
+#endif
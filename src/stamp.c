@@ -0,0 +1,158 @@
+#include <string.h>     // memcpy(), strchr()
+#include "stamp.h"
+
+/*
+ * Conversion specifiers of strftime() that are known to only depend on the
+ * minute or coarser units. Everything not listed here is assumed to possibly
+ * change every second, to be on the safe side.
+ */
+static const char *COARSE_CONVERSIONS = "aAbBCdDeFgGhHIjmMnpRtuUVwWyYzZ%";
+
+/*
+ * Figures out how often the output of the given strftime() format can change,
+ * in seconds. This is either 60, if it contains nothing finer than minutes,
+ * or 1 otherwise. Note that time zone offsets are (nowadays) always whole
+ * minutes, so local minutes start at the same time as UTC minutes do.
+ */
+static time_t format_granularity(const char *format)
+{
+	for (const char *c = format; *c; ++c)
+	{
+		if (*c != '%')
+		{
+			continue;
+		}
+
+		// Skip flags, field width and the E/O modifiers
+		++c;
+		while (*c && strchr("_-0^#0123456789EO", *c))
+		{
+			++c;
+		}
+		if (*c == '\0')
+		{
+			break;
+		}
+		if (strchr(COARSE_CONVERSIONS, *c) == NULL)
+		{
+			return 1;
+		}
+	}
+	return 60;
+}
+
+/*
+ * Writes the unsigned number 'n' in decimal to 'buf', zero-padded to at least
+ * 'width' digits. Returns the number of characters written.
+ */
+static size_t render_number(char *buf, unsigned long long n, size_t width)
+{
+	char tmp[24];
+	size_t len = 0;
+	do
+	{
+		tmp[len++] = '0' + n % 10;
+		n /= 10;
+	}
+	while (n > 0 || len < width);
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		buf[i] = tmp[len - 1 - i];
+	}
+	return len;
+}
+
+/*
+ * Puts the format, as rendered for 't', into the buffer at 'pos', rendering
+ * it only if it could have changed since last time. Returns the new 'pos'.
+ */
+static size_t render_format(struct stamp *st, time_t t, size_t pos)
+{
+	if (t / st->granularity != st->key)
+	{
+		struct tm lt;
+		localtime_r(&t, &lt);
+
+		// strftime() returns 0 if the result didn't fit (or is
+		// empty), in which case we end up with just the space
+		size_t res = strftime(st->cached, STAMP_BUFFER - 1, st->format, &lt);
+		st->cached[res] = ' ';
+		st->cached_len = res + 1;
+		st->key = t / st->granularity;
+	}
+
+	memcpy(st->buf + pos, st->cached, st->cached_len);
+	return pos + st->cached_len;
+}
+
+/*
+ * Initializes the timestamp cache for the given strftime() format, which can
+ * be NULL for no formatted timestamp. Unless 'clock' is STAMP_NONE, the time
+ * of that clock in seconds and microseconds will be put in front of it.
+ */
+void stamp_init(struct stamp *st, const char *format, int clock)
+{
+	memset(st, 0, sizeof(struct stamp));
+	st->format = format;
+	st->clock = clock;
+	st->granularity = format ? format_granularity(format) : 1;
+	st->key = -1;
+}
+
+/*
+ * Returns the timestamp prefix for the current time, including a trailing
+ * space, or an empty string if no timestamp is wanted. The length of the
+ * string will be written to 'len'. The returned pointer stays valid until
+ * the next call.
+ */
+const char *stamp_get(struct stamp *st, size_t *len)
+{
+	size_t pos = 0;
+
+	if (st->clock != STAMP_NONE)
+	{
+		struct timespec ts;
+		clock_gettime(st->clock == STAMP_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts);
+		pos += render_number(st->buf, ts.tv_sec, 1);
+		st->buf[pos++] = '.';
+		pos += render_number(st->buf + pos, ts.tv_nsec / 1000, 6);
+		st->buf[pos++] = ' ';
+	}
+
+	if (st->format)
+	{
+		pos = render_format(st, time(NULL), pos);
+	}
+
+	st->buf[pos] = '\0';
+	*len = pos;
+	return st->buf;
+}
+
+/*
+ * Like stamp_get(), but for the given time in microseconds since the epoch,
+ * like that of an archived record, instead of now. Unless the clock is
+ * STAMP_NONE, that time itself is put in front.
+ */
+const char *stamp_at(struct stamp *st, uint64_t usec, size_t *len)
+{
+	size_t pos = 0;
+
+	if (st->clock != STAMP_NONE)
+	{
+		pos += render_number(st->buf, usec / 1000000, 1);
+		st->buf[pos++] = '.';
+		pos += render_number(st->buf + pos, usec % 1000000, 6);
+		st->buf[pos++] = ' ';
+	}
+
+	if (st->format)
+	{
+		pos = render_format(st, usec / 1000000, pos);
+	}
+
+	st->buf[pos] = '\0';
+	*len = pos;
+	return st->buf;
+}
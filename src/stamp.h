@@ -0,0 +1,44 @@
+#ifndef STAMP_H
+#define STAMP_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <time.h>       // time_t
+
+#define STAMP_BUFFER 96
+#define STAMP_MONO_BUFFER 32
+
+enum stamp_clock
+{
+	STAMP_NONE,          // No 'sec.usec' in front
+	STAMP_MONOTONIC,     // Since an arbitrary point, for latency analysis
+	STAMP_REALTIME       // Since the epoch, as mockd replays it
+};
+
+/*
+ * Timestamp prefix cache. Running strftime() (and localtime_r() before it)
+ * for every single chat message is wasteful, as the result only changes
+ * once per second - or even only once per minute, if the format does not
+ * contain any conversions that show seconds. Hence, we keep the rendered
+ * string around and only re-render it when it could actually change.
+ * Optionally, a monotonic (or epoch) timestamp with microsecond precision is
+ * put in front, which is rendered for every call, but without any library
+ * calls.
+ * Not thread-safe; every thread should have its own.
+ */
+struct stamp
+{
+	const char *format;             // strftime() format, or NULL
+	int         clock;              // Prepend 'sec.usec' (enum stamp_clock)
+	time_t      granularity;        // Seconds between possible changes
+	time_t      key;                // Time / granularity of cached string
+	char        cached[STAMP_BUFFER]; // Rendered format plus a space
+	size_t      cached_len;         // Length of cached
+	char        buf[STAMP_MONO_BUFFER + STAMP_BUFFER]; // Complete prefix
+};
+
+void        stamp_init(struct stamp *st, const char *format, int clock);
+const char *stamp_get(struct stamp *st, size_t *len);
+const char *stamp_at(struct stamp *st, uint64_t usec, size_t *len);
+
+#endif
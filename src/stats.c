@@ -0,0 +1,264 @@
+#include <stdio.h>      // vsnprintf()
+#include <stdarg.h>     // va_list, va_start(), va_end()
+#include <stdlib.h>     // qsort()
+#include <string.h>     // strlen(), memset(), memcpy(), memcmp()
+#include <stdint.h>     // uint8_t, uint32_t, uint64_t, UINT32_MAX
+#include <math.h>       // log()
+#include "stats.h"
+
+#define SLICE (STATS_SECONDS / STATS_SLICES)
+
+/*
+ * FNV-1a, with its bits mixed some more (like MurmurHash3 finishes): the
+ * upper bits of FNV-1a don't change much between similar names, but they
+ * pick the HyperLogLog register.
+ */
+static uint64_t hash_str(const char *str, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash = (hash ^ (unsigned char) str[i]) * 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static void hll_add(uint8_t *regs, uint64_t hash)
+{
+	size_t reg = hash >> (64 - STATS_HLL_BITS);
+	uint64_t rest = hash << STATS_HLL_BITS;
+	uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - STATS_HLL_BITS + 1;
+	if (rank > regs[reg])
+	{
+		regs[reg] = rank;
+	}
+}
+
+static double hll_count(const uint8_t *regs)
+{
+	double m = STATS_HLL_REGS;
+	double sum = 0.0;
+	size_t zeros = 0;
+	for (size_t i = 0; i < STATS_HLL_REGS; ++i)
+	{
+		sum += 1.0 / (double) ((uint64_t) 1 << regs[i]);
+		zeros += regs[i] == 0;
+	}
+	double est = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+
+	// With few names, how many registers are still empty tells us more
+	if (est <= 2.5 * m && zeros > 0)
+	{
+		est = m * log(m / zeros);
+	}
+	return est;
+}
+
+/*
+ * Counts a message sent by 'origin' at 'now'.
+ */
+void stats_message(struct stats *st, time_t now, const char *origin)
+{
+	struct stats_second *sec = &st->seconds[now % STATS_SECONDS];
+	if (sec->sec != now)
+	{
+		sec->sec = now;
+		sec->count = 0;
+	}
+	sec->count += 1;
+	st->messages += 1;
+
+	if (origin == NULL)
+	{
+		return;
+	}
+	uint64_t hash = hash_str(origin, strlen(origin));
+	time_t slice = now / SLICE;
+	size_t i = slice % STATS_SLICES;
+	if (st->slice_at[i] != slice)
+	{
+		memset(st->slices[i], 0, STATS_HLL_REGS);
+		st->slice_at[i] = slice;
+	}
+	hll_add(st->slices[i], hash);
+	hll_add(st->total, hash);
+}
+
+/*
+ * Counts one use of an emote and keeps it in the top list if it's one of the
+ * most used since the last snapshot.
+ */
+void stats_emote(struct stats *st, const char *name, size_t len)
+{
+	if (len > STATS_MAX_TERM)
+	{
+		len = STATS_MAX_TERM;
+	}
+	uint64_t hash = hash_str(name, len);
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+
+	// Only counters at the minimum need to go up, the others are too large
+	// already because of collisions; this keeps the guesses lower
+	uint32_t *counters[STATS_CMS_DEPTH];
+	uint32_t min = UINT32_MAX;
+	for (size_t d = 0; d < STATS_CMS_DEPTH; ++d)
+	{
+		counters[d] = &st->sketch[d][(h1 + d * h2) % STATS_CMS_WIDTH];
+		if (*counters[d] < min)
+		{
+			min = *counters[d];
+		}
+	}
+	uint32_t count = min + 1;
+	for (size_t d = 0; d < STATS_CMS_DEPTH; ++d)
+	{
+		if (*counters[d] < count)
+		{
+			*counters[d] = count;
+		}
+	}
+
+	size_t low = 0;
+	for (size_t i = 0; i < st->num_top; ++i)
+	{
+		if (st->top[i].len == len && memcmp(st->top[i].str, name, len) == 0)
+		{
+			st->top[i].count = count;
+			return;
+		}
+		if (st->top[i].count < st->top[low].count)
+		{
+			low = i;
+		}
+	}
+	if (st->num_top < STATS_TOP)
+	{
+		low = st->num_top++;
+	}
+	else if (count <= st->top[low].count)
+	{
+		return;
+	}
+	memcpy(st->top[low].str, name, len);
+	st->top[low].len = len;
+	st->top[low].count = count;
+}
+
+/*
+ * Returns the estimated number of different chatters in about the last
+ * STATS_SECONDS seconds.
+ */
+double stats_chatters(const struct stats *st, time_t now)
+{
+	uint8_t regs[STATS_HLL_REGS] = { 0 };
+	time_t slice = now / SLICE;
+	for (size_t s = 0; s < STATS_SLICES; ++s)
+	{
+		if (st->slice_at[s] + STATS_SLICES <= slice)
+		{
+			continue;
+		}
+		for (size_t i = 0; i < STATS_HLL_REGS; ++i)
+		{
+			if (st->slices[s][i] > regs[i])
+			{
+				regs[i] = st->slices[s][i];
+			}
+		}
+	}
+	return hll_count(regs);
+}
+
+static int compare_terms(const void *a, const void *b)
+{
+	const struct stats_term *ta = a;
+	const struct stats_term *tb = b;
+	return (ta->count < tb->count) - (ta->count > tb->count);
+}
+
+/*
+ * Appends to the 'len' bytes in 'buf' like snprintf(), counting what didn't
+ * fit, so the caller can tell in the end.
+ */
+static void put(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int res = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, fmt, args);
+	va_end(args);
+	*len += res > 0 ? (size_t) res : 0;
+}
+
+/*
+ * Appends 'str' as a JSON string, escaped as needed.
+ */
+static void put_string(char *buf, size_t size, size_t *len, const char *str, size_t n)
+{
+	put(buf, size, len, "\"");
+	for (size_t i = 0; i < n; ++i)
+	{
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\')
+		{
+			put(buf, size, len, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			put(buf, size, len, "\\u%04x", c);
+		}
+		else
+		{
+			put(buf, size, len, "%c", c);
+		}
+	}
+	put(buf, size, len, "\"");
+}
+
+/*
+ * Writes a snapshot of the channel's analytics to 'buf', as one line of JSON,
+ * and starts over with the emotes. Returns the length of the line, or 0 if
+ * it didn't fit.
+ */
+size_t stats_snapshot(struct stats *st, time_t now, const char *chan, char *buf, size_t size)
+{
+	uint32_t minute = 0;
+	uint32_t last = 0;
+	uint32_t peak = 0;
+	for (size_t i = 0; i < STATS_SECONDS; ++i)
+	{
+		const struct stats_second *sec = &st->seconds[i];
+		if (sec->sec <= now - STATS_SECONDS || sec->sec > now)
+		{
+			continue;
+		}
+		minute += sec->count;
+		peak = sec->count > peak ? sec->count : peak;
+		last = sec->sec == now - 1 ? sec->count : last;
+	}
+
+	size_t len = 0;
+	put(buf, size, &len, "{\"time\":%lld,\"channel\":\"%s\",\"messages\":%llu,"
+			"\"last_minute\":%u,\"last_second\":%u,\"peak_second\":%u,"
+			"\"chatters_last_minute\":%.0f,\"chatters\":%.0f,\"emotes\":[",
+			(long long) now, chan, (unsigned long long) st->messages,
+			minute, last, peak, stats_chatters(st, now), hll_count(st->total));
+
+	qsort(st->top, st->num_top, sizeof(struct stats_term), compare_terms);
+	for (size_t i = 0; i < st->num_top; ++i)
+	{
+		put(buf, size, &len, "%s{\"name\":", i ? "," : "");
+		put_string(buf, size, &len, st->top[i].str, st->top[i].len);
+		put(buf, size, &len, ",\"count\":%u}", st->top[i].count);
+	}
+	put(buf, size, &len, "]}\n");
+
+	memset(st->sketch, 0, sizeof(st->sketch));
+	st->num_top = 0;
+	return len < size ? len : 0;
+}
@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint8_t, uint32_t, uint64_t
+#include <time.h>       // time_t
+
+#define STATS_INTERVAL  10    // Default seconds between snapshots
+#define STATS_SECONDS   60    // Length of the rolling window
+#define STATS_SLICES    4     // Chatters are counted per quarter of the window
+#define STATS_HLL_BITS  10    // 1024 registers, about 3% error
+#define STATS_HLL_REGS  (1 << STATS_HLL_BITS)
+#define STATS_CMS_DEPTH 4
+#define STATS_CMS_WIDTH 256
+#define STATS_TOP       10    // Emotes in every snapshot
+#define STATS_MAX_TERM  32    // Longer emote names are cut off
+#define STATS_SNAPSHOT  4096  // Enough for one snapshot line
+
+struct stats_second
+{
+	time_t   sec;
+	uint32_t count;
+};
+
+struct stats_term
+{
+	char     str[STATS_MAX_TERM];
+	size_t   len;
+	uint32_t count;
+};
+
+/*
+ * The analytics of one channel, which take the same memory no matter how
+ * much is going on in it:
+ *
+ * Messages are counted per second in a ring that covers the window; a
+ * second's bucket is reused once it has fallen out of the window.
+ *
+ * Unique chatters are counted with HyperLogLog: the hash of a name picks a
+ * register and sets it to the number of leading zeros in the rest of the
+ * hash, if that's more than it holds. The more names, the longer the
+ * longest run of zeros, so the registers tell how many names there were,
+ * but not which. Every slice of the window has its registers, which are
+ * cleared when the slice comes around again; the window's count is taken
+ * from the highest value of each register across the slices.
+ *
+ * Emotes are counted in a count-min sketch: a row of counters per hash
+ * function, of which the emote increments one per row. Collisions only make
+ * counters larger, so the smallest of them is the best guess. The emotes
+ * with the highest guesses are kept in a short list, reset with every
+ * snapshot, like the sketch.
+ */
+struct stats
+{
+	struct stats_second seconds[STATS_SECONDS];
+	uint8_t             slices[STATS_SLICES][STATS_HLL_REGS];
+	time_t              slice_at[STATS_SLICES];  // Which slice the registers are for
+	uint8_t             total[STATS_HLL_REGS];   // Chatters since we started
+	uint64_t            messages;                // Since we started
+	uint32_t            sketch[STATS_CMS_DEPTH][STATS_CMS_WIDTH];
+	struct stats_term   top[STATS_TOP];
+	size_t              num_top;
+};
+
+void   stats_message(struct stats *st, time_t now, const char *origin);
+void   stats_emote(struct stats *st, const char *name, size_t len);
+double stats_chatters(const struct stats *st, time_t now);
+size_t stats_snapshot(struct stats *st, time_t now, const char *chan, char *buf, size_t size);
+
+#endif
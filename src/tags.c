@@ -0,0 +1,216 @@
+#include <stdlib.h>     // NULL, strtol(), strtoll()
+#include <string.h>     // memset(), memchr(), memcmp(), strcmp(), strcspn(), strlen()
+#include "tags.h"
+
+/*
+ * Names of the keys, in the order of the enum, which is sorted so we can use
+ * a binary search to intern a key.
+ */
+static const char *key_names[TAG_NUM_KEYS] = {
+	"badge-info",
+	"badges",
+	"ban-duration",
+	"bits",
+	"client-nonce",
+	"color",
+	"display-name",
+	"emote-only",
+	"emote-sets",
+	"emotes",
+	"first-msg",
+	"flags",
+	"followers-only",
+	"id",
+	"login",
+	"message-id",
+	"mod",
+	"msg-id",
+	"r9k",
+	"reply-parent-msg-id",
+	"returning-chatter",
+	"room-id",
+	"slow",
+	"subs-only",
+	"subscriber",
+	"system-msg",
+	"target-msg-id",
+	"target-user-id",
+	"thread-id",
+	"tmi-sent-ts",
+	"turbo",
+	"user-id",
+	"user-type",
+	"vip"
+};
+
+/*
+ * Returns the enum value of the given tag key, or -1 if we don't know it.
+ */
+int tags_key(const char *key)
+{
+	int lo = 0;
+	int hi = TAG_NUM_KEYS;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		int cmp = strcmp(key, key_names[mid]);
+		if (cmp == 0)
+		{
+			return mid;
+		}
+		if (cmp < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+const char *tags_key_name(enum tag_key key)
+{
+	return key >= 0 && key < TAG_NUM_KEYS ? key_names[key] : NULL;
+}
+
+/*
+ * Splits "subscriber/12,premium/1" into the badges array.
+ */
+static void parse_badges(struct tag_index *idx, const char *val)
+{
+	while (*val && idx->num_badges < TAGS_MAX_BADGES)
+	{
+		size_t len = strcspn(val, ",");
+		const char *slash = memchr(val, '/', len);
+		if (slash)
+		{
+			struct tag_badge *b = &idx->badges[idx->num_badges++];
+			b->name = val;
+			b->name_len = slash - val;
+			b->version = slash + 1;
+			b->version_len = len - (slash + 1 - val);
+		}
+		val += len + (val[len] == ',');
+	}
+}
+
+/*
+ * Splits "25:0-4,12-16/1902:6-10" into the emotes array, one entry for every
+ * position an emote is used at.
+ */
+static void parse_emotes(struct tag_index *idx, const char *val)
+{
+	while (*val && idx->num_emotes < TAGS_MAX_EMOTES)
+	{
+		size_t len = strcspn(val, "/");
+		const char *colon = memchr(val, ':', len);
+		if (colon == NULL)
+		{
+			break;
+		}
+
+		const char *pos = colon + 1;
+		const char *end = val + len;
+		while (pos < end && idx->num_emotes < TAGS_MAX_EMOTES)
+		{
+			char *next;
+			long start = strtol(pos, &next, 10);
+			if (*next != '-')
+			{
+				break;
+			}
+			long stop = strtol(next + 1, &next, 10);
+
+			struct tag_emote *e = &idx->emotes[idx->num_emotes++];
+			e->id = val;
+			e->id_len = colon - val;
+			e->start = start;
+			e->end = stop;
+
+			pos = next + (*next == ',');
+		}
+		val = end + (*end == '/');
+	}
+}
+
+/*
+ * Builds the index for the given tags, in one pass over them. The index only
+ * points into the tags, so it's valid as long as the event is.
+ */
+void tags_index(struct tag_index *idx, twirc_tag_t **tags)
+{
+	memset(idx->values, 0, sizeof(idx->values));
+	idx->num_badges = 0;
+	idx->num_emotes = 0;
+
+	for (size_t i = 0; tags && tags[i]; ++i)
+	{
+		int key = tags_key(tags[i]->key);
+		if (key != -1 && tags[i]->value)
+		{
+			idx->values[key] = tags[i]->value;
+		}
+	}
+
+	if (idx->values[TAG_BADGES])
+	{
+		parse_badges(idx, idx->values[TAG_BADGES]);
+	}
+	if (idx->values[TAG_EMOTES])
+	{
+		parse_emotes(idx, idx->values[TAG_EMOTES]);
+	}
+}
+
+/*
+ * Returns the value of the tag, or NULL if it's missing. Twitch often sends
+ * tags with an empty value, those are returned as NULL as well.
+ */
+const char *tags_get(const struct tag_index *idx, enum tag_key key)
+{
+	const char *val = idx->values[key];
+	return val && *val ? val : NULL;
+}
+
+/*
+ * Returns the value of the tag as a number, or 'def' if it's missing or not
+ * a number. Good for user-id, tmi-sent-ts, bits and the like.
+ */
+long long tags_int(const struct tag_index *idx, enum tag_key key, long long def)
+{
+	const char *val = tags_get(idx, key);
+	if (val == NULL)
+	{
+		return def;
+	}
+	char *end;
+	long long num = strtoll(val, &end, 10);
+	return *end == '\0' ? num : def;
+}
+
+/*
+ * Returns 1 if the tag is "1" (like mod, subscriber or turbo), 0 otherwise.
+ */
+int tags_bool(const struct tag_index *idx, enum tag_key key)
+{
+	const char *val = idx->values[key];
+	return val && val[0] == '1' && val[1] == '\0';
+}
+
+/*
+ * Returns 1 if the user has the given badge, like "broadcaster", 0 otherwise.
+ */
+int tags_has_badge(const struct tag_index *idx, const char *name)
+{
+	size_t len = strlen(name);
+	for (size_t i = 0; i < idx->num_badges; ++i)
+	{
+		if (idx->badges[i].name_len == len && memcmp(idx->badges[i].name, name, len) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
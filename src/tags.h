@@ -0,0 +1,95 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint16_t
+#include "libtwirc.h"
+
+#define TAGS_MAX_BADGES 16     // Badges we keep per message, more are ignored
+#define TAGS_MAX_EMOTES 64     // Emote positions we keep per message
+
+/*
+ * The tag keys Twitch sends that we know about, sorted by name. Every known
+ * key gets a fixed slot in the index; other tags are simply not indexed.
+ */
+enum tag_key
+{
+	TAG_BADGE_INFO,
+	TAG_BADGES,
+	TAG_BAN_DURATION,
+	TAG_BITS,
+	TAG_CLIENT_NONCE,
+	TAG_COLOR,
+	TAG_DISPLAY_NAME,
+	TAG_EMOTE_ONLY,
+	TAG_EMOTE_SETS,
+	TAG_EMOTES,
+	TAG_FIRST_MSG,
+	TAG_FLAGS,
+	TAG_FOLLOWERS_ONLY,
+	TAG_ID,
+	TAG_LOGIN,
+	TAG_MESSAGE_ID,
+	TAG_MOD,
+	TAG_MSG_ID,
+	TAG_R9K,
+	TAG_REPLY_PARENT_MSG_ID,
+	TAG_RETURNING_CHATTER,
+	TAG_ROOM_ID,
+	TAG_SLOW,
+	TAG_SUBS_ONLY,
+	TAG_SUBSCRIBER,
+	TAG_SYSTEM_MSG,
+	TAG_TARGET_MSG_ID,
+	TAG_TARGET_USER_ID,
+	TAG_THREAD_ID,
+	TAG_TMI_SENT_TS,
+	TAG_TURBO,
+	TAG_USER_ID,
+	TAG_USER_TYPE,
+	TAG_VIP,
+	TAG_NUM_KEYS
+};
+
+/*
+ * Badges and emotes point into the tag values of the event, so they are only
+ * valid as long as the event is, and are not null-terminated.
+ */
+struct tag_badge
+{
+	const char *name;           // Like "subscriber"
+	const char *version;        // Like "12"
+	uint16_t    name_len;
+	uint16_t    version_len;
+};
+
+struct tag_emote
+{
+	const char *id;             // Like "25" or "emotesv2_..."
+	uint16_t    id_len;
+	uint16_t    start;          // Position in the message (in characters)
+	uint16_t    end;            // Inclusive
+};
+
+/*
+ * Everything a handler might want from the tags of one event, built in a
+ * single pass by tags_index(). It's meant to live on the stack.
+ */
+struct tag_index
+{
+	const char      *values[TAG_NUM_KEYS];  // NULL if not present
+	struct tag_badge badges[TAGS_MAX_BADGES];
+	size_t           num_badges;
+	struct tag_emote emotes[TAGS_MAX_EMOTES];
+	size_t           num_emotes;
+};
+
+int          tags_key(const char *key);
+const char  *tags_key_name(enum tag_key key);
+void         tags_index(struct tag_index *idx, twirc_tag_t **tags);
+const char  *tags_get(const struct tag_index *idx, enum tag_key key);
+long long    tags_int(const struct tag_index *idx, enum tag_key key, long long def);
+int          tags_bool(const struct tag_index *idx, enum tag_key key);
+int          tags_has_badge(const struct tag_index *idx, const char *name);
+
+#endif
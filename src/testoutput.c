@@ -0,0 +1,96 @@
+#include <stdio.h>      // NULL, fprintf()
+#include <stdlib.h>     // EXIT_FAILURE, EXIT_SUCCESS
+#include <string.h>     // strlen()
+#include <unistd.h>     // pipe(), read(), close()
+#include <poll.h>       // poll()
+#include <time.h>       // clock_gettime()
+#include <sys/uio.h>    // struct iovec
+#include "output.h"
+
+#define FLUSH_MS 100
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Writes 'line' to the output, which buffers far more than that, and waits
+ * for it to come out of the pipe. Returns the milliseconds that took, or -1
+ * if it didn't within 'timeout' milliseconds.
+ */
+static long time_flush(struct output *out, int rfd, const char *line, int timeout)
+{
+	struct iovec iov = { .iov_base = (char *) line, .iov_len = strlen(line) };
+	long start = now_ms();
+	output_write(out, &iov, 1);
+
+	struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+	while (now_ms() - start < timeout)
+	{
+		output_tick(out);
+		if (poll(&pfd, 1, 10) == 1)
+		{
+			char buf[256];
+			if (read(rfd, buf, sizeof(buf)) > 0)
+			{
+				return now_ms() - start;
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+ * Checks that a little output gets written once it's been buffered for
+ * FLUSH_MS, long before the buffer fills up. Returns 0 if it does, else -1.
+ */
+static int test_flush_ms(const char *name, int threaded)
+{
+	int fds[2];
+	if (pipe(fds) == -1)
+	{
+		return -1;
+	}
+
+	struct output out;
+	int res = 0;
+	if (output_init(&out, fds[1], OUTPUT_FLUSH_BYTES, FLUSH_MS) == -1 ||
+	    (threaded && output_start(&out, OUTPUT_BLOCK, -1) == -1))
+	{
+		fprintf(stderr, "%s: could not set up the output\n", name);
+		res = -1;
+	}
+
+	// Twice, as the writer thread goes back to sleep after the first
+	for (int i = 0; res == 0 && i < 2; ++i)
+	{
+		long ms = time_flush(&out, fds[0], "hello\n", 10 * FLUSH_MS);
+		if (ms == -1)
+		{
+			fprintf(stderr, "%s: line %d not written after %d ms\n", name, i + 1, 10 * FLUSH_MS);
+			res = -1;
+		}
+		else if (ms < FLUSH_MS / 2)
+		{
+			fprintf(stderr, "%s: line %d written after %ld ms, expected %d\n", name, i + 1, ms, FLUSH_MS);
+			res = -1;
+		}
+	}
+
+	output_free(&out);
+	close(fds[0]);
+	close(fds[1]);
+	fprintf(stderr, "%s: %s\n", name, res == 0 ? "ok" : "FAILED");
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+	failed += test_flush_ms("flush after -F, no writer thread", 0) == -1;
+	failed += test_flush_ms("flush after -F, writer thread", 1) == -1;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}